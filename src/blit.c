@@ -0,0 +1,1236 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_AVX_STREAM
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__GNUC__)
+#define HAVE_NEON_ROWS
+#include <arm_neon.h>
+#endif
+
+#include "png_codec.h"
+#include "blit.h"
+#include "cpu.h"
+
+#define CHECKER_LIGHT	0x00cccccc
+#define CHECKER_DARK	0x00999999
+
+/*
+ * Framebuffer store layer. Framebuffers are mapped write-combined; going
+ * through the cache only evicts the image we are reading from and partial
+ * lines stall the WC buffers, so large copies and fills use non-temporal
+ * stores on CPUs that have them. Those are weakly ordered, blit_fence()
+ * has to be called once a frame is complete.
+ */
+static void store_cached_copy(void *, const void *, size_t);
+static void store_cached_fill(void *, uint32_t, size_t);
+
+void (*blit_copy)(void *, const void *, size_t) = store_cached_copy;
+void (*blit_fill)(void *, uint32_t, size_t) = store_cached_fill;
+static int blit_store_method = BLIT_STORE_CACHED;
+
+static const char *store_names[BLIT_STORE_COUNT] = {
+	[BLIT_STORE_CACHED]	= "cached",
+	[BLIT_STORE_SSE2]	= "sse2-nt",
+	[BLIT_STORE_AVX]	= "avx-nt",
+};
+
+
+/* the pattern as seen from a destination that is `skew' bytes further */
+static inline uint32_t
+pattern_skew(uint32_t pattern, uintptr_t skew)
+{
+	uint8_t pb[8];
+
+	memcpy(pb, &pattern, 4);
+	memcpy(pb + 4, &pattern, 4);
+	memcpy(&pattern, pb + (skew & 3), 4);
+	return pattern;
+}
+
+
+static void
+store_cached_copy(void *dst, const void *src, size_t len)
+{
+	memcpy(dst, src, len);
+}
+
+
+/* repeats the 32 bit pattern as laid out in memory */
+static void
+store_cached_fill(void *dst, uint32_t pattern, size_t len)
+{
+	uint8_t *d = dst;
+	uint8_t pb[4];
+	uint32_t *d32;
+	size_t head;
+
+	if (pattern_skew(pattern, 1) == pattern) {
+		memset(dst, pattern & 0xff, len);
+		return;
+	}
+	memcpy(pb, &pattern, 4);
+	for (head = 0; len && ((uintptr_t) d & 3); len--, d++, head++)
+		*d = pb[head & 3];
+	pattern = pattern_skew(pattern, head);
+	for (d32 = (uint32_t *) d; len >= 4; len -= 4)
+		*d32++ = pattern;
+	memcpy(d32, &pattern, len);
+}
+
+
+#ifdef __SSE2__
+static void
+store_sse2_copy(void *dst, const void *src, size_t len)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t head;
+
+	head = (16 - ((uintptr_t) d & 15)) & 15;
+	if (len < head + 64) {
+		memcpy(d, s, len);
+		return;
+	}
+	memcpy(d, s, head);
+	d += head; s += head; len -= head;
+
+	for (; len >= 64; len -= 64, d += 64, s += 64) {
+		_mm_stream_si128((__m128i *) (d +  0),
+		    _mm_loadu_si128((const __m128i *) (s +  0)));
+		_mm_stream_si128((__m128i *) (d + 16),
+		    _mm_loadu_si128((const __m128i *) (s + 16)));
+		_mm_stream_si128((__m128i *) (d + 32),
+		    _mm_loadu_si128((const __m128i *) (s + 32)));
+		_mm_stream_si128((__m128i *) (d + 48),
+		    _mm_loadu_si128((const __m128i *) (s + 48)));
+	}
+	for (; len >= 16; len -= 16, d += 16, s += 16)
+		_mm_stream_si128((__m128i *) d,
+		    _mm_loadu_si128((const __m128i *) s));
+	memcpy(d, s, len);
+}
+
+
+static void
+store_sse2_fill(void *dst, uint32_t pattern, size_t len)
+{
+	uint8_t *d = dst;
+	__m128i v;
+	size_t head;
+
+	head = (16 - ((uintptr_t) d & 15)) & 15;
+	if (len < head + 64) {
+		store_cached_fill(d, pattern, len);
+		return;
+	}
+	store_cached_fill(d, pattern, head);
+	pattern = pattern_skew(pattern, head);
+	d += head; len -= head;
+
+	v = _mm_set1_epi32(pattern);
+	for (; len >= 64; len -= 64, d += 64) {
+		_mm_stream_si128((__m128i *) (d +  0), v);
+		_mm_stream_si128((__m128i *) (d + 16), v);
+		_mm_stream_si128((__m128i *) (d + 32), v);
+		_mm_stream_si128((__m128i *) (d + 48), v);
+	}
+	for (; len >= 16; len -= 16, d += 16)
+		_mm_stream_si128((__m128i *) d, v);
+	store_cached_fill(d, pattern, len);
+}
+#endif
+
+
+#ifdef HAVE_AVX_STREAM
+__attribute__((target("avx")))
+static void
+store_avx_copy(void *dst, const void *src, size_t len)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t head;
+
+	head = (32 - ((uintptr_t) d & 31)) & 31;
+	if (len < head + 128) {
+		memcpy(d, s, len);
+		return;
+	}
+	memcpy(d, s, head);
+	d += head; s += head; len -= head;
+
+	for (; len >= 128; len -= 128, d += 128, s += 128) {
+		_mm256_stream_si256((__m256i *) (d +  0),
+		    _mm256_loadu_si256((const __m256i *) (s +  0)));
+		_mm256_stream_si256((__m256i *) (d + 32),
+		    _mm256_loadu_si256((const __m256i *) (s + 32)));
+		_mm256_stream_si256((__m256i *) (d + 64),
+		    _mm256_loadu_si256((const __m256i *) (s + 64)));
+		_mm256_stream_si256((__m256i *) (d + 96),
+		    _mm256_loadu_si256((const __m256i *) (s + 96)));
+	}
+	for (; len >= 32; len -= 32, d += 32, s += 32)
+		_mm256_stream_si256((__m256i *) d,
+		    _mm256_loadu_si256((const __m256i *) s));
+	_mm256_zeroupper();
+	memcpy(d, s, len);
+}
+
+
+__attribute__((target("avx")))
+static void
+store_avx_fill(void *dst, uint32_t pattern, size_t len)
+{
+	uint8_t *d = dst;
+	__m256i v;
+	size_t head;
+
+	head = (32 - ((uintptr_t) d & 31)) & 31;
+	if (len < head + 128) {
+		store_cached_fill(d, pattern, len);
+		return;
+	}
+	store_cached_fill(d, pattern, head);
+	pattern = pattern_skew(pattern, head);
+	d += head; len -= head;
+
+	v = _mm256_set1_epi32(pattern);
+	for (; len >= 128; len -= 128, d += 128) {
+		_mm256_stream_si256((__m256i *) (d +  0), v);
+		_mm256_stream_si256((__m256i *) (d + 32), v);
+		_mm256_stream_si256((__m256i *) (d + 64), v);
+		_mm256_stream_si256((__m256i *) (d + 96), v);
+	}
+	for (; len >= 32; len -= 32, d += 32)
+		_mm256_stream_si256((__m256i *) d, v);
+	_mm256_zeroupper();
+	store_cached_fill(d, pattern, len);
+}
+#endif
+
+
+bool
+blit_store_available(int method)
+{
+	switch (method) {
+	case BLIT_STORE_CACHED:
+		return true;
+#ifdef __SSE2__
+	case BLIT_STORE_SSE2:
+		return true;
+#endif
+#ifdef HAVE_AVX_STREAM
+	case BLIT_STORE_AVX:
+		return cpu_has(CPU_AVX);
+#endif
+	}
+	return false;
+}
+
+
+/*
+ * Select the store method, BLIT_STORE_AUTO picks the widest non-temporal
+ * stores the CPU supports. Returns the method actually used.
+ */
+int
+blit_store_init(int method)
+{
+	if (method == BLIT_STORE_AUTO) {
+		for (method = BLIT_STORE_COUNT - 1; method > 0; method--)
+			if (blit_store_available(method))
+				break;
+	}
+	if (!blit_store_available(method))
+		method = BLIT_STORE_CACHED;
+
+	blit_copy = store_cached_copy;
+	blit_fill = store_cached_fill;
+	switch (method) {
+#ifdef __SSE2__
+	case BLIT_STORE_SSE2:
+		blit_copy = store_sse2_copy;
+		blit_fill = store_sse2_fill;
+		break;
+#endif
+#ifdef HAVE_AVX_STREAM
+	case BLIT_STORE_AVX:
+		blit_copy = store_avx_copy;
+		blit_fill = store_avx_fill;
+		break;
+#endif
+	}
+	blit_store_method = method;
+	return method;
+}
+
+
+const char *
+blit_store_name(int method)
+{
+	if ((method < 0) || (method >= BLIT_STORE_COUNT))
+		return "unknown";
+	return store_names[method];
+}
+
+
+/* order the weakly ordered streaming stores before anyone looks */
+void
+blit_fence(void)
+{
+#ifdef __SSE2__
+	if (blit_store_method != BLIT_STORE_CACHED)
+		_mm_sfence();
+#endif
+}
+
+
+static const struct {
+	const char	*name;
+	int		 bytes;
+	int		 source;
+} pixfmts[BLIT_FMT_COUNT] = {
+	[BLIT_FMT_CI8]		= { "CI8",		1, BLIT_SRC_INDEXED8 },
+	[BLIT_FMT_XRGB8888]	= { "XRGB8888",		4, BLIT_SRC_RGBA32 },
+	[BLIT_FMT_XBGR8888]	= { "XBGR8888",		4, BLIT_SRC_RGBA32 },
+	[BLIT_FMT_RGB888]	= { "RGB888",		3, BLIT_SRC_RGBA32 },
+	[BLIT_FMT_BGR888]	= { "BGR888",		3, BLIT_SRC_RGBA32 },
+	[BLIT_FMT_RGB565]	= { "RGB565",		2, BLIT_SRC_RGBA32 },
+	[BLIT_FMT_XRGB2101010]	= { "XRGB2101010",	4, BLIT_SRC_RGBA64 },
+	[BLIT_FMT_XBGR2101010]	= { "XBGR2101010",	4, BLIT_SRC_RGBA64 },
+};
+
+
+/*
+ * Map the channel layout reported by WSDISPLAYIO_GET_FBINFO onto one of the
+ * formats we have blitters for, -1 if there is none.  Every offset has to
+ * match, BGRX or 24 bits padded to 32 must not pass for one of ours.
+ */
+static const struct {
+	int	bpp;
+	int	size[3];	/* red, green, blue */
+	int	off[3];
+	int	fmt;
+} pixfmt_masks[] = {
+	{ 32, {  8,  8,  8 }, { 16,  8,  0 }, BLIT_FMT_XRGB8888 },
+	{ 32, {  8,  8,  8 }, {  0,  8, 16 }, BLIT_FMT_XBGR8888 },
+	{ 24, {  8,  8,  8 }, { 16,  8,  0 }, BLIT_FMT_RGB888 },
+	{ 24, {  8,  8,  8 }, {  0,  8, 16 }, BLIT_FMT_BGR888 },
+	{ 16, {  5,  6,  5 }, { 11,  5,  0 }, BLIT_FMT_RGB565 },
+	{ 32, { 10, 10, 10 }, { 20, 10,  0 }, BLIT_FMT_XRGB2101010 },
+	{ 32, { 10, 10, 10 }, {  0, 10, 20 }, BLIT_FMT_XBGR2101010 },
+};
+
+int
+blit_pixfmt_from_masks(int bpp, int r_off, int r_size, int g_off, int g_size,
+    int b_off, int b_size)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(pixfmt_masks) / sizeof(pixfmt_masks[0]); i++) {
+		if ((pixfmt_masks[i].bpp == bpp) &&
+		    (pixfmt_masks[i].size[0] == r_size) &&
+		    (pixfmt_masks[i].size[1] == g_size) &&
+		    (pixfmt_masks[i].size[2] == b_size) &&
+		    (pixfmt_masks[i].off[0] == r_off) &&
+		    (pixfmt_masks[i].off[1] == g_off) &&
+		    (pixfmt_masks[i].off[2] == b_off))
+			return pixfmt_masks[i].fmt;
+	}
+	return -1;
+}
+
+
+/* guess for drivers that only know about WSDISPLAYIO_GINFO */
+int
+blit_pixfmt_from_depth(int depth)
+{
+	switch (depth) {
+	case 8:
+		return BLIT_FMT_CI8;
+	case 16:
+		return BLIT_FMT_RGB565;
+	case 24:
+		return BLIT_FMT_RGB888;
+	case 32:
+		return BLIT_FMT_XRGB8888;
+	}
+	return -1;
+}
+
+
+int
+blit_pixfmt_bytes(int fmt)
+{
+	return pixfmts[fmt].bytes;
+}
+
+
+int
+blit_pixfmt_source(int fmt)
+{
+	return pixfmts[fmt].source;
+}
+
+
+const char *
+blit_pixfmt_name(int fmt)
+{
+	return pixfmts[fmt].name;
+}
+
+
+void
+blit_backdrop_init(struct blit_backdrop *bd)
+{
+	bd->mode = BLIT_BACKDROP_BKGD;
+	bd->colour = 0x00000000;
+	bd->checker[0] = CHECKER_LIGHT;
+	bd->checker[1] = CHECKER_DARK;
+}
+
+/*
+ * Accepts "bkgd", "checker" or a colour written as #rrggbb, 0xrrggbb or
+ * plain rrggbb.
+ */
+bool
+blit_backdrop_parse(struct blit_backdrop *bd, const char *arg)
+{
+	unsigned long colour;
+	char *end;
+
+	if (strcasecmp(arg, "bkgd") == 0) {
+		bd->mode = BLIT_BACKDROP_BKGD;
+		return true;
+	}
+	if (strcasecmp(arg, "checker") == 0) {
+		bd->mode = BLIT_BACKDROP_CHECKER;
+		return true;
+	}
+
+	if (*arg == '#')
+		arg++;
+	colour = strtoul(arg, &end, 16);
+	if ((*arg == '\0') || (*end != '\0') || (colour > 0xffffff))
+		return false;
+
+	bd->mode = BLIT_BACKDROP_SOLID;
+	bd->colour = (uint32_t) colour;
+	return true;
+}
+
+/*
+ * Solid colour transparent pixels end up on. Has to be called before the
+ * image is converted, the bKGD samples are stored in the file's own
+ * colour type and depth.
+ */
+uint32_t
+blit_backdrop_colour(const struct blit_backdrop *bd, struct png_info *info)
+{
+	uint32_t rgb;
+
+	if (bd->mode == BLIT_BACKDROP_CHECKER)
+		return bd->checker[0];
+	if ((bd->mode == BLIT_BACKDROP_BKGD) &&
+	    png_get_background_rgb32(info, &rgb))
+		return rgb;
+	return bd->colour;
+}
+
+
+/* backdrop rows `width' pixels long for an image at (x0, y0) */
+static bool
+composite_setup(struct blit_composite *bc, const struct blit_backdrop *bd,
+    struct png_info *info, uint32_t width, uint32_t x0, uint32_t y0)
+{
+	uint32_t colour, x, phase;
+	int row;
+
+	bc->y0 = y0;
+	bc->bg_rows[0] = malloc(width * sizeof(uint32_t));
+	if (bc->bg_rows[0] == NULL)
+		return false;
+
+	if (bd->mode != BLIT_BACKDROP_CHECKER) {
+		colour = 0xff000000 | blit_backdrop_colour(bd, info);
+		for (x = 0; x < width; x++)
+			bc->bg_rows[0][x] = colour;
+		bc->bg_rows[1] = bc->bg_rows[0];
+		bc->enabled = true;
+		return true;
+	}
+
+	bc->bg_rows[1] = malloc(width * sizeof(uint32_t));
+	if (bc->bg_rows[1] == NULL) {
+		blit_composite_free(bc);
+		return false;
+	}
+	/* squares are aligned to the screen, not to the image */
+	for (row = 0; row < 2; row++) {
+		for (x = 0; x < width; x++) {
+			phase = (((x0 + x) >> BLIT_CHECKER_SHIFT) + row) & 1;
+			bc->bg_rows[row][x] = 0xff000000 | bd->checker[phase];
+		}
+	}
+	bc->enabled = true;
+	return true;
+}
+
+
+bool
+blit_composite_setup(struct blit_composite *bc, const struct blit_backdrop *bd,
+    struct png_info *info, uint32_t x0, uint32_t y0)
+{
+	memset(bc, 0, sizeof(*bc));
+
+	if (!(info->colourtype & PNG_COLOURT_ALPHA) && !info->has_transparancy)
+		return true;
+	return composite_setup(bc, bd, info, info->width, x0, y0);
+}
+
+
+/*
+ * The same for an animation's canvas, which frames can leave transparent
+ * whether the image has alpha or not.
+ */
+bool
+blit_composite_setup_canvas(struct blit_composite *bc,
+    const struct blit_backdrop *bd, struct png_info *info, uint32_t x0,
+    uint32_t y0)
+{
+	memset(bc, 0, sizeof(*bc));
+	return composite_setup(bc, bd, info, info->canvas_width, x0, y0);
+}
+
+
+void
+blit_composite_free(struct blit_composite *bc)
+{
+	if (bc->bg_rows[1] != bc->bg_rows[0])
+		free(bc->bg_rows[1]);
+	free(bc->bg_rows[0]);
+	bc->bg_rows[0] = bc->bg_rows[1] = NULL;
+	bc->enabled = false;
+}
+
+
+/*
+ * out = (src * A + bg * (255 - A)) / 255, red and blue handled together in
+ * one word and green in another. The division is the exact rounding
+ * (t + 128 + ((t + 128) >> 8)) >> 8.
+ *
+ * Images stay straight alpha: that is what the codec hands out, what APNG
+ * frames are composed in and what the caches hold, and premultiplying
+ * would cost colour precision at low alpha.  Premultiplied would only save
+ * the src * A multiply, which runs in parallel with bg * (255 - A) anyway.
+ */
+uint32_t
+blit_blend_pixel(uint32_t src, uint32_t bg)
+{
+	uint32_t a, na, rb, g;
+
+	a = src >> 24;
+	if (a == 0xff)
+		return src;
+	if (a == 0)
+		return bg | 0xff000000;
+	na = 255 - a;
+
+	rb = (src & 0x00ff00ff) * a + (bg & 0x00ff00ff) * na + 0x00800080;
+	rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+	g  = (src & 0x0000ff00) * a + (bg & 0x0000ff00) * na + 0x00008000;
+	g  = ((g + ((g >> 8) & 0x0000ff00)) >> 8) & 0x0000ff00;
+
+	return 0xff000000 | rb | g;
+}
+
+
+/*
+ * Blend a row of 0xAARRGGBB pixels over a prerendered backdrop row
+ * straight into the destination; the framebuffer gets written once, just
+ * like the opaque memcpy path.
+ */
+void
+blit_composite_row(uint32_t *dst, const uint32_t *src, const uint32_t *bg,
+    uint32_t n)
+{
+	uint32_t x;
+#ifdef __SSE2__
+	__m128i s, b, a, lo, hi, blo, bhi, alo, ahi, zero, ff, ffa, amask;
+	int opaque;
+
+	zero  = _mm_setzero_si128();
+	ff    = _mm_set1_epi16(0xff);
+	ffa   = _mm_set1_epi32(0xff000000);
+	x = 0;
+	for (; x + 4 <= n; x += 4) {
+		s = _mm_loadu_si128((const __m128i *) (src + x));
+
+		/* whole groups that are opaque or clear take a shortcut */
+		amask = _mm_and_si128(s, ffa);
+		opaque = _mm_movemask_epi8(_mm_cmpeq_epi32(amask, ffa));
+		if (opaque == 0xffff) {
+			_mm_storeu_si128((__m128i *) (dst + x), s);
+			continue;
+		}
+		b = _mm_loadu_si128((const __m128i *) (bg + x));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(amask, zero)) == 0xffff) {
+			_mm_storeu_si128((__m128i *) (dst + x), b);
+			continue;
+		}
+
+		lo  = _mm_unpacklo_epi8(s, zero);
+		hi  = _mm_unpackhi_epi8(s, zero);
+		blo = _mm_unpacklo_epi8(b, zero);
+		bhi = _mm_unpackhi_epi8(b, zero);
+
+		/* broadcast each pixel's alpha over its four 16 bit lanes */
+		a   = _mm_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 3, 3));
+		alo = _mm_shufflehi_epi16(a,  _MM_SHUFFLE(3, 3, 3, 3));
+		a   = _mm_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 3, 3));
+		ahi = _mm_shufflehi_epi16(a,  _MM_SHUFFLE(3, 3, 3, 3));
+
+		lo = _mm_add_epi16(_mm_mullo_epi16(lo, alo),
+		    _mm_mullo_epi16(blo, _mm_sub_epi16(ff, alo)));
+		hi = _mm_add_epi16(_mm_mullo_epi16(hi, ahi),
+		    _mm_mullo_epi16(bhi, _mm_sub_epi16(ff, ahi)));
+		lo = _mm_add_epi16(lo, _mm_set1_epi16(0x80));
+		hi = _mm_add_epi16(hi, _mm_set1_epi16(0x80));
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+		s = _mm_or_si128(_mm_packus_epi16(lo, hi), ffa);
+		_mm_storeu_si128((__m128i *) (dst + x), s);
+	}
+	for (; x < n; x++)
+		dst[x] = blit_blend_pixel(src[x], bg[x]);
+#else
+	for (x = 0; x < n; x++)
+		dst[x] = blit_blend_pixel(src[x], bg[x]);
+#endif
+}
+
+
+/* as blit_blend_pixel() but for 0xAAAARRRRGGGGBBBB over an 8 bit backdrop */
+static inline uint64_t
+blend_pixel64(uint64_t src, uint32_t bg)
+{
+	uint64_t a, na, c, b, out;
+	int shift;
+
+	a = src >> 48;
+	if (a == 0xffff)
+		return src;
+	na = 0xffff - a;
+
+	out = (uint64_t) 0xffff << 48;
+	for (shift = 0; shift < 48; shift += 16) {
+		c = (src >> shift) & 0xffff;
+		b = ((bg >> (shift / 2)) & 0xff) * 0x101;
+		c = (c * a + b * na + 0x7fff) / 0xffff;
+		out |= c << shift;
+	}
+	return out;
+}
+
+
+/*
+ * Pixel loaders; they hand an 0xAARRGGBB or 0xAAAARRRRGGGGBBBB value in a
+ * register to the storers below.
+ */
+#define LOAD32(s, bg, x)	(((const uint32_t *) (s))[x])
+#define LOAD32_BLEND(s, bg, x)	blit_blend_pixel(LOAD32(s, bg, x), (bg)[x])
+#define LOAD64(s, bg, x)	(((const uint64_t *) (s))[x])
+#define LOAD64_BLEND(s, bg, x)	blend_pixel64(LOAD64(s, bg, x), (bg)[x])
+
+/* expand the top bits of 8 and 16 bit channels into a 10 bit one */
+#define C8(p, sh)		(((p) >> (sh)) & 0xff)
+#define C8TO10(p, sh)		((C8(p, sh) << 2) | (C8(p, sh) >> 6))
+#define C16TO10(p, sh)		((uint32_t) (((p) >> ((sh) + 6)) & 0x3ff))
+
+static inline void
+store_xrgb8888(uint8_t *d, uint32_t p)
+{
+	*(uint32_t *) d = p;
+}
+
+static inline void
+store_xbgr8888(uint8_t *d, uint32_t p)
+{
+	*(uint32_t *) d = (p & 0xff00ff00) | ((p >> 16) & 0xff) |
+	    ((p & 0xff) << 16);
+}
+
+static inline void
+store_rgb888(uint8_t *d, uint32_t p)
+{
+	d[0] = p;
+	d[1] = p >> 8;
+	d[2] = p >> 16;
+}
+
+static inline void
+store_bgr888(uint8_t *d, uint32_t p)
+{
+	d[0] = p >> 16;
+	d[1] = p >> 8;
+	d[2] = p;
+}
+
+static inline void
+store_rgb565(uint8_t *d, uint32_t p)
+{
+	*(uint16_t *) d = ((p >> 8) & 0xf800) | ((p >> 5) & 0x07e0) |
+	    ((p >> 3) & 0x001f);
+}
+
+static inline void
+store_xrgb2101010(uint8_t *d, uint32_t p)
+{
+	*(uint32_t *) d = (C8TO10(p, 16) << 20) | (C8TO10(p, 8) << 10) |
+	    C8TO10(p, 0);
+}
+
+static inline void
+store_xbgr2101010(uint8_t *d, uint32_t p)
+{
+	*(uint32_t *) d = (C8TO10(p, 0) << 20) | (C8TO10(p, 8) << 10) |
+	    C8TO10(p, 16);
+}
+
+static inline void
+store64_xrgb2101010(uint8_t *d, uint64_t p)
+{
+	*(uint32_t *) d = (C16TO10(p, 32) << 20) | (C16TO10(p, 16) << 10) |
+	    C16TO10(p, 0);
+}
+
+static inline void
+store64_xbgr2101010(uint8_t *d, uint64_t p)
+{
+	*(uint32_t *) d = (C16TO10(p, 0) << 20) | (C16TO10(p, 16) << 10) |
+	    C16TO10(p, 32);
+}
+
+
+/*
+ * Row blitter template; every (load, store) pair gets its own loop so the
+ * swizzle is inlined and there is no per pixel format switch.
+ */
+#define BLIT_ROW(name, load, store, dst_bytes)				\
+static void								\
+name(uint8_t *dst, const uint8_t *src, const uint32_t *bg, uint32_t n)	\
+{									\
+	uint32_t x;							\
+									\
+	for (x = 0; x < n; x++, dst += (dst_bytes))			\
+		store(dst, load(src, bg, x));				\
+}
+
+#define BLIT_ROWS(fmt, store, dst_bytes)				\
+	BLIT_ROW(row_##fmt, LOAD32, store, dst_bytes)			\
+	BLIT_ROW(row_##fmt##_blend, LOAD32_BLEND, store, dst_bytes)
+
+#define BLIT_ROWS64(fmt, store, dst_bytes)				\
+	BLIT_ROW(row64_##fmt, LOAD64, store, dst_bytes)			\
+	BLIT_ROW(row64_##fmt##_blend, LOAD64_BLEND, store, dst_bytes)
+
+BLIT_ROWS(xbgr8888, store_xbgr8888, 4)
+BLIT_ROWS(rgb888, store_rgb888, 3)
+BLIT_ROWS(bgr888, store_bgr888, 3)
+BLIT_ROWS(rgb565, store_rgb565, 2)
+BLIT_ROWS(xrgb2101010, store_xrgb2101010, 4)
+BLIT_ROWS(xbgr2101010, store_xbgr2101010, 4)
+BLIT_ROWS64(xrgb2101010, store64_xrgb2101010, 4)
+BLIT_ROWS64(xbgr2101010, store64_xbgr2101010, 4)
+
+
+/*
+ * The framebuffer's native layout is a straight copy. Rows go to the
+ * shadow's scratch row or a cache entry, both read back right away, so
+ * unlike blit_copy() into the framebuffer these stay in the cache.
+ */
+static void
+row_copy8(uint8_t *dst, const uint8_t *src, const uint32_t *bg, uint32_t n)
+{
+	memcpy(dst, src, n);
+}
+
+static void
+row_xrgb8888(uint8_t *dst, const uint8_t *src, const uint32_t *bg, uint32_t n)
+{
+	memcpy(dst, src, n * sizeof(uint32_t));
+}
+
+static void
+row_xrgb8888_blend(uint8_t *dst, const uint8_t *src, const uint32_t *bg,
+    uint32_t n)
+{
+	blit_composite_row((uint32_t *) dst, (const uint32_t *) src, bg, n);
+}
+
+#ifdef __SSE2__
+/* swap red and blue four pixels at a time */
+static void
+row_xbgr8888_sse2(uint8_t *dst, const uint8_t *src, const uint32_t *bg,
+    uint32_t n)
+{
+	__m128i p, ag, rb;
+	uint32_t x;
+
+	ag = _mm_set1_epi32(0xff00ff00);
+	rb = _mm_set1_epi32(0x000000ff);
+	for (x = 0; x + 4 <= n; x += 4) {
+		p = _mm_loadu_si128((const __m128i *) (src + 4 * x));
+		p = _mm_or_si128(_mm_and_si128(p, ag),
+		    _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 16), rb),
+		    _mm_slli_epi32(_mm_and_si128(p, rb), 16)));
+		_mm_storeu_si128((__m128i *) (dst + 4 * x), p);
+	}
+	row_xbgr8888(dst + 4 * x, src + 4 * x, bg, n - x);
+}
+
+
+/* pack eight pixels into 5:6:5, sign extended so packs does not saturate */
+static void
+row_rgb565_sse2(uint8_t *dst, const uint8_t *src, const uint32_t *bg,
+    uint32_t n)
+{
+	__m128i p, q, r, g, b;
+	uint32_t x;
+
+	r = _mm_set1_epi32(0xf800);
+	g = _mm_set1_epi32(0x07e0);
+	b = _mm_set1_epi32(0x001f);
+	for (x = 0; x + 8 <= n; x += 8) {
+		p = _mm_loadu_si128((const __m128i *) (src + 4 * x));
+		q = _mm_loadu_si128((const __m128i *) (src + 4 * x + 16));
+		p = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 8), r),
+		    _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 5), g),
+		    _mm_and_si128(_mm_srli_epi32(p, 3), b)));
+		q = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(q, 8), r),
+		    _mm_or_si128(_mm_and_si128(_mm_srli_epi32(q, 5), g),
+		    _mm_and_si128(_mm_srli_epi32(q, 3), b)));
+		p = _mm_srai_epi32(_mm_slli_epi32(p, 16), 16);
+		q = _mm_srai_epi32(_mm_slli_epi32(q, 16), 16);
+		_mm_storeu_si128((__m128i *) (dst + 2 * x), _mm_packs_epi32(p, q));
+	}
+	row_rgb565(dst + 2 * x, src + 4 * x, bg, n - x);
+}
+#endif
+
+
+#ifdef HAVE_AVX_STREAM
+/* byte swizzles, one pshufb per register */
+__attribute__((target("ssse3")))
+static void
+row_xbgr8888_ssse3(uint8_t *dst, const uint8_t *src, const uint32_t *bg,
+    uint32_t n)
+{
+	__m128i mask;
+	uint32_t x;
+
+	mask = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11,
+	    14, 13, 12, 15);
+	for (x = 0; x + 4 <= n; x += 4)
+		_mm_storeu_si128((__m128i *) (dst + 4 * x), _mm_shuffle_epi8(
+		    _mm_loadu_si128((const __m128i *) (src + 4 * x)), mask));
+	row_xbgr8888(dst + 4 * x, src + 4 * x, bg, n - x);
+}
+
+
+__attribute__((target("avx2")))
+static void
+row_xbgr8888_avx2(uint8_t *dst, const uint8_t *src, const uint32_t *bg,
+    uint32_t n)
+{
+	__m256i mask;
+	uint32_t x;
+
+	mask = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11,
+	    14, 13, 12, 15, 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11,
+	    14, 13, 12, 15);
+	for (x = 0; x + 8 <= n; x += 8)
+		_mm256_storeu_si256((__m256i *) (dst + 4 * x),
+		    _mm256_shuffle_epi8(_mm256_loadu_si256(
+		    (const __m256i *) (src + 4 * x)), mask));
+	_mm256_zeroupper();
+	row_xbgr8888(dst + 4 * x, src + 4 * x, bg, n - x);
+}
+
+
+/*
+ * Sixteen pixels to 48 bytes: squeeze the padding out of each register,
+ * then stitch the 12 byte pieces into three full stores.
+ */
+__attribute__((target("ssse3")))
+static inline void
+row_24_ssse3(uint8_t *dst, const uint8_t *src, uint32_t n, __m128i mask)
+{
+	__m128i c0, c1, c2, c3;
+	uint32_t x;
+
+	for (x = 0; x + 16 <= n; x += 16, src += 64, dst += 48) {
+		c0 = _mm_shuffle_epi8(_mm_loadu_si128(
+		    (const __m128i *) (src +  0)), mask);
+		c1 = _mm_shuffle_epi8(_mm_loadu_si128(
+		    (const __m128i *) (src + 16)), mask);
+		c2 = _mm_shuffle_epi8(_mm_loadu_si128(
+		    (const __m128i *) (src + 32)), mask);
+		c3 = _mm_shuffle_epi8(_mm_loadu_si128(
+		    (const __m128i *) (src + 48)), mask);
+		_mm_storeu_si128((__m128i *) (dst +  0),
+		    _mm_or_si128(c0, _mm_slli_si128(c1, 12)));
+		_mm_storeu_si128((__m128i *) (dst + 16),
+		    _mm_or_si128(_mm_srli_si128(c1, 4), _mm_slli_si128(c2, 8)));
+		_mm_storeu_si128((__m128i *) (dst + 32),
+		    _mm_or_si128(_mm_srli_si128(c2, 8), _mm_slli_si128(c3, 4)));
+	}
+}
+
+
+__attribute__((target("ssse3")))
+static void
+row_rgb888_ssse3(uint8_t *dst, const uint8_t *src, const uint32_t *bg,
+    uint32_t n)
+{
+	uint32_t done = n & ~15;
+
+	row_24_ssse3(dst, src, n, _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10,
+	    12, 13, 14, -1, -1, -1, -1));
+	row_rgb888(dst + 3 * done, src + 4 * done, bg, n - done);
+}
+
+
+__attribute__((target("ssse3")))
+static void
+row_bgr888_ssse3(uint8_t *dst, const uint8_t *src, const uint32_t *bg,
+    uint32_t n)
+{
+	uint32_t done = n & ~15;
+
+	row_24_ssse3(dst, src, n, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+	    14, 13, 12, -1, -1, -1, -1));
+	row_bgr888(dst + 3 * done, src + 4 * done, bg, n - done);
+}
+#endif
+
+
+#ifdef HAVE_NEON_ROWS
+/* the de-interleaving loads do the swizzles */
+static void
+row_xbgr8888_neon(uint8_t *dst, const uint8_t *src, const uint32_t *bg,
+    uint32_t n)
+{
+	uint8x16x4_t p;
+	uint8x16_t t;
+	uint32_t x;
+
+	for (x = 0; x + 16 <= n; x += 16) {
+		p = vld4q_u8(src + 4 * x);
+		t = p.val[0];
+		p.val[0] = p.val[2];
+		p.val[2] = t;
+		vst4q_u8(dst + 4 * x, p);
+	}
+	row_xbgr8888(dst + 4 * x, src + 4 * x, bg, n - x);
+}
+
+
+static void
+row_rgb888_neon(uint8_t *dst, const uint8_t *src, const uint32_t *bg,
+    uint32_t n)
+{
+	uint8x16x4_t p;
+	uint8x16x3_t c;
+	uint32_t x;
+
+	for (x = 0; x + 16 <= n; x += 16) {
+		p = vld4q_u8(src + 4 * x);
+		c.val[0] = p.val[0];
+		c.val[1] = p.val[1];
+		c.val[2] = p.val[2];
+		vst3q_u8(dst + 3 * x, c);
+	}
+	row_rgb888(dst + 3 * x, src + 4 * x, bg, n - x);
+}
+
+
+static void
+row_bgr888_neon(uint8_t *dst, const uint8_t *src, const uint32_t *bg,
+    uint32_t n)
+{
+	uint8x16x4_t p;
+	uint8x16x3_t c;
+	uint32_t x;
+
+	for (x = 0; x + 16 <= n; x += 16) {
+		p = vld4q_u8(src + 4 * x);
+		c.val[0] = p.val[2];
+		c.val[1] = p.val[1];
+		c.val[2] = p.val[0];
+		vst3q_u8(dst + 3 * x, c);
+	}
+	row_bgr888(dst + 3 * x, src + 4 * x, bg, n - x);
+}
+
+
+static void
+row_rgb565_neon(uint8_t *dst, const uint8_t *src, const uint32_t *bg,
+    uint32_t n)
+{
+	uint8x8x4_t p;
+	uint16x8_t v;
+	uint32_t x;
+
+	for (x = 0; x + 8 <= n; x += 8) {
+		p = vld4_u8(src + 4 * x);
+		v = vshll_n_u8(p.val[2], 8);
+		v = vsriq_n_u16(v, vshll_n_u8(p.val[1], 8), 5);
+		v = vsriq_n_u16(v, vshll_n_u8(p.val[0], 8), 11);
+		vst1q_u16((uint16_t *) (dst + 2 * x), v);
+	}
+	row_rgb565(dst + 2 * x, src + 4 * x, bg, n - x);
+}
+#endif
+
+
+/* indexed by [format][source][blend] */
+static const blit_row_func blit_rows[BLIT_FMT_COUNT][BLIT_SRC_COUNT][2] = {
+	[BLIT_FMT_CI8] = {
+		[BLIT_SRC_INDEXED8] = { row_copy8, row_copy8 },
+	},
+	[BLIT_FMT_XRGB8888] = {
+		[BLIT_SRC_RGBA32] = { row_xrgb8888, row_xrgb8888_blend },
+	},
+	[BLIT_FMT_XBGR8888] = {
+#ifdef __SSE2__
+		[BLIT_SRC_RGBA32] = { row_xbgr8888_sse2, row_xbgr8888_blend },
+#else
+		[BLIT_SRC_RGBA32] = { row_xbgr8888, row_xbgr8888_blend },
+#endif
+	},
+	[BLIT_FMT_RGB888] = {
+		[BLIT_SRC_RGBA32] = { row_rgb888, row_rgb888_blend },
+	},
+	[BLIT_FMT_BGR888] = {
+		[BLIT_SRC_RGBA32] = { row_bgr888, row_bgr888_blend },
+	},
+	[BLIT_FMT_RGB565] = {
+#ifdef __SSE2__
+		[BLIT_SRC_RGBA32] = { row_rgb565_sse2, row_rgb565_blend },
+#else
+		[BLIT_SRC_RGBA32] = { row_rgb565, row_rgb565_blend },
+#endif
+	},
+	[BLIT_FMT_XRGB2101010] = {
+		[BLIT_SRC_RGBA32] = { row_xrgb2101010, row_xrgb2101010_blend },
+		[BLIT_SRC_RGBA64] = { row64_xrgb2101010, row64_xrgb2101010_blend },
+	},
+	[BLIT_FMT_XBGR2101010] = {
+		[BLIT_SRC_RGBA32] = { row_xbgr2101010, row_xbgr2101010_blend },
+		[BLIT_SRC_RGBA64] = { row64_xbgr2101010, row64_xbgr2101010_blend },
+	},
+};
+
+
+/* opaque RGBA32 rows that have a faster variant on this CPU */
+static blit_row_func
+blit_select_simd(int fmt)
+{
+#ifdef HAVE_AVX_STREAM
+	if ((fmt == BLIT_FMT_XBGR8888) && cpu_has(CPU_AVX2))
+		return row_xbgr8888_avx2;
+	if (cpu_has(CPU_SSSE3)) {
+		switch (fmt) {
+		case BLIT_FMT_XBGR8888:
+			return row_xbgr8888_ssse3;
+		case BLIT_FMT_RGB888:
+			return row_rgb888_ssse3;
+		case BLIT_FMT_BGR888:
+			return row_bgr888_ssse3;
+		}
+	}
+#endif
+#ifdef HAVE_NEON_ROWS
+	if (cpu_has(CPU_NEON)) {
+		switch (fmt) {
+		case BLIT_FMT_XBGR8888:
+			return row_xbgr8888_neon;
+		case BLIT_FMT_RGB888:
+			return row_rgb888_neon;
+		case BLIT_FMT_BGR888:
+			return row_bgr888_neon;
+		case BLIT_FMT_RGB565:
+			return row_rgb565_neon;
+		}
+	}
+#endif
+	return NULL;
+}
+
+
+/* pick the row blitter once per image; NULL if the pair is unsupported */
+blit_row_func
+blit_select_row(int fmt, int src, bool blend)
+{
+	blit_row_func row;
+
+	if ((fmt < 0) || (fmt >= BLIT_FMT_COUNT))
+		return NULL;
+	if ((src < 0) || (src >= BLIT_SRC_COUNT))
+		return NULL;
+	if (!blend && (src == BLIT_SRC_RGBA32) &&
+	    ((row = blit_select_simd(fmt)) != NULL))
+		return row;
+	return blit_rows[fmt][src][blend ? 1 : 0];
+}
+
+
+/*
+ * And back from the framebuffer: 0xffRRGGBB from a pixel, the top bits
+ * of wider channels and the low ones of narrower channels repeated.
+ */
+#define C5TO8(v)		(((v) << 3) | ((v) >> 2))
+#define C6TO8(v)		(((v) << 2) | ((v) >> 4))
+#define C10TO8(p, sh)		(((p) >> ((sh) + 2)) & 0xff)
+
+static inline uint32_t
+load_xrgb8888(const uint8_t *s)
+{
+	return *(const uint32_t *) s | 0xff000000;
+}
+
+static inline uint32_t
+load_xbgr8888(const uint8_t *s)
+{
+	uint32_t p;
+
+	p = *(const uint32_t *) s;
+	return 0xff000000 | (p & 0x0000ff00) | ((p >> 16) & 0xff) |
+	    ((p & 0xff) << 16);
+}
+
+static inline uint32_t
+load_rgb888(const uint8_t *s)
+{
+	return 0xff000000 | (s[2] << 16) | (s[1] << 8) | s[0];
+}
+
+static inline uint32_t
+load_bgr888(const uint8_t *s)
+{
+	return 0xff000000 | (s[0] << 16) | (s[1] << 8) | s[2];
+}
+
+static inline uint32_t
+load_rgb565(const uint8_t *s)
+{
+	uint32_t p;
+
+	p = *(const uint16_t *) s;
+	return 0xff000000 | (C5TO8(p >> 11) << 16) |
+	    (C6TO8((p >> 5) & 0x3f) << 8) | C5TO8(p & 0x1f);
+}
+
+static inline uint32_t
+load_xrgb2101010(const uint8_t *s)
+{
+	uint32_t p;
+
+	p = *(const uint32_t *) s;
+	return 0xff000000 | (C10TO8(p, 20) << 16) | (C10TO8(p, 10) << 8) |
+	    C10TO8(p, 0);
+}
+
+static inline uint32_t
+load_xbgr2101010(const uint8_t *s)
+{
+	uint32_t p;
+
+	p = *(const uint32_t *) s;
+	return 0xff000000 | (C10TO8(p, 0) << 16) | (C10TO8(p, 10) << 8) |
+	    C10TO8(p, 20);
+}
+
+#define UNPACK_ROW(fmt, src_bytes)					\
+static void								\
+unpack_##fmt(uint32_t *dst, const uint8_t *src, const uint32_t *cmap,	\
+    uint32_t n)								\
+{									\
+	uint32_t x;							\
+									\
+	for (x = 0; x < n; x++, src += (src_bytes))			\
+		dst[x] = load_##fmt(src);				\
+}
+
+UNPACK_ROW(xrgb8888, 4)
+UNPACK_ROW(xbgr8888, 4)
+UNPACK_ROW(rgb888, 3)
+UNPACK_ROW(bgr888, 3)
+UNPACK_ROW(rgb565, 2)
+UNPACK_ROW(xrgb2101010, 4)
+UNPACK_ROW(xbgr2101010, 4)
+
+static void
+unpack_ci8(uint32_t *dst, const uint8_t *src, const uint32_t *cmap,
+    uint32_t n)
+{
+	uint32_t x;
+
+	for (x = 0; x < n; x++)
+		dst[x] = 0xff000000 | cmap[src[x]];
+}
+
+static const blit_unpack_func blit_unpacks[BLIT_FMT_COUNT] = {
+	[BLIT_FMT_CI8]		= unpack_ci8,
+	[BLIT_FMT_XRGB8888]	= unpack_xrgb8888,
+	[BLIT_FMT_XBGR8888]	= unpack_xbgr8888,
+	[BLIT_FMT_RGB888]	= unpack_rgb888,
+	[BLIT_FMT_BGR888]	= unpack_bgr888,
+	[BLIT_FMT_RGB565]	= unpack_rgb565,
+	[BLIT_FMT_XRGB2101010]	= unpack_xrgb2101010,
+	[BLIT_FMT_XBGR2101010]	= unpack_xbgr2101010,
+};
+
+/* framebuffer rows to png_convert_to_rgba32() layout, NULL if unknown */
+blit_unpack_func
+blit_select_unpack(int fmt)
+{
+	if ((fmt < 0) || (fmt >= BLIT_FMT_COUNT))
+		return NULL;
+	return blit_unpacks[fmt];
+}
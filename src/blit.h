@@ -0,0 +1,128 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BLIT_H
+#define _BLIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "png_codec.h"
+
+/* what transparent pixels are composited against */
+#define BLIT_BACKDROP_BKGD	0	/* image bKGD, solid colour if absent */
+#define BLIT_BACKDROP_SOLID	1
+#define BLIT_BACKDROP_CHECKER	2
+
+#define BLIT_CHECKER_SHIFT	3	/* 8x8 pixel squares */
+
+/* framebuffer pixel layouts, named after the pixel value MSB first */
+#define BLIT_FMT_CI8		0	/* palette index */
+#define BLIT_FMT_XRGB8888	1
+#define BLIT_FMT_XBGR8888	2
+#define BLIT_FMT_RGB888		3	/* packed, little endian 24 bit value */
+#define BLIT_FMT_BGR888		4
+#define BLIT_FMT_RGB565		5
+#define BLIT_FMT_XRGB2101010	6
+#define BLIT_FMT_XBGR2101010	7
+#define BLIT_FMT_COUNT		8
+
+/* image layouts the blitters read */
+#define BLIT_SRC_INDEXED8	0	/* 8 bit indexed png */
+#define BLIT_SRC_RGBA32		1	/* png_convert_to_rgba32() output */
+#define BLIT_SRC_RGBA64		2	/* png_convert_to_rgba64() output */
+#define BLIT_SRC_COUNT		3
+
+/* how copies and fills reach the framebuffer */
+#define BLIT_STORE_AUTO		-1
+#define BLIT_STORE_CACHED	0	/* plain memcpy/memset */
+#define BLIT_STORE_SSE2		1	/* movntdq */
+#define BLIT_STORE_AVX		2	/* vmovntdq */
+#define BLIT_STORE_COUNT	3
+
+/* dst, src, backdrop row (ignored when not compositing), pixels */
+typedef void (*blit_row_func)(uint8_t *, const uint8_t *, const uint32_t *,
+    uint32_t);
+
+/* dst, framebuffer row, colour map as 0x00RRGGBB for CI8, pixels */
+typedef void (*blit_unpack_func)(uint32_t *, const uint8_t *,
+    const uint32_t *, uint32_t);
+
+struct blit_backdrop {
+	int		 mode;
+	uint32_t	 colour;	/* 0x00RRGGBB */
+	uint32_t	 checker[2];
+};
+
+/*
+ * Per image compositing state; the backdrop is prerendered for the even
+ * and odd checker rows so blending never has to look at coordinates.
+ */
+struct blit_composite {
+	bool		 enabled;
+	uint32_t	 y0;
+	uint32_t	*bg_rows[2];
+};
+
+extern void (*blit_copy)(void *, const void *, size_t);
+extern void (*blit_fill)(void *, uint32_t, size_t);
+
+int	blit_store_init(int);
+bool	blit_store_available(int);
+const char *blit_store_name(int);
+void	blit_fence(void);
+
+int	blit_pixfmt_from_masks(int, int, int, int, int, int, int);
+int	blit_pixfmt_from_depth(int);
+int	blit_pixfmt_bytes(int);
+int	blit_pixfmt_source(int);
+const char *blit_pixfmt_name(int);
+blit_row_func blit_select_row(int, int, bool);
+blit_unpack_func blit_select_unpack(int);
+
+void	blit_backdrop_init(struct blit_backdrop *);
+bool	blit_backdrop_parse(struct blit_backdrop *, const char *);
+uint32_t blit_backdrop_colour(const struct blit_backdrop *, struct png_info *);
+
+bool	blit_composite_setup(struct blit_composite *,
+	    const struct blit_backdrop *, struct png_info *,
+	    uint32_t, uint32_t);
+bool	blit_composite_setup_canvas(struct blit_composite *,
+	    const struct blit_backdrop *, struct png_info *,
+	    uint32_t, uint32_t);
+void	blit_composite_free(struct blit_composite *);
+uint32_t blit_blend_pixel(uint32_t, uint32_t);
+void	blit_composite_row(uint32_t *, const uint32_t *, const uint32_t *,
+	    uint32_t);
+
+static inline const uint32_t *
+blit_composite_bg_row(const struct blit_composite *bc, uint32_t y)
+{
+	return bc->bg_rows[((bc->y0 + y) >> BLIT_CHECKER_SHIFT) & 1];
+}
+
+#endif	/* _BLIT_H */
@@ -0,0 +1,260 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Measures fill and copy bandwidth of the framebuffer store methods, both
+ * into plain memory and, on NetBSD, into a real wsdisplay framebuffer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#ifdef __NetBSD__
+#include <dev/wscons/wsconsio.h>
+#endif
+
+#include "blit.h"
+
+struct surface {
+	const char	*name;
+	uint8_t		*base;
+	uint32_t	 width, height;
+	uint32_t	 stride;
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void
+bench_surface(struct surface *sf, const uint8_t *image, int frames)
+{
+	double start, fill_t, copy_t, mbytes;
+	uint32_t row_bytes, y;
+	uint8_t *opos;
+	int method, frame;
+
+	row_bytes = sf->width * 4;
+	mbytes = (double) row_bytes * sf->height * frames / (1024 * 1024);
+
+	for (method = 0; method < BLIT_STORE_COUNT; method++) {
+		if (!blit_store_available(method))
+			continue;
+		blit_store_init(method);
+
+		start = now();
+		for (frame = 0; frame < frames; frame++) {
+			opos = sf->base;
+			for (y = 0; y < sf->height; y++, opos += sf->stride)
+				blit_fill(opos, frame, row_bytes);
+			blit_fence();
+		}
+		fill_t = now() - start;
+
+		start = now();
+		for (frame = 0; frame < frames; frame++) {
+			opos = sf->base;
+			for (y = 0; y < sf->height; y++, opos += sf->stride)
+				blit_copy(opos, image + y * row_bytes, row_bytes);
+			blit_fence();
+		}
+		copy_t = now() - start;
+
+		printf("%-12s %-8s fill %8.1f MB/s   copy %8.1f MB/s\n",
+		    sf->name, blit_store_name(method),
+		    mbytes / fill_t, mbytes / copy_t);
+	}
+}
+
+
+#ifdef __NetBSD__
+static bool
+open_framebuffer(const char *dev, struct surface *sf, int *fdp)
+{
+	struct wsdisplay_fbinfo fbinfo;
+	u_int stride;
+	int fd, mode;
+	void *fb;
+
+	fd = open(dev, O_RDWR);
+	if (fd < 0) {
+		perror("Can't open wsdisplay dev");
+		return false;
+	}
+	if ((ioctl(fd, WSDISPLAYIO_GINFO, &fbinfo) == -1) ||
+	    (ioctl(fd, WSDISPLAYIO_LINEBYTES, &stride) == -1)) {
+		perror("Can't get wsdisplay geometry");
+		close(fd);
+		return false;
+	}
+	if (fbinfo.depth != 32) {
+		fprintf(stderr, "Only 32 bit framebuffers are benchmarked\n");
+		close(fd);
+		return false;
+	}
+
+	mode = WSDISPLAYIO_MODE_MAPPED;
+	if (ioctl(fd, WSDISPLAYIO_SMODE, &mode) == -1) {
+		perror("WSDISPLAYIO_SMODE ioctl failed");
+		close(fd);
+		return false;
+	}
+	fb = mmap(NULL, stride * fbinfo.height, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, fd, 0);
+	if (fb == MAP_FAILED) {
+		perror("Can't map framebuffer");
+		mode = WSDISPLAYIO_MODE_EMUL;
+		ioctl(fd, WSDISPLAYIO_SMODE, &mode);
+		close(fd);
+		return false;
+	}
+
+	sf->name = "framebuffer";
+	sf->base = fb;
+	sf->width = fbinfo.width;
+	sf->height = fbinfo.height;
+	sf->stride = stride;
+	*fdp = fd;
+	return true;
+}
+
+
+static void
+close_framebuffer(struct surface *sf, int fd)
+{
+	int mode;
+
+	munmap(sf->base, sf->stride * sf->height);
+	mode = WSDISPLAYIO_MODE_EMUL;
+	ioctl(fd, WSDISPLAYIO_SMODE, &mode);
+	close(fd);
+}
+#endif
+
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [-w width] [-h height] [-n frames] "
+	    "[-m wsdisplay]\n", progname);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	struct surface mem;
+	const char *fbdev;
+	uint8_t *image;
+	size_t size;
+	uint32_t i;
+	int ch, frames;
+#ifdef __NetBSD__
+	struct surface fb;
+	int fd;
+#endif
+
+	fbdev = NULL;
+	frames = 100;
+	mem.name = "memory";
+	mem.width = 1920;
+	mem.height = 1080;
+	while ((ch = getopt(argc, argv, "w:h:n:m:")) != -1) {
+		switch (ch) {
+		case 'w':
+			mem.width = atoi(optarg);
+			break;
+		case 'h':
+			mem.height = atoi(optarg);
+			break;
+		case 'n':
+			frames = atoi(optarg);
+			break;
+		case 'm':
+			fbdev = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if ((mem.width == 0) || (mem.height == 0) || (frames <= 0)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* the source image is sized for the largest surface */
+	size = (size_t) mem.width * mem.height * 4;
+#ifdef __NetBSD__
+	if (fbdev && open_framebuffer(fbdev, &fb, &fd)) {
+		if ((size_t) fb.width * fb.height * 4 > size)
+			size = (size_t) fb.width * fb.height * 4;
+	} else {
+		fbdev = NULL;
+	}
+#else
+	if (fbdev)
+		fprintf(stderr, "No framebuffer support on this platform\n");
+#endif
+
+	/* mimic a framebuffer: page aligned, stride padded to a cache line */
+	mem.stride = (mem.width * 4 + 63) & ~63;
+	if ((posix_memalign((void **) &mem.base, 4096,
+	    (size_t) mem.stride * mem.height) != 0) ||
+	    ((image = malloc(size)) == NULL)) {
+		fprintf(stderr, "Can't allocate benchmark buffers\n");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < size; i++)
+		image[i] = i * 7;
+
+	printf("%u x %u, %d frames per run\n", mem.width, mem.height, frames);
+	bench_surface(&mem, image, frames);
+#ifdef __NetBSD__
+	if (fbdev) {
+		bench_surface(&fb, image, frames);
+		close_framebuffer(&fb, fd);
+	}
+#endif
+
+	free(mem.base);
+	free(image);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,780 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Codec benchmark. Generates a deterministic corpus with the saver, every
+ * colour type and bit depth, interlaced or not, each filter type and IDAT
+ * chunks from a single byte to one chunk holding the whole image, then
+ * times loading and conversion to RGBA32 on it. The loaded image is
+ * checked against what was saved so broken decoding does not go unnoticed
+ * behind good numbers, and headers the loader has to refuse are tried on
+ * it first. With a reference decoder compiled in, see the Makefile, it is
+ * timed on the same files.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "png_codec.h"
+#include "png_batch.h"
+
+/* in codecbench_ref.c, kept apart as <png.h> clashes with png_codec.h */
+const char *ref_name(void);
+int	ref_decode(const uint8_t *, size_t, uint32_t *, uint32_t *);
+
+struct corpus_format {
+	const char	*name;
+	int		 colourtype;
+	int		 depth;
+};
+
+static const struct corpus_format formats[] = {
+	{ "grey1",	PNG_COLOUR_GREY_ONLY,	 1 },
+	{ "grey2",	PNG_COLOUR_GREY_ONLY,	 2 },
+	{ "grey4",	PNG_COLOUR_GREY_ONLY,	 4 },
+	{ "grey8",	PNG_COLOUR_GREY_ONLY,	 8 },
+	{ "grey16",	PNG_COLOUR_GREY_ONLY,	16 },
+	{ "rgb8",	PNG_COLOUR_RGB,		 8 },
+	{ "rgb16",	PNG_COLOUR_RGB,		16 },
+	{ "index1",	PNG_COLOUR_INDEXED,	 1 },
+	{ "index2",	PNG_COLOUR_INDEXED,	 2 },
+	{ "index4",	PNG_COLOUR_INDEXED,	 4 },
+	{ "index8",	PNG_COLOUR_INDEXED,	 8 },
+	{ "greya8",	PNG_COLOUR_GREY_ALPHA,	 8 },
+	{ "greya16",	PNG_COLOUR_GREY_ALPHA,	16 },
+	{ "rgba8",	PNG_COLOUR_RGBA,	 8 },
+	{ "rgba16",	PNG_COLOUR_RGBA,	16 },
+};
+#define NFORMATS	(sizeof(formats) / sizeof(formats[0]))
+
+static const char *filter_names[] = {
+	"none", "sub", "up", "average", "paeth", "adaptive"
+};
+
+/* IDAT chunk sizes, 0 puts the whole stream in one chunk */
+static const uint32_t chunk_sizes[] = { 1, 61, 4096, 0 };
+#define NCHUNKS		(sizeof(chunk_sizes) / sizeof(chunk_sizes[0]))
+
+struct corpus_file {
+	char		 path[1024];
+	int		 format;
+	int		 interlace;
+	int		 filter;
+	uint32_t	 chunk;		/* 0 as saved, else rechunked */
+	uint32_t	 width, height;
+	uint32_t	 seed;
+};
+
+struct bench_total {
+	double		 load_t, conv_t, ref_t;
+	double		 mbytes, mpixels;
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static uint32_t
+xorshift(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+
+/* bytes per row of the image as the codec keeps it */
+static uint32_t
+image_strave(const struct corpus_format *f, uint32_t width)
+{
+	static const int spp[8] = { 1, 0, 3, 1, 2, 0, 4, 0 };
+
+	return (width * f->depth * spp[f->colourtype] + 7) / 8;
+}
+
+
+/*
+ * Smooth gradients with a little noise, so the filters have something to
+ * work with and the result compresses like a photograph rather than like
+ * either random bytes or a flat colour.
+ */
+static uint8_t *
+image_generate(const struct corpus_format *f, uint32_t width,
+    uint32_t height, uint32_t seed)
+{
+	static const int spp[8] = { 1, 0, 3, 1, 2, 0, 4, 0 };
+	uint32_t strave, x, y, c, maxval, val, noise, bit, state;
+	uint8_t *blob, *row;
+	int samples;
+
+	samples = spp[f->colourtype];
+	strave = image_strave(f, width);
+	blob = calloc(1, (size_t) strave * height);
+	if (blob == NULL)
+		return NULL;
+
+	maxval = (1U << f->depth) - 1;
+	state = seed | 1;
+	for (y = 0; y < height; y++) {
+		row = blob + (size_t) strave * y;
+		for (x = 0; x < width; x++) {
+			for (c = 0; c < samples; c++) {
+				val = (uint64_t) (maxval + 1) *
+				    ((x * (c + 1) + y * (samples - c)) %
+				    (width + height)) / (width + height);
+				noise = xorshift(&state) % (maxval / 32 + 1);
+				val = (val + noise > maxval) ? maxval : val + noise;
+
+				bit = (x * samples + c) * f->depth;
+				if (f->depth == 16) {
+					row[bit / 8]     = val >> 8;
+					row[bit / 8 + 1] = val;
+				} else {
+					row[bit / 8] |= val <<
+					    (8 - (bit & 7) - f->depth);
+				}
+			}
+		}
+	}
+	return blob;
+}
+
+
+static bool
+image_save(const struct corpus_file *cf)
+{
+	const struct corpus_format *f = &formats[cf->format];
+	struct png_info *info;
+	png_file_status status;
+	uint8_t *blob;
+	int fh, i;
+
+	blob = image_generate(f, cf->width, cf->height, cf->seed);
+	info = png_create_png_context();
+	if ((blob == NULL) || (info == NULL)) {
+		free(blob);
+		png_dispose_png(info);
+		return false;
+	}
+
+	/* the image now belongs to the context */
+	png_populate_with_image(info, f->colourtype, blob, f->depth,
+	    cf->width, cf->height);
+	info->interlace = cf->interlace;
+	png_set_save_filter(info, cf->filter);
+	if (f->colourtype == PNG_COLOUR_INDEXED) {
+		/* a few see-through entries to get a tRNS chunk too */
+		for (i = 0; i < 256; i++)
+			info->palette[i] = ((i % 16) ? 0xff000000 : 0x80000000) |
+			    (i << 16) | ((255 - i) << 8) | ((i * 7) & 0xff);
+	}
+
+	fh = open(cf->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fh < 0) {
+		perror(cf->path);
+		png_dispose_png(info);
+		return false;
+	}
+	status = png_start_saving(info, fh);
+	while (status & PNG_FILE_SAVING)
+		status = png_save_a_piece(info);
+	close(fh);
+	png_dispose_png(info);
+
+	if (status & PNG_FILE_ERROR) {
+		fprintf(stderr, "%s: saving failed, status %x\n", cf->path,
+		    status);
+		return false;
+	}
+	return true;
+}
+
+
+static uint8_t *
+file_read(const char *path, size_t *len)
+{
+	struct stat st;
+	uint8_t *data;
+	ssize_t got;
+	size_t pos;
+	int fh;
+
+	fh = open(path, O_RDONLY);
+	if (fh < 0)
+		return NULL;
+	if ((fstat(fh, &st) == -1) || ((data = malloc(st.st_size + 1)) == NULL)) {
+		close(fh);
+		return NULL;
+	}
+	for (pos = 0; pos < st.st_size; pos += got) {
+		got = read(fh, data + pos, st.st_size - pos);
+		if (got <= 0)
+			break;
+	}
+	close(fh);
+	*len = pos;
+	return data;
+}
+
+
+static void
+put_be32(uint8_t *pos, uint32_t val)
+{
+	pos[0] = val >> 24;
+	pos[1] = val >> 16;
+	pos[2] = val >> 8;
+	pos[3] = val;
+}
+
+
+static uint32_t
+get_be32(const uint8_t *pos)
+{
+	return ((uint32_t) pos[0] << 24) | (pos[1] << 16) | (pos[2] << 8) |
+	    pos[3];
+}
+
+
+static uint8_t *
+chunk_put(uint8_t *pos, const char *type, const uint8_t *data, uint32_t len)
+{
+	put_be32(pos, len);
+	memcpy(pos + 4, type, 4);
+	if (len)
+		memcpy(pos + 8, data, len);
+	put_be32(pos + 8 + len, crc32(0, pos + 4, len + 4));
+	return pos + 12 + len;
+}
+
+
+/* rewrite the file with its IDAT stream split into chunk sized pieces */
+static bool
+image_rechunk(const char *path, uint32_t chunk)
+{
+	uint8_t *in, *out, *pos, *idat;
+	size_t in_len, idat_len, off, len, piece;
+	bool idat_done;
+	FILE *f;
+
+	if ((in = file_read(path, &in_len)) == NULL)
+		return false;
+
+	/* gather the stream */
+	idat = malloc(in_len);
+	idat_len = 0;
+	for (off = 8; idat && (off + 12 <= in_len); off += len + 12) {
+		len = get_be32(in + off);
+		if (memcmp(in + off + 4, "IDAT", 4) == 0) {
+			memcpy(idat + idat_len, in + off + 8, len);
+			idat_len += len;
+		}
+	}
+	if (chunk == 0)
+		chunk = idat_len;
+
+	/* a single byte chunk costs 12 bytes of framing */
+	out = malloc(in_len + 12 * (idat_len / chunk + 1));
+	if ((idat == NULL) || (out == NULL)) {
+		free(in);
+		free(idat);
+		free(out);
+		return false;
+	}
+	memcpy(out, in, 8);
+	pos = out + 8;
+	idat_done = false;
+	for (off = 8; off + 12 <= in_len; off += len + 12) {
+		len = get_be32(in + off);
+		if (memcmp(in + off + 4, "IDAT", 4) != 0) {
+			memcpy(pos, in + off, len + 12);
+			pos += len + 12;
+			continue;
+		}
+		if (idat_done)
+			continue;
+		for (piece = 0; piece < idat_len; piece += chunk)
+			pos = chunk_put(pos, "IDAT", idat + piece,
+			    (idat_len - piece < chunk) ? idat_len - piece : chunk);
+		idat_done = true;
+	}
+
+	f = fopen(path, "w");
+	if (f != NULL) {
+		fwrite(out, 1, pos - out, f);
+		fclose(f);
+	}
+	free(in);
+	free(idat);
+	free(out);
+	return f != NULL;
+}
+
+
+static struct png_info *
+image_load(const char *path, png_file_status *statusp)
+{
+	struct png_info *info;
+	png_file_status status;
+	int fh;
+
+	fh = open(path, O_NONBLOCK | O_RDONLY);
+	if (fh < 0) {
+		perror(path);
+		return NULL;
+	}
+	info = png_create_png_context();
+	status = png_start_loading(info, fh);
+	while (status & PNG_FILE_LOADING)
+		status = png_load_a_piece(info);
+	close(fh);
+	*statusp = status;
+	return info;
+}
+
+
+/*
+ * PNG and headers of the other formats the loader knows whose sizes don't
+ * fit, each followed by a little data; all of them have to end in an error.
+ */
+#define HOSTILE(name, data)	{ name, data, sizeof(data) - 1 }
+
+static const struct {
+	const char	*name;
+	const char	*data;
+	size_t		 len;
+} hostile[] = {
+	HOSTILE("png-stride-wraps",	"\x89PNG\r\n\x1a\n\0\0\0\rIHDR \0\0\1\0\0\0\1"
+					"\x10\x06\0\0\0\xfc\xfbS?\0\0\0\x0bIDATx\xda\x63`\x80"
+					"\x02\0\0\x09\0\1h\xf6\xcfN\0\0\0\0IEND\xae\x42`\x82"),
+	HOSTILE("png-rgb-depth-3",	"\x89PNG\r\n\x1a\n\0\0\0\rIHDR\0\0\0\4\0\0\0\4"
+					"\3\2\0\0\0QC88\0\0\0\x0bIDATx\xda\x63`@\0\0\0\x0c"
+					"\0\1\xef\xe8\x33%\0\0\0\0IEND\xae\x42`\x82"),
+	HOSTILE("png-colourtype-9",	"\x89PNG\r\n\x1a\n\0\0\0\rIHDR\0\0\0\4\0\0\0\4"
+					"\x08\x09\0\0\0\xf1\x92\x8e(\0\0\0\x0bIDATx\xda\x63`"
+					"\xc0\4\0\0\x14\0\1\xeeZi\x09\0\0\0\0IEND\xae\x42`\x82"),
+	HOSTILE("pgm-stride-wraps",	"P5\n536870912 1\n255\n\0\0\0\0"),
+	HOSTILE("ppm-stride-wraps",	"P6\n1431655766 1\n255\n\0\0\0\0"),
+	HOSTILE("pam-image-too-big",	"P7\nWIDTH 65536\nHEIGHT 65536\nDEPTH 4\n"
+					"MAXVAL 255\nENDHDR\n\0\0\0\0"),
+	HOSTILE("pam-depth",		"P7\nWIDTH 4\nHEIGHT 4\nDEPTH 5\n"
+					"MAXVAL 255\nENDHDR\n\0\0\0\0"),
+	HOSTILE("pgm-maxval",		"P5 4 4 70000\n\0\0\0\0"),
+	HOSTILE("farbfeld-stride-wraps", "farbfeld\x20\0\0\0\0\0\0\1\0\0\0\0"),
+	HOSTILE("qoi-too-big",		"qoif\x7f\xff\xff\xff\x7f\xff\xff\xff\4\0"
+					"\0\0\0\0"),
+};
+#define NHOSTILE	(sizeof(hostile) / sizeof(hostile[0]))
+
+
+static bool
+corpus_reject(const char *dir)
+{
+	struct png_info *info;
+	png_file_status status;
+	char path[1024];
+	bool ok;
+	int fd, i;
+
+	ok = true;
+	for (i = 0; i < NHOSTILE; i++) {
+		snprintf(path, sizeof(path), "%s/hostile-%s", dir,
+		    hostile[i].name);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if ((fd < 0) ||
+		    (write(fd, hostile[i].data, hostile[i].len) !=
+		    (ssize_t) hostile[i].len)) {
+			perror(path);
+			if (fd >= 0)
+				close(fd);
+			return false;
+		}
+		close(fd);
+
+		info = image_load(path, &status);
+		if ((info == NULL) || !(status & PNG_FILE_ERROR)) {
+			printf("%-28s NOT REFUSED\n", hostile[i].name);
+			ok = false;
+		}
+		png_dispose_png(info);
+	}
+	return ok;
+}
+
+
+static int
+corpus_build(const char *dir, uint32_t width, uint32_t height,
+    struct corpus_file **filesp)
+{
+	struct corpus_file *files, *cf;
+	int nfiles, f, interlace, filter, c;
+
+	if ((mkdir(dir, 0755) == -1) && (errno != EEXIST)) {
+		perror(dir);
+		return -1;
+	}
+
+	nfiles = NFORMATS * 2 * 6 + NCHUNKS + 1;
+	files = calloc(nfiles, sizeof(struct corpus_file));
+	if (files == NULL)
+		return -1;
+
+	cf = files;
+	for (f = 0; f < NFORMATS; f++) {
+		for (interlace = 0; interlace < 2; interlace++) {
+			for (filter = 0; filter < 6; filter++, cf++) {
+				snprintf(cf->path, sizeof(cf->path),
+				    "%s/%s-%s-%s.png", dir, formats[f].name,
+				    interlace ? "adam7" : "plain",
+				    filter_names[filter]);
+				cf->format = f;
+				cf->interlace = interlace;
+				cf->filter = filter;
+				cf->width = width;
+				cf->height = height;
+			}
+		}
+	}
+
+	/* chunking only matters to the loader, one format will do */
+	for (c = 0; c < NCHUNKS; c++, cf++) {
+		snprintf(cf->path, sizeof(cf->path), "%s/rgba8-chunk%u.png",
+		    dir, chunk_sizes[c]);
+		cf->format = 13;
+		cf->filter = PNG_SAVE_FILTER_ADAPTIVE;
+		cf->chunk = chunk_sizes[c] ? chunk_sizes[c] : UINT32_MAX;
+		cf->width = width;
+		cf->height = height;
+	}
+
+	/* and something closer to a photo from a camera */
+	snprintf(cf->path, sizeof(cf->path), "%s/rgb8-large.png", dir);
+	cf->format = 5;
+	cf->filter = PNG_SAVE_FILTER_ADAPTIVE;
+	cf->width = width * 4;
+	cf->height = height * 3;
+
+	for (cf = files; cf < files + nfiles; cf++) {
+		cf->seed = cf - files;
+		if (!image_save(cf))
+			goto fail;
+		if (cf->chunk && !image_rechunk(cf->path,
+		    (cf->chunk == UINT32_MAX) ? 0 : cf->chunk))
+			goto fail;
+	}
+	*filesp = files;
+	return nfiles;
+
+fail:
+	free(files);
+	return -1;
+}
+
+
+static void
+bench_file(struct corpus_file *cf, int runs, bool reference,
+    struct bench_total *total)
+{
+	const struct corpus_format *f = &formats[cf->format];
+	struct png_info *info;
+	png_file_status status;
+	double t0, t1, t2, load_t, conv_t, ref_t, mbytes, mpixels;
+	uint8_t *expect, *data;
+	uint32_t strave, w, h;
+	size_t len;
+	bool ok;
+	int run;
+
+	strave = image_strave(f, cf->width);
+	expect = image_generate(f, cf->width, cf->height, cf->seed);
+	load_t = conv_t = ref_t = 1e9;
+	ok = true;
+
+	for (run = 0; run < runs; run++) {
+		t0 = now();
+		info = image_load(cf->path, &status);
+		t1 = now();
+		if ((info == NULL) || (status & PNG_FILE_ERROR)) {
+			ok = false;
+			png_dispose_png(info);
+			break;
+		}
+		if ((run == 0) && ((info->strave != strave) ||
+		    (memcmp(info->blob, expect, (size_t) strave * cf->height))))
+			ok = false;
+		png_convert_to_rgba32(info, 0);
+		t2 = now();
+		png_dispose_png(info);
+
+		if (t1 - t0 < load_t)
+			load_t = t1 - t0;
+		if (t2 - t1 < conv_t)
+			conv_t = t2 - t1;
+	}
+	free(expect);
+
+	if (reference && ((data = file_read(cf->path, &len)) != NULL)) {
+		for (run = 0; run < runs; run++) {
+			t0 = now();
+			if (ref_decode(data, len, &w, &h) != 0)
+				break;
+			t1 = now();
+			if (t1 - t0 < ref_t)
+				ref_t = t1 - t0;
+		}
+		free(data);
+	}
+
+	mbytes = (double) strave * cf->height / (1024 * 1024);
+	mpixels = (double) cf->width * cf->height / 1e6;
+	printf("%-28s", strrchr(cf->path, '/') + 1);
+	if (!ok) {
+		printf(" DECODE FAILED\n");
+		return;
+	}
+	printf(" %8.1f MB/s %7.1f Mpix/s %8.1f Mpix/s", mbytes / load_t,
+	    mpixels / load_t, mpixels / conv_t);
+	if (ref_t < 1e9)
+		printf(" %8.1f Mpix/s", mpixels / ref_t);
+	printf("\n");
+
+	total->load_t += load_t;
+	total->conv_t += conv_t;
+	if (ref_t < 1e9)
+		total->ref_t += ref_t;
+	total->mbytes += mbytes;
+	total->mpixels += mpixels;
+}
+
+
+/* the whole corpus at once on a worker pool, load and convert */
+static void
+bench_parallel(struct corpus_file *files, int nfiles, int runs, int workers,
+    const struct bench_total *total)
+{
+	struct png_batch *batch;
+	struct png_batch_result result;
+	double start, best, t;
+	int run, i, failed;
+
+	batch = png_batch_create(workers, PNG_BATCH_RGBA32);
+	if (batch == NULL) {
+		fprintf(stderr, "Can't start the decoder threads\n");
+		return;
+	}
+
+	best = 1e9;
+	failed = 0;
+	for (run = 0; run < runs; run++) {
+		start = now();
+		for (i = 0; i < nfiles; i++)
+			if (png_batch_submit(batch, files[i].path, NULL) < 0)
+				failed++;
+		while (png_batch_next(batch, &result, 1)) {
+			if (result.status & PNG_FILE_ERROR)
+				failed++;
+			png_dispose_png(result.info);
+		}
+		t = now() - start;
+		if (t < best)
+			best = t;
+	}
+
+	printf("%d workers %18.1f Mpix/s, %.1f times serial load+convert",
+	    png_batch_workers(batch), total->mpixels / best,
+	    (total->load_t + total->conv_t) / best);
+	if (failed)
+		printf(", %d FAILED", failed);
+	printf("\n");
+	png_batch_destroy(batch);
+}
+
+
+/* headers only, the way a playlist would be looked over */
+static void
+bench_probe(struct corpus_file *files, int nfiles, int runs, int workers)
+{
+	struct png_batch *batch;
+	struct png_batch_result result;
+	double start, best, t;
+	int run, i, failed;
+
+	batch = png_batch_create(workers, PNG_BATCH_PROBE);
+	if (batch == NULL) {
+		fprintf(stderr, "Can't start the probe threads\n");
+		return;
+	}
+
+	best = 1e9;
+	failed = 0;
+	for (run = 0; run < runs; run++) {
+		start = now();
+		for (i = 0; i < nfiles; i++)
+			if (png_batch_submit(batch, files[i].path, NULL) < 0)
+				failed++;
+		while (png_batch_next(batch, &result, 1)) {
+			if ((result.status & PNG_FILE_ERROR) ||
+			    (result.header.width != files[result.id % nfiles].width))
+				failed++;
+		}
+		t = now() - start;
+		if (t < best)
+			best = t;
+	}
+
+	printf("%d workers %18.0f probes/s", png_batch_workers(batch),
+	    nfiles / best);
+	if (failed)
+		printf(", %d FAILED", failed);
+	printf("\n");
+	png_batch_destroy(batch);
+}
+
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [-r] [-i kernels] [-j workers] [-n runs] "
+	    "[-w width] [-h height] directory\n", progname);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	struct corpus_file *files;
+	struct bench_total total;
+	uint32_t width, height;
+	bool reference;
+	char *progname;
+	int ch, runs, nfiles, i, level, workers;
+
+	progname = argv[0];
+	runs = 3;
+	level = PNG_KERNELS_AUTO;
+	workers = -1;
+	width = height = 512;
+	reference = false;
+	while ((ch = getopt(argc, argv, "ri:j:n:w:h:")) != -1) {
+		switch (ch) {
+		case 'i':
+			for (level = 0; level < PNG_KERNELS_COUNT; level++)
+				if (!strcmp(optarg, png_kernels_name(level)))
+					break;
+			if (level == PNG_KERNELS_COUNT) {
+				usage(progname);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':
+			reference = true;
+			break;
+		case 'j':
+			workers = atoi(optarg);
+			break;
+		case 'n':
+			runs = atoi(optarg);
+			break;
+		case 'w':
+			width = atoi(optarg);
+			break;
+		case 'h':
+			height = atoi(optarg);
+			break;
+		default:
+			usage(progname);
+			return EXIT_FAILURE;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if ((argc != 1) || (runs < 1) || (width < 8) || (height < 8)) {
+		usage(progname);
+		return EXIT_FAILURE;
+	}
+	if (reference && (ref_name() == NULL)) {
+		fprintf(stderr, "no reference decoder compiled in\n");
+		reference = false;
+	}
+
+	png_init();
+	if ((level != PNG_KERNELS_AUTO) && !png_kernels_available(level))
+		fprintf(stderr, "%s kernels not supported here, using scalar\n",
+		    png_kernels_name(level));
+	if (level != PNG_KERNELS_AUTO)
+		png_kernels_init(level);
+	printf("kernels: %s\n", png_kernels_name(png_kernels_get()));
+	nfiles = corpus_build(argv[0], width, height, &files);
+	if (nfiles < 0) {
+		fprintf(stderr, "Can't generate corpus in %s\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (!corpus_reject(argv[0]))
+		fprintf(stderr, "the loader took headers it should refuse\n");
+
+	printf("%-28s %13s %14s %15s", "best of runs", "load", "load",
+	    "convert");
+	if (reference)
+		printf(" %15s", ref_name());
+	printf("\n");
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < nfiles; i++)
+		bench_file(&files[i], runs, reference, &total);
+
+	printf("%-28s %8.1f MB/s %7.1f Mpix/s %8.1f Mpix/s", "total",
+	    total.mbytes / total.load_t, total.mpixels / total.load_t,
+	    total.mpixels / total.conv_t);
+	if (reference)
+		printf(" %8.1f Mpix/s", total.mpixels / total.ref_t);
+	printf("\n");
+
+	/* 0 is one per CPU */
+	if (workers >= 0) {
+		bench_parallel(files, nfiles, runs, workers, &total);
+		bench_probe(files, nfiles, runs, workers);
+	}
+
+	free(files);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,89 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Reference decoder for codecbench, libpng's simplified API decoding to
+ * RGBA like png_load() followed by png_convert_to_rgba32() does.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef HAVE_LIBPNG
+#include <png.h>
+
+const char *
+ref_name(void)
+{
+	return "libpng " PNG_LIBPNG_VER_STRING;
+}
+
+
+int
+ref_decode(const uint8_t *data, size_t len, uint32_t *width,
+    uint32_t *height)
+{
+	png_image image;
+	void *buffer;
+	int ok;
+
+	memset(&image, 0, sizeof(image));
+	image.version = PNG_IMAGE_VERSION;
+	if (!png_image_begin_read_from_memory(&image, data, len))
+		return -1;
+
+	image.format = PNG_FORMAT_BGRA;
+	buffer = malloc(PNG_IMAGE_SIZE(image));
+	if (buffer == NULL) {
+		png_image_free(&image);
+		return -1;
+	}
+	ok = png_image_finish_read(&image, NULL, buffer, 0, NULL);
+	free(buffer);
+
+	*width = image.width;
+	*height = image.height;
+	return ok ? 0 : -1;
+}
+
+#else
+
+const char *
+ref_name(void)
+{
+	return NULL;
+}
+
+
+int
+ref_decode(const uint8_t *data, size_t len, uint32_t *width,
+    uint32_t *height)
+{
+	return -1;
+}
+
+#endif
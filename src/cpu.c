@@ -0,0 +1,154 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_CPUID
+#include <cpuid.h>
+#endif
+#if defined(__aarch64__) && defined(__linux__)
+#define HAVE_HWCAP
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32	(1 << 7)
+#endif
+#endif
+
+#include "cpu.h"
+
+static pthread_once_t probed = PTHREAD_ONCE_INIT;
+static unsigned int features;
+
+static const struct {
+	unsigned int	 feature;
+	const char	*name;
+} feature_names[] = {
+	{ CPU_SSE2,	 "sse2" },
+	{ CPU_SSSE3,	 "ssse3" },
+	{ CPU_SSE41,	 "sse4.1" },
+	{ CPU_PCLMUL,	 "pclmul" },
+	{ CPU_AVX,	 "avx" },
+	{ CPU_AVX2,	 "avx2" },
+	{ CPU_NEON,	 "neon" },
+	{ CPU_ARM_CRC32, "crc32" },
+};
+
+
+#ifdef HAVE_CPUID
+static unsigned int
+cpu_probe(void)
+{
+	unsigned int eax, ebx, ecx, edx, xcr0_lo, xcr0_hi, max, found;
+
+	found = 0;
+	max = __get_cpuid_max(0, NULL);
+	if ((max < 1) || !__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+
+	if (edx & bit_SSE2)
+		found |= CPU_SSE2;
+	if (ecx & bit_SSSE3)
+		found |= CPU_SSSE3;
+	if (ecx & bit_SSE4_1)
+		found |= CPU_SSE41;
+	if (ecx & bit_PCLMUL)
+		found |= CPU_PCLMUL;
+
+	/* the kernel has to save the ymm state too */
+	if ((ecx & bit_AVX) && (ecx & bit_OSXSAVE)) {
+		__asm__ volatile ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi)
+		    : "c" (0));
+		if ((xcr0_lo & 6) == 6) {
+			found |= CPU_AVX;
+			if (max >= 7) {
+				__cpuid_count(7, 0, eax, ebx, ecx, edx);
+				if (ebx & bit_AVX2)
+					found |= CPU_AVX2;
+			}
+		}
+	}
+	return found;
+}
+#elif defined(__aarch64__)
+static unsigned int
+cpu_probe(void)
+{
+	unsigned int found;
+
+	/* Advanced SIMD is part of the base architecture */
+	found = CPU_NEON;
+#ifdef HAVE_HWCAP
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+		found |= CPU_ARM_CRC32;
+#endif
+	return found;
+}
+#else
+static unsigned int
+cpu_probe(void)
+{
+#ifdef __ARM_NEON
+	/* only when compiled for it, there is no portable way to ask */
+	return CPU_NEON;
+#else
+	return 0;
+#endif
+}
+#endif
+
+
+static void
+cpu_probe_once(void)
+{
+	features = cpu_probe();
+}
+
+
+unsigned int
+cpu_features(void)
+{
+	pthread_once(&probed, cpu_probe_once);
+	return features;
+}
+
+
+void
+cpu_print_features(FILE *f)
+{
+	unsigned int have;
+	size_t i;
+
+	have = cpu_features();
+	fprintf(f, "cpu:");
+	for (i = 0; i < sizeof(feature_names) / sizeof(feature_names[0]); i++)
+		if (have & feature_names[i].feature)
+			fprintf(f, " %s", feature_names[i].name);
+	if (have == 0)
+		fprintf(f, " none");
+	fprintf(f, "\n");
+}
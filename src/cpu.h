@@ -0,0 +1,55 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _CPU_H
+#define _CPU_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Instruction set extensions the hot loops may use. They are probed once
+ * at run time so one binary picks the best code on every machine.
+ */
+#define CPU_SSE2	0x0001
+#define CPU_SSSE3	0x0002
+#define CPU_SSE41	0x0004
+#define CPU_PCLMUL	0x0008	/* carry-less multiply */
+#define CPU_AVX		0x0010	/* with the OS saving the ymm state */
+#define CPU_AVX2	0x0020
+#define CPU_NEON	0x0100
+#define CPU_ARM_CRC32	0x0200
+
+unsigned int	cpu_features(void);
+void		cpu_print_features(FILE *);
+
+static inline bool
+cpu_has(unsigned int features)
+{
+	return (cpu_features() & features) == features;
+}
+
+#endif	/* _CPU_H */
@@ -0,0 +1,650 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blit.h"
+#include "diskcache.h"
+
+#define FNV_OFFSET	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x100000001b3ULL
+
+static void *diskcache_thread(void *);
+
+
+static uint64_t
+fnv1a(uint64_t h, const void *p, size_t len)
+{
+	const uint8_t *b = p;
+
+	while (len--) {
+		h ^= *b++;
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+
+struct diskcache_entry {
+	char		 name[NAME_MAX + 1];
+	time_t		 mtime;
+	uint64_t	 size;
+};
+
+static int
+diskcache_entry_cmp(const void *a, const void *b)
+{
+	const struct diskcache_entry *ea = a, *eb = b;
+
+	if (ea->mtime != eb->mtime)
+		return (ea->mtime < eb->mtime) ? -1 : 1;
+	return strcmp(ea->name, eb->name);
+}
+
+
+/*
+ * Go over the directory: count what the entries take, remove temporary
+ * files left behind by runs that died and, with trim, drop the least
+ * recently used entries until a quarter of the limit is free again.
+ * Called before the background thread runs, and then only on it.
+ */
+static void
+diskcache_scan(struct diskcache *dc, bool trim)
+{
+	struct diskcache_entry *entries, *e;
+	struct dirent *de;
+	struct stat st;
+	char name[PATH_MAX];
+	size_t count, room, len, i;
+	time_t now;
+	DIR *dir;
+
+	dir = opendir(dc->dir);
+	if (dir == NULL)
+		return;
+	now = time(NULL);
+	entries = NULL;
+	count = room = 0;
+	dc->used = 0;
+	while ((de = readdir(dir)) != NULL) {
+		len = strlen(de->d_name);
+		if (snprintf(name, sizeof(name), "%s/%s", dc->dir,
+		    de->d_name) >= (int) sizeof(name))
+			continue;
+		if (strncmp(de->d_name, ".tmp.", 5) == 0) {
+			if ((stat(name, &st) == 0) &&
+			    (st.st_mtime + DISKCACHE_TMP_AGE < now))
+				unlink(name);
+			continue;
+		}
+		if ((len < 4) || (strcmp(de->d_name + len - 4, ".img") != 0) ||
+		    (stat(name, &st) < 0) || !S_ISREG(st.st_mode))
+			continue;
+		dc->used += st.st_size;
+		if (!trim || (len > NAME_MAX))
+			continue;
+
+		if (count == room) {
+			room = room ? room * 2 : 256;
+			e = realloc(entries, room * sizeof(*entries));
+			if (e == NULL)
+				break;
+			entries = e;
+		}
+		e = &entries[count++];
+		strcpy(e->name, de->d_name);
+		e->mtime = st.st_mtime;
+		e->size = st.st_size;
+	}
+	closedir(dir);
+
+	if (trim && (count > 0)) {
+		qsort(entries, count, sizeof(*entries), diskcache_entry_cmp);
+		for (i = 0; (i < count) && (dc->used > dc->limit - dc->limit / 4);
+		    i++) {
+			if ((snprintf(name, sizeof(name), "%s/%s", dc->dir,
+			    entries[i].name) < (int) sizeof(name)) &&
+			    (unlink(name) == 0))
+				dc->used -= entries[i].size;
+		}
+	}
+	free(entries);
+}
+
+
+bool
+diskcache_init(struct diskcache *dc, const char *dir, uint32_t width,
+    uint32_t height, int pixfmt, const struct blit_backdrop *backdrop,
+    uint32_t gamma, uint64_t limit)
+{
+	sigset_t all, old;
+	struct stat st;
+	long page;
+	int error;
+
+	memset(dc, 0, sizeof(*dc));
+	if ((dir == NULL) || (pixfmt < 0))
+		return false;
+
+	if ((mkdir(dir, 0755) < 0) && (errno != EEXIST)) {
+		perror("Can't create cache directory");
+		return false;
+	}
+	if ((stat(dir, &st) < 0) || !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "Cache %s is not a directory\n", dir);
+		return false;
+	}
+	if (strlen(dir) >= sizeof(dc->dir)) {
+		fprintf(stderr, "Cache directory name too long\n");
+		return false;
+	}
+	strcpy(dc->dir, dir);
+
+	dc->screen.width = width;
+	dc->screen.height = height;
+	dc->screen.pixfmt = pixfmt;
+	dc->screen.backdrop_mode = backdrop->mode;
+	dc->screen.backdrop_colour = backdrop->colour;
+	dc->screen.backdrop_checker[0] = backdrop->checker[0];
+	dc->screen.backdrop_checker[1] = backdrop->checker[1];
+	dc->screen.gamma = gamma;
+	dc->pixel_bytes = blit_pixfmt_bytes(pixfmt);
+
+	page = sysconf(_SC_PAGESIZE);
+	dc->page = (page > 0) ? page : 4096;
+	dc->limit = limit;
+	diskcache_scan(dc, false);
+	if (limit && (dc->used > limit))
+		diskcache_scan(dc, true);
+
+	pthread_mutex_init(&dc->lock, NULL);
+	pthread_cond_init(&dc->wake, NULL);
+	/* signals stay with the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	error = pthread_create(&dc->thread, NULL, diskcache_thread, dc);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (error != 0) {
+		pthread_cond_destroy(&dc->wake);
+		pthread_mutex_destroy(&dc->lock);
+		return false;
+	}
+	dc->enabled = true;
+	return true;
+}
+
+
+void
+diskcache_free(struct diskcache *dc)
+{
+	if (!dc->enabled)
+		return;
+
+	/* pre-warming stops, the queued stores are still written */
+	pthread_mutex_lock(&dc->lock);
+	dc->stop = true;
+	pthread_cond_signal(&dc->wake);
+	pthread_mutex_unlock(&dc->lock);
+	pthread_join(dc->thread, NULL);
+	pthread_cond_destroy(&dc->wake);
+	pthread_mutex_destroy(&dc->lock);
+	dc->enabled = false;
+}
+
+
+/*
+ * The key of an image on this screen. Entries are named after it, the
+ * header repeats it so that a hash collision can't show the wrong image.
+ */
+static bool
+diskcache_key(struct diskcache *dc, const char *path,
+    struct diskcache_header *hdr, char *real, char *name)
+{
+	struct stat st;
+	uint64_t h;
+
+	if (realpath(path, real) == NULL)
+		return false;
+	if ((stat(real, &st) < 0) || !S_ISREG(st.st_mode))
+		return false;
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, DISKCACHE_MAGIC, sizeof(DISKCACHE_MAGIC));
+	hdr->version = DISKCACHE_VERSION;
+	hdr->src_size = st.st_size;
+	hdr->src_mtime = st.st_mtime;
+	hdr->screen = dc->screen;
+	hdr->path_len = strlen(real);
+
+	h = fnv1a(FNV_OFFSET, real, hdr->path_len);
+	h = fnv1a(h, &dc->screen, sizeof(dc->screen));
+	snprintf(name, PATH_MAX, "%s/%016llx.img", dc->dir,
+	    (unsigned long long) h);
+	return true;
+}
+
+
+/* open the entry for path if there is a current one */
+static int
+diskcache_find(struct diskcache *dc, const char *path,
+    struct diskcache_header *hdr, off_t *size)
+{
+	struct diskcache_header key;
+	struct stat st;
+	char real[PATH_MAX], name[PATH_MAX], stored[PATH_MAX];
+	uint64_t need;
+	int fd;
+
+	if (!diskcache_key(dc, path, &key, real, name))
+		return -1;
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if ((fstat(fd, &st) < 0) ||
+	    (pread(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr)))
+		goto stale;
+	if ((memcmp(hdr->magic, key.magic, sizeof(key.magic)) != 0) ||
+	    (hdr->version != key.version) ||
+	    (hdr->src_size != key.src_size) ||
+	    (hdr->src_mtime != key.src_mtime) ||
+	    (memcmp(&hdr->screen, &key.screen, sizeof(key.screen)) != 0) ||
+	    (hdr->path_len != key.path_len))
+		goto stale;
+	if (pread(fd, stored, hdr->path_len, sizeof(*hdr)) !=
+	    (ssize_t) hdr->path_len)
+		goto stale;
+	if (memcmp(stored, real, hdr->path_len) != 0)
+		goto stale;
+
+	/* and it has to fit both the file and the screen */
+	need = hdr->data_offset + (uint64_t) hdr->stride * hdr->height;
+	if ((hdr->data_offset % dc->page) || (need > (uint64_t) st.st_size) ||
+	    (hdr->stride < hdr->width * dc->pixel_bytes) ||
+	    (hdr->x + hdr->width > dc->screen.width) ||
+	    (hdr->y + hdr->height > dc->screen.height) ||
+	    (hdr->cmap_count > 256))
+		goto stale;
+
+	*size = st.st_size;
+	return fd;
+
+stale:
+	close(fd);
+	return -1;
+}
+
+
+/* map the current entry for path, false if there is none */
+bool
+diskcache_open(struct diskcache *dc, const char *path,
+    struct diskcache_image *img)
+{
+	struct diskcache_header hdr;
+	off_t size;
+	int fd;
+
+	memset(img, 0, sizeof(*img));
+	if (!dc->enabled)
+		return false;
+
+	fd = diskcache_find(dc, path, &hdr, &size);
+	if (fd < 0)
+		return false;
+	img->map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	/* used now, the last to go when the directory is trimmed */
+	futimens(fd, NULL);
+	close(fd);
+	if (img->map == MAP_FAILED) {
+		img->map = NULL;
+		return false;
+	}
+	img->map_size = size;
+	posix_madvise(img->map, size, POSIX_MADV_SEQUENTIAL);
+
+	img->pixels = img->map + hdr.data_offset;
+	img->x = hdr.x;
+	img->y = hdr.y;
+	img->width = hdr.width;
+	img->height = hdr.height;
+	img->stride = hdr.stride;
+	img->cmap.count = hdr.cmap_count;
+	memcpy(img->cmap.red, hdr.cmap[0], sizeof(img->cmap.red));
+	memcpy(img->cmap.green, hdr.cmap[1], sizeof(img->cmap.green));
+	memcpy(img->cmap.blue, hdr.cmap[2], sizeof(img->cmap.blue));
+	return true;
+}
+
+
+void
+diskcache_close(struct diskcache_image *img)
+{
+	if (img->map != NULL)
+		munmap(img->map, img->map_size);
+	img->map = NULL;
+}
+
+
+/* is there a current entry for path? Only its header is read */
+bool
+diskcache_has(struct diskcache *dc, const char *path)
+{
+	struct diskcache_header hdr;
+	off_t size;
+	int fd;
+
+	if (!dc->enabled)
+		return false;
+
+	fd = diskcache_find(dc, path, &hdr, &size);
+	if (fd < 0)
+		return false;
+	close(fd);
+	return true;
+}
+
+
+/*
+ * Like diskcache_has(), and the kernel is asked to start reading the
+ * entry in; for the next DISKCACHE_AHEAD images only, they will likely
+ * be shown soon.
+ */
+bool
+diskcache_readahead(struct diskcache *dc, const char *path)
+{
+	struct diskcache_header hdr;
+	off_t size;
+	int fd;
+
+	if (!dc->enabled)
+		return false;
+
+	fd = diskcache_find(dc, path, &hdr, &size);
+	if (fd < 0)
+		return false;
+	posix_fadvise(fd, 0, size, POSIX_FADV_WILLNEED);
+	close(fd);
+	return true;
+}
+
+
+/*
+ * Start a new entry for the image at path placed at (x, y) on the screen;
+ * the caller fills in img->pixels and commits, queues or aborts it. The
+ * entry is put together in memory and written under a temporary name on
+ * commit, so a full disk is a failed write rather than a fault on a mapped
+ * page, and only renamed into place once it is on disk, so readers never
+ * see half an image.
+ */
+bool
+diskcache_create(struct diskcache *dc, const char *path, uint32_t x,
+    uint32_t y, uint32_t width, uint32_t height,
+    const struct display_cmap *cmap, struct diskcache_image *img)
+{
+	struct diskcache_header hdr;
+	char real[PATH_MAX];
+	size_t size;
+	int count;
+
+	memset(img, 0, sizeof(*img));
+	if (!dc->enabled)
+		return false;
+	if (!diskcache_key(dc, path, &hdr, real, img->name))
+		return false;
+
+	hdr.x = x;
+	hdr.y = y;
+	hdr.width = width;
+	hdr.height = height;
+	/* rows padded to 16 bytes for the vector row copies */
+	hdr.stride = (width * dc->pixel_bytes + 15) & ~15U;
+	hdr.data_offset = (sizeof(hdr) + hdr.path_len + dc->page - 1) &
+	    ~(dc->page - 1);
+	if (cmap != NULL) {
+		count = (cmap->count > 256) ? 256 : cmap->count;
+		hdr.cmap_count = count;
+		memcpy(hdr.cmap[0], cmap->red, count);
+		memcpy(hdr.cmap[1], cmap->green, count);
+		memcpy(hdr.cmap[2], cmap->blue, count);
+	}
+	size = hdr.data_offset + (size_t) hdr.stride * height;
+
+	img->map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (img->map == MAP_FAILED) {
+		img->map = NULL;
+		return false;
+	}
+	img->map_size = size;
+
+	memcpy(img->map, &hdr, sizeof(hdr));
+	memcpy(img->map + sizeof(hdr), real, hdr.path_len);
+	img->pixels = img->map + hdr.data_offset;
+	img->x = x;
+	img->y = y;
+	img->width = width;
+	img->height = height;
+	img->stride = hdr.stride;
+	return true;
+}
+
+
+static bool
+diskcache_write(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+
+/* write the entry out and free it; on the background thread */
+bool
+diskcache_commit(struct diskcache *dc, struct diskcache_image *img)
+{
+	char tmp[PATH_MAX];
+	uint64_t size;
+	bool ok;
+	int fd;
+
+	size = img->map_size;
+	snprintf(tmp, sizeof(tmp), "%s/.tmp.XXXXXX", dc->dir);
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		diskcache_close(img);
+		return false;
+	}
+	ok = diskcache_write(fd, img->map, size) && (fsync(fd) == 0);
+	diskcache_close(img);
+	ok = (close(fd) == 0) && ok;
+	ok = ok && (rename(tmp, img->name) == 0);
+	if (!ok)
+		unlink(tmp);
+
+	if (ok && dc->limit) {
+		dc->used += size;
+		if (dc->used > dc->limit)
+			diskcache_scan(dc, true);
+	}
+	return ok;
+}
+
+
+/*
+ * Hand a filled in entry to the background thread to be committed, so
+ * the write, the fsync and any trimming stay off the caller's thread.
+ * The entry is the queue's from here on, even if it is dropped because
+ * the queue is full or already holds one for the same image.
+ */
+bool
+diskcache_queue(struct diskcache *dc, struct diskcache_image *img)
+{
+	struct diskcache_image *job, **tail;
+	bool ok;
+
+	job = malloc(sizeof(*job));
+	if (job == NULL) {
+		diskcache_abort(img);
+		return false;
+	}
+	*job = *img;
+	job->next = NULL;
+	img->map = NULL;
+
+	pthread_mutex_lock(&dc->lock);
+	ok = !dc->stop && (dc->queued < DISKCACHE_QUEUE);
+	for (tail = &dc->queue; ok && (*tail != NULL); tail = &(*tail)->next)
+		ok = (strcmp((*tail)->name, job->name) != 0);
+	if (ok) {
+		*tail = job;
+		dc->queued++;
+		pthread_cond_signal(&dc->wake);
+	}
+	pthread_mutex_unlock(&dc->lock);
+
+	if (!ok) {
+		diskcache_abort(job);
+		free(job);
+	}
+	return ok;
+}
+
+
+void
+diskcache_abort(struct diskcache_image *img)
+{
+	diskcache_close(img);
+}
+
+
+/* is what img would write already there, header and path alike? */
+static bool
+diskcache_stored(struct diskcache_image *img)
+{
+	const struct diskcache_header *hdr;
+	uint8_t buf[sizeof(*hdr) + PATH_MAX];
+	size_t len;
+	int fd;
+
+	hdr = (const struct diskcache_header *) img->map;
+	len = sizeof(*hdr) + hdr->path_len;
+	fd = open(img->name, O_RDONLY);
+	if (fd < 0)
+		return false;
+	if ((pread(fd, buf, len, 0) != (ssize_t) len) ||
+	    (memcmp(buf, img->map, len) != 0)) {
+		close(fd);
+		return false;
+	}
+	close(fd);
+	return true;
+}
+
+
+static void *
+diskcache_thread(void *arg)
+{
+	struct diskcache *dc = arg;
+	struct diskcache_image *img;
+	const char *path;
+
+	pthread_mutex_lock(&dc->lock);
+	for (;;) {
+		img = dc->queue;
+		path = NULL;
+		if (img != NULL) {
+			dc->queue = img->next;
+			dc->queued--;
+		} else if (dc->stop) {
+			break;
+		} else if (dc->warm_next < dc->warm_count) {
+			path = dc->warm_paths[dc->warm_next++];
+		} else {
+			pthread_cond_wait(&dc->wake, &dc->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&dc->lock);
+
+		if (img != NULL) {
+			if (diskcache_stored(img))
+				diskcache_abort(img);
+			else
+				diskcache_commit(dc, img);
+			free(img);
+		} else if (!diskcache_has(dc, path)) {
+			dc->fill(dc, path);
+		}
+		pthread_mutex_lock(&dc->lock);
+	}
+	pthread_mutex_unlock(&dc->lock);
+	return NULL;
+}
+
+
+/*
+ * Fill in the entries missing for paths on the background thread, one
+ * image at a time and only when no stores are queued, so it doesn't get in
+ * the way of showing them. The paths have to stay around until
+ * diskcache_free().
+ */
+bool
+diskcache_warm(struct diskcache *dc, const char **paths, int count,
+    diskcache_fill_func fill)
+{
+	if (!dc->enabled)
+		return false;
+
+	pthread_mutex_lock(&dc->lock);
+	dc->warm_paths = paths;
+	dc->warm_count = count;
+	dc->warm_next = 0;
+	dc->fill = fill;
+	pthread_cond_signal(&dc->wake);
+	pthread_mutex_unlock(&dc->lock);
+	return true;
+}
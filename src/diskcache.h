@@ -0,0 +1,149 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _DISKCACHE_H
+#define _DISKCACHE_H
+
+#include <sys/types.h>
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "blit.h"
+#include "display.h"
+
+/*
+ * Images as they end up on the framebuffer, kept in files in a cache
+ * directory so that a restarted wsdv can map them and blit them without
+ * going near the decoder. An entry is keyed by the image's path, size
+ * and modification time and by the screen's geometry, pixel format,
+ * backdrop and gamma; when any of them changed it is a miss and gets written anew.
+ *
+ * A file is a header, the path, and from the next page on the rows of the
+ * image's rectangle on the screen in the framebuffer's pixel format.
+ *
+ * The directory is kept under a size limit by dropping the entries that
+ * were used least recently; using an entry touches its modification time.
+ */
+
+#define DISKCACHE_MAGIC		"WSDVIMG"
+#define DISKCACHE_VERSION	2
+
+/* entries read in ahead of being shown, the rest are only looked up */
+#define DISKCACHE_AHEAD		2
+
+/* temporary files this old are left over from runs that died */
+#define DISKCACHE_TMP_AGE	(10 * 60)
+
+/* stores waiting for the background thread, each holds a whole image */
+#define DISKCACHE_QUEUE		4
+
+/* what the screen makes of an image */
+struct diskcache_screen {
+	uint32_t	 width, height;
+	uint32_t	 pixfmt;		/* BLIT_FMT_* */
+	uint32_t	 backdrop_mode;
+	uint32_t	 backdrop_colour;
+	uint32_t	 backdrop_checker[2];
+	uint32_t	 gamma;			/* png_set_display_gamma() */
+};
+
+struct diskcache_header {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 data_offset;		/* page aligned */
+	uint64_t	 src_size;
+	int64_t		 src_mtime;
+	struct diskcache_screen screen;
+	uint32_t	 x, y, width, height;	/* placement on the screen */
+	uint32_t	 stride;
+	uint32_t	 path_len;
+	uint32_t	 cmap_count;		/* for BLIT_FMT_CI8 */
+	uint8_t		 cmap[3][256];
+};
+
+/* a mapped entry, or one put together in memory and written on commit */
+struct diskcache_image {
+	uint8_t		*map;
+	size_t		 map_size;
+	uint8_t		*pixels;
+	uint32_t	 x, y, width, height;
+	uint32_t	 stride;
+	struct display_cmap cmap;
+
+	char		 name[PATH_MAX];
+	struct diskcache_image *next;	/* on the store queue */
+};
+
+struct diskcache;
+
+/* makes and stores the entry for a path, on the pre-warm thread */
+typedef bool (*diskcache_fill_func)(struct diskcache *, const char *);
+
+struct diskcache {
+	bool		 enabled;
+	char		 dir[PATH_MAX - 32];	/* room for the entry names */
+	struct diskcache_screen screen;
+	uint32_t	 pixel_bytes;
+	size_t		 page;
+
+	/* size of the entries, only the background thread's once it runs */
+	uint64_t	 limit;			/* 0 for none */
+	uint64_t	 used;
+
+	/* the background thread: queued stores first, then pre-warming */
+	pthread_t	 thread;
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 wake;
+	bool		 stop;
+	struct diskcache_image *queue;
+	int		 queued;
+	const char	**warm_paths;
+	int		 warm_count;
+	int		 warm_next;
+	diskcache_fill_func fill;
+};
+
+bool	diskcache_init(struct diskcache *, const char *, uint32_t, uint32_t,
+	    int, const struct blit_backdrop *, uint32_t, uint64_t);
+void	diskcache_free(struct diskcache *);
+bool	diskcache_open(struct diskcache *, const char *,
+	    struct diskcache_image *);
+void	diskcache_close(struct diskcache_image *);
+bool	diskcache_has(struct diskcache *, const char *);
+bool	diskcache_readahead(struct diskcache *, const char *);
+bool	diskcache_create(struct diskcache *, const char *, uint32_t, uint32_t,
+	    uint32_t, uint32_t, const struct display_cmap *,
+	    struct diskcache_image *);
+bool	diskcache_commit(struct diskcache *, struct diskcache_image *);
+bool	diskcache_queue(struct diskcache *, struct diskcache_image *);
+void	diskcache_abort(struct diskcache_image *);
+bool	diskcache_warm(struct diskcache *, const char **, int,
+	    diskcache_fill_func);
+
+#endif	/* _DISKCACHE_H */
@@ -0,0 +1,112 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "display.h"
+
+/* compiled in backends, the first one is the default */
+static const struct display_backend *backends[] = {
+#ifdef __NetBSD__
+	&display_wscons,
+#endif
+#ifdef __linux__
+	&display_fbdev,
+#endif
+	&display_headless,
+	NULL
+};
+
+
+const struct display_backend *
+display_backend_default(void)
+{
+	return backends[0];
+}
+
+
+const struct display_backend *
+display_backend_find(const char *name)
+{
+	int i;
+
+	for (i = 0; backends[i] != NULL; i++)
+		if (strcmp(backends[i]->name, name) == 0)
+			return backends[i];
+	return NULL;
+}
+
+
+void
+display_backend_list(FILE *out)
+{
+	int i;
+
+	for (i = 0; backends[i] != NULL; i++)
+		fprintf(out, "%s%s", i ? ", " : "", backends[i]->name);
+	fprintf(out, "\n");
+}
+
+
+/*
+ * Open the display and input devices, NULL names select the backend's
+ * defaults.
+ */
+bool
+display_open(struct display *d, const struct display_backend *be,
+    const char *display, const char *input)
+{
+	const char *geometry;
+
+	geometry = d->geometry;
+	memset(d, 0, sizeof(*d));
+	d->be = be;
+	d->geometry = geometry;
+	d->disp_fd = d->input_fd = -1;
+	d->pixfmt = -1;
+
+	if (display == NULL)
+		display = be->default_display ? be->default_display() :
+		    be->def_display;
+	if (input == NULL)
+		input = be->def_input;
+
+	printf("using %s display %s, input %s\n", be->name, display, input);
+
+	return be->open(d, display, input);
+}
+
+
+void
+display_close(struct display *d)
+{
+	if (d->be)
+		d->be->close(d);
+	d->be = NULL;
+}
@@ -0,0 +1,129 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _DISPLAY_H
+#define _DISPLAY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Display and input backends. Everything wsdv needs from the console
+ * system goes through one of these so the viewer runs on wscons, on Linux
+ * fbdev/evdev and headless on a shared memory framebuffer.
+ */
+
+#define DISPLAY_EVENT_KEY_UP	1
+#define DISPLAY_EVENT_KEY_DOWN	2
+
+struct display_event {
+	int		 type;
+	int		 value;		/* raw keycode */
+	uint64_t	 time;		/* arrival, latency_clock() based */
+};
+
+struct display_cmap {
+	uint32_t	 count;
+	uint8_t		 red[256];
+	uint8_t		 green[256];
+	uint8_t		 blue[256];
+};
+
+struct display;
+
+struct display_backend {
+	const char	*name;
+
+	/* device names used when none are given, NULL to ask the backend */
+	const char	*def_display;
+	const char	*def_input;
+	const char	*(*default_display)(void);
+
+	bool	(*open)(struct display *, const char *, const char *);
+	void	(*close)(struct display *);
+
+	/* fill in geometry, stride and pixel format */
+	bool	(*query)(struct display *);
+
+	/* switch to graphics and map the framebuffer, and back */
+	bool	(*map)(struct display *);
+	void	(*unmap)(struct display *);
+
+	bool	(*get_cmap)(struct display *, struct display_cmap *);
+	bool	(*put_cmap)(struct display *, const struct display_cmap *);
+
+	/* 1 for an event, 0 if there is none, -1 on error */
+	int	(*read_event)(struct display *, struct display_event *);
+
+	/*
+	 * Optional, for input that doesn't come through a pollable
+	 * input_fd: milliseconds until read_event has the next event,
+	 * 0 if it has one now, -1 to poll input_fd after all.
+	 */
+	int	(*pending)(struct display *);
+
+	/* raw keycode to the console's key symbol, see keymap.h; -1 if none */
+	int	(*translate)(struct display *, int);
+};
+
+struct display {
+	const struct display_backend *be;
+
+	int		 disp_fd;
+	int		 input_fd;	/* pollable, see pending */
+
+	/* filled in by query */
+	uint32_t	 width, height;
+	uint32_t	 stride;
+	uint32_t	 depth;
+	uint32_t	 cmsize;
+	int		 pixfmt;	/* BLIT_FMT_* */
+
+	/* filled in by map */
+	uint8_t		*fb;
+	size_t		 fb_size;
+
+	/* headless only: WIDTHxHEIGHT[xDEPTH] */
+	const char	*geometry;
+
+	void		*priv;
+};
+
+extern const struct display_backend display_wscons;
+extern const struct display_backend display_fbdev;
+extern const struct display_backend display_headless;
+
+const struct display_backend *display_backend_default(void);
+const struct display_backend *display_backend_find(const char *);
+void	display_backend_list(FILE *);
+
+bool	display_open(struct display *, const struct display_backend *,
+	    const char *, const char *);
+void	display_close(struct display *);
+
+#endif	/* _DISPLAY_H */
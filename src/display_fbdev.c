@@ -0,0 +1,317 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Linux backend: fbdev framebuffer and evdev keyboard.
+ */
+
+#include "display.h"
+
+#ifdef __linux__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <linux/fb.h>
+#include <linux/input.h>
+#include <linux/kd.h>
+
+#include "blit.h"
+#include "keymap.h"
+#include "latency.h"
+
+struct fbdev_private {
+	struct fb_var_screeninfo vinfo;
+	struct fb_fix_screeninfo finfo;
+	struct display_cmap	 ocmap;
+	uint8_t			*map_base;
+	int			 tty_fd;
+	bool			 mapped;
+};
+
+/* evdev keycodes of the keys wsdv knows about, as console key symbols */
+static const struct {
+	int		 code;
+	int		 sym;
+} fbdev_keys[] = {
+	{ KEY_ESC,		KS_Escape },
+	{ KEY_SPACE,		KS_space },
+	{ KEY_BACKSPACE,	KS_BackSpace },
+	{ KEY_ENTER,		KS_Return },
+	{ KEY_RIGHT,		KS_Right },
+	{ KEY_LEFT,		KS_Left },
+	{ KEY_PAGEDOWN,		KS_Next },
+	{ KEY_PAGEUP,		KS_Prior },
+	{ KEY_HOME,		KS_Home },
+	{ KEY_END,		KS_End },
+	{ KEY_S,		KS_s },
+	{ KEY_0,		KS_0 },
+	{ KEY_1,		KS_1 },
+	{ KEY_2,		KS_2 },
+	{ KEY_3,		KS_3 },
+	{ KEY_4,		KS_4 },
+	{ KEY_5,		KS_5 },
+	{ KEY_6,		KS_6 },
+	{ KEY_7,		KS_7 },
+	{ KEY_8,		KS_8 },
+	{ KEY_9,		KS_9 },
+};
+
+
+static bool
+fbdev_open(struct display *d, const char *fbdev, const char *evdev)
+{
+	struct fbdev_private *fp;
+
+	fp = d->priv = calloc(1, sizeof(struct fbdev_private));
+	if (fp == NULL)
+		return false;
+	fp->tty_fd = -1;
+
+	d->disp_fd = open(fbdev, O_RDWR);
+	if (d->disp_fd < 0) {
+		perror("Can't open framebuffer dev");
+		return false;
+	}
+	d->input_fd = open(evdev, O_RDONLY);
+	if (d->input_fd < 0) {
+		perror("Can't open input event dev");
+		return false;
+	}
+
+	/* the console keeps drawing unless its tty is put in graphics mode */
+	if (isatty(0))
+		fp->tty_fd = 0;
+	return true;
+}
+
+
+static void
+fbdev_unmap(struct display *d)
+{
+	struct fbdev_private *fp = d->priv;
+
+	if (!fp->mapped)
+		return;
+	if (d->pixfmt == BLIT_FMT_CI8)
+		d->be->put_cmap(d, &fp->ocmap);
+	if (fp->map_base != NULL)
+		munmap(fp->map_base, fp->finfo.smem_len);
+	fp->map_base = NULL;
+	d->fb = NULL;
+	if (fp->tty_fd >= 0)
+		ioctl(fp->tty_fd, KDSETMODE, KD_TEXT);
+	fp->mapped = false;
+}
+
+
+static void
+fbdev_close(struct display *d)
+{
+	struct fbdev_private *fp = d->priv;
+
+	if (fp) {
+		fbdev_unmap(d);
+		free(fp);
+	}
+	d->priv = NULL;
+	if (d->disp_fd >= 0)
+		close(d->disp_fd);
+	if (d->input_fd >= 0)
+		close(d->input_fd);
+	d->disp_fd = d->input_fd = -1;
+}
+
+
+static bool
+fbdev_query(struct display *d)
+{
+	struct fbdev_private *fp = d->priv;
+	struct fb_var_screeninfo *vi = &fp->vinfo;
+
+	if ((ioctl(d->disp_fd, FBIOGET_VSCREENINFO, vi) == -1) ||
+	    (ioctl(d->disp_fd, FBIOGET_FSCREENINFO, &fp->finfo) == -1)) {
+		perror("Can't get framebuffer info");
+		return false;
+	}
+
+	d->width  = vi->xres;
+	d->height = vi->yres;
+	d->depth  = vi->bits_per_pixel;
+	d->stride = fp->finfo.line_length;
+	d->cmsize = 0;
+
+	if (fp->finfo.visual == FB_VISUAL_PSEUDOCOLOR) {
+		d->pixfmt = (vi->bits_per_pixel == 8) ? BLIT_FMT_CI8 : -1;
+		d->cmsize = 256;
+	} else {
+		d->pixfmt = blit_pixfmt_from_masks(vi->bits_per_pixel,
+		    vi->red.offset, vi->red.length,
+		    vi->green.offset, vi->green.length,
+		    vi->blue.offset, vi->blue.length);
+	}
+	return true;
+}
+
+
+static bool
+fbdev_map(struct display *d)
+{
+	struct fbdev_private *fp = d->priv;
+	void *mapped;
+
+	mapped = mmap(NULL, fp->finfo.smem_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, d->disp_fd, 0);
+	if (mapped == MAP_FAILED) {
+		perror("Can't map framebuffer");
+		return false;
+	}
+	fp->map_base = mapped;
+	fp->mapped = true;
+
+	if (fp->tty_fd >= 0)
+		ioctl(fp->tty_fd, KDSETMODE, KD_GRAPHICS);
+
+	if (d->pixfmt == BLIT_FMT_CI8)
+		d->be->get_cmap(d, &fp->ocmap);
+
+	/* the visible screen may be panned into a larger virtual one */
+	d->fb = fp->map_base + fp->vinfo.yoffset * d->stride +
+	    fp->vinfo.xoffset * (d->depth / 8);
+	d->fb_size = d->stride * d->height;
+	return true;
+}
+
+
+static bool
+fbdev_get_cmap(struct display *d, struct display_cmap *cmap)
+{
+	struct fb_cmap fbcmap;
+	uint16_t red[256], green[256], blue[256];
+	uint32_t i;
+
+	cmap->count = d->cmsize > 256 ? 256 : d->cmsize;
+	fbcmap.start = 0;
+	fbcmap.len = cmap->count;
+	fbcmap.red = red;
+	fbcmap.green = green;
+	fbcmap.blue = blue;
+	fbcmap.transp = NULL;
+	if (ioctl(d->disp_fd, FBIOGETCMAP, &fbcmap) == -1) {
+		perror("FBIOGETCMAP ioctl failed");
+		return false;
+	}
+	for (i = 0; i < cmap->count; i++) {
+		cmap->red[i]   = red[i] >> 8;
+		cmap->green[i] = green[i] >> 8;
+		cmap->blue[i]  = blue[i] >> 8;
+	}
+	return true;
+}
+
+
+static bool
+fbdev_put_cmap(struct display *d, const struct display_cmap *cmap)
+{
+	struct fb_cmap fbcmap;
+	uint16_t red[256], green[256], blue[256];
+	uint32_t i;
+
+	for (i = 0; i < cmap->count; i++) {
+		red[i]   = cmap->red[i] * 0x101;
+		green[i] = cmap->green[i] * 0x101;
+		blue[i]  = cmap->blue[i] * 0x101;
+	}
+	fbcmap.start = 0;
+	fbcmap.len = cmap->count;
+	fbcmap.red = red;
+	fbcmap.green = green;
+	fbcmap.blue = blue;
+	fbcmap.transp = NULL;
+	if (ioctl(d->disp_fd, FBIOPUTCMAP, &fbcmap) == -1) {
+		perror("FBIOPUTCMAP ioctl failed");
+		return false;
+	}
+	return true;
+}
+
+
+static int
+fbdev_read_event(struct display *d, struct display_event *ev)
+{
+	struct input_event ie;
+	ssize_t len;
+
+	len = read(d->input_fd, &ie, sizeof(ie));
+	if (len < 0)
+		return -1;
+	if ((len != sizeof(ie)) || (ie.type != EV_KEY))
+		return 0;
+
+	/* autorepeat counts as another press, like wskbd does */
+	ev->type = ie.value ? DISPLAY_EVENT_KEY_DOWN : DISPLAY_EVENT_KEY_UP;
+	ev->value = ie.code;
+	ev->time = latency_clock();
+	return 1;
+}
+
+
+static int
+fbdev_translate(struct display *d, int code)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(fbdev_keys) / sizeof(fbdev_keys[0]); i++)
+		if (fbdev_keys[i].code == code)
+			return fbdev_keys[i].sym;
+	/* evdev numbers are no key symbols, the rest are dropped */
+	return -1;
+}
+
+
+const struct display_backend display_fbdev = {
+	.name		 = "fbdev",
+	.def_display	 = "/dev/fb0",
+	.def_input	 = "/dev/input/event0",
+	.open		 = fbdev_open,
+	.close		 = fbdev_close,
+	.query		 = fbdev_query,
+	.map		 = fbdev_map,
+	.unmap		 = fbdev_unmap,
+	.get_cmap	 = fbdev_get_cmap,
+	.put_cmap	 = fbdev_put_cmap,
+	.read_event	 = fbdev_read_event,
+	.translate	 = fbdev_translate,
+};
+
+#endif	/* __linux__ */
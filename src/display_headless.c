@@ -0,0 +1,469 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Headless backend: the framebuffer lives in shared memory (or a plain
+ * file) and keys come from a script, so the whole display pipeline can be
+ * run and profiled on machines without a console.
+ *
+ * Script lines are `next', `prev', `first', `last', `exit',
+ * `key <keycode>', `down <keycode>', `up <keycode>', `sleep <milliseconds>'
+ * and `repeat <count> <milliseconds> <command>'; `#' starts a comment. The
+ * end of the script exits the viewer.
+ *
+ * Scripts run on their own clock: `sleep' delays the next event relative
+ * to the previous one, not to when wsdv got around to reading it, so
+ * events pile up when the viewer is slower than the script, just like
+ * with a real keyboard. Each event is stamped with the time it was due.
+ * The script is read one event ahead to know when that is, so a script
+ * fed through a pipe holds up the viewer until its next line arrives.
+ *
+ * A framebuffer named `-' is anonymous memory nobody else can see.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "display.h"
+#include "blit.h"
+#include "keymap.h"
+#include "latency.h"
+
+#define SCRIPT_LINE_MAX		256
+#define DEF_GEOMETRY		"1024x768x32"
+
+struct headless_private {
+	struct display_cmap	 cmap;
+	bool			 anon;		/* framebuffer not shared */
+	int			 pending_up;	/* key to release, -1 if none */
+
+	/* script clock, 0 until the first event is read */
+	uint64_t		 due;
+
+	/* presses still to come from a `repeat' line */
+	int			 repeat_key;
+	long			 repeat_left;
+	uint64_t		 repeat_interval;
+
+	/* next event, read ahead to know when it is due */
+	bool			 staged;
+	bool			 next_press;	/* up follows */
+	struct display_event	 next;
+
+	bool			 eof;
+	char			 buf[SCRIPT_LINE_MAX];
+	size_t			 buf_len;
+};
+
+
+static bool
+headless_open(struct display *d, const char *shm, const char *script)
+{
+	struct headless_private *hp;
+
+	hp = d->priv = calloc(1, sizeof(struct headless_private));
+	if (hp == NULL)
+		return false;
+	hp->pending_up = -1;
+
+	/* a bare name is POSIX shared memory, anything else a file */
+	if (strcmp(shm, "-") == 0)
+		hp->anon = true;
+	else if ((shm[0] == '/') && (strchr(shm + 1, '/') == NULL))
+		d->disp_fd = shm_open(shm, O_RDWR | O_CREAT, 0600);
+	else
+		d->disp_fd = open(shm, O_RDWR | O_CREAT, 0600);
+	if (!hp->anon && (d->disp_fd < 0)) {
+		perror("Can't open headless framebuffer");
+		return false;
+	}
+
+	if (strcmp(script, "-") == 0) {
+		d->input_fd = dup(STDIN_FILENO);
+	} else {
+		d->input_fd = open(script, O_RDONLY);
+	}
+	if (d->input_fd < 0) {
+		perror("Can't open input script");
+		return false;
+	}
+	return true;
+}
+
+
+static void
+headless_unmap(struct display *d)
+{
+	if (d->fb != NULL)
+		munmap(d->fb, d->fb_size);
+	d->fb = NULL;
+}
+
+
+static void
+headless_close(struct display *d)
+{
+	headless_unmap(d);
+	free(d->priv);
+	d->priv = NULL;
+	if (d->disp_fd >= 0)
+		close(d->disp_fd);
+	if (d->input_fd >= 0)
+		close(d->input_fd);
+	d->disp_fd = d->input_fd = -1;
+}
+
+
+static bool
+headless_query(struct display *d)
+{
+	const char *geometry;
+	unsigned int width, height, depth;
+	int n;
+
+	geometry = d->geometry ? d->geometry : DEF_GEOMETRY;
+	depth = 32;
+	n = sscanf(geometry, "%ux%ux%u", &width, &height, &depth);
+	if ((n < 2) || (width == 0) || (height == 0)) {
+		fprintf(stderr, "Invalid geometry %s\n", geometry);
+		return false;
+	}
+
+	d->width  = width;
+	d->height = height;
+	d->depth  = depth;
+	d->pixfmt = blit_pixfmt_from_depth(depth);
+	if (d->pixfmt < 0) {
+		fprintf(stderr, "Unsupported depth %u\n", depth);
+		return false;
+	}
+	d->stride = width * blit_pixfmt_bytes(d->pixfmt);
+	d->cmsize = (d->pixfmt == BLIT_FMT_CI8) ? 256 : 0;
+	return true;
+}
+
+
+static bool
+headless_map(struct display *d)
+{
+	struct headless_private *hp = d->priv;
+	void *mapped;
+
+	d->fb_size = (size_t) d->stride * d->height;
+	if (hp->anon) {
+		mapped = mmap(NULL, d->fb_size, PROT_READ | PROT_WRITE,
+		    MAP_ANON | MAP_PRIVATE, -1, 0);
+	} else {
+		if (ftruncate(d->disp_fd, d->fb_size) == -1) {
+			perror("Can't size headless framebuffer");
+			return false;
+		}
+		mapped = mmap(NULL, d->fb_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, d->disp_fd, 0);
+	}
+	if (mapped == MAP_FAILED) {
+		perror("Can't map headless framebuffer");
+		return false;
+	}
+	d->fb = mapped;
+	return true;
+}
+
+
+static bool
+headless_get_cmap(struct display *d, struct display_cmap *cmap)
+{
+	struct headless_private *hp = d->priv;
+
+	*cmap = hp->cmap;
+	return true;
+}
+
+
+static bool
+headless_put_cmap(struct display *d, const struct display_cmap *cmap)
+{
+	struct headless_private *hp = d->priv;
+
+	hp->cmap = *cmap;
+	return true;
+}
+
+
+/* next script line without comments and surrounding blanks, NULL at EOF */
+static char *
+headless_read_line(struct display *d)
+{
+	struct headless_private *hp = d->priv;
+	char *nl, *line, *end;
+	ssize_t len;
+
+	for (;;) {
+		nl = memchr(hp->buf, '\n', hp->buf_len);
+		if ((nl == NULL) && !hp->eof && (hp->buf_len < sizeof(hp->buf) - 1)) {
+			len = read(d->input_fd, hp->buf + hp->buf_len,
+			    sizeof(hp->buf) - 1 - hp->buf_len);
+			if ((len < 0) && (errno == EINTR))
+				continue;
+			if (len <= 0)
+				hp->eof = true;
+			else
+				hp->buf_len += len;
+			continue;
+		}
+		if (hp->buf_len == 0)
+			return NULL;
+		if (nl == NULL)
+			nl = hp->buf + hp->buf_len;
+
+		/* hand out the line, keep the rest for next time */
+		*nl = '\0';
+		line = strdup(hp->buf);
+		len = nl - hp->buf;
+		if (len < (ssize_t) hp->buf_len)
+			len++;
+		memmove(hp->buf, hp->buf + len, hp->buf_len - len);
+		hp->buf_len -= len;
+		if (line == NULL)
+			return NULL;
+
+		if ((end = strchr(line, '#')) != NULL)
+			*end = '\0';
+		end = line + strlen(line);
+		while ((end > line) && isspace((unsigned char) end[-1]))
+			*--end = '\0';
+		if (*line != '\0')
+			return line;
+		free(line);
+	}
+}
+
+
+/* key symbol for a script command, -1 if it is not a key */
+static int
+headless_parse_key(const char *cmd, const char *arg)
+{
+	if (strcmp(cmd, "next") == 0)
+		return WSDV_NEXTIMG;
+	if (strcmp(cmd, "prev") == 0)
+		return WSDV_PREVIMG;
+	if ((strcmp(cmd, "exit") == 0) || (strcmp(cmd, "quit") == 0))
+		return WSDV_EXIT;
+	if (strcmp(cmd, "first") == 0)
+		return KS_Home;
+	if (strcmp(cmd, "last") == 0)
+		return KS_End;
+	if (strcmp(cmd, "key") == 0)
+		return strtol(arg, NULL, 0);
+	return -1;
+}
+
+
+/* wait for the script clock to reach the next event */
+static void
+headless_wait(struct headless_private *hp)
+{
+	struct timespec ts;
+	uint64_t now;
+
+	now = latency_clock();
+	if (hp->due > now) {
+		ts.tv_sec = (hp->due - now) / 1000000000ULL;
+		ts.tv_nsec = (hp->due - now) % 1000000000ULL;
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			;
+	}
+}
+
+
+/* set up the next event with the time it is due, reading the script */
+static void
+headless_stage(struct display *d)
+{
+	struct headless_private *hp = d->priv;
+	struct display_event *ev = &hp->next;
+	char *line, *cmd, *arg;
+	long val;
+	int key, type;
+	bool press;
+
+	if (hp->staged)
+		return;
+	hp->staged = true;
+	hp->next_press = false;
+
+	if (hp->pending_up >= 0) {
+		ev->type = DISPLAY_EVENT_KEY_UP;
+		ev->value = hp->pending_up;
+		hp->pending_up = -1;
+		goto due;
+	}
+
+	if (hp->repeat_left > 0) {
+		hp->repeat_left--;
+		hp->due += hp->repeat_interval;
+		ev->type = DISPLAY_EVENT_KEY_DOWN;
+		ev->value = hp->repeat_key;
+		hp->next_press = true;
+		goto due;
+	}
+
+	for (;;) {
+		line = headless_read_line(d);
+		if (line == NULL) {
+			/* end of script ends the session */
+			ev->type = DISPLAY_EVENT_KEY_DOWN;
+			ev->value = WSDV_EXIT;
+			goto due;
+		}
+
+		cmd = line;
+		while (isspace((unsigned char) *cmd))
+			cmd++;
+		arg = cmd + strcspn(cmd, " \t");
+		if (*arg)
+			*arg++ = '\0';
+		while (isspace((unsigned char) *arg))
+			arg++;
+		val = strtol(arg, NULL, 0);
+
+		key = -1;
+		type = DISPLAY_EVENT_KEY_DOWN;
+		press = true;		/* down followed by up */
+		if (strcmp(cmd, "down") == 0) {
+			key = val;
+			press = false;
+		} else if (strcmp(cmd, "up") == 0) {
+			key = val;
+			type = DISPLAY_EVENT_KEY_UP;
+			press = false;
+		} else if (strcmp(cmd, "sleep") == 0) {
+			if (hp->due == 0)
+				hp->due = latency_clock();
+			hp->due += (uint64_t) val * 1000000;
+		} else if (strcmp(cmd, "repeat") == 0) {
+			/* repeat <count> <interval> <command> */
+			hp->repeat_left = val;
+			arg += strcspn(arg, " \t");
+			hp->repeat_interval = strtol(arg, &arg, 0) * 1000000ULL;
+			while (isspace((unsigned char) *arg))
+				arg++;
+			cmd = arg;
+			arg = cmd + strcspn(cmd, " \t");
+			if (*arg)
+				*arg++ = '\0';
+			hp->repeat_key = headless_parse_key(cmd, arg);
+			if ((hp->repeat_key < 0) || (hp->repeat_left <= 0)) {
+				fprintf(stderr, "ignoring script line `%s'\n",
+				    line);
+				hp->repeat_left = 0;
+			} else {
+				/* the first press is due now */
+				hp->repeat_left--;
+				key = hp->repeat_key;
+			}
+		} else if ((key = headless_parse_key(cmd, arg)) < 0) {
+			fprintf(stderr, "ignoring script line `%s'\n", line);
+		}
+		free(line);
+
+		if (key >= 0) {
+			ev->type = type;
+			ev->value = key;
+			hp->next_press = press;
+			break;
+		}
+	}
+
+due:
+	if (hp->due == 0)
+		hp->due = latency_clock();
+	ev->time = hp->due;
+}
+
+
+static int
+headless_read_event(struct display *d, struct display_event *ev)
+{
+	struct headless_private *hp = d->priv;
+
+	headless_stage(d);
+	headless_wait(hp);
+	*ev = hp->next;
+	if (hp->next_press)
+		hp->pending_up = ev->value;
+	hp->staged = false;
+	return 1;
+}
+
+
+/* the script is read ahead, its clock says when the next event is due */
+static int
+headless_pending(struct display *d)
+{
+	struct headless_private *hp = d->priv;
+	uint64_t now;
+
+	headless_stage(d);
+	now = latency_clock();
+	if (hp->due <= now)
+		return 0;
+	return (hp->due - now + 999999) / 1000000;
+}
+
+
+/* scripts speak key symbols already */
+static int
+headless_translate(struct display *d, int code)
+{
+	return code;
+}
+
+
+const struct display_backend display_headless = {
+	.name		 = "headless",
+	.def_display	 = "/wsdv-headless",
+	.def_input	 = "-",
+	.open		 = headless_open,
+	.close		 = headless_close,
+	.query		 = headless_query,
+	.map		 = headless_map,
+	.unmap		 = headless_unmap,
+	.get_cmap	 = headless_get_cmap,
+	.put_cmap	 = headless_put_cmap,
+	.read_event	 = headless_read_event,
+	.pending	 = headless_pending,
+	.translate	 = headless_translate,
+};
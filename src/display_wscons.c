@@ -0,0 +1,476 @@
+/*-
+ * Copyright (c) 2011, 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Radoslaw Kujawa and Reinoud Zandijk.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * NetBSD wscons backend: wsdisplay framebuffer and wskbd input.
+ */
+
+#include "display.h"
+
+#ifdef __NetBSD__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#include <sys/syslimits.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+
+#include <dev/wscons/wsconsio.h>
+#include <dev/wscons/wsdisplay_usl_io.h>
+
+#include "blit.h"
+#include "keymap.h"
+#include "latency.h"
+
+static const char* def_wsdisp = "/dev/ttyE0";
+//static const char* def_wsdispcfg = "/dev/ttyEcfg";
+//static const char* def_wsdispstat = "/dev/ttyEstat";
+
+struct wscons_private {
+	struct wsdisplay_fbinfo	 fbinfo;
+	struct wskbd_map_data	 wskbd_map;
+	struct display_cmap	 ocmap;
+	bool			 mapped;
+};
+
+
+static void *
+ws_mmap(int fd, size_t len)
+{
+	void *addr;
+	void *mapped;
+
+	addr = 0;	/* XXX: driver-dependent? */
+	
+	/* XXX: page size? */	
+	mapped = mmap(addr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);	
+	
+	return mapped;
+}
+
+
+static bool
+ws_cmap_get(struct display *d, struct display_cmap *cmap)
+{
+	struct wsdisplay_cmap wscmap;
+
+	cmap->count = d->cmsize > 256 ? 256 : d->cmsize;
+	wscmap.index = 0;
+	wscmap.count = cmap->count;
+	wscmap.red   = cmap->red;
+	wscmap.green = cmap->green;
+	wscmap.blue  = cmap->blue;
+
+	if (ioctl(d->disp_fd, WSDISPLAYIO_GETCMAP, &wscmap) == -1) {
+		perror("WSDISPLAYIO_GETCMAP ioctl failed");
+		return false;
+	}
+	return true;
+}
+
+
+static bool
+ws_cmap_set(struct display *d, const struct display_cmap *cmap)
+{
+	struct wsdisplay_cmap wscmap;
+
+	wscmap.index = 0;
+	wscmap.count = cmap->count;
+	wscmap.red   = __UNCONST(cmap->red);
+	wscmap.green = __UNCONST(cmap->green);
+	wscmap.blue  = __UNCONST(cmap->blue);
+
+	if (ioctl(d->disp_fd, WSDISPLAYIO_PUTCMAP, &wscmap) == -1) {
+		perror("WSDISPLAYIO_PUTCMAP ioctl failed");
+		return false;
+	}
+	return true;
+}
+
+
+/*
+ * Find out the channel layout of the framebuffer; drivers that don't know
+ * WSDISPLAYIO_GET_FBINFO get the traditional layout for their depth.
+ */
+static int
+ws_get_pixfmt(struct display *d)
+{
+#ifdef WSDISPLAYIO_GET_FBINFO
+	struct wsdisplayio_fbinfo fbi;
+#endif
+	int fmt;
+
+	fmt = -1;
+#ifdef WSDISPLAYIO_GET_FBINFO
+	if (ioctl(d->disp_fd, WSDISPLAYIO_GET_FBINFO, &fbi) == 0) {
+		if ((fbi.fbi_pixeltype == WSFB_CI) && (fbi.fbi_bitsperpixel == 8))
+			fmt = BLIT_FMT_CI8;
+		/* a layout we have no blitter for is no reason to guess */
+		if (fbi.fbi_pixeltype == WSFB_RGB)
+			return blit_pixfmt_from_masks(fbi.fbi_bitsperpixel,
+			    fbi.fbi_subtype.fbi_rgbmasks.red_offset,
+			    fbi.fbi_subtype.fbi_rgbmasks.red_size,
+			    fbi.fbi_subtype.fbi_rgbmasks.green_offset,
+			    fbi.fbi_subtype.fbi_rgbmasks.green_size,
+			    fbi.fbi_subtype.fbi_rgbmasks.blue_offset,
+			    fbi.fbi_subtype.fbi_rgbmasks.blue_size);
+	}
+#endif
+	if (fmt < 0)
+		fmt = blit_pixfmt_from_depth(d->depth);
+	return fmt;
+}
+
+
+static bool
+ws_get_display_geom(struct display *d)
+{
+	struct wscons_private *wp = d->priv;
+	u_int linebytes;
+
+	if (ioctl(d->disp_fd, WSDISPLAYIO_GINFO, &wp->fbinfo)) {
+		perror("WSDISPLAYIO_GINFO ioctl failed during getting wsdisplay info");
+		return false;
+	}
+	linebytes = 0;
+	ioctl(d->disp_fd, WSDISPLAYIO_LINEBYTES, &linebytes);
+
+	d->width  = wp->fbinfo.width;
+	d->height = wp->fbinfo.height;
+	d->depth  = wp->fbinfo.depth;
+	d->cmsize = wp->fbinfo.cmsize;
+	d->stride = linebytes;
+	d->pixfmt = ws_get_pixfmt(d);
+	return true;
+}
+
+
+static bool
+ws_prepare_keyboard(struct display *d)
+{
+	struct wscons_private *wp = d->priv;
+	struct wskbd_map_data *wskbd_map = &wp->wskbd_map;
+
+	if (!wskbd_map->map) {
+		wskbd_map->map = calloc(sizeof(struct wscons_keymap), WSKBDIO_MAXMAPLEN);
+		if (wskbd_map->map == NULL) {
+			wskbd_map->maplen = 0;
+			perror("Can't allocate keyboard mapping");
+			return false;
+		}
+	}
+	wskbd_map->maplen = WSKBDIO_MAXMAPLEN;
+	if (ioctl(d->input_fd, WSKBDIO_GETMAP, wskbd_map)) {
+		perror("WSKBDIO_GETMAP failed");
+		return false;
+	}
+
+#ifdef WSDV_DEBUG
+	/* print keymapping for debug purposes */
+	printf("keymap len = %d, mapping :", wskbd_map->maplen);
+	struct wscons_keymap *km = wskbd_map->map;
+	int i;
+	for (i = 0; i < wskbd_map->maplen; i++) {
+		printf("%d => %d, ", i, KS_VALUE(km[i].group1[0]));
+	}
+	printf("\n");
+#endif
+
+#if 0
+	/* this fails... but why? */
+	int ver = WSKBDIO_EVENT_VERSION;
+	if (ioctl(d->input_fd, WSKBDIO_SETVERSION, &ver) == -1) {
+		perror("WSKBDIO_SETVERSION ioctl failed");
+		return false;
+	}
+#endif
+
+	return true;
+}	
+
+
+static int
+ws_kbd_translate(struct display *d, int kc)
+{
+	struct wscons_private *wp = d->priv;
+	struct wscons_keymap *km;
+
+	if ((wp->wskbd_map.maplen == 0) || (kc < 0) ||
+	    (kc >= wp->wskbd_map.maplen))
+		return WSDV_EXIT;
+
+	km = wp->wskbd_map.map;
+	return KS_VALUE(km[kc].group1[0]);
+}
+
+
+static int
+ws_read_event(struct display *d, struct display_event *ev)
+{
+	struct wscons_event event;
+	ssize_t len;
+
+	len = read(d->input_fd, &event, sizeof(event));
+	if (len < 0)
+		return -1;
+	if (len != sizeof(event))
+		return 0;
+
+	// printf("event type %x value %x\n", event.type, event.value);
+	switch (event.type) {
+	case WSCONS_EVENT_KEY_DOWN:
+		ev->type = DISPLAY_EVENT_KEY_DOWN;
+		break;
+	case WSCONS_EVENT_KEY_UP:
+		ev->type = DISPLAY_EVENT_KEY_UP;
+		break;
+	default:
+		return 0;
+	}
+	ev->value = event.value;
+	ev->time = latency_clock();
+	return 1;
+}
+
+
+static void
+ws_restore_screen(struct display *d) 
+{
+	struct wscons_private *wp = d->priv;
+	int wsmode;
+
+	if (!wp->mapped)
+		return;
+
+	if (d->pixfmt == BLIT_FMT_CI8)
+		ws_cmap_set(d, &wp->ocmap);
+
+	if (d->fb != NULL)
+		munmap(d->fb, d->fb_size);
+	d->fb = NULL;
+
+	wsmode = WSDISPLAYIO_MODE_EMUL;
+	if (ioctl(d->disp_fd, WSDISPLAYIO_SMODE, &wsmode) == -1) {
+		perror("WSDISPLAYIO_SMODE ioctl failed during restore");
+	}
+	wp->mapped = false;
+}
+
+
+static bool
+ws_prepare_screen(struct display *d)
+{
+	struct wscons_private *wp = d->priv;
+	void *mapped;
+	int wsmode;
+
+	/* imho this cannot work, descriptors will be closed at this moment */
+	/*atexit(ws_restore_screen);*/
+
+	wsmode = WSDISPLAYIO_MODE_MAPPED;
+	if (ioctl(d->disp_fd, WSDISPLAYIO_SMODE, &wsmode) == -1) {
+		perror("WSDISPLAYIO_SMODE ioctl failed");
+		return false;
+	}
+	wp->mapped = true;
+
+	if (d->pixfmt == BLIT_FMT_CI8) 
+		ws_cmap_get(d, &wp->ocmap);
+
+	d->fb_size = d->stride * d->height;
+	mapped = ws_mmap(d->disp_fd, d->fb_size);
+	if (mapped == MAP_FAILED) {
+		perror("Can't map framebuffer");
+		return false;
+	}
+	d->fb = mapped;
+
+	return true;
+}	
+
+
+static bool
+ws_open(struct display *d, const char *wsdisp, const char *wskbd)
+{
+	d->priv = calloc(1, sizeof(struct wscons_private));
+	if (d->priv == NULL)
+		return false;
+
+	d->input_fd = open(wskbd, O_RDWR);
+	d->disp_fd = open(wsdisp, O_RDWR);
+
+	if (d->disp_fd < 0) {
+		perror("Can't open wsdisplay dev");
+		return false;
+	}
+	if (d->input_fd < 0) {
+		perror("Can't open wskbd dev");
+		return false;
+	}
+
+	return ws_prepare_keyboard(d);
+}
+
+
+static void
+ws_close(struct display *d)
+{
+	struct wscons_private *wp = d->priv;
+
+	if (wp) {
+		ws_restore_screen(d);
+		free(wp->wskbd_map.map);
+		free(wp);
+	}
+	d->priv = NULL;
+	if (d->disp_fd >= 0)
+		close(d->disp_fd);
+	if (d->input_fd >= 0)
+		close(d->input_fd);
+	d->disp_fd = d->input_fd = -1;
+}
+
+
+/*
+ * Try to determine default wsdisplay device, not hardcode it... 
+ * This needs some cleanup and much more error checking. 
+ */
+static const char *
+wsdv_display_get_default(void) 
+{
+	int i;
+	static char ttypath[PATH_MAX];
+	char *ttydevname;
+	struct stat s;
+	dev_t ttydev;
+	devmajor_t wsdisp_major;
+	size_t miblen;
+	struct kinfo_drivers *kern_drivers;
+	static int mib[2] = {CTL_KERN, KERN_DRIVERS};
+
+	wsdisp_major = 0;
+	memset(ttypath, 0, sizeof(ttypath));
+	ttydev = 0;
+
+	sysctl(mib, 2, NULL, &miblen, NULL, 0);
+	kern_drivers = malloc(miblen);
+	sysctl(mib, 2, kern_drivers, &miblen, NULL, 0);
+
+	/* obtain device major number for wsdisplay driver */
+	for (i = 0; i < miblen / sizeof(*kern_drivers); kern_drivers++, i++) {
+		if (strcmp("wsdisplay", kern_drivers->d_name))
+			continue;
+		wsdisp_major = kern_drivers->d_cmajor;
+		break;
+	}
+
+	if (wsdisp_major == 0)
+		err(EXIT_FAILURE, 
+		    "could not deterine wsdisplay device major number\n");
+			
+	if (isatty(0)) {
+		snprintf(ttypath, sizeof(ttypath), "%s", ttyname(0));
+	
+		if (stat(ttypath, &s) == -1)
+			perror("error stating stdin");
+
+		ttydev = s.st_dev; 
+	}
+
+	/* if stdin is not a tty or is a tty that is not a wsdisplay */
+	if (ttydev == 0 || (major(ttydev) != wsdisp_major)) {
+		ttydevname = devname(makedev(wsdisp_major, 0), S_IFCHR);
+		snprintf(ttypath, sizeof(ttypath), "/dev/%s", ttydevname);
+	}
+
+	if (stat(ttypath, &s) == -1) {
+		perror("error stating wsdisplay device file");
+		/* fall back to hard coded default */
+		snprintf(ttypath, sizeof(ttypath), "%s", def_wsdisp);
+	}
+
+	return ttypath;
+}
+
+#if 0
+/* Return number of currently active wsdispaly screen. */
+int
+wsdv_screen_get_active()
+{
+	int screen;
+
+	if (ioctl(wsdispcfg_fd, VT_GETACTIVE, &screen) == -1) {
+		perror("Can't get active screen! Forgot WSDISPLAY_COMPAT_USL?\n");
+		return -1;
+	}
+
+	printf("active screen is %d\n", screen);
+	
+	return screen;
+}
+
+bool
+wsdv_screen_switch(int screen)
+{
+
+	printf("going to switch to screen %d\n", screen);
+
+	if (ioctl(wsdispcfg_fd, VT_ACTIVATE, screen) == -1) {
+		perror("Can't switch screen");
+	}
+	
+	return true;
+}
+#endif 
+
+
+const struct display_backend display_wscons = {
+	.name		 = "wscons",
+	.def_input	 = "/dev/wskbd0",
+	.default_display = wsdv_display_get_default,
+	.open		 = ws_open,
+	.close		 = ws_close,
+	.query		 = ws_get_display_geom,
+	.map		 = ws_prepare_screen,
+	.unmap		 = ws_restore_screen,
+	.get_cmap	 = ws_cmap_get,
+	.put_cmap	 = ws_cmap_set,
+	.read_event	 = ws_read_event,
+	.translate	 = ws_kbd_translate,
+};
+
+#endif	/* __NetBSD__ */
@@ -0,0 +1,109 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fileio.h"
+#include "latency.h"
+
+
+void
+fileio_init(struct fileio *fio, uint64_t big)
+{
+	memset(fio, 0, sizeof(*fio));
+	fio->big = big;
+	fio->window = (big < FILEIO_WINDOW) ? big : FILEIO_WINDOW;
+}
+
+
+/* open path for loading; -1 if it can't be */
+int
+fileio_open(struct fileio *fio, const char *path, struct fileio_file *f)
+{
+	struct stat st;
+	uint64_t start;
+
+	memset(f, 0, sizeof(*f));
+	start = latency_clock();
+	f->fd = open(path, O_NONBLOCK | O_RDONLY);
+	if (f->fd < 0)
+		return -1;
+
+	if (fstat(f->fd, &st) == 0)
+		f->size = st.st_size;
+	f->big = (fio->big > 0) && ((uint64_t) f->size >= fio->big);
+	if (f->big)
+		posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	else
+		posix_fadvise(f->fd, 0, 0, POSIX_FADV_WILLNEED);
+	f->open_ns = latency_clock() - start;
+	return f->fd;
+}
+
+
+void
+fileio_close(struct fileio *fio, struct fileio_file *f)
+{
+	if (f->fd < 0)
+		return;
+
+	/* read once, keep the page cache for the others */
+	if (f->big)
+		posix_fadvise(f->fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(f->fd);
+	f->fd = -1;
+}
+
+
+/*
+ * Have the kernel start reading these, most wanted first. It only queues
+ * the reads, the pages are in by the time a decoder gets there.
+ */
+void
+fileio_readahead(struct fileio *fio, const char **paths, int count)
+{
+	struct stat st;
+	off_t len;
+	int i, fd;
+
+	for (i = 0; i < count; i++) {
+		fd = open(paths[i], O_NONBLOCK | O_RDONLY);
+		if (fd < 0)
+			continue;
+		if (fstat(fd, &st) == 0) {
+			len = st.st_size;
+			if ((fio->big > 0) && ((uint64_t) len >= fio->big))
+				len = fio->window;
+			posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+		}
+		close(fd);
+	}
+}
@@ -0,0 +1,64 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _FILEIO_H
+#define _FILEIO_H
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * How image files are read. The files the viewer is likely to show next
+ * are handed to the kernel's readahead so slow storage is busy while the
+ * current one is looked at, instead of when the key is pressed. Files of
+ * `big' bytes and up are read sequentially and dropped from the page
+ * cache again when loaded, so one huge image doesn't push out the cached
+ * ones; only their first `window' bytes are read ahead.
+ */
+
+#define FILEIO_BIG	(16 * 1024 * 1024)
+#define FILEIO_WINDOW	(2 * 1024 * 1024)
+
+struct fileio {
+	uint64_t	 big;
+	uint64_t	 window;
+};
+
+struct fileio_file {
+	int		 fd;
+	off_t		 size;
+	bool		 big;
+	uint64_t	 open_ns;	/* open() and the hints */
+};
+
+void	fileio_init(struct fileio *, uint64_t);
+int	fileio_open(struct fileio *, const char *, struct fileio_file *);
+void	fileio_close(struct fileio *, struct fileio_file *);
+void	fileio_readahead(struct fileio *, const char **, int);
+
+#endif	/* _FILEIO_H */
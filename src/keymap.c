@@ -1,74 +1,291 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
 
+#include <sys/stat.h>
+
+#ifdef __NetBSD__
 #include <prop/proplib.h>
+#endif
 
-#define MAX_KEY_SIZE 16 
-#define MAX_VAL_SIZE 16 
+#include "keymap.h"
 
-static prop_dictionary_t pd;
+#define MAX_KEY_SIZE 16
 
-int
-wsdv_keycode_translate(int eventval) 
+/* slideshow interval and counts are kept sane */
+#define KEYMAP_ARG_MAX	1000000
+
+/*
+ * A keymap file compiled into its table is cached next to it, so later
+ * runs don't need to parse the XML; the size and time of the property
+ * list tell when it is out of date.
+ */
+#define KEYMAP_CACHE_MAGIC	"WSDVKEY"
+#define KEYMAP_CACHE_VERSION	1
+
+struct keymap_cache {
+	char			 magic[8];
+	uint32_t		 version;
+	uint32_t		 codes;
+	uint64_t		 src_size;
+	int64_t			 src_mtime;
+	struct keymap_action	 code[KEYMAP_CODES];
+};
+
+/* what the console's keys do unless a keymap file says otherwise */
+static const struct {
+	int			 sym;
+	struct keymap_action	 act;
+} keymap_defaults[] = {
+	{ KS_Escape,	{ KEYMAP_EXIT,		  0 } },
+	{ KS_space,	{ KEYMAP_MOVE,		  1 } },
+	{ KS_BackSpace,	{ KEYMAP_MOVE,		 -1 } },
+	{ KS_Right,	{ KEYMAP_MOVE,		  1 } },
+	{ KS_Left,	{ KEYMAP_MOVE,		 -1 } },
+	{ KS_Next,	{ KEYMAP_MOVE,		 10 } },
+	{ KS_Prior,	{ KEYMAP_MOVE,		-10 } },
+	{ KS_Home,	{ KEYMAP_GOTO,		  1 } },
+	{ KS_End,	{ KEYMAP_GOTO,		 -1 } },
+	{ KS_Return,	{ KEYMAP_GOTO,		  0 } },
+	{ KS_s,		{ KEYMAP_SLIDESHOW,	  0 } },
+};
+
+/* and the names keymap files use for them */
+static const struct {
+	const char	*name;
+	int		 action;
+	int		 arg;		/* when none is given */
+} keymap_names[] = {
+	{ "exit",	KEYMAP_EXIT,		 0 },
+	{ "quit",	KEYMAP_EXIT,		 0 },
+	{ "next",	KEYMAP_MOVE,		 1 },
+	{ "prev",	KEYMAP_MOVE,		-1 },
+	{ "jump",	KEYMAP_MOVE,		 0 },
+	{ "first",	KEYMAP_GOTO,		 1 },
+	{ "last",	KEYMAP_GOTO,		-1 },
+	{ "goto",	KEYMAP_GOTO,		 0 },
+	{ "digit",	KEYMAP_DIGIT,		-1 },
+	{ "slideshow",	KEYMAP_SLIDESHOW,	 0 },
+};
+
+#define NELEM(a)	(sizeof(a) / sizeof((a)[0]))
+
+
+/* set up the default bindings, no keymap file */
+void
+keymap_init(struct keymap *km)
+{
+	struct keymap_action *act;
+	size_t i;
+
+	memset(km, 0, sizeof(*km));
+	for (i = 0; i < NELEM(keymap_defaults); i++)
+		km->sym[keymap_symbol_slot(keymap_defaults[i].sym)] =
+		    keymap_defaults[i].act;
+	for (i = 0; i <= 9; i++) {
+		act = &km->sym[keymap_symbol_slot(KS_0 + i)];
+		act->action = KEYMAP_DIGIT;
+		act->arg = i;
+	}
+}
+
+
+/*
+ * An action as keymap files write it: a name from keymap_names, some of
+ * them followed by a number.
+ */
+bool
+keymap_parse_action(const char *str, struct keymap_action *act)
 {
-	int tkeycode;
-	bool r;
-	char okeycode[MAX_KEY_SIZE];
-
-	if (pd == NULL)
-		return eventval;
-
-	snprintf(okeycode, MAX_KEY_SIZE-1, "%d", eventval);
-	r = prop_dictionary_get_int32(pd, okeycode, &tkeycode);
-#if 0
-	if (!r) {
-		snprintf(okeycode, MAX_KEY_SIZE-1, "%x", eventval);
-		r = prop_dictionary_get_int32(pd, okeycode, &tkeycode);
+	const char *arg;
+	char *end;
+	size_t i, len;
+	long val;
+
+	while (*str == ' ' || *str == '\t')
+		str++;
+	len = strcspn(str, " \t");
+	for (i = 0; i < NELEM(keymap_names); i++)
+		if ((strlen(keymap_names[i].name) == len) &&
+		    (strncmp(keymap_names[i].name, str, len) == 0))
+			break;
+	if (i == NELEM(keymap_names))
+		return false;
+
+	act->action = keymap_names[i].action;
+	act->arg = keymap_names[i].arg;
+	arg = str + len;
+	while (*arg == ' ' || *arg == '\t')
+		arg++;
+	if (*arg != '\0') {
+		val = strtol(arg, &end, 0);
+		while (*end == ' ' || *end == '\t')
+			end++;
+		if ((*end != '\0') || (val < -KEYMAP_ARG_MAX) ||
+		    (val > KEYMAP_ARG_MAX))
+			return false;
+		act->arg = val;
 	}
-#endif 
 
-	if (!r) {
-		fprintf(stderr, "unable to map event value %s\n", okeycode);
-		return eventval;
+	switch (act->action) {
+	case KEYMAP_MOVE:
+		return act->arg != 0;
+	case KEYMAP_DIGIT:
+		return (act->arg >= 0) && (act->arg <= 9);
+	case KEYMAP_SLIDESHOW:
+		return act->arg >= 0;
 	}
+	return true;
+}
 
-#if WSDV_DEBUG
-	fprintf(stderr, "translated event value %x into %x\n", eventval,
-	    tkeycode);
-#endif
 
-	return tkeycode;
+/* a key symbol that does the same with the default bindings, -1 if none */
+int
+keymap_action_symbol(const struct keymap_action *act)
+{
+	size_t i;
+
+	if (act->action == KEYMAP_DIGIT)
+		return KS_0 + act->arg;
+	for (i = 0; i < NELEM(keymap_defaults); i++)
+		if ((keymap_defaults[i].act.action == act->action) &&
+		    (keymap_defaults[i].act.arg == act->arg))
+			return keymap_defaults[i].sym;
+	return -1;
 }
 
-bool
-wsdv_keymap_load(char *file)
+
+static bool
+keymap_cache_read(struct keymap *km, const char *name, const struct stat *src)
 {
-	pd = prop_dictionary_internalize_from_file(file);
-	return pd;
+	struct keymap_cache cache;
+	ssize_t len;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return false;
+	len = read(fd, &cache, sizeof(cache));
+	close(fd);
+
+	if ((len != sizeof(cache)) ||
+	    memcmp(cache.magic, KEYMAP_CACHE_MAGIC, sizeof(cache.magic)) ||
+	    (cache.version != KEYMAP_CACHE_VERSION) ||
+	    (cache.codes != KEYMAP_CODES) ||
+	    (cache.src_size != (uint64_t) src->st_size) ||
+	    (cache.src_mtime != (int64_t) src->st_mtime))
+		return false;
+
+	memcpy(km->code, cache.code, sizeof(km->code));
+	return true;
 }
 
-#if 0 
-void
-wsdv_keymap_save_default(void)
+
+/* best effort, the keymap file's directory may well be read only */
+static void
+keymap_cache_write(struct keymap *km, const char *name, const struct stat *src)
+{
+	struct keymap_cache cache;
+	char tmp[PATH_MAX];
+	bool ok;
+	int fd;
+
+	memset(&cache, 0, sizeof(cache));
+	memcpy(cache.magic, KEYMAP_CACHE_MAGIC, sizeof(cache.magic));
+	cache.version = KEYMAP_CACHE_VERSION;
+	cache.codes = KEYMAP_CODES;
+	cache.src_size = src->st_size;
+	cache.src_mtime = src->st_mtime;
+	memcpy(cache.code, km->code, sizeof(cache.code));
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", name) >= (int) sizeof(tmp))
+		return;
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+	ok = (write(fd, &cache, sizeof(cache)) == sizeof(cache));
+	ok = (close(fd) == 0) && ok;
+	if (!ok || (rename(tmp, name) != 0))
+		unlink(tmp);
+}
+
+
+#ifdef __NetBSD__
+/*
+ * Keys are raw keycodes in decimal. Values are key symbols, which get
+ * the symbol's default binding, or actions by name; keycodes without an
+ * entry are taken for symbols as they are.
+ */
+static bool
+keymap_compile(struct keymap *km, const char *file)
 {
-	int32_t v;
+	prop_dictionary_t pd;
+	const char *str;
 	char key[MAX_KEY_SIZE];
-	char val[MAX_VAL_SIZE];
+	int32_t sym;
+	int i;
 
-	pd = prop_dictionary_create();
+	pd = prop_dictionary_internalize_from_file(file);
+	if (pd == NULL) {
+		fprintf(stderr, "Can't read keymap %s\n", file);
+		return false;
+	}
 
-	snprintf(key, MAX_KEY_SIZE-1, "%d", 0x29);
-	//snprintf(val, MAX_VAL_SIZE-1, "%d", 0x29);
-	prop_dictionary_set_int32(pd, key, 0x29);
+	for (i = 0; i < KEYMAP_CODES; i++) {
+		snprintf(key, sizeof(key), "%d", i);
+		if (prop_dictionary_get_int32(pd, key, &sym)) {
+			km->code[i] = *keymap_symbol(km, sym);
+		} else if (prop_dictionary_get_cstring_nocopy(pd, key, &str)) {
+			if (!keymap_parse_action(str, &km->code[i])) {
+				fprintf(stderr, "%s: key %d: unknown action "
+				    "`%s'\n", file, i, str);
+				km->code[i].action = KEYMAP_NONE;
+			}
+		} else {
+			km->code[i] = *keymap_symbol(km, i);
+		}
+	}
 
-	prop_dictionary_externalize_to_file(pd, "map1.plist");
-		
+	prop_object_release(pd);
+	return true;
 }
+#else	/* !__NetBSD__ */
 
-int
-main(int argc, void *argv[]) {
-	wsdv_keymap_load("map1.plist");
-	wsdv_keycode_translate(0x2C);
-	wsdv_keycode_translate(0x2B);
+/* keymap files are property lists, no proplib means no translation */
+static bool
+keymap_compile(struct keymap *km, const char *file)
+{
+	fprintf(stderr, "keymap files need proplib, ignoring %s\n", file);
+	return false;
 }
-#endif 
+#endif	/* __NetBSD__ */
+
 
+/* translate raw keycodes with a keymap file, after keymap_init() */
+bool
+keymap_load(struct keymap *km, const char *file)
+{
+	char cache[PATH_MAX];
+	struct stat st;
+
+	if (stat(file, &st) == -1) {
+		perror(file);
+		return false;
+	}
+
+	if (snprintf(cache, sizeof(cache), "%s.cache", file) >=
+	    (int) sizeof(cache))
+		cache[0] = '\0';
+	if ((cache[0] == '\0') || !keymap_cache_read(km, cache, &st)) {
+		if (!keymap_compile(km, file))
+			return false;
+		if (cache[0] != '\0')
+			keymap_cache_write(km, cache, &st);
+	}
+	km->loaded = true;
+	return true;
+}
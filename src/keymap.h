@@ -1,9 +1,103 @@
+
+#ifndef _KEYMAP_H
+#define _KEYMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __NetBSD__
 #include <dev/wscons/wsksymdef.h>
+#else
+/* the wscons key symbols wsdv uses, values as in wsksymdef.h */
+#define KS_BackSpace	0x08
+#define KS_Return	0x0d
+#define KS_Escape	0x1b
+#define KS_space	0x20
+#define KS_0		0x30
+#define KS_1		0x31
+#define KS_2		0x32
+#define KS_3		0x33
+#define KS_4		0x34
+#define KS_5		0x35
+#define KS_6		0x36
+#define KS_7		0x37
+#define KS_8		0x38
+#define KS_9		0x39
+#define KS_s		0x73
+#define KS_Home		0xf381
+#define KS_Prior	0xf382
+#define KS_Next		0xf383
+#define KS_Left		0xf386
+#define KS_Right	0xf387
+#define KS_End		0xf388
+#endif
 
 #define WSDV_EXIT	KS_Escape
 #define WSDV_NEXTIMG	KS_space
 #define WSDV_PREVIMG	KS_BackSpace
 #define WSDV_SWITCH_SCREEN_2	KS_2
 
-int	wsdv_keycode_translate(int);
-bool	wsdv_keymap_load(char *);
+/*
+ * What a key does. Digits typed before a key make up a count: it
+ * multiplies a move, is the image to go to when goto has none of its
+ * own and the slideshow interval in seconds.
+ */
+#define KEYMAP_NONE		0
+#define KEYMAP_EXIT		1
+#define KEYMAP_MOVE		2	/* arg images on, negative back */
+#define KEYMAP_GOTO		3	/* arg from 1, negative from the end */
+#define KEYMAP_DIGIT		4	/* arg 0-9 */
+#define KEYMAP_SLIDESHOW	5	/* toggle, arg ms between images */
+
+struct keymap_action {
+	int32_t		 action;
+	int32_t		 arg;
+};
+
+/*
+ * Both ways from a key press to what it does are single table lookups:
+ * raw keycodes through the table compiled from a keymap file, or key
+ * symbols from the backend through the default bindings.
+ */
+#define KEYMAP_CODES	256	/* raw keycodes a keymap file translates */
+#define KEYMAP_SYMBOLS	768	/* Latin-1, the keypad and function keys */
+
+struct keymap {
+	bool			 loaded;	/* from a keymap file */
+	struct keymap_action	 code[KEYMAP_CODES];
+	/* the slot past the symbols is for the ones that are unbound */
+	struct keymap_action	 sym[KEYMAP_SYMBOLS + 1];
+};
+
+void	keymap_init(struct keymap *);
+bool	keymap_load(struct keymap *, const char *);
+bool	keymap_parse_action(const char *, struct keymap_action *);
+int	keymap_action_symbol(const struct keymap_action *);
+
+/* slot of a key symbol in the table, KEYMAP_SYMBOLS for unbound ones */
+static inline int
+keymap_symbol_slot(int sym)
+{
+	if ((sym >= 0) && (sym < 0x100))
+		return sym;
+	if ((sym >= 0xf200) && (sym < 0xf400))
+		return 0x100 + (sym - 0xf200);
+	return KEYMAP_SYMBOLS;
+}
+
+static inline const struct keymap_action *
+keymap_symbol(const struct keymap *km, int sym)
+{
+	return &km->sym[keymap_symbol_slot(sym)];
+}
+
+/* keycodes past the table are unbound, not folded onto it */
+static inline const struct keymap_action *
+keymap_code(const struct keymap *km, int code)
+{
+	if ((code < 0) || (code >= KEYMAP_CODES))
+		return &km->sym[KEYMAP_SYMBOLS];
+	return &km->code[code];
+}
+
+#endif	/* _KEYMAP_H */
@@ -0,0 +1,177 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "latency.h"
+
+static const char *stage_names[LATENCY_STAGES] = {
+	"event", "decode", "convert", "blit", "total"
+};
+
+/* monotonic time in nanoseconds, also used to stamp input events */
+uint64_t
+latency_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+latency_init(struct latency *l, bool enabled)
+{
+	memset(l, 0, sizeof(*l));
+	l->enabled = enabled;
+}
+
+void
+latency_free(struct latency *l)
+{
+	int i;
+
+	for (i = 0; i < LATENCY_STAGES; i++)
+		free(l->samples[i]);
+	latency_init(l, l->enabled);
+}
+
+/* a key press arrived at time `when', 0 if the input has no timestamp */
+void
+latency_begin(struct latency *l, uint64_t when)
+{
+	uint64_t now;
+
+	if (!l->enabled)
+		return;
+
+	now = latency_clock();
+	if ((when == 0) || (when > now))
+		when = now;
+
+	memset(l->cur, 0, sizeof(l->cur));
+	l->start = when;
+	l->mark = now;
+	l->cur[LATENCY_EVENT] = now - when;
+	l->done = 1 << LATENCY_EVENT;
+	l->active = true;
+}
+
+/* the stage that started at the previous mark has finished */
+void
+latency_mark(struct latency *l, int stage)
+{
+	uint64_t now;
+
+	if (!l->active)
+		return;
+
+	now = latency_clock();
+	l->cur[stage] += now - l->mark;
+	l->mark = now;
+	l->done |= 1 << stage;
+}
+
+/* keep the sample if the press got an image onto the screen */
+void
+latency_end(struct latency *l)
+{
+	uint64_t *p;
+	size_t size;
+	int i;
+
+	if (!l->active)
+		return;
+	l->active = false;
+
+	if (!(l->done & (1 << LATENCY_BLIT)))
+		return;
+
+	if (l->count == l->size) {
+		size = l->size ? l->size * 2 : 256;
+		for (i = 0; i < LATENCY_STAGES; i++) {
+			p = realloc(l->samples[i], size * sizeof(uint64_t));
+			if (p == NULL)
+				return;
+			l->samples[i] = p;
+		}
+		l->size = size;
+	}
+
+	/* the last mark is when the blit finished */
+	l->cur[LATENCY_TOTAL] = l->mark - l->start;
+	for (i = 0; i < LATENCY_STAGES; i++)
+		l->samples[i][l->count] = l->cur[i];
+	l->count++;
+}
+
+static int
+latency_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* nearest rank percentile of sorted samples */
+static uint64_t
+latency_percentile(const uint64_t *s, size_t n, unsigned int pct)
+{
+	size_t rank;
+
+	rank = (n * pct + 99) / 100;
+	if (rank == 0)
+		rank = 1;
+	return s[rank - 1];
+}
+
+void
+latency_report(struct latency *l, FILE *f)
+{
+	uint64_t *s;
+	int i;
+
+	if (!l->enabled)
+		return;
+
+	fprintf(f, "latency over %zu key presses, milliseconds\n", l->count);
+	if (l->count == 0)
+		return;
+
+	fprintf(f, "%-8s %9s %9s %9s\n", "stage", "p50", "p99", "max");
+	for (i = 0; i < LATENCY_STAGES; i++) {
+		s = l->samples[i];
+		qsort(s, l->count, sizeof(*s), latency_cmp);
+		fprintf(f, "%-8s %9.3f %9.3f %9.3f\n", stage_names[i],
+		    latency_percentile(s, l->count, 50) / 1e6,
+		    latency_percentile(s, l->count, 99) / 1e6,
+		    s[l->count - 1] / 1e6);
+	}
+}
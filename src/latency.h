@@ -0,0 +1,71 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _LATENCY_H
+#define _LATENCY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Key-to-photon latency. Every key press that puts a new image on the
+ * screen is one sample, split into the stages below; the time the event
+ * spent queued before wsdv read it counts as the first stage.
+ */
+
+#define LATENCY_EVENT	0	/* event arrival to read */
+#define LATENCY_DECODE	1	/* png_load() */
+#define LATENCY_CONVERT	2	/* conversion to the screen's format */
+#define LATENCY_BLIT	3	/* rows through the shadow onto the screen */
+#define LATENCY_TOTAL	4	/* event arrival to the last pixel */
+#define LATENCY_STAGES	5
+
+struct latency {
+	bool		 enabled;
+
+	/* sample in progress */
+	bool		 active;
+	uint64_t	 start, mark;
+	uint64_t	 cur[LATENCY_STAGES];
+	uint32_t	 done;		/* stages marked */
+
+	/* finished samples, in nanoseconds */
+	uint64_t	*samples[LATENCY_STAGES];
+	size_t		 count, size;
+};
+
+uint64_t latency_clock(void);
+
+void	latency_init(struct latency *, bool);
+void	latency_free(struct latency *);
+void	latency_begin(struct latency *, uint64_t);
+void	latency_mark(struct latency *, int);
+void	latency_end(struct latency *);
+void	latency_report(struct latency *, FILE *);
+
+#endif	/* _LATENCY_H */
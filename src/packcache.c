@@ -0,0 +1,388 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "packcache.h"
+
+/*
+ * The row coder follows LZ4's block format: a token with the literal
+ * count in the high and the match length - 4 in the low nibble, counts of
+ * 15 continued in bytes of 255, the literals, then a 2 byte little endian
+ * distance back. The last sequence has literals only. Distances and
+ * positions are 16 bit, wider rows are kept unpacked.
+ */
+
+#define LZ_HASH_BITS	10
+#define LZ_MIN_MATCH	4
+#define LZ_MAX_ROW	65535
+
+static inline uint32_t
+lz_hash(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static inline uint8_t *
+lz_put_count(uint8_t *op, size_t count)
+{
+	for (; count >= 255; count -= 255)
+		*op++ = 255;
+	*op++ = count;
+	return op;
+}
+
+/* bytes written to dst, 0 if it doesn't fit in cap */
+static size_t
+lz_pack(uint16_t *hash, const uint8_t *src, size_t len, uint8_t *dst,
+    size_t cap)
+{
+	const uint8_t *ip, *anchor, *ref, *end, *limit;
+	uint8_t *op, *oend, *token;
+	size_t lit, match;
+	uint32_t h, misses;
+
+	memset(hash, 0, sizeof(uint16_t) << LZ_HASH_BITS);
+	ip = anchor = src;
+	end = src + len;
+	limit = (len > 8) ? end - 8 : src;
+	op = dst;
+	oend = dst + cap;
+	misses = 0;
+
+	if (ip < limit)
+		ip++;
+	while (ip < limit) {
+		h = lz_hash(ip);
+		ref = src + hash[h];
+		hash[h] = ip - src;
+		if ((ref >= ip) || (memcmp(ref, ip, LZ_MIN_MATCH) != 0)) {
+			/* skip ahead faster through what doesn't pack */
+			ip += 1 + (misses++ >> 5);
+			continue;
+		}
+		misses = 0;
+
+		match = LZ_MIN_MATCH;
+		while ((ip + match < end) && (ref[match] == ip[match]))
+			match++;
+		lit = ip - anchor;
+		if (op + 1 + lit / 255 + 1 + lit + 2 + match / 255 + 1 > oend)
+			return 0;
+
+		token = op++;
+		*token = (lit >= 15 ? 15 : lit) << 4;
+		if (lit >= 15)
+			op = lz_put_count(op, lit - 15);
+		memcpy(op, anchor, lit);
+		op += lit;
+		*op++ = (ip - ref) & 0xff;
+		*op++ = (ip - ref) >> 8;
+		match -= LZ_MIN_MATCH;
+		*token |= (match >= 15) ? 15 : match;
+		if (match >= 15)
+			op = lz_put_count(op, match - 15);
+
+		ip += match + LZ_MIN_MATCH;
+		anchor = ip;
+	}
+
+	lit = end - anchor;
+	if (op + 1 + lit / 255 + 1 + lit > oend)
+		return 0;
+	token = op++;
+	*token = (lit >= 15 ? 15 : lit) << 4;
+	if (lit >= 15)
+		op = lz_put_count(op, lit - 15);
+	memcpy(op, anchor, lit);
+	op += lit;
+	return op - dst;
+}
+
+static inline bool
+lz_get_count(const uint8_t **ip, const uint8_t *iend, size_t *count)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= iend)
+			return false;
+		b = *(*ip)++;
+		*count += b;
+	} while (b == 255);
+	return true;
+}
+
+static bool
+lz_unpack(const uint8_t *src, size_t len, uint8_t *dst, size_t dlen)
+{
+	const uint8_t *ip, *iend, *ref;
+	uint8_t *op, *oend;
+	size_t lit, match, n;
+	uint8_t token;
+
+	ip = src;
+	iend = src + len;
+	op = dst;
+	oend = dst + dlen;
+	while (ip < iend) {
+		token = *ip++;
+		lit = token >> 4;
+		if ((lit == 15) && !lz_get_count(&ip, iend, &lit))
+			return false;
+		if ((lit > (size_t) (iend - ip)) || (lit > (size_t) (oend - op)))
+			return false;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if (ip >= iend)
+			break;
+
+		if (iend - ip < 2)
+			return false;
+		n = ip[0] | (ip[1] << 8);
+		ip += 2;
+		match = token & 15;
+		if ((match == 15) && !lz_get_count(&ip, iend, &match))
+			return false;
+		match += LZ_MIN_MATCH;
+		if ((n == 0) || (n > (size_t) (op - dst)) ||
+		    (match > (size_t) (oend - op)))
+			return false;
+
+		/* runs overlap themselves; the span to copy doubles each time */
+		ref = op - n;
+		while (match > 0) {
+			n = op - ref;
+			if (n > match)
+				n = match;
+			memcpy(op, ref, n);
+			op += n;
+			match -= n;
+		}
+	}
+	return op == oend;
+}
+
+
+bool
+packcache_init(struct packcache *pc, uint64_t budget, uint32_t pixel_bytes)
+{
+	memset(pc, 0, sizeof(*pc));
+	TAILQ_INIT(&pc->images);
+	pc->budget = budget;
+	pc->pixel_bytes = pixel_bytes;
+	if (budget == 0)
+		return true;
+
+	pc->hash = malloc(sizeof(uint16_t) << LZ_HASH_BITS);
+	if (pc->hash == NULL)
+		return false;
+	pc->enabled = true;
+	return true;
+}
+
+static void
+packcache_remove(struct packcache *pc, struct packed_image *pk)
+{
+	TAILQ_REMOVE(&pc->images, pk, lru);
+	pc->used -= pk->bytes;
+	free(pk->rows);
+	free(pk->data);
+	free(pk);
+}
+
+void
+packcache_free(struct packcache *pc)
+{
+	struct packed_image *pk;
+
+	while ((pk = TAILQ_FIRST(&pc->images)) != NULL)
+		packcache_remove(pc, pk);
+	free(pc->hash);
+	free(pc->row);
+	pc->hash = NULL;
+	pc->row = NULL;
+	pc->enabled = false;
+}
+
+static struct packed_image *
+packcache_lookup(struct packcache *pc, const char *path)
+{
+	struct packed_image *pk;
+
+	TAILQ_FOREACH(pk, &pc->images, lru)
+		if (strcmp(pk->path, path) == 0)
+			return pk;
+	return NULL;
+}
+
+bool
+packcache_has(struct packcache *pc, const char *path)
+{
+	return pc->enabled && (packcache_lookup(pc, path) != NULL);
+}
+
+/* the packed image for path, it stays the cache's */
+struct packed_image *
+packcache_get(struct packcache *pc, const char *path)
+{
+	struct packed_image *pk;
+
+	if (!pc->enabled)
+		return NULL;
+
+	pk = packcache_lookup(pc, path);
+	if (pk == NULL)
+		return NULL;
+
+	pc->hits++;
+	TAILQ_REMOVE(&pc->images, pk, lru);
+	TAILQ_INSERT_HEAD(&pc->images, pk, lru);
+	pk->unpacked = UINT32_MAX;
+	return pk;
+}
+
+/*
+ * Pack the image at (x, y) sized width x height whose rows, in the
+ * framebuffer's format, are stride bytes apart. Least recently shown
+ * images make room for it; false if it doesn't fit at all.
+ */
+bool
+packcache_put(struct packcache *pc, const char *path, uint32_t x, uint32_t y,
+    uint32_t width, uint32_t height, const uint8_t *pixels, size_t stride,
+    const struct display_cmap *cmap)
+{
+	struct packed_image *pk;
+	const uint8_t *src, *prev;
+	uint8_t *data;
+	size_t row_bytes, used, size, len;
+	uint32_t row;
+
+	if (!pc->enabled || (packcache_lookup(pc, path) != NULL))
+		return false;
+
+	row_bytes = (size_t) width * pc->pixel_bytes;
+	if (row_bytes > pc->row_size) {
+		free(pc->row);
+		pc->row = malloc(row_bytes);
+		pc->row_size = (pc->row != NULL) ? row_bytes : 0;
+		if (pc->row == NULL)
+			return false;
+	}
+
+	pk = calloc(1, sizeof(*pk));
+	if (pk == NULL)
+		return false;
+	pk->rows = calloc(height, sizeof(struct packed_row));
+	size = row_bytes * height / 4 + row_bytes;
+	pk->data = malloc(size);
+	if ((pk->rows == NULL) || (pk->data == NULL))
+		goto fail;
+
+	used = 0;
+	prev = NULL;
+	for (row = 0; row < height; row++) {
+		src = pixels + row * stride;
+		if ((prev != NULL) && (memcmp(src, prev, row_bytes) == 0)) {
+			pk->rows[row] = pk->rows[row - 1];
+			continue;
+		}
+		prev = src;
+
+		len = 0;
+		if (row_bytes <= LZ_MAX_ROW)
+			len = lz_pack(pc->hash, src, row_bytes, pc->row,
+			    row_bytes - 1);
+		if (len == 0)
+			len = row_bytes;
+		if (used + len > size) {
+			size = size * 2 + len;
+			data = realloc(pk->data, size);
+			if (data == NULL)
+				goto fail;
+			pk->data = data;
+		}
+		memcpy(pk->data + used, (len == row_bytes) ? src : pc->row,
+		    len);
+		pk->rows[row].offset = used;
+		pk->rows[row].length = len;
+		used += len;
+	}
+	data = realloc(pk->data, used ? used : 1);
+	if (data != NULL)
+		pk->data = data;
+
+	pk->path = path;
+	pk->x = x;
+	pk->y = y;
+	pk->width = width;
+	pk->height = height;
+	pk->row_bytes = row_bytes;
+	if (cmap != NULL)
+		pk->cmap = *cmap;
+	pk->bytes = sizeof(*pk) + height * sizeof(struct packed_row) + used;
+	if (pk->bytes > pc->budget)
+		goto fail;
+
+	while (pc->used + pk->bytes > pc->budget)
+		packcache_remove(pc, TAILQ_LAST(&pc->images, packed_image_head));
+	pc->used += pk->bytes;
+	TAILQ_INSERT_HEAD(&pc->images, pk, lru);
+	return true;
+
+fail:
+	free(pk->rows);
+	free(pk->data);
+	free(pk);
+	return false;
+}
+
+/*
+ * Row y of a packed image in the framebuffer's format: straight from the
+ * cache if it is kept as is, otherwise unpacked into scratch. Rows have to
+ * be asked for in order after packcache_get().
+ */
+const uint8_t *
+packcache_row(struct packed_image *pk, uint32_t y, uint8_t *scratch)
+{
+	struct packed_row *r = &pk->rows[y];
+
+	if (r->length == pk->row_bytes)
+		return pk->data + r->offset;
+	if (r->offset != pk->unpacked) {
+		if (!lz_unpack(pk->data + r->offset, r->length, scratch,
+		    pk->row_bytes))
+			memset(scratch, 0, pk->row_bytes);
+		pk->unpacked = r->offset;
+	}
+	return scratch;
+}
@@ -0,0 +1,88 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PACKCACHE_H
+#define _PACKCACHE_H
+
+#include <sys/queue.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "display.h"
+
+/*
+ * Images that have been shown, kept compressed in the framebuffer's pixel
+ * format under a budget of their own, so several times more of them stay
+ * ready than the prefetcher's unpacked images. Each row is packed on its
+ * own with a small LZ4 style coder: rows that don't get smaller are kept
+ * as they are, a row the same as the one above is only stored once.
+ * Showing one unpacks it a row at a time on its way to the screen.
+ */
+
+struct packed_row {
+	uint32_t	 offset;	/* into data */
+	uint32_t	 length;	/* row_bytes if stored as is */
+};
+
+struct packed_image {
+	const char	*path;
+	uint32_t	 x, y, width, height;	/* placement on the screen */
+	uint32_t	 row_bytes;
+	struct display_cmap cmap;	/* count 0 unless BLIT_FMT_CI8 */
+	struct packed_row *rows;
+	uint8_t		*data;
+	size_t		 bytes;		/* all of it, for the budget */
+	uint32_t	 unpacked;	/* offset of the row in the scratch */
+	TAILQ_ENTRY(packed_image) lru;
+};
+
+struct packcache {
+	bool		 enabled;
+	uint64_t	 budget;
+	uint64_t	 used;
+	uint32_t	 pixel_bytes;
+	TAILQ_HEAD(packed_image_head, packed_image) images; /* recent first */
+
+	/* packer's scratch */
+	uint16_t	*hash;
+	uint8_t		*row;
+	size_t		 row_size;
+
+	uint64_t	 hits;
+};
+
+bool	packcache_init(struct packcache *, uint64_t, uint32_t);
+void	packcache_free(struct packcache *);
+bool	packcache_has(struct packcache *, const char *);
+struct packed_image *packcache_get(struct packcache *, const char *);
+bool	packcache_put(struct packcache *, const char *, uint32_t, uint32_t,
+	    uint32_t, uint32_t, const uint8_t *, size_t,
+	    const struct display_cmap *);
+const uint8_t *packcache_row(struct packed_image *, uint32_t, uint8_t *);
+
+#endif	/* _PACKCACHE_H */
@@ -0,0 +1,532 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "playlist.h"
+
+#define PLAYLIST_ARGS		0	/* paths from the command line */
+#define PLAYLIST_LISTING	1	/* a directory's, subdirectories end in / */
+#define PLAYLIST_FILE		2
+#define PLAYLIST_DIR		3
+
+/* the first this many bytes of a playlist file tell how it is separated */
+#define PLAYLIST_SNIFF		4096
+
+#define PLAYLIST_CHUNK		(64 * 1024)
+
+struct playlist_chunk {
+	struct playlist_chunk	*next;
+	size_t			 used, size;
+	char			 data[];
+};
+
+/* what is taken from directories; the loader goes by the contents */
+static const char *playlist_suffixes[] = {
+	".png",
+	".qoi",
+	".ff",
+	".farbfeld",
+	".pam",
+	".pbm",
+	".pgm",
+	".ppm",
+	".pnm",
+	NULL
+};
+
+
+void
+playlist_init(struct playlist *pl)
+{
+	memset(pl, 0, sizeof(*pl));
+}
+
+
+void
+playlist_free(struct playlist *pl)
+{
+	struct playlist_chunk *chunk;
+	struct playlist_source *src;
+	size_t i;
+
+	for (i = 0; i < pl->queued; i++) {
+		src = &pl->queue[i];
+		if (src->type != PLAYLIST_FILE)
+			continue;
+		if (src->mapped)
+			munmap(src->map, src->size);
+		else
+			free(src->map);
+	}
+	for (i = 0; i < pl->depth; i++)
+		if (pl->stack[i].type == PLAYLIST_LISTING)
+			free(pl->stack[i].names);
+	while ((chunk = pl->chunks) != NULL) {
+		pl->chunks = chunk->next;
+		free(chunk);
+	}
+	free(pl->queue);
+	free(pl->stack);
+	free(pl->paths);
+	playlist_init(pl);
+}
+
+
+/* room for a string that lives as long as the playlist */
+static char *
+playlist_alloc(struct playlist *pl, size_t len)
+{
+	struct playlist_chunk *chunk;
+	size_t size;
+
+	chunk = pl->chunks;
+	if ((chunk == NULL) || (chunk->size - chunk->used < len)) {
+		size = (len > PLAYLIST_CHUNK) ? len : PLAYLIST_CHUNK;
+		chunk = malloc(sizeof(*chunk) + size);
+		if (chunk == NULL)
+			return NULL;
+		chunk->used = 0;
+		chunk->size = size;
+		chunk->next = pl->chunks;
+		pl->chunks = chunk;
+	}
+	chunk->used += len;
+	return chunk->data + chunk->used - len;
+}
+
+
+static bool
+playlist_grow(void **array, size_t *size, size_t elem, size_t first)
+{
+	size_t nsize;
+	void *p;
+
+	nsize = *size ? *size * 2 : first;
+	p = realloc(*array, nsize * elem);
+	if (p == NULL)
+		return false;
+	*array = p;
+	*size = nsize;
+	return true;
+}
+
+
+static bool
+playlist_queue(struct playlist *pl, struct playlist_source *src)
+{
+	if ((pl->queued == pl->queue_size) && !playlist_grow(
+	    (void **) &pl->queue, &pl->queue_size, sizeof(*src), 8))
+		return false;
+	pl->queue[pl->queued++] = *src;
+	return true;
+}
+
+
+static bool
+playlist_push(struct playlist *pl, struct playlist_source *src)
+{
+	if ((pl->depth == pl->stack_size) && !playlist_grow(
+	    (void **) &pl->stack, &pl->stack_size, sizeof(*src), 8))
+		return false;
+	pl->stack[pl->depth++] = *src;
+	return true;
+}
+
+
+static void
+playlist_pop(struct playlist *pl)
+{
+	struct playlist_source *src;
+
+	src = &pl->stack[--pl->depth];
+	if (src->type == PLAYLIST_LISTING)
+		free(src->names);
+}
+
+
+static bool
+playlist_append(struct playlist *pl, char *path)
+{
+	if ((pl->count == pl->size) && !playlist_grow((void **) &pl->paths,
+	    &pl->size, sizeof(*pl->paths), 1024))
+		return false;
+	pl->paths[pl->count++] = path;
+	return true;
+}
+
+
+/* paths as given on the command line, files or directories */
+bool
+playlist_add_paths(struct playlist *pl, char **paths, size_t count)
+{
+	struct playlist_source src;
+
+	memset(&src, 0, sizeof(src));
+	src.type = PLAYLIST_ARGS;
+	src.names = paths;
+	src.count = count;
+	return playlist_queue(pl, &src);
+}
+
+
+/* a playlist file, `-' for standard input */
+bool
+playlist_add_file(struct playlist *pl, const char *file)
+{
+	struct playlist_source src;
+	struct stat st;
+	size_t size;
+	ssize_t len;
+	char *p;
+	int fd;
+
+	memset(&src, 0, sizeof(src));
+	src.type = PLAYLIST_FILE;
+	fd = (strcmp(file, "-") == 0) ? dup(STDIN_FILENO) : open(file, O_RDONLY);
+	if ((fd < 0) || (fstat(fd, &st) == -1)) {
+		perror(file);
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	/* private, the separators are overwritten to end the paths */
+	if (S_ISREG(st.st_mode) && (st.st_size > 0)) {
+		src.map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE, fd, 0);
+		if (src.map != MAP_FAILED) {
+			src.size = st.st_size;
+			src.mapped = true;
+			posix_madvise(src.map, src.size, POSIX_MADV_SEQUENTIAL);
+		} else {
+			src.map = NULL;
+		}
+	}
+	/* pipes and the like are read whole */
+	if (!src.mapped && !S_ISREG(st.st_mode)) {
+		size = 0;
+		for (;;) {
+			if ((src.size == size) && !playlist_grow((void **) &src.map,
+			    &size, 1, PLAYLIST_CHUNK))
+				break;
+			len = read(fd, src.map + src.size, size - src.size);
+			if ((len < 0) && (errno == EINTR))
+				continue;
+			if (len <= 0)
+				break;
+			src.size += len;
+		}
+	}
+	close(fd);
+
+	p = NULL;
+	if (src.map != NULL)
+		p = memchr(src.map, '\0', (src.size < PLAYLIST_SNIFF) ?
+		    src.size : PLAYLIST_SNIFF);
+	src.sep = (p != NULL) ? '\0' : '\n';
+	if (!playlist_queue(pl, &src)) {
+		if (src.mapped)
+			munmap(src.map, src.size);
+		else
+			free(src.map);
+		return false;
+	}
+	return true;
+}
+
+
+/* next path from a playlist file, NULL at its end */
+static char *
+playlist_file_next(struct playlist *pl, struct playlist_source *src)
+{
+	char *start, *end, *path;
+	size_t len;
+
+	while (src->pos < src->size) {
+		start = src->map + src->pos;
+		end = memchr(start, src->sep, src->size - src->pos);
+		if (end != NULL) {
+			len = end - start;
+			src->pos += len + 1;
+			path = start;
+		} else {
+			/* no room to end the last one in the file */
+			len = src->size - src->pos;
+			src->pos = src->size;
+			path = playlist_alloc(pl, len + 1);
+			if (path == NULL)
+				return NULL;
+			memcpy(path, start, len);
+		}
+		if ((src->sep == '\n') && (len > 0) && (path[len - 1] == '\r'))
+			len--;
+		path[len] = '\0';
+
+		/* blank lines and m3u style comments */
+		if ((len > 0) && ((src->sep != '\n') || (path[0] != '#')))
+			return path;
+	}
+	return NULL;
+}
+
+
+static bool
+playlist_wanted(const char *name)
+{
+	size_t len, slen;
+	int i;
+
+	len = strlen(name);
+	for (i = 0; playlist_suffixes[i] != NULL; i++) {
+		slen = strlen(playlist_suffixes[i]);
+		if ((len > slen) &&
+		    (strcasecmp(name + len - slen, playlist_suffixes[i]) == 0))
+			return true;
+	}
+	return false;
+}
+
+
+/* names in order, with runs of digits compared as numbers */
+static int
+playlist_cmp(const void *a, const void *b)
+{
+	const unsigned char *p, *q;
+	size_t n, m;
+	int r;
+
+	p = *(const unsigned char * const *) a;
+	q = *(const unsigned char * const *) b;
+	while (*p && *q) {
+		if (isdigit(*p) && isdigit(*q)) {
+			while (*p == '0')
+				p++;
+			while (*q == '0')
+				q++;
+			for (n = 0; isdigit(p[n]); n++)
+				;
+			for (m = 0; isdigit(q[m]); m++)
+				;
+			if (n != m)
+				return (n < m) ? -1 : 1;
+			if ((r = memcmp(p, q, n)) != 0)
+				return r;
+			p += n;
+			q += m;
+			continue;
+		}
+		if (*p != *q)
+			return *p - *q;
+		p++;
+		q++;
+	}
+	if (*p != *q)
+		return *p - *q;
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+
+/*
+ * Turn a directory source into the listing of the images and the
+ * subdirectories in it; false if there is nothing to list.
+ */
+static bool
+playlist_read_dir(struct playlist *pl, struct playlist_source *src)
+{
+	struct dirent *de;
+	struct stat st;
+	const char *dir;
+	char **names, *path;
+	size_t count, size, dlen, nlen;
+	bool isdir;
+	DIR *d;
+
+	dir = src->dir;
+	d = opendir(dir);
+	if (d == NULL) {
+		perror(dir);
+		return false;
+	}
+	dlen = strlen(dir);
+	if ((dlen > 0) && (dir[dlen - 1] == '/'))
+		dlen--;
+
+	names = NULL;
+	count = size = 0;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		isdir = (de->d_type == DT_DIR);
+		if (!isdir && (de->d_type != DT_UNKNOWN) &&
+		    (de->d_type != DT_LNK) && !playlist_wanted(de->d_name))
+			continue;
+
+		nlen = strlen(de->d_name);
+		path = playlist_alloc(pl, dlen + nlen + 3);
+		if (path == NULL)
+			break;
+		memcpy(path, dir, dlen);
+		path[dlen] = '/';
+		memcpy(path + dlen + 1, de->d_name, nlen + 1);
+
+		/* symbolic links to directories are left out, no loops */
+		if ((de->d_type == DT_UNKNOWN) || (de->d_type == DT_LNK)) {
+			if (((de->d_type == DT_UNKNOWN) ? lstat(path, &st) :
+			    stat(path, &st)) == -1)
+				continue;
+			isdir = S_ISDIR(st.st_mode) && (de->d_type == DT_UNKNOWN);
+			if (!isdir && (S_ISDIR(st.st_mode) ||
+			    !playlist_wanted(de->d_name)))
+				continue;
+		}
+		if (isdir)
+			strcpy(path + dlen + 1 + nlen, "/");
+
+		if ((count == size) && !playlist_grow((void **) &names, &size,
+		    sizeof(*names), 64))
+			break;
+		names[count++] = path;
+	}
+	closedir(d);
+
+	if (count == 0) {
+		free(names);
+		return false;
+	}
+	qsort(names, count, sizeof(*names), playlist_cmp);
+	src->type = PLAYLIST_LISTING;
+	src->names = names;
+	src->count = count;
+	src->next = 0;
+	return true;
+}
+
+
+/* the images so far are all there will be */
+static void
+playlist_oom(struct playlist *pl)
+{
+	fprintf(stderr, "Out of memory, playlist cut at %zu images\n",
+	    pl->count);
+	pl->complete = true;
+}
+
+
+/* read the sources on until there are `want' paths or no more */
+static void
+playlist_fill(struct playlist *pl, size_t want)
+{
+	struct playlist_source *src, sub;
+	struct stat st;
+	char *path;
+	size_t len;
+
+	while ((pl->count < want) && !pl->complete) {
+		if (pl->depth == 0) {
+			if (pl->queue_next == pl->queued)
+				pl->complete = true;
+			else if (!playlist_push(pl, &pl->queue[pl->queue_next++]))
+				playlist_oom(pl);
+			continue;
+		}
+
+		src = &pl->stack[pl->depth - 1];
+		path = NULL;
+		memset(&sub, 0, sizeof(sub));
+		sub.type = PLAYLIST_DIR;
+		switch (src->type) {
+		case PLAYLIST_DIR:
+			if (!playlist_read_dir(pl, src))
+				playlist_pop(pl);
+			continue;
+		case PLAYLIST_FILE:
+			path = playlist_file_next(pl, src);
+			break;
+		case PLAYLIST_ARGS:
+			if (src->next == src->count)
+				break;
+			path = src->names[src->next++];
+			/* missing files are reported when they are shown */
+			if ((stat(path, &st) == 0) && S_ISDIR(st.st_mode)) {
+				sub.dir = path;
+				path = NULL;
+			}
+			break;
+		case PLAYLIST_LISTING:
+			if (src->next == src->count)
+				break;
+			path = src->names[src->next++];
+			len = strlen(path);
+			if (path[len - 1] == '/') {
+				sub.dir = path;
+				path = NULL;
+			}
+			break;
+		}
+
+		if (sub.dir != NULL) {
+			if (!playlist_push(pl, &sub))
+				playlist_oom(pl);
+		} else if (path != NULL) {
+			if (!playlist_append(pl, path))
+				playlist_oom(pl);
+		} else {
+			playlist_pop(pl);
+		}
+	}
+}
+
+
+/* path of image i counting from 0, NULL past the end */
+char *
+playlist_path(struct playlist *pl, size_t i)
+{
+	if (i >= pl->count)
+		playlist_fill(pl, i + 1);
+	return (i < pl->count) ? pl->paths[i] : NULL;
+}
+
+
+/* all the images there are, reading everything still to be read */
+size_t
+playlist_count(struct playlist *pl)
+{
+	playlist_fill(pl, SIZE_MAX);
+	return pl->count;
+}
@@ -0,0 +1,85 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PLAYLIST_H
+#define _PLAYLIST_H
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The images to step through, by index. Paths come from the command
+ * line, from playlist files and from directories; they are collected
+ * into one array as navigation gets to them, so a playlist of millions
+ * of entries or a directory tree of an archive costs nothing at startup.
+ *
+ * Playlist files are mapped, not read, and hold one path per line or
+ * NUL separated paths as `find -print0' writes them; the paths are used
+ * where they are in the mapping. Directories are read when the viewer
+ * gets to them, sorted with numbers in names compared as numbers, and
+ * their subdirectories in turn.
+ */
+
+/* where paths still come from, read in order */
+struct playlist_source {
+	int		 type;		/* PLAYLIST_* in playlist.c */
+	char		**names;	/* the command line, a directory's */
+	size_t		 count, next;
+	char		*map;		/* playlist file, `size' bytes */
+	size_t		 size, pos;
+	bool		 mapped;	/* rather than read into memory */
+	char		 sep;		/* '\n' or '\0' */
+	const char	*dir;		/* directory not read yet */
+};
+
+struct playlist_chunk;
+
+struct playlist {
+	char		**paths;
+	size_t		 count, size;
+	bool		 complete;	/* all sources read */
+
+	/* the queue of sources and the ones being read, innermost last */
+	struct playlist_source *queue;
+	size_t		 queued, queue_next, queue_size;
+	struct playlist_source *stack;
+	size_t		 depth, stack_size;
+
+	/* strings for directory entries */
+	struct playlist_chunk *chunks;
+};
+
+void	playlist_init(struct playlist *);
+void	playlist_free(struct playlist *);
+bool	playlist_add_paths(struct playlist *, char **, size_t);
+bool	playlist_add_file(struct playlist *, const char *);
+char	*playlist_path(struct playlist *, size_t);
+size_t	playlist_count(struct playlist *);
+
+#endif	/* _PLAYLIST_H */
@@ -0,0 +1,401 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#ifndef NO_STDINT
+#	include <stdint.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "png_codec.h"
+#include "png_batch.h"
+
+
+struct png_batch_job {
+	struct png_batch_job	*next;
+	struct png_batch_result	 result;
+	int			 cancel;	/* asked to stop */
+	char			 path[];
+};
+
+struct png_batch {
+	pthread_mutex_t		 lock;
+	pthread_cond_t		 work;		/* a job was queued, or stop */
+	pthread_cond_t		 done;		/* a result was queued */
+
+	struct png_batch_job	*queue, **queue_tail;
+	struct png_batch_job	*running;
+	struct png_batch_job	*results, **results_tail;
+	int			 pending;	/* submitted, not collected */
+	int			 next_id;
+	int			 stopping;
+	int			 flags;
+	uint32_t		 max_width, max_height;
+	uint32_t		 display_gamma;
+
+	png_batch_hook		 hook;
+	png_batch_release	 release;
+	void			*hook_arg;
+
+	int			 nworkers;
+	pthread_t		*workers;
+};
+
+
+static int
+png_batch_cancelled(struct png_batch *batch, struct png_batch_job *job) {
+	int cancel;
+
+	pthread_mutex_lock(&batch->lock);
+	cancel = job->cancel;
+	pthread_mutex_unlock(&batch->lock);
+	return cancel;
+}
+
+
+static void
+png_batch_decode(struct png_batch *batch, struct png_batch_job *job) {
+	struct png_batch_result *result = &job->result;
+	png_file_status status;
+	uint32_t max_width, max_height;
+	int fh;
+
+	max_width = batch->max_width;
+	max_height = batch->max_height;
+
+	if (png_batch_cancelled(batch, job))
+		goto cancelled;
+	fh = open(job->path, O_RDONLY);
+	if (fh < 0) {
+		result->error = errno;
+		result->status = PNG_FILE_ERROR | PNG_FILE_BAD_FILEHANDLE;
+		return;
+	}
+
+	if ((batch->flags & PNG_BATCH_PROBE) || max_width || max_height) {
+		status = png_probe(fh, &result->header);
+		if (batch->flags & PNG_BATCH_PROBE) {
+			close(fh);
+			result->status = status;
+			return;
+		}
+		/* what isn't a sound png is left to the loader to report */
+		if (!(status & PNG_FILE_ERROR) &&
+		    ((max_width && (result->header.width > max_width)) ||
+		     (max_height && (result->header.height > max_height)))) {
+			close(fh);
+			result->status = PNG_FILE_ERROR | PNG_FILE_IMP_LIMIT;
+			return;
+		}
+	}
+
+	result->info = png_create_png_context();
+	if (!result->info) {
+		close(fh);
+		result->status = PNG_FILE_ERROR | PNG_FILE_OUT_OF_MEM;
+		return;
+	}
+	png_set_display_gamma(result->info, batch->display_gamma);
+	status = png_start_loading(result->info, fh);
+	while (status & PNG_FILE_LOADING) {
+		if (png_batch_cancelled(batch, job))
+			break;
+		status = png_load_a_piece(result->info);
+	}
+	close(fh);
+	if (png_batch_cancelled(batch, job))
+		goto cancelled;
+
+	if (!(status & PNG_FILE_ERROR) && (batch->flags & PNG_BATCH_RGBA32))
+		status = png_convert_to_rgba32(result->info, 0);
+	result->status = status;
+	if (!(status & PNG_FILE_ERROR) && batch->hook)
+		batch->hook(result, batch->hook_arg);
+	return;
+
+cancelled:
+	png_dispose_png(result->info);
+	result->info = NULL;
+	result->status = PNG_FILE_ERROR;
+	result->cancelled = 1;
+}
+
+
+/* with the lock held */
+static void
+png_batch_complete(struct png_batch *batch, struct png_batch_job *job) {
+	job->next = NULL;
+	*batch->results_tail = job;
+	batch->results_tail = &job->next;
+	pthread_cond_signal(&batch->done);
+}
+
+
+static void *
+png_batch_worker(void *arg) {
+	struct png_batch *batch = arg;
+	struct png_batch_job *job, **pjob;
+
+	pthread_mutex_lock(&batch->lock);
+	for (;;) {
+		while (!batch->queue && !batch->stopping)
+			pthread_cond_wait(&batch->work, &batch->lock);
+		if (batch->stopping)
+			break;
+
+		job = batch->queue;
+		batch->queue = job->next;
+		if (!batch->queue)
+			batch->queue_tail = &batch->queue;
+		job->next = batch->running;
+		batch->running = job;
+		pthread_mutex_unlock(&batch->lock);
+
+		png_batch_decode(batch, job);
+
+		pthread_mutex_lock(&batch->lock);
+		for (pjob = &batch->running; *pjob != job; pjob = &(*pjob)->next)
+			;
+		*pjob = job->next;
+		png_batch_complete(batch, job);
+	}
+	pthread_mutex_unlock(&batch->lock);
+	return NULL;
+}
+
+
+static void
+png_batch_free_jobs(struct png_batch *batch, struct png_batch_job *job) {
+	struct png_batch_job *next;
+
+	for (; job; job = next) {
+		next = job->next;
+		png_dispose_png(job->result.info);
+		if (job->result.data && batch->release)
+			batch->release(job->result.data, batch->hook_arg);
+		free(job);
+	}
+}
+
+
+struct png_batch *
+png_batch_create(int workers, int flags) {
+	struct png_batch *batch;
+	sigset_t all, old;
+	long online;
+
+	if (workers <= 0) {
+		online = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = (online > 0) ? (int) online : 1;
+	}
+
+	batch = calloc(1, sizeof(struct png_batch));
+	if (!batch)
+		return NULL;
+	batch->workers = calloc(workers, sizeof(pthread_t));
+	if (!batch->workers) {
+		free(batch);
+		return NULL;
+	}
+	pthread_mutex_init(&batch->lock, NULL);
+	pthread_cond_init(&batch->work, NULL);
+	pthread_cond_init(&batch->done, NULL);
+	batch->queue_tail = &batch->queue;
+	batch->results_tail = &batch->results;
+	batch->flags = flags;
+	batch->display_gamma = PNG_GAMMA_DISPLAY;
+
+	png_init();
+
+	/* signals stay with the caller's threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (; batch->nworkers < workers; batch->nworkers++) {
+		if (pthread_create(&batch->workers[batch->nworkers], NULL,
+		    png_batch_worker, batch) != 0)
+			break;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (!batch->nworkers) {
+		png_batch_destroy(batch);
+		return NULL;
+	}
+	return batch;
+}
+
+
+void
+png_batch_destroy(struct png_batch *batch) {
+	struct png_batch_job *queued;
+	int i;
+
+	if (!batch)
+		return;
+
+	pthread_mutex_lock(&batch->lock);
+	queued = batch->queue;
+	batch->queue = NULL;
+	batch->queue_tail = &batch->queue;
+	batch->stopping = 1;
+	pthread_cond_broadcast(&batch->work);
+	pthread_mutex_unlock(&batch->lock);
+
+	/* jobs being decoded still end up in the results */
+	for (i = 0; i < batch->nworkers; i++)
+		pthread_join(batch->workers[i], NULL);
+
+	png_batch_free_jobs(batch, queued);
+	png_batch_free_jobs(batch, batch->results);
+
+	pthread_cond_destroy(&batch->done);
+	pthread_cond_destroy(&batch->work);
+	pthread_mutex_destroy(&batch->lock);
+	free(batch->workers);
+	free(batch);
+}
+
+
+/* to be set before the first job is submitted */
+void
+png_batch_set_hook(struct png_batch *batch, png_batch_hook hook,
+    png_batch_release release, void *arg) {
+	batch->hook = hook;
+	batch->release = release;
+	batch->hook_arg = arg;
+}
+
+
+/* likewise */
+void
+png_batch_set_limit(struct png_batch *batch, uint32_t width, uint32_t height) {
+	batch->max_width = width;
+	batch->max_height = height;
+}
+
+
+/* what the images are converted for, before anything is submitted */
+void
+png_batch_set_display_gamma(struct png_batch *batch, uint32_t gamma) {
+	batch->display_gamma = gamma;
+}
+
+
+int
+png_batch_workers(struct png_batch *batch) {
+	return batch->nworkers;
+}
+
+
+int
+png_batch_submit(struct png_batch *batch, const char *path, void *arg) {
+	struct png_batch_job *job;
+	size_t len;
+	int id;
+
+	len = strlen(path);
+	job = calloc(1, sizeof(struct png_batch_job) + len + 1);
+	if (!job)
+		return -1;
+	memcpy(job->path, path, len + 1);
+	job->result.arg = arg;
+
+	pthread_mutex_lock(&batch->lock);
+	id = job->result.id = batch->next_id++;
+	*batch->queue_tail = job;
+	batch->queue_tail = &job->next;
+	batch->pending++;
+	pthread_cond_signal(&batch->work);
+	pthread_mutex_unlock(&batch->lock);
+
+	return id;
+}
+
+
+int
+png_batch_next(struct png_batch *batch, struct png_batch_result *result, int wait) {
+	struct png_batch_job *job;
+
+	pthread_mutex_lock(&batch->lock);
+	while (!batch->results && wait && batch->pending)
+		pthread_cond_wait(&batch->done, &batch->lock);
+	job = batch->results;
+	if (job) {
+		batch->results = job->next;
+		if (!batch->results)
+			batch->results_tail = &batch->results;
+		batch->pending--;
+	}
+	pthread_mutex_unlock(&batch->lock);
+
+	if (!job)
+		return 0;
+	*result = job->result;
+	free(job);
+	return 1;
+}
+
+
+/* submitted jobs whose results have not been collected yet */
+int
+png_batch_pending(struct png_batch *batch) {
+	int pending;
+
+	pthread_mutex_lock(&batch->lock);
+	pending = batch->pending;
+	pthread_mutex_unlock(&batch->lock);
+	return pending;
+}
+
+
+void
+png_batch_cancel(struct png_batch *batch, int id) {
+	struct png_batch_job *job, **pjob;
+
+	pthread_mutex_lock(&batch->lock);
+	for (pjob = &batch->queue; (job = *pjob); pjob = &job->next) {
+		if (job->result.id != id)
+			continue;
+		*pjob = job->next;
+		if (!*pjob)
+			batch->queue_tail = pjob;
+		job->result.status = PNG_FILE_ERROR;
+		job->result.cancelled = 1;
+		png_batch_complete(batch, job);
+		break;
+	}
+	for (job = batch->running; job; job = job->next)
+		if (job->result.id == id)
+			job->cancel = 1;
+	pthread_mutex_unlock(&batch->lock);
+}
@@ -0,0 +1,89 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PNG_BATCH_H
+#define _PNG_BATCH_H
+
+#include "png_codec.h"
+
+/*
+ * Decodes files on a pool of worker threads. Paths go in with
+ * png_batch_submit(), finished contexts come back out of a completion
+ * queue in the order they complete, not the order they were submitted.
+ */
+
+#define PNG_BATCH_RGBA32	0x01	/* png_convert_to_rgba32() when loaded */
+#define PNG_BATCH_PROBE		0x02	/* png_probe() only, no info */
+
+struct png_batch;
+
+struct png_batch_result {
+	struct png_info	*info;		/* NULL if it never got loading */
+	png_file_status	 status;
+	int		 error;		/* errno if the file didn't open */
+	int		 cancelled;	/* by png_batch_cancel(), no info */
+	int		 id;		/* as returned by png_batch_submit() */
+	struct png_header header;	/* when probed */
+	void		*arg;
+	void		*data;		/* what the hook made of it */
+	size_t		 data_size;	/* and its size, for accounting */
+};
+
+/*
+ * Optional work done on the worker after a file loaded without error. The
+ * hook may take over result->info and leave its product in result->data;
+ * the release function disposes of products nobody collected.
+ */
+typedef void (*png_batch_hook)(struct png_batch_result *, void *);
+typedef void (*png_batch_release)(void *, void *);
+
+/*
+ * With a limit set, files whose header says they are bigger fail with
+ * PNG_FILE_IMP_LIMIT without being decoded; 0 is no limit.
+ */
+
+/*
+ * workers 0 is one per online CPU. png_batch_submit() numbers the jobs
+ * from 0, -1 if out of memory. png_batch_next() hands out one result,
+ * waiting for it if asked to and any are outstanding; 0 if there is none.
+ * Results are the caller's to png_dispose_png(); destroying the batch
+ * drops jobs not started yet and disposes of uncollected results.
+ * Every job yields one result, a cancelled one too: a queued job is
+ * not started, a running one stops at its next piece.
+ */
+extern struct png_batch *png_batch_create(int workers, int flags);
+extern void png_batch_destroy(struct png_batch *batch);
+
+extern void png_batch_set_hook(struct png_batch *batch, png_batch_hook hook, png_batch_release release, void *arg);
+extern void png_batch_set_limit(struct png_batch *batch, uint32_t width, uint32_t height);
+extern void png_batch_set_display_gamma(struct png_batch *batch, uint32_t gamma);
+extern int png_batch_workers(struct png_batch *batch);
+extern int png_batch_submit(struct png_batch *batch, const char *path, void *arg);
+extern int png_batch_next(struct png_batch *batch, struct png_batch_result *result, int wait);
+extern int png_batch_pending(struct png_batch *batch);
+extern void png_batch_cancel(struct png_batch *batch, int id);
+
+#endif	/* _PNG_BATCH_H */
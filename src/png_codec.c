@@ -40,8 +40,14 @@
 #include <errno.h>
 #include <unistd.h>
 #include <assert.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
 
 #include "png_codec.h"
+#include "png_kernels.h"
+#include "raw_codec.h"
+#include "probes.h"
 
 
 #define BUFFER_SIZE	(32*1024)
@@ -56,6 +62,8 @@
 #define LOADER_STATE_IHDR		 3
 #define LOADER_STATE_READ_IDATS		 4
 #define LOADER_STATE_FINISHED		 5
+#define LOADER_STATE_RAW_HEADER		 6	/* not a PNG, see raw_codec.h */
+#define LOADER_STATE_RAW_DATA		 7
 #define LOADER_STATE_ERROR		99
 
 
@@ -65,6 +73,7 @@
 #define BLOCK_LD_STATE_READ_BLK		 2
 #define BLOCK_LD_STATE_READ_CRC		 3
 #define BLOCK_LD_STATE_FINISHED		 4
+#define BLOCK_LD_STATE_SKIP		 5
 #define BLOCK_LD_STATE_ERROR		99
 
 
@@ -75,6 +84,7 @@
 #define FILTER_LD_STATE_STARTLINE	 3
 #define FILTER_LD_STATE_FILTERMODE	 4
 #define FILTER_LD_STATE_INLINE	 	 5
+#define FILTER_LD_STATE_FINISHED	 6
 
 
 /* saver state machine */
@@ -85,6 +95,9 @@
 #define SAVER_STATE_SEND_MISC_BLOCKS	 4
 #define SAVER_STATE_START_SENDING_IDATS	 5
 #define SAVER_STATE_SEND_IDATS		 6
+#define SAVER_STATE_SEND_FCTL		 7
+#define SAVER_STATE_FRAME_DONE		 8
+#define SAVER_STATE_SEND_IEND		 9
 #define SAVER_STATE_FINISHED		98
 #define SAVER_STATE_ERROR		99
 
@@ -111,6 +124,10 @@
 #define BLOCK_TYPE_TIME		(0x454d4954)
 #define BLOCK_TYPE_PHYS		(0x53594850)
 #define BLOCK_TYPE_TRNS		(0x534e5254)
+#define BLOCK_TYPE_SRGB		(0x42475253)
+#define BLOCK_TYPE_ACTL		(0x4c544341)
+#define BLOCK_TYPE_FCTL		(0x4c544346)
+#define BLOCK_TYPE_FDAT		(0x54414446)
 
 
 /* block flags */
@@ -118,6 +135,10 @@
 #define BLOCK_PRIVATE		 2
 #define BLOCK_NON_CONFORMING	 4
 #define BLOCK_SAFE_TO_COPY	 8
+#define BLOCK_SKIPPED		16	/* ancillary, not interpreted */
+
+/* PNG limits chunks to 2^31 - 1 bytes */
+#define BLOCK_MAX_LENGTH	0x7fffffff
 
 
 /* mixed endian macro's */
@@ -142,16 +163,14 @@
 
 
 /* progressive display help table - as specified for Adam7 interlace */
-uint8_t starting_row[7]  = { 0, 0, 4, 0, 2, 0, 1 };
-uint8_t starting_col[7]  = { 0, 4, 0, 2, 0, 1, 0 };
-uint8_t row_increment[7] = { 8, 8, 8, 4, 4, 2, 2 };
-uint8_t col_increment[7] = { 8, 8, 4, 4, 2, 2, 1 };
-uint8_t block_height[7]  = { 8, 8, 4, 4, 2, 2, 1 };
-uint8_t block_width[7]   = { 8, 4, 4, 2, 2, 1, 1 };
+static const uint8_t starting_row[7]  = { 0, 0, 4, 0, 2, 0, 1 };
+static const uint8_t starting_col[7]  = { 0, 4, 0, 2, 0, 1, 0 };
+static const uint8_t row_increment[7] = { 8, 8, 8, 4, 4, 2, 2 };
+static const uint8_t col_increment[7] = { 8, 8, 4, 4, 2, 2, 1 };
 
 
 /* Samples per pixel indexed by colour type */
-static int8_t samples_per_pixel[8] = {
+static const int8_t samples_per_pixel[8] = {
 	1,	/* 0 : grey		*/
 	0,	/* 1 : illegal		*/
 	3,	/* 2 : RGB colour	*/
@@ -162,6 +181,35 @@ static int8_t samples_per_pixel[8] = {
 	0,	/* 7 : illegal		*/
 };
 
+/* Bit depths the specs allow per colour type, bit n set for depth n */
+static const uint32_t legal_depths[8] = {
+	(1 << 1) | (1 << 2) | (1 << 4) | (1 << 8) | (1 << 16),
+	0,
+	(1 << 8) | (1 << 16),
+	(1 << 1) | (1 << 2) | (1 << 4) | (1 << 8),
+	(1 << 8) | (1 << 16),
+	0,
+	(1 << 8) | (1 << 16),
+	0,
+};
+
+
+/*
+ * IHDR checks shared by png_probe() and the loader, so the probe never
+ * accepts what the loader would then size wrongly.
+ */
+static int
+png_ihdr_valid(uint32_t width, uint32_t height, uint32_t bpp, uint32_t colourtype,
+    uint32_t compression, uint32_t filter, uint32_t interlace) {
+	if (!width || !height || (width > 0x7fffffff) || (height > 0x7fffffff))
+		return 0;
+	if ((colourtype > 7) || !samples_per_pixel[colourtype])
+		return 0;
+	if ((bpp > 16) || !(legal_depths[colourtype] & (1 << bpp)))
+		return 0;
+	return !compression && !filter && (interlace <= 1);
+}
+
 
 struct png_private {
 	uint32_t	 fhandle;
@@ -197,6 +245,7 @@ struct png_private {
 	uint32_t	 col, row;
 	uint32_t	 pass;
 	uint32_t	 line_pos;
+	uint32_t	 line_length;		/* bytes in a row of the current pass	    */
 	uint8_t		 cur_filtermode;
 	uint8_t		*this_line;		/* pointers to transmit/recieve buffers */
 	uint8_t		*last_line;
@@ -207,70 +256,295 @@ struct png_private {
 
 	uint8_t		*filter_result[5];	/* pointers to tryouts of different filters */
 	int32_t		 filter_effect[5];	/* estimates of the filter efficiency       */
+	int		 save_filter;		/* PNG_SAVE_FILTER_*			    */
+	int		 foreign_blob;		/* blob is not ours to account for	    */
+
+	/* APNG */
+	int		 animate;		/* png_set_animate()			    */
+	uint32_t	 frames;		/* fcTL's seen				    */
+	int		 frame_pending;		/* its data is being decoded		    */
+	int		 idat_seen;
+	uint8_t		 ihdr_bpp;		/* for frames after conversion		    */
+	uint8_t		 ihdr_colourtype;
+	uint32_t	 sequence;		/* of the next fcTL or fdAT written	    */
+	uint32_t	 actl_pos;		/* in the file, for the frame count	    */
+	struct png_rect	 save_rect;		/* part of the blob being written	    */
+
+	/* QOI, farbfeld and PNM */
+	struct raw_state raw;
 };
 
 
-static struct png_info *
-allocate_png_info(void) {
-	return calloc(1, sizeof(struct png_info));
+/*
+ * Accounting allocator. Every block carries its size in front of it so
+ * that frees can be counted; the totals are kept over all contexts and in
+ * the png_stats of the context the block belongs to, if any. The totals are
+ * the only state contexts share, they are kept under a lock.
+ */
+#define MEM_HEADER	16		/* keeps the block aligned for anything */
+
+static struct png_memory png_memory;
+static pthread_mutex_t png_memory_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *
+png_alloc(struct png_info *info, size_t size, int clear) {
+	uint8_t *block;
+
+	/* reserve first so racing allocations can't overshoot the limit */
+	pthread_mutex_lock(&png_memory_lock);
+	if (png_memory.limit && (png_memory.current + size > png_memory.limit)) {
+		pthread_mutex_unlock(&png_memory_lock);
+		return NULL;
+	}
+	png_memory.current += size;
+	if (png_memory.current > png_memory.peak)
+		png_memory.peak = png_memory.current;
+	pthread_mutex_unlock(&png_memory_lock);
+
+	if (clear)
+		block = calloc(1, size + MEM_HEADER);
+	else
+		block = malloc(size + MEM_HEADER);
+	if (!block) {
+		pthread_mutex_lock(&png_memory_lock);
+		png_memory.current -= size;
+		pthread_mutex_unlock(&png_memory_lock);
+		return NULL;
+	}
+	*((size_t *) block) = size;
+
+	if (info) {
+		info->stats.mem_current += size;
+		if (info->stats.mem_current > info->stats.mem_peak)
+			info->stats.mem_peak = info->stats.mem_current;
+	}
+
+	return block + MEM_HEADER;
 }
 
 
 static void
-free_png_info(struct png_info *png_info) {
-	free(png_info);
+png_release(struct png_info *info, void *ptr) {
+	uint8_t *block;
+	size_t size;
+
+	if (!ptr)
+		return;
+	block = (uint8_t *) ptr - MEM_HEADER;
+	size = *((size_t *) block);
+
+	pthread_mutex_lock(&png_memory_lock);
+	png_memory.current -= size;
+	pthread_mutex_unlock(&png_memory_lock);
+	if (info)
+		info->stats.mem_current -= size;
+	free(block);
 }
 
 
-static uint8_t *
-allocate_image(uint32_t size) {
-	return calloc(1, size);
+/* zlib's allocations count against the context too */
+static voidpf
+png_zalloc(voidpf opaque, uInt items, uInt size) {
+	struct png_info *info = opaque;
+	void *ptr;
+
+	ptr = NULL;
+	if (!size || (items <= ((size_t) -1 - MEM_HEADER) / size))
+		ptr = png_alloc(info, (size_t) items * size, 0);
+	if (!ptr)
+		info->filestate |= PNG_FILE_OUT_OF_MEM;
+	return ptr ? ptr : Z_NULL;
 }
 
 
 static void
-free_image(uint8_t *image) {
-	free(image);
+png_zfree(voidpf opaque, voidpf ptr) {
+	png_release(opaque, ptr);
+}
+
+
+void
+png_get_memory(struct png_memory *memory) {
+	pthread_mutex_lock(&png_memory_lock);
+	*memory = png_memory;
+	pthread_mutex_unlock(&png_memory_lock);
+}
+
+
+void
+png_set_memory_limit(uint64_t limit) {
+	pthread_mutex_lock(&png_memory_lock);
+	png_memory.limit = limit;
+	pthread_mutex_unlock(&png_memory_lock);
 }
 
 
 /*
- * CRC stuff following ISO 3309
+ * Gamma correction. Only images that say how they are encoded get it;
+ * when that is as good as what the display does, the tables are left out.
  */
-static uint32_t crc_table[256];
+#define GAMMA_SLACK	0.01
 
-static void
-make_crc_table(void) {
-	uint32_t c;
-	int n, k;
-
-	for (n=0; n<256; n++) {
-		c = (uint32_t) n;
-		for (k=0; k < 8; k++) {
-			if (c & 1)
-				c = 0xedb88320 ^ (c >> 1);
-			else
-				c = (c >> 1);
-			;
-		}
-		crc_table[n] = c;
+void
+png_set_display_gamma(struct png_info *info, uint32_t gamma) {
+	info->display_gamma = gamma;
+}
+
+
+/*
+ * Ancillary chunks the loader has no use for are only read when their
+ * CRC is to be checked; otherwise they are seeked over.
+ */
+static int png_check_skipped = 0;
+
+void
+png_set_check_skipped(int check) {
+	png_check_skipped = check;
+}
+
+
+/*
+ * The chunks the loader has no use for and so doesn't assemble: unknown
+ * ancillary ones, APNG's unless animating and the default image of an
+ * animation that isn't its first frame.
+ */
+static int
+png_block_skipped(struct png_info *info) {
+	struct png_private *png_private = info->png_private;
+
+	switch (png_private->cur_block_type) {
+	case BLOCK_TYPE_IHDR:
+	case BLOCK_TYPE_IEND:
+	case BLOCK_TYPE_PLTE:
+	case BLOCK_TYPE_TRNS:
+	case BLOCK_TYPE_BKGD:
+	case BLOCK_TYPE_GAMA:
+	case BLOCK_TYPE_SRGB:
+		return 0;
+	case BLOCK_TYPE_IDAT:
+		return png_private->animate && info->is_animated && !png_private->frames;
+	case BLOCK_TYPE_ACTL:
+	case BLOCK_TYPE_FCTL:
+		return !png_private->animate;
+	case BLOCK_TYPE_FDAT:
+		return !png_private->animate || !png_private->frame_pending;
 	}
+	return png_private->cur_block_flags & BLOCK_ANCILLARY;
 }
 
 
-static uint32_t
-update_crc(uint32_t crc, uint8_t *buf, int len) {
-	uint32_t c = crc;
-	int n;
+/* what the samples are raised to, 0 if nothing needs doing */
+static double
+png_gamma_exponent(struct png_info *info) {
+	double exponent;
+	uint32_t gamma;
+
+	gamma = info->has_srgb ? PNG_GAMMA_SRGB : info->gamma;
+	if (!info->display_gamma || !(info->has_srgb || info->has_gamma) || !gamma)
+		return 0;
+	exponent = 1e10 / ((double) gamma * info->display_gamma);
+	if (fabs(exponent - 1.0) < GAMMA_SLACK)
+		return 0;
+	return exponent;
+}
+
+
+int
+png_gamma_table8(struct png_info *info, uint8_t *table) {
+	double exponent;
+	int i;
+
+	exponent = png_gamma_exponent(info);
+	for (i = 0; i < 256; i++)
+		table[i] = exponent ? (uint8_t) (255.0 * pow(i / 255.0, exponent) + 0.5) : i;
+	return exponent != 0;
+}
+
 
-	for(n=0; n < len; n++) {
-		c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+int
+png_gamma_table16(struct png_info *info, uint16_t *table) {
+	double exponent;
+	int i;
+
+	exponent = png_gamma_exponent(info);
+	for (i = 0; i < 256; i++)
+		table[i] = exponent ? (uint16_t) (65535.0 * pow(i / 255.0, exponent) + 0.5) : i * 0x101;
+	return exponent != 0;
+}
+
+
+/* a 16 bit sample through a table for 8 bit ones, exact for linear ones */
+static inline uint64_t
+png_trans16(const uint16_t *trans, uint32_t val) {
+	uint32_t index, frac;
+
+	index = val / 257;
+	frac = val - 257 * index;
+	if (!frac)
+		return trans[index];
+	return trans[index] + ((int32_t) trans[index+1] - trans[index]) * (int32_t) frac / 257;
+}
+
+
+static struct png_info *
+allocate_png_info(void) {
+	struct png_info *info;
+
+	/* a context accounts for itself */
+	info = png_alloc(NULL, sizeof(struct png_info), 1);
+	if (info)
+		info->stats.mem_current = info->stats.mem_peak = sizeof(struct png_info);
+	return info;
+}
+
+
+static void
+free_png_info(struct png_info *png_info) {
+	png_release(NULL, png_info);
+}
+
+
+static uint8_t *
+allocate_image(struct png_info *info, uint32_t size) {
+	return png_alloc(info, size, 1);
+}
+
+
+/* blobs handed in by png_populate_with_image() came from plain malloc() */
+static void
+free_image(struct png_info *info, uint8_t *image) {
+	if (info->png_private && info->png_private->foreign_blob) {
+		free(image);
+		info->png_private->foreign_blob = 0;
+		return;
 	}
-	return c;
+	png_release(info, image);
 }
+
+
 /*
- * End of CRC stuff
+ * CRC following ISO 3309, by whatever png_kernels_init() found fastest
  */
+static inline uint32_t
+update_crc(uint32_t crc, uint8_t *buf, int len) {
+	return png_kernels.crc(crc, buf, len);
+}
+
+
+/*
+ * Stage timing for struct png_stats
+ */
+static inline uint64_t
+png_clock(void) {
+#ifndef PNG_NO_STATS
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+	return 0;
+#endif
+}
 
 
 /*
@@ -292,13 +566,48 @@ PaethPredictor(uint8_t a, uint8_t b, uint8_t c) {
 }
 
 
+png_file_status
+png_set_save_filter(struct png_info *info, int filter) {
+	if (!info || !info->png_private)
+		return PNG_FILE_ERROR;
+	if ((filter < PNG_SAVE_FILTER_NONE) || (filter > PNG_SAVE_FILTER_ADAPTIVE))
+		return PNG_FILE_ERROR;
+	if (info->filestate & PNG_FILE_SAVING)
+		return PNG_FILE_ERROR;
+
+	info->png_private->save_filter = filter;
+	return info->filestate;
+}
+
+
+/* before png_start_loading() or png_start_saving() */
+png_file_status
+png_set_animate(struct png_info *info, int animate) {
+	if (!info || !info->png_private)
+		return PNG_FILE_ERROR;
+	if (info->filestate & (PNG_FILE_LOADING | PNG_FILE_SAVING))
+		return PNG_FILE_ERROR;
+
+	info->png_private->animate = animate;
+	return info->filestate;
+}
+
+
+static pthread_once_t png_init_once = PTHREAD_ONCE_INIT;
+
+static void
+png_init_kernels(void) {
+	png_kernels_init(PNG_KERNELS_AUTO);
+}
+
+
 /*
- * Provide two allocation functions to allow for special cached memory
- * management as found in the Artdraw library
+ * One time set up. Safe to call from any thread any number of times;
+ * png_create_png_context() does so itself.
  */
 void
 png_init(void) {
-	make_crc_table();
+	pthread_once(&png_init_once, png_init_kernels);
 }
 
 
@@ -308,35 +617,39 @@ png_create_png_context(void) {
 	struct png_private *png_private;
 	int index;
 
+	png_init();
+
+	/* both come cleared */
 	info = allocate_png_info();
 	if (!info)
 		return NULL;
+	info->display_gamma = PNG_GAMMA_DISPLAY;
 
-	/* we got a png_info structure ! -> clear for sure */
-	memset(info, 0, sizeof(struct png_info));
-
-	png_private = info->png_private = calloc(1, sizeof(struct png_private));
+	png_private = info->png_private = png_alloc(info, sizeof(struct png_private), 1);
 	if (!png_private) {
 		free_png_info(info);
 		return NULL;
 	}
-	memset(png_private, 0, sizeof(struct png_private));
 
 	/* initialise structure */
 	png_private->buf_length = png_private->blk_cache_pos = png_private->z_buf_pos = 0;
 
-	png_private->buffer	= malloc(BUFFER_SIZE+1);
-	png_private->blk_cache	= malloc(ASSEMBLE_SIZE+1);
-	png_private->z_buf	= malloc(ZBUF_SIZE+1);
+	png_private->buffer	= png_alloc(info, BUFFER_SIZE+1, 0);
+	png_private->blk_cache	= png_alloc(info, ASSEMBLE_SIZE+1, 0);
+	png_private->z_buf	= png_alloc(info, ZBUF_SIZE+1, 0);
 	if (png_private->buffer && png_private->blk_cache && png_private->z_buf) {
 		info->filestate = PNG_FILE_CLEAR;
 		png_private->fhandle = -1;
+		png_private->zlib_state.zalloc = png_zalloc;
+		png_private->zlib_state.zfree  = png_zfree;
+		png_private->zlib_state.opaque = info;
 
 		/* initialise state machines */
 		png_private->loader_state = LOADER_STATE_OFF;
 		png_private->saver_state  = SAVER_STATE_OFF;
 		png_private->block_state  = BLOCK_LD_STATE_WAIT;
 		png_private->filter_state = FILTER_LD_STATE_WAIT;
+		png_private->save_filter  = PNG_SAVE_FILTER_ADAPTIVE;
 
 		/* initialise palette */
 		for (index=0; index <= 255; index++)
@@ -359,6 +672,8 @@ png_populate_with_image(struct png_info *info, int colourtype, void *blob, int b
 		return PNG_FILE_WOULD_DESTROY;
 
 	info->blob = blob;
+	if (info->png_private)
+		info->png_private->foreign_blob = (blob != NULL);
 	info->colourtype = colourtype;
 	info->width  = width;
 	info->height = height;
@@ -392,7 +707,7 @@ png_populate_and_allocate_empty_image(struct png_info *info, int colourtype, int
 	/* late allocate */
 	png_populate_with_image(info, colourtype, NULL, bpp, width, height);
 	if (info->filestate == PNG_FILE_CLEAR) {
-		info->blob = allocate_image(info->strave * info->height);
+		info->blob = allocate_image(info, info->strave * info->height);
 		info->filestate = PNG_FILE_IS_DRAWABLE;
 	}
 
@@ -400,6 +715,101 @@ png_populate_and_allocate_empty_image(struct png_info *info, int colourtype, int
 }
 
 
+/*
+ * Header only: no context, no allocation and a single small read, so it
+ * can be run over whole playlists. Returns PNG_FILE_FINISHED when IHDR
+ * was sound.
+ */
+png_file_status
+png_probe(int fhandle, struct png_header *header) {
+	static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	uint8_t buf[PNG_PROBE_SIZE], *pos;
+	uint32_t length, type, crc;
+	struct raw_header raw;
+	ssize_t len;
+	size_t at;
+	int format;
+
+	memset(header, 0, sizeof(*header));
+	do {
+		len = pread(fhandle, buf, sizeof(buf), 0);
+	} while ((len < 0) && (errno == EINTR));
+	if (len < 0)
+		return PNG_FILE_ERROR | PNG_FILE_BAD_FILEHANDLE;
+	if ((len < 8) || memcmp(buf, signature, 8)) {
+		/* the other formats the loader knows have nothing past their header */
+		format = raw_sniff(buf, len);
+		if (format == RAW_FORMAT_NONE)
+			return PNG_FILE_ERROR | PNG_FILE_NO_PNG;
+		if (raw_read_header(format, buf, len, &raw) <= 0)
+			return PNG_FILE_ERROR | PNG_FILE_OUT_OF_SPECS;
+		header->width	   = raw.width;
+		header->height	   = raw.height;
+		header->bpp	   = raw.bpp;
+		header->colourtype = raw.colourtype;
+		header->sample_depth = raw.bpp;
+		header->has_gamma  = raw.linear;
+		header->gamma	   = raw.linear ? 100000 : 0;
+		header->complete   = 1;
+		return PNG_FILE_FINISHED;
+	}
+
+	/* IHDR comes first and has to be complete */
+	pos = buf + 8;
+	if ((len < 8 + 12 + 13) || (READ4_BE(pos) != 13) ||
+	    ((READ4_LE(pos+4) & 0xdfdfdfdf) != BLOCK_TYPE_IHDR))
+		return PNG_FILE_ERROR | PNG_FILE_OUT_OF_SPECS;
+	crc = update_crc(0xffffffff, pos+4, 4 + 13) ^ 0xffffffff;
+	if (crc != READ4_BE(pos+8+13))
+		return PNG_FILE_ERROR | PNG_FILE_CRC_ERR;
+
+	pos += 8;
+	header->width	   = READ4_BE(pos+0);
+	header->height	   = READ4_BE(pos+4);
+	header->bpp	   = pos[8];
+	header->colourtype = pos[9];
+	header->interlace  = pos[12];
+	header->sample_depth = header->bpp;
+	if (header->colourtype == PNG_COLOUR_INDEXED)
+		header->sample_depth = 8;
+	if (!png_ihdr_valid(header->width, header->height, header->bpp,
+	    header->colourtype, pos[10], pos[11], header->interlace))
+		return PNG_FILE_ERROR | PNG_FILE_OUT_OF_SPECS;
+
+	/* the chunks up to the image data that made it into the read */
+	at = 8 + 12 + 13;
+	while (at + 8 <= (size_t) len) {
+		pos = buf + at;
+		length = READ4_BE(pos);
+		type = READ4_LE(pos+4) & 0xdfdfdfdf;
+		if ((type == BLOCK_TYPE_IDAT) || (type == BLOCK_TYPE_IEND)) {
+			header->complete = 1;
+			break;
+		}
+		if ((at + 12 > (size_t) len) || (length > (size_t) len - at - 12))
+			break;
+		pos += 8;
+		if (type == BLOCK_TYPE_PLTE)
+			header->palette_size = length / 3;
+		if (type == BLOCK_TYPE_TRNS)
+			header->has_transparancy = 1;
+		if (type == BLOCK_TYPE_BKGD)
+			header->has_backgroundcolour = 1;
+		if ((type == BLOCK_TYPE_GAMA) && (length == 4)) {
+			header->gamma = READ4_BE(pos);
+			header->has_gamma = (header->gamma != 0);
+		}
+		if ((type == BLOCK_TYPE_SRGB) && (length == 1))
+			header->has_srgb = 1;
+		if ((type == BLOCK_TYPE_ACTL) && (length == 8))
+			header->num_frames = READ4_BE(pos);
+		at += length + 12;
+	}
+
+	return PNG_FILE_FINISHED;
+}
+
+
 png_file_status
 png_start_loading(struct png_info *info, int fhandle) {
 	if (!fhandle)
@@ -409,6 +819,7 @@ png_start_loading(struct png_info *info, int fhandle) {
 		info->filestate = PNG_FILE_LOADING;
 		info->png_private->fhandle = fhandle;
 		info->png_private->loader_state = LOADER_STATE_START;
+		WSDV_LOAD_START(info, fhandle);
 		return info->filestate;
 	}
 
@@ -427,6 +838,10 @@ png_start_saving(struct png_info *info, int fhandle) {
 			info->png_private->fhandle = fhandle;
 			info->png_private->saver_state = SAVER_STATE_START;
 			info->png_private->filter_state = FILTER_SA_STATE_WAIT;
+			info->png_private->save_rect.x = 0;
+			info->png_private->save_rect.y = 0;
+			info->png_private->save_rect.width  = info->width;
+			info->png_private->save_rect.height = info->height;
 		}
 	}
 
@@ -442,20 +857,25 @@ png_dispose_png(struct png_info *info) {
 	if (info) {
 		png_private = info->png_private;
 		if (info->blob)
-			free_image(info->blob);
+			free_image(info, info->blob);
 
 		if (png_private) {
-			if (png_private->buffer)	free(png_private->buffer);
-			if (png_private->blk_cache)	free(png_private->blk_cache);
-			if (png_private->z_buf)		free(png_private->z_buf);
-			if (png_private->lines[0])	free(png_private->lines[0]);
-			if (png_private->lines[1])	free(png_private->lines[1]);
-			if (png_private->packed_line)	free(png_private->packed_line);
-			for (index=0; index<5; index++) {
-				if (png_private->filter_result[index])
-					free(png_private->filter_result[index]);
+			/* a load or save that was abandoned halfway */
+			if (png_private->zlib_state.state != NULL) {
+				if (png_private->loader_state != LOADER_STATE_OFF)
+					inflateEnd(&png_private->zlib_state);
+				else
+					deflateEnd(&png_private->zlib_state);
 			}
-			free(info->png_private);
+			png_release(info, png_private->buffer);
+			png_release(info, png_private->blk_cache);
+			png_release(info, png_private->z_buf);
+			png_release(info, png_private->lines[0]);
+			png_release(info, png_private->lines[1]);
+			png_release(info, png_private->packed_line);
+			for (index=0; index<5; index++)
+				png_release(info, png_private->filter_result[index]);
+			png_release(info, info->png_private);
 			info->png_private = NULL;
 		}
 		free_png_info(info);
@@ -464,46 +884,110 @@ png_dispose_png(struct png_info *info) {
 }
 
 
-/* Process the decrunched idat piece in the blk_cache buffer */
+/* Put a defiltered row of the current pass where it belongs in the image */
+static void
+png_store_row(struct png_info *info, uint8_t *line) {
+	struct png_private *png_private;
+	uint8_t		*screen_line, *screen;
+	uint32_t	 col, dcol, bit, offset, colour, mask;
+	int		 pixel_bits, bytes_per_pixel;
+
+	/* shortcut */
+	png_private = info->png_private;
+
+/* XXX change me for pixel pusher XXX */
+	screen_line = info->blob + (size_t) info->strave*png_private->row;
+	if (!info->interlace) {
+		memcpy(screen_line, line, png_private->line_length);
+		return;
+	}
+
+	pixel_bits = info->bpp * info->samples_per_pixel;
+	col  = starting_col[png_private->pass];
+	dcol = col_increment[png_private->pass];
+	if (pixel_bits >= 8) {
+		bytes_per_pixel = pixel_bits/8;
+		screen = screen_line + col*bytes_per_pixel;
+		for (; col < info->width; col += dcol) {
+			memcpy(screen, line, bytes_per_pixel);
+			screen += dcol*bytes_per_pixel;
+			line += bytes_per_pixel;
+		}
+		return;
+	}
+
+	/* sub byte pixels are packed MSB first and or'ed into the cleared blob */
+	mask = (1 << pixel_bits)-1;
+	for (bit = 0; col < info->width; col += dcol, bit += pixel_bits) {
+		colour = (line[bit >> 3] >> (8-pixel_bits-(bit & 7))) & mask;
+		offset = col*pixel_bits;
+		screen_line[offset >> 3] |= colour << (8-pixel_bits-(offset & 7));
+	}
+}
+
+
+/*
+ * Process the decrunched idat piece in the z_buf; rows are gathered whole
+ * and then defiltered and stored by the selected kernels.
+ */
 static int
 png_process_idat_in_blk_cache(struct png_info *info) {
 	struct png_private *png_private;
 	uint8_t		*recycled;
-	uint8_t		*pos, *thislinepos, *lastlinepos, *screen, *screen_line;
-	uint8_t		 this_byte, left_byte, top_byte, topleft_byte, result;
-	uint32_t	 colour;
-	uint32_t	 consumed, pixel_bit_offset, subpixel_mask;
-	int		 leave, leave_line, bytes_per_pixel, pixels_per_byte;
-	int		 bpp, subpixel, index, dcol, drow;
+	uint32_t	 pos, length, pass_width, pass_height;
+	int		 pixel_bits, bytes_per_pixel;
 
 	/* shortcut */
 	png_private = info->png_private;
 
 	/* some used `constants' */
-	bpp = info->bpp;
-	subpixel_mask = (1 << bpp)-1;
+	pixel_bits = info->bpp * info->samples_per_pixel;
+	bytes_per_pixel = (pixel_bits+7)/8;
 
-	/* status variables */
-	consumed = 0;
-	leave = 0;
-	while (!leave) {
+	pos = 0;
+	while (pos < png_private->z_buf_pos) {
 		/* do the filter state machine */
 		switch (png_private->filter_state) {
 			case FILTER_LD_STATE_WAIT :
 				fprintf(stderr, "Filter state: i shouldn't be here\n");
+				pos = png_private->z_buf_pos;
 				break;
 			case FILTER_LD_STATE_START :
 				png_private->pass = 0;			/* specs start with 1 */
 				png_private->filter_state = FILTER_LD_STATE_START_PASS;
 				/* fall trough */
 			case FILTER_LD_STATE_START_PASS :
+				/* passes without pixels have no filter bytes either */
+				pass_width  = info->width;
+				pass_height = info->height;
+				while (info->interlace && (png_private->pass < 7)) {
+					pass_width  = 0;
+					pass_height = 0;
+					if (info->width > starting_col[png_private->pass])
+						pass_width = (info->width - starting_col[png_private->pass] +
+						    col_increment[png_private->pass]-1) / col_increment[png_private->pass];
+					if (info->height > starting_row[png_private->pass])
+						pass_height = (info->height - starting_row[png_private->pass] +
+						    row_increment[png_private->pass]-1) / row_increment[png_private->pass];
+					if (pass_width && pass_height)
+						break;
+					png_private->pass++;
+				}
+				if (png_private->pass >= (info->interlace ? 7 : 1)) {
+					/* whatever follows the last row is ignored */
+					png_private->filter_state = FILTER_LD_STATE_FINISHED;
+					break;
+				}
+
 				png_private->this_line = png_private->lines[0];
 				png_private->last_line = png_private->lines[1];
 				png_private->row = 0;
 				if (info->interlace) png_private->row = starting_row[png_private->pass];
+				png_private->line_length = ((uint64_t) pass_width*pixel_bits + 7)/8;
 				/* clear the old memories */
-				memset(png_private->this_line, 0, info->strave + 16);
-				memset(png_private->last_line, 0, info->strave + 16);
+				memset(png_private->this_line, 0, png_private->line_length + 16);
+				memset(png_private->last_line, 0, png_private->line_length + 16);
+				WSDV_PASS_START(info, png_private->pass);
 
 				png_private->filter_state = FILTER_LD_STATE_STARTLINE;
 				/* fall trough */
@@ -511,142 +995,143 @@ png_process_idat_in_blk_cache(struct png_info *info) {
 				recycled = png_private->last_line;
 				png_private->last_line = png_private->this_line;
 				png_private->this_line = recycled;
-				png_private->col = 0;
-				if (info->interlace) png_private->col = starting_col[png_private->pass];
 				png_private->line_pos = 0;
 				png_private->filter_state = FILTER_LD_STATE_FILTERMODE;
 				/* fall trough */
 			case FILTER_LD_STATE_FILTERMODE :
-				if (png_private->z_buf_pos >= 1) {
-					png_private->cur_filtermode = *png_private->z_buf;
-					consumed++;
-					png_private->filter_state = FILTER_LD_STATE_INLINE;
-					if (png_private->cur_filtermode>4) {
-						fprintf(stderr, "HAR! found undefined PNG filtermode %d\n", png_private->cur_filtermode);
-						png_private->block_state  = BLOCK_LD_STATE_ERROR;
-						info->filestate |=  PNG_FILE_OUT_OF_SPECS;
-						leave = 1;
-					}
-				} else {
-					leave = 1;
+				png_private->cur_filtermode = png_private->z_buf[pos++];
+				if (png_private->cur_filtermode>4) {
+					fprintf(stderr, "HAR! found undefined PNG filtermode %d\n", png_private->cur_filtermode);
+					png_private->block_state  = BLOCK_LD_STATE_ERROR;
+					info->filestate |=  PNG_FILE_OUT_OF_SPECS;
+					png_private->z_buf_pos = 0;
+					return 0;
 				}
+				png_private->filter_state = FILTER_LD_STATE_INLINE;
 				break;
 			case FILTER_LD_STATE_INLINE :
-				/* set some usefull variables */
-				dcol = 1; drow = 1;
-				if (info->interlace) {
-					dcol = col_increment[png_private->pass];
-					drow = row_increment[png_private->pass];
-				}
+				/* gather the row; the lines have 8 bytes of slack in front */
+				length = png_private->line_length - png_private->line_pos;
+				if (length > png_private->z_buf_pos - pos)
+					length = png_private->z_buf_pos - pos;
+				memcpy(png_private->this_line + 8 + png_private->line_pos,
+				    png_private->z_buf + pos, length);
+				pos += length;
+				png_private->line_pos += length;
+				if (png_private->line_pos < png_private->line_length)
+					break;
 
-				/* bytes_per_pixel is the number of bytes nessisary for at least one pixel */
-				bytes_per_pixel = (info->sample_depth * info->samples_per_pixel)/8;
-				if (bytes_per_pixel == 0)
-					bytes_per_pixel = 1;
-				pixels_per_byte = (8/bpp);
+				/* call me paranoid */
+				if ((png_private->row >= info->height) ||
+				    (png_private->line_length > info->strave)) {
+					png_private->block_state  = BLOCK_LD_STATE_ERROR;
+					info->filestate |=  PNG_FILE_IMP_LIMIT;
+					png_private->z_buf_pos = 0;
+					return 0;
+				}
+				if (png_private->cur_filtermode)
+					png_kernels.unfilter[png_private->cur_filtermode](
+					    png_private->this_line + 8, png_private->last_line + 8,
+					    png_private->line_length, bytes_per_pixel);
+				png_store_row(info, png_private->this_line + 8);
+
+				/* next line !!!! */
+				WSDV_ROW_DONE(info, png_private->pass, png_private->row);
+				png_private->row += info->interlace ? row_increment[png_private->pass] : 1;
+				if (png_private->row >= info->height) {
+					png_private->pass++;
+					png_private->filter_state = FILTER_LD_STATE_START_PASS;
+				} else {
+					png_private->filter_state = FILTER_LD_STATE_STARTLINE;
+				}
+				break;
+			case FILTER_LD_STATE_FINISHED :
+				pos = png_private->z_buf_pos;
+				break;
+		}
+	}
+	png_private->z_buf_pos = 0;
 
-				/* update the pointers */
-				pos = png_private->z_buf;
-				thislinepos = png_private->this_line + png_private->line_pos + 8;
-				lastlinepos = png_private->last_line + png_private->line_pos + 8;
-/* XXX change me for pixel pusher XXX */
-				screen_line = info->blob + info->strave*png_private->row;
-				screen = screen_line + bytes_per_pixel*png_private->col;
-				leave_line = 0;
-				while ((png_private->z_buf_pos - consumed >= bytes_per_pixel) && !leave_line) {
-					/* copy the raw bytes into the line */
-					for(index=0; index < bytes_per_pixel; index++) {
-						this_byte    = thislinepos[index] = pos[index];
-						left_byte    = thislinepos[index-bytes_per_pixel];
-						top_byte     = lastlinepos[index];
-						topleft_byte = lastlinepos[index-bytes_per_pixel];
-						/* apply the filters */
-						result = this_byte;
-						switch (png_private->cur_filtermode) {
-							case 0 : /* None	*/
-								break;
-							case 1 : /* Sub		*/
-								result += left_byte;
-								break;
-							case 2 : /* Up		*/
-								result += top_byte;
-								break;
-							case 3 : /* Average	*/
-								result += (left_byte + top_byte)/2;
-								break;
-							case 4 : /* Paeth	*/
-								result += PaethPredictor(left_byte, top_byte, topleft_byte);
-								break;
-						}
-						/*
-						 * this is not well documented in the specs; the filter
-						 * method is done on bytes but the packed bytes need to be
-						 * distributed according to the interlace method
-						 * anyway... in pixels !
-						 */
-						if (pixels_per_byte > 1) {
-							for(subpixel=0; subpixel<pixels_per_byte; subpixel++) {
-								pixel_bit_offset = bpp*png_private->col;
-								screen = screen_line + (pixel_bit_offset>>3);
-								colour = (result >> (8-bpp)) & subpixel_mask;
+	return 0;
+}
 
-								/* call me paranoid */
-								assert(screen < info->blob + (info->strave * info->height));
 
-/* XXX change me for pixel pusher XXX */
-								*screen |= (colour << (8-(pixel_bit_offset & 7)-bpp));
-								result = result << bpp;
-								png_private->col += dcol;
-							}
-						} else {
-							/* call me paranoid */
-							assert(screen+index < info->blob + (info->strave * info->height));
+/*
+ * Take on the frame an fcTL describes. When it comes before the image
+ * data the default image is the first frame and decodes as usual; later
+ * frames get a blob of their own size for their fdAT's.
+ */
+static int
+png_start_frame(struct png_info *info) {
+	struct png_private *png_private;
+	struct png_frame frame;
+	uint8_t *pos;
+	int ok;
 
-/* XXX change me for pixel pusher XXX */
-							screen[index] = result;
-						}
-						thislinepos[index] = result;
-					}
-					thislinepos += bytes_per_pixel;
-					lastlinepos += bytes_per_pixel;
-					consumed += bytes_per_pixel;
-					pos += bytes_per_pixel;
-					png_private->line_pos += bytes_per_pixel;
+	/* shortcut */
+	png_private = info->png_private;
 
-					if (pixels_per_byte <= 1) {
-						png_private->col += dcol;
-						screen += dcol*bytes_per_pixel;
-					}
+	if (png_private->cur_block_length != 26) {
+		info->filestate |= PNG_FILE_OUT_OF_SPECS;
+		return 1;
+	}
+	pos = png_private->blk_cache;
+	frame.rect.width  = READ4_BE(pos+ 4);
+	frame.rect.height = READ4_BE(pos+ 8);
+	frame.rect.x	  = READ4_BE(pos+12);
+	frame.rect.y	  = READ4_BE(pos+16);
+	frame.delay_num	  = READ2_BE(pos+20);
+	frame.delay_den	  = READ2_BE(pos+22);
+	frame.dispose_op  = pos[24];
+	frame.blend_op	  = pos[25];
+	frame.index	  = png_private->frames;
+
+	/* inside the canvas, the first frame all of it */
+	ok  = frame.rect.width && frame.rect.height;
+	ok &= (frame.rect.x < info->canvas_width) && (frame.rect.y < info->canvas_height);
+	ok &= (frame.rect.width  <= info->canvas_width  - frame.rect.x);
+	ok &= (frame.rect.height <= info->canvas_height - frame.rect.y);
+	ok &= (frame.dispose_op <= PNG_DISPOSE_PREVIOUS) && (frame.blend_op <= PNG_BLEND_OVER);
+	if (!png_private->frames)
+		ok &= (frame.rect.width == info->canvas_width) && (frame.rect.height == info->canvas_height);
+	if (!ok) {
+		info->filestate |= PNG_FILE_OUT_OF_SPECS;
+		return 1;
+	}
+	/* there is nothing before the first frame to go back to */
+	if (!png_private->frames && (frame.dispose_op == PNG_DISPOSE_PREVIOUS))
+		frame.dispose_op = PNG_DISPOSE_BACKGROUND;
 
-					if (png_private->col >= info->width) {
-						/* next line !!!! */
-/* XXX change me for pixel pusher : we can do it here too! XXX */
-						png_private->row += drow;
-						if (png_private->row >= info->height) {
-							png_private->pass++;	/* XXX why here ? XXX */
-							png_private->filter_state = FILTER_LD_STATE_START_PASS;
-						} else {
-							png_private->filter_state = FILTER_LD_STATE_STARTLINE;
-						}
-						leave_line = 1;
-					}
-				}
-				/* dont forget we have consumed as much as possible */
-				if (!leave_line) leave = 1;
-				break;
-		}
+	png_private->frames++;
+	png_private->frame_pending = 1;
+	info->frame = frame;
+	if (!png_private->idat_seen)
+		return 0;
 
-		if (consumed) {
-			/* fprintf(stderr, "line: consumed %d bytes\n", consumed); */
-			if (consumed)
-				memmove(png_private->z_buf, png_private->z_buf+consumed, png_private->z_buf_pos-consumed);
-			png_private->z_buf_pos -= consumed;
-			consumed = 0;
-		}
-		if (png_private->z_buf_pos == 0)
-			leave=1;
+	/* conversion may have had its way with the last one */
+	if (info->blob)
+		free_image(info, info->blob);
+	info->width		= frame.rect.width;
+	info->height		= frame.rect.height;
+	info->bpp		= png_private->ihdr_bpp;
+	info->colourtype	= png_private->ihdr_colourtype;
+	info->sample_depth	= info->bpp;
+	if (info->colourtype == PNG_COLOUR_INDEXED)
+		info->sample_depth = 8;
+	info->samples_per_pixel	= samples_per_pixel[info->colourtype];
+	info->strave		= (info->width * info->bpp * info->samples_per_pixel+7)/8;
+	info->blob		= allocate_image(info, info->strave * info->height);
+	if (!info->blob) {
+		info->filestate |= PNG_FILE_OUT_OF_MEM;
+		return 1;
 	}
 
+	png_private->filter_state = FILTER_LD_STATE_START;
+	png_private->z_buf_pos = 0;
+	if (inflateReset(&png_private->zlib_state) != Z_OK) {
+		info->filestate |= PNG_FILE_ZLIB_ERR;
+		return 1;
+	}
 	return 0;
 }
 
@@ -654,10 +1139,11 @@ png_process_idat_in_blk_cache(struct png_info *info) {
 static png_file_status
 png_loader_statemachine(struct png_info *info) {
 	struct png_private *png_private;
-	uint32_t consumed;
+	uint32_t consumed, skip, at;
 	uint32_t crc, rgb;
 	uint8_t  *pos, A;
 	int	  ok, leave, zresult, index, colourtype;
+	uint64_t  started, now, stride;
 
 	/* shortcut */
 	png_private = info->png_private;
@@ -688,10 +1174,10 @@ png_loader_statemachine(struct png_info *info) {
 					/* check for interesting flags */
 					png_private->cur_block_flags  = 0;
 					pos = png_private->buffer+4;	/* process block type */
-					if (pos[0] && 32) png_private->cur_block_flags |= BLOCK_ANCILLARY;
-					if (pos[1] && 32) png_private->cur_block_flags |= BLOCK_PRIVATE;
-					if (pos[2] && 32) png_private->cur_block_flags |= BLOCK_NON_CONFORMING;
-					if (pos[3] && 32) png_private->cur_block_flags |= BLOCK_SAFE_TO_COPY;
+					if (pos[0] & 32) png_private->cur_block_flags |= BLOCK_ANCILLARY;
+					if (pos[1] & 32) png_private->cur_block_flags |= BLOCK_PRIVATE;
+					if (pos[2] & 32) png_private->cur_block_flags |= BLOCK_NON_CONFORMING;
+					if (pos[3] & 32) png_private->cur_block_flags |= BLOCK_SAFE_TO_COPY;
 
 					pos[0] = pos[0] & 223;
 					pos[1] = pos[1] & 223;
@@ -699,10 +1185,23 @@ png_loader_statemachine(struct png_info *info) {
 					pos[3] = pos[3] & 223;
 
 					png_private->cur_block_type   = READ4_LE(png_private->buffer+4);
+					WSDV_CHUNK_START(info, png_private->cur_block_type,
+					    png_private->cur_block_length);
 
 					consumed = 8;
 
 					png_private->block_state = BLOCK_LD_STATE_READ_BLK;
+					if (png_private->cur_block_length > BLOCK_MAX_LENGTH) {
+						info->filestate |= PNG_FILE_OUT_OF_SPECS;
+						png_private->block_state = BLOCK_LD_STATE_ERROR;
+					} else if (png_block_skipped(info)) {
+						png_private->cur_block_flags |= BLOCK_SKIPPED;
+						if (!png_check_skipped) {
+							/* CRC and all */
+							png_private->cur_block_left += 4;
+							png_private->block_state = BLOCK_LD_STATE_SKIP;
+						}
+					}
 				} else {
 					leave = 1;
 				}
@@ -714,9 +1213,14 @@ png_loader_statemachine(struct png_info *info) {
 					consumed = png_private->cur_block_left;
 				png_private->cur_block_left -= consumed;
 
+				started = png_clock();
 				png_private->cur_running_crc = update_crc(png_private->cur_running_crc, png_private->buffer, consumed);
+				info->stats.crc_ns += png_clock() - started;
 
-				if (png_private->cur_block_type != BLOCK_TYPE_IDAT) {
+				if (png_private->cur_block_flags & BLOCK_SKIPPED) {
+					/* only checked */
+				} else if ((png_private->cur_block_type != BLOCK_TYPE_IDAT) &&
+				    (png_private->cur_block_type != BLOCK_TYPE_FDAT)) {
 					/* assemble block */
 					if (png_private->blk_cache_pos + consumed < ASSEMBLE_SIZE) {
 						memcpy(png_private->blk_cache+png_private->blk_cache_pos, png_private->buffer, consumed);
@@ -734,27 +1238,44 @@ png_loader_statemachine(struct png_info *info) {
 					 * that the lib could give a zlib error when something is wrong in the
 					 * datastream where it otherwise would give a CRC error right away.
 					 */
-					png_private->zlib_state.next_in   = png_private->buffer;
-					png_private->zlib_state.avail_in  = consumed;
+					skip = 0;
+					if (png_private->cur_block_type == BLOCK_TYPE_FDAT) {
+						/* fdAT's start with their sequence number */
+						at = png_private->cur_block_length - png_private->cur_block_left - consumed;
+						if (at < 4)
+							skip = (consumed < 4 - at) ? consumed : 4 - at;
+					}
+					png_private->zlib_state.next_in   = png_private->buffer + skip;
+					png_private->zlib_state.avail_in  = consumed - skip;
 					/* process until all input is consumed */
-					do {
+					ok = (png_private->zlib_state.avail_in > 0);
+					while (ok) {
 						png_private->zlib_state.next_out  = png_private->z_buf + png_private->z_buf_pos;
 						png_private->zlib_state.avail_out = ZBUF_SIZE - png_private->z_buf_pos;
+						WSDV_INFLATE_START(info, png_private->zlib_state.avail_in);
+						started = png_clock();
 						zresult = inflate(&png_private->zlib_state, Z_SYNC_FLUSH);
+						now = png_clock();
+						WSDV_INFLATE_DONE(info, png_private->zlib_state.avail_in,
+						    ZBUF_SIZE - png_private->z_buf_pos - png_private->zlib_state.avail_out,
+						    zresult);
+						info->stats.inflate_ns += now - started;
 						if ((zresult == Z_OK) || (zresult == Z_STREAM_END)) {
+							info->stats.bytes_inflated += ZBUF_SIZE - png_private->z_buf_pos - png_private->zlib_state.avail_out;
 							png_private->z_buf_pos = ZBUF_SIZE - png_private->zlib_state.avail_out;
 							/* process the stuff in the output buffer */
 							if (png_process_idat_in_blk_cache(info)) {
 								info->filestate |= PNG_FILE_IDAT_ERR;
 								png_private->block_state = BLOCK_LD_STATE_ERROR;
 							}
+							info->stats.defilter_ns += png_clock() - now;
 						} else {
 							info->filestate |= PNG_FILE_ZLIB_ERR;
 							png_private->block_state = BLOCK_LD_STATE_ERROR;
 						}
 						ok  = (png_private->block_state != BLOCK_LD_STATE_ERROR);
 						ok &= (png_private->zlib_state.avail_in > 0);
-					} while (ok);
+					}
 				}
 
 				if ((png_private->cur_block_left == 0) && (png_private->block_state == BLOCK_LD_STATE_READ_BLK))
@@ -766,7 +1287,10 @@ png_loader_statemachine(struct png_info *info) {
 			case BLOCK_LD_STATE_READ_CRC :
 				if (png_private->buf_length >=4 ) {
 					crc = READ4_BE(png_private->buffer);
-					if (crc != (png_private->cur_running_crc ^ 0xffffffff)) {
+					ok = (crc == (png_private->cur_running_crc ^ 0xffffffff));
+					WSDV_CHUNK_END(info, png_private->cur_block_type,
+					    png_private->cur_block_length, ok);
+					if (!ok) {
 						info->filestate |=  PNG_FILE_CRC_ERR;
 						png_private->block_state = BLOCK_LD_STATE_ERROR;
 					} else {
@@ -777,6 +1301,20 @@ png_loader_statemachine(struct png_info *info) {
 					leave = 1;
 				}
 				break;
+			case BLOCK_LD_STATE_SKIP :
+				/* what isn't in the buffer png_load_for() seeks over */
+				consumed = png_private->buf_length;
+				if (consumed > png_private->cur_block_left)
+					consumed = png_private->cur_block_left;
+				png_private->cur_block_left -= consumed;
+				if (png_private->cur_block_left == 0) {
+					WSDV_CHUNK_END(info, png_private->cur_block_type,
+					    png_private->cur_block_length, 1);
+					png_private->block_state = BLOCK_LD_STATE_FINISHED;
+				} else {
+					leave = 1;
+				}
+				break;
 			case BLOCK_LD_STATE_FINISHED :
 				break;
 			case BLOCK_LD_STATE_ERROR :
@@ -800,11 +1338,19 @@ png_loader_statemachine(struct png_info *info) {
 					ok = ok && (*pos++ == 10);
 					ok = ok && (*pos++ == 26);
 					ok = ok && (*pos++ == 10);
+					png_private->raw.format = RAW_FORMAT_NONE;
+					if (!ok)
+						png_private->raw.format = raw_sniff(png_private->buffer, png_private->buf_length);
+					if (png_private->raw.format != RAW_FORMAT_NONE) {
+						png_private->loader_state = LOADER_STATE_RAW_HEADER;
+						break;
+					}
 					if (!ok) {
 						info->filestate |= PNG_FILE_NO_PNG;
 						png_private->loader_state = LOADER_STATE_ERROR;
 						/* XXX cleanup XXX */
 						leave = 1;
+						break;
 					}
 					info->filestate = PNG_FILE_LOADING;
 					png_private->loader_state = LOADER_STATE_IDENTIFIED;
@@ -813,8 +1359,6 @@ png_loader_statemachine(struct png_info *info) {
 				break;
 			case LOADER_STATE_IDENTIFIED :
 				/* initialise libz */
-				png_private->zlib_state.zalloc = Z_NULL;
-				png_private->zlib_state.zfree  = Z_NULL;
 				if (inflateInit(&png_private->zlib_state) != Z_OK) {
 					info->filestate |= PNG_FILE_ZLIB_ERR;
 					png_private->loader_state = LOADER_STATE_ERROR;
@@ -847,28 +1391,42 @@ png_loader_statemachine(struct png_info *info) {
 						if (info->colourtype == PNG_COLOUR_INDEXED)
 							info->sample_depth = 8;
 
-						if (info->compression || info->filter || (info->interlace>1)) {
+						if (!png_ihdr_valid(info->width, info->height, info->bpp, info->colourtype,
+						    info->compression, info->filter, info->interlace)) {
 							info->filestate |= PNG_FILE_OUT_OF_SPECS;
 							png_private->loader_state = LOADER_STATE_ERROR;
+							break;
 						}
 
 						/* please sync this code with the `png_populate and allocate_empty image' function! */
 						/* calculate sizes */
 						info->samples_per_pixel = samples_per_pixel[info->colourtype];
-						/* round up strave */
-						info->strave = (info->width * info->bpp * info->samples_per_pixel+7)/8;
+						/* round up strave; row and image have to fit in 32 bits */
+						stride = ((uint64_t) info->width * info->bpp * info->samples_per_pixel + 7) / 8;
+						if ((stride > 0xffffffffULL) || (stride * info->height > 0xffffffffULL)) {
+							info->filestate |= PNG_FILE_IMP_LIMIT;
+							png_private->loader_state = LOADER_STATE_ERROR;
+							break;
+						}
+						info->strave = stride;
+
+						/* a still image is one frame that covers it all */
+						info->canvas_width  = info->frame.rect.width  = info->width;
+						info->canvas_height = info->frame.rect.height = info->height;
+						png_private->ihdr_bpp = info->bpp;
+						png_private->ihdr_colourtype = info->colourtype;
 
 						/* set up picture decoding vars */
 						png_private->filter_state	= FILTER_LD_STATE_START;
 
 						/* allocate blobs; strave has been normalised to bytes */
 /* XXX change me ????? for pixel pusher XXX */
-						info->blob = allocate_image(info->strave * info->height);	/* XXX 12345 XXX */
+						info->blob = allocate_image(info, info->strave * info->height);	/* XXX 12345 XXX */
 						ok = (info->blob != NULL);
 
 						/* allocate some slack space 2*4*2 bytes extra for easy decoding */
-						png_private->lines[0] = allocate_image(info->strave + 16);
-						png_private->lines[1] = allocate_image(info->strave + 16);
+						png_private->lines[0] = allocate_image(info, info->strave + 16);
+						png_private->lines[1] = allocate_image(info, info->strave + 16);
 						ok = ok && ((png_private->lines[0]!=NULL) && (png_private->lines[1]!=NULL));
 						if (!ok) {
 							info->filestate |= PNG_FILE_OUT_OF_MEM;
@@ -891,6 +1449,14 @@ png_loader_statemachine(struct png_info *info) {
 				break;
 			case LOADER_STATE_READ_IDATS :
 				if (png_private->block_state == BLOCK_LD_STATE_FINISHED) {
+					if ((png_private->cur_block_type == BLOCK_TYPE_FCTL) &&
+					    png_private->frame_pending) {
+						/* the frame before is complete, the fcTL waits */
+						png_private->frame_pending = 0;
+						info->filestate |= PNG_FILE_FRAME;
+						leave = 1;
+						break;
+					}
 					png_private->block_state = BLOCK_LD_STATE_START;
 
 					if (png_private->cur_block_type == BLOCK_TYPE_IEND) {
@@ -949,6 +1515,36 @@ png_loader_statemachine(struct png_info *info) {
 						info->has_backgroundcolour = 1;
 						break;
 					}
+					if (png_private->cur_block_type == BLOCK_TYPE_GAMA) {
+						if (png_private->cur_block_length == 4) {
+							info->gamma = READ4_BE(png_private->blk_cache);
+							info->has_gamma = (info->gamma != 0);
+						}
+						break;
+					}
+					if (png_private->cur_block_type == BLOCK_TYPE_SRGB) {
+						if (png_private->cur_block_length == 1) {
+							info->srgb_intent = png_private->blk_cache[0];
+							info->has_srgb = 1;
+						}
+						break;
+					}
+					if (png_private->cur_block_type == BLOCK_TYPE_ACTL) {
+						/* only in front of the image data */
+						if ((png_private->cur_block_length == 8) && !png_private->idat_seen) {
+							info->num_frames = READ4_BE(png_private->blk_cache + 0);
+							info->num_plays  = READ4_BE(png_private->blk_cache + 4);
+							info->is_animated = (info->num_frames > 0);
+						}
+						break;
+					}
+					if (png_private->cur_block_type == BLOCK_TYPE_FCTL) {
+						if (png_start_frame(info))
+							png_private->loader_state = LOADER_STATE_ERROR;
+						break;
+					}
+					if (png_private->cur_block_type == BLOCK_TYPE_IDAT)
+						png_private->idat_seen = 1;
 
 #ifndef NDEBUG
 					if (png_private->cur_block_type != BLOCK_TYPE_IDAT) {
@@ -958,11 +1554,79 @@ png_loader_statemachine(struct png_info *info) {
 
 				}
 				break;
+			case LOADER_STATE_RAW_HEADER :
+				ok = raw_read_header(png_private->raw.format, png_private->buffer,
+						png_private->buf_length, &png_private->raw.header);
+				if (!ok && (png_private->buf_length < BUFFER_SIZE-1)) {
+					leave = 1;
+					break;
+				}
+				if (ok <= 0) {
+					/* a header that doesn't fit the buffer isn't one either */
+					info->filestate |= PNG_FILE_OUT_OF_SPECS;
+					png_private->loader_state = LOADER_STATE_ERROR;
+					break;
+				}
+
+				/* fill in what an IHDR would have said */
+				info->width	  = png_private->raw.header.width;
+				info->height	  = png_private->raw.header.height;
+				info->bpp	  = png_private->raw.header.bpp;
+				info->colourtype  = png_private->raw.header.colourtype;
+				info->compression = info->filter = info->interlace = 0;
+				info->sample_depth = info->bpp;
+				info->samples_per_pixel = samples_per_pixel[info->colourtype];
+				/* row and image have to fit the 32 bit sizes the rest goes by */
+				stride = ((uint64_t) info->width * info->bpp * info->samples_per_pixel + 7) / 8;
+				if ((stride > 0xffffffffULL) || (stride * info->height > 0xffffffffULL)) {
+					info->filestate |= PNG_FILE_IMP_LIMIT;
+					png_private->loader_state = LOADER_STATE_ERROR;
+					break;
+				}
+				info->strave = stride;
+				info->canvas_width  = info->frame.rect.width  = info->width;
+				info->canvas_height = info->frame.rect.height = info->height;
+				png_private->ihdr_bpp = info->bpp;
+				png_private->ihdr_colourtype = info->colourtype;
+
+				/* QOI's linear colour space is a gamma of 1.0 */
+				if (png_private->raw.header.linear) {
+					info->has_gamma = 1;
+					info->gamma = 100000;
+				}
+
+				info->blob = allocate_image(info, info->strave * info->height);
+				if (!info->blob) {
+					info->filestate |= PNG_FILE_OUT_OF_MEM;
+					png_private->loader_state = LOADER_STATE_ERROR;
+					break;
+				}
+				raw_start(&png_private->raw, info->blob, (size_t) info->strave * info->height);
+				info->filestate |= PNG_FILE_IS_DRAWABLE;
+				png_private->loader_state = LOADER_STATE_RAW_DATA;
+				consumed = png_private->raw.header.size;
+				break;
+			case LOADER_STATE_RAW_DATA :
+				started = png_clock();
+				ok = raw_decode(&png_private->raw, png_private->buffer, png_private->buf_length);
+				info->stats.defilter_ns += png_clock() - started;
+				if (ok < 0) {
+					info->filestate |= PNG_FILE_OUT_OF_SPECS;
+					png_private->loader_state = LOADER_STATE_ERROR;
+					break;
+				}
+				consumed = ok;
+				if (png_private->raw.out_pos == png_private->raw.out_size)
+					png_private->loader_state = LOADER_STATE_FINISHED;
+				else
+					leave = 1;
+				break;
 			case LOADER_STATE_FINISHED :
 				inflateEnd(&png_private->zlib_state);
 
 				info->filestate &= ~PNG_FILE_LOADING;
 				info->filestate |=  PNG_FILE_FINISHED;
+				WSDV_LOAD_DONE(info, info->filestate);
 				leave = 1;
 				break;
 			case LOADER_STATE_ERROR :
@@ -970,6 +1634,7 @@ png_loader_statemachine(struct png_info *info) {
 
 				info->filestate &= ~PNG_FILE_LOADING;
 				info->filestate |=  PNG_FILE_ERROR;
+				WSDV_LOAD_DONE(info, info->filestate);
 				leave = 1;
 				break;
 		}
@@ -1029,11 +1694,51 @@ static uint8_t
 }
 
 
+/*
+ * Filter one packed line with the given filter type; `bpp' is the number of
+ * bytes per complete pixel, at least one, as the filters need it.
+ */
+static int32_t
+png_saver_filter_line(uint8_t *out, uint8_t *line, uint8_t *prior, uint32_t length, int bpp, int filtermode) {
+	uint32_t index;
+	uint8_t left, top, topleft, result;
+	int32_t effect;
+
+	effect = 0;
+	for (index = 0; index < length; index++) {
+		left    = (index >= bpp) ? line[index-bpp]  : 0;
+		topleft = (index >= bpp) ? prior[index-bpp] : 0;
+		top     = prior[index];
+		result  = line[index];
+		switch (filtermode) {
+			case 0 : /* None	*/
+				break;
+			case 1 : /* Sub		*/
+				result -= left;
+				break;
+			case 2 : /* Up		*/
+				result -= top;
+				break;
+			case 3 : /* Average	*/
+				result -= (left + top)/2;
+				break;
+			case 4 : /* Paeth	*/
+				result -= (uint8_t) PaethPredictor(left, top, topleft);
+				break;
+		}
+		out[index] = result;
+		/* minimum sum of absolute differences, as the specs suggest */
+		effect += abs((int8_t) result);
+	}
+	return effect;
+}
+
+
 static void
 png_saver_filter_fillup_zbuf(struct png_info *info, struct png_private *png_private) {
 	uint8_t	*recycled, *packed_line, *pl_pos, *screen, *screen_line;
 	uint8_t	*pos;
-	int bpp, subpixel, index, dcol, drow;
+	int bpp, subpixel, index, dcol, drow, filtermode, filter_bpp;
 	int ok, col, leave, bytes_per_pixel, pixels_per_byte;
 	uint32_t result;
 	uint32_t colour;
@@ -1044,6 +1749,14 @@ png_saver_filter_fillup_zbuf(struct png_info *info, struct png_private *png_priv
 	uint32_t pixel_bit_offset, subpixel_mask;
 	uint32_t col32;
 	uint64_t col64;
+	uint32_t width, height;
+	uint8_t *origin;
+
+	/* the whole image, or the part of it an APNG frame covers */
+	width  = png_private->save_rect.width;
+	height = png_private->save_rect.height;
+	origin = info->blob + info->strave * png_private->save_rect.y +
+		(png_private->save_rect.x * info->bpp * info->samples_per_pixel) / 8;
 
 	/* data output starts here */
 	pos = png_private->z_buf + png_private->z_buf_pos;
@@ -1068,16 +1781,16 @@ png_saver_filter_fillup_zbuf(struct png_info *info, struct png_private *png_priv
 				/* allocate some slack space 2*4*2 bytes extra for easy decoding */
 				ok = 1;
 				if (png_private->lines[0] == NULL) {
-					png_private->lines[0] = allocate_image(info->strave + 16);
-					png_private->lines[1] = allocate_image(info->strave + 16);
+					png_private->lines[0] = allocate_image(info, info->strave + 16);
+					png_private->lines[1] = allocate_image(info, info->strave + 16);
 					ok = ((png_private->lines[0]!=NULL) && (png_private->lines[1]!=NULL));
 				}
 				if (png_private->filter_result[0] == NULL) {
 					for (index=0; index<5; index++) {
-						png_private->filter_result[index] = allocate_image(info->strave + 16);
+						png_private->filter_result[index] = allocate_image(info, info->strave + 16);
 						ok = ok && (png_private->filter_result[index] != NULL);
 					}
-					packed_line = png_private->packed_line = allocate_image(info->strave + 16);
+					packed_line = png_private->packed_line = allocate_image(info, info->strave + 16);
 					ok = ok && (png_private->packed_line != NULL);
 				}
 				if (!ok) {
@@ -1124,9 +1837,9 @@ png_saver_filter_fillup_zbuf(struct png_info *info, struct png_private *png_priv
 				if (info->interlace)
 					dcol = col_increment[png_private->pass];
 
-				while (png_private->col < info->width) {
+				while (png_private->col < width) {
 					/* XXX we allways do one complete line at a time XXX */
-					screen_line = info->blob + info->strave*png_private->row;
+					screen_line = origin + info->strave*png_private->row;
 /* XXX change me for pixel pusher XXX */
 					screen = screen_line + bytes_per_pixel*png_private->col;
 					if (pixels_per_byte > 1) {
@@ -1146,7 +1859,9 @@ png_saver_filter_fillup_zbuf(struct png_info *info, struct png_private *png_priv
 
 								screen = screen_line + (pixel_bit_offset>>3);
 /* XXX change me for pixel pusher XXX */
-								colour = (*screen >> (8-(pixel_bit_offset & 7)-bpp)) & subpixel_mask;
+								colour = 0;
+								if (col < width)
+									colour = (*screen >> (8-(pixel_bit_offset & 7)-bpp)) & subpixel_mask;
 							}
 							result = result >> bpp;
 							result |= colour << (8-bpp);
@@ -1197,12 +1912,33 @@ png_saver_filter_fillup_zbuf(struct png_info *info, struct png_private *png_priv
 				}
 				break;
 			case FILTER_SA_STATE_OUTPUT_LINE :
-				/* output filter type and packed line	*/
 				/* now select best filter type		*/
-				*pos++ = 0;	/* filter type 0 */
-				memcpy(pos, packed_line, png_private->packedline_length);
+				filter_bpp = (info->bpp * info->samples_per_pixel + 7)/8;
+				filtermode = png_private->save_filter;
+				if (filtermode == PNG_SAVE_FILTER_ADAPTIVE) {
+					filtermode = 0;
+					for (index=0; index<5; index++) {
+						png_private->filter_effect[index] = png_saver_filter_line(
+							png_private->filter_result[index], packed_line,
+							png_private->last_line, png_private->packedline_length,
+							filter_bpp, index);
+						if (png_private->filter_effect[index] < png_private->filter_effect[filtermode])
+							filtermode = index;
+					}
+				} else {
+					png_saver_filter_line(png_private->filter_result[filtermode], packed_line,
+						png_private->last_line, png_private->packedline_length,
+						filter_bpp, filtermode);
+				}
+
+				/* output filter type and filtered line	*/
+				*pos++ = filtermode;
+				memcpy(pos, png_private->filter_result[filtermode], png_private->packedline_length);
 				png_private->z_buf_pos += png_private->packedline_length+1;
 				pos += png_private->packedline_length;
+
+				/* the unfiltered line is the prior line of the next one */
+				memcpy(png_private->this_line, packed_line, png_private->packedline_length);
 				png_private->filter_state = FILTER_SA_STATE_NEXT_LINE;
 				png_private->packedline_length=0;
 				break;
@@ -1210,7 +1946,7 @@ png_saver_filter_fillup_zbuf(struct png_info *info, struct png_private *png_priv
 				drow = 1; if (info->interlace) drow = row_increment[png_private->pass];
 				png_private->row += drow;
 				png_private->filter_state = FILTER_SA_STATE_STARTLINE;
-				if (png_private->row >= info->height) {
+				if (png_private->row >= height) {
 					png_private->filter_state = FILTER_SA_STATE_NEXT_PASS;
 				}
 				break;
@@ -1228,12 +1964,36 @@ png_saver_filter_fillup_zbuf(struct png_info *info, struct png_private *png_priv
 }
 
 
+/* the frame count in the acTL written at the start of the file */
+static int
+png_saver_patch_actl(struct png_info *info) {
+	struct png_private *png_private;
+	uint8_t chunk[20], *pos;
+	ssize_t len;
+
+	png_private = info->png_private;
+	pos = png_saver_start_block(chunk, BLOCK_TYPE_ACTL, png_private, BLOCK_ANCILLARY | BLOCK_PRIVATE);
+	WRITE4_BE(pos, png_private->frames);  pos+=4;
+	WRITE4_BE(pos, info->num_plays);      pos+=4;
+	png_saver_end_block(pos, png_private);
+
+	do {
+		len = pwrite(png_private->fhandle, chunk, sizeof(chunk), png_private->actl_pos);
+	} while ((len < 0) && (errno == EINTR));
+	if (len != sizeof(chunk)) {
+		info->filestate |= PNG_FILE_BAD_FILEHANDLE;
+		return -1;
+	}
+	return 0;
+}
+
+
 static png_file_status
 png_saver_statemachine(struct png_info *info) {
 	struct png_private *png_private;
 	uint8_t *pos, flags;
 	int	 leave, pal_entries, entry, transparencies, colourtype;
-	int	 consumed, produced, result, zflags;
+	int	 consumed, result, zflags, zdone;
 
 	/* shortcut */
 	png_private = info->png_private;
@@ -1275,6 +2035,15 @@ png_saver_statemachine(struct png_info *info) {
 				*pos++ = info->interlace;
 
 				pos = png_saver_end_block(pos, png_private);
+
+				/* nothing is written yet, the frame count follows when it is known */
+				if (png_private->animate) {
+					png_private->actl_pos = pos - png_private->buffer;
+					pos = png_saver_start_block(pos, BLOCK_TYPE_ACTL, png_private, BLOCK_ANCILLARY | BLOCK_PRIVATE);
+					WRITE4_BE(pos, 1);		  pos+=4;
+					WRITE4_BE(pos, info->num_plays); pos+=4;
+					pos = png_saver_end_block(pos, png_private);
+				}
 				png_private->buf_length = pos - png_private->buffer;
 				
 				png_private->saver_state = SAVER_STATE_SEND_MISC_BLOCKS;
@@ -1371,8 +2140,6 @@ png_saver_statemachine(struct png_info *info) {
 				break;
 			case SAVER_STATE_START_SENDING_IDATS :
 				/* initialise libz */
-				png_private->zlib_state.zalloc = Z_NULL;
-				png_private->zlib_state.zfree  = Z_NULL;
 				if (deflateInit(&png_private->zlib_state, Z_DEFAULT_COMPRESSION) != Z_OK) {
 					info->filestate |= PNG_FILE_ZLIB_ERR;
 					png_private->saver_state = SAVER_STATE_ERROR;
@@ -1381,6 +2148,34 @@ png_saver_statemachine(struct png_info *info) {
 				png_private->z_buf_pos = 0;
 				png_private->filter_state = FILTER_SA_STATE_START;
 				png_private->saver_state = SAVER_STATE_SEND_IDATS;
+				if (png_private->animate)
+					png_private->saver_state = SAVER_STATE_SEND_FCTL;
+				break;
+			case SAVER_STATE_SEND_FCTL :
+				if (BUFFER_SIZE - png_private->buf_length < 64) {
+					leave = 1;
+					break;
+				}
+				pos = png_private->buffer + png_private->buf_length;
+				pos = png_saver_start_block(pos, BLOCK_TYPE_FCTL, png_private, BLOCK_ANCILLARY | BLOCK_PRIVATE);
+				WRITE4_BE(pos, png_private->sequence);	pos+=4;
+				WRITE4_BE(pos, info->frame.rect.width);	pos+=4;
+				WRITE4_BE(pos, info->frame.rect.height);	pos+=4;
+				WRITE4_BE(pos, info->frame.rect.x);	pos+=4;
+				WRITE4_BE(pos, info->frame.rect.y);	pos+=4;
+				WRITE2_BE(pos, info->frame.delay_num);	pos+=2;
+				WRITE2_BE(pos, info->frame.delay_den);	pos+=2;
+				*pos++ = info->frame.dispose_op;
+				*pos++ = info->frame.blend_op;
+				pos = png_saver_end_block(pos, png_private);
+				png_private->buf_length = pos - png_private->buffer;
+				png_private->sequence++;
+				png_private->frames++;
+
+				png_private->save_rect = info->frame.rect;
+				png_private->z_buf_pos = 0;
+				png_private->filter_state = FILTER_SA_STATE_START;
+				png_private->saver_state = SAVER_STATE_SEND_IDATS;
 				break;
 			case SAVER_STATE_SEND_IDATS :
 				if (BUFFER_SIZE - png_private->buf_length >= 8096+12) {
@@ -1388,15 +2183,24 @@ png_saver_statemachine(struct png_info *info) {
 					png_saver_filter_fillup_zbuf(info, png_private);
 					if (png_private->filter_state == FILTER_SA_STATE_WAIT_FOR_SPACE) leave=1;
 
-					if (png_private->z_buf_pos) {
+					/* Z_FINISH can need more than one block to flush out */
+					zdone = 0;
+					if (png_private->z_buf_pos || (png_private->filter_state == FILTER_SA_STATE_FINISHED)) {
 						pos = png_private->buffer + png_private->buf_length;
-						pos = png_saver_start_block(pos, BLOCK_TYPE_IDAT, png_private, 0);
+						if (png_private->frames > 1) {
+							/* frames after the default image */
+							pos = png_saver_start_block(pos, BLOCK_TYPE_FDAT, png_private, BLOCK_ANCILLARY | BLOCK_PRIVATE);
+							WRITE4_BE(pos, png_private->sequence); pos+=4;
+							png_private->sequence++;
+						} else {
+							pos = png_saver_start_block(pos, BLOCK_TYPE_IDAT, png_private, 0);
+						}
 
 						/* we reserve 4 bytes for sanity and for the CRC */
 						png_private->zlib_state.next_in = png_private->z_buf;
 						png_private->zlib_state.avail_in = png_private->z_buf_pos;
 						png_private->zlib_state.next_out = pos;
-						png_private->zlib_state.avail_out = BUFFER_SIZE - png_private->buf_length - 4;
+						png_private->zlib_state.avail_out = BUFFER_SIZE - (pos - png_private->buffer) - 4;
 
 						zflags = Z_SYNC_FLUSH;
 						if (png_private->filter_state == FILTER_SA_STATE_FINISHED) {
@@ -1408,8 +2212,8 @@ png_saver_statemachine(struct png_info *info) {
 							png_private->saver_state = SAVER_STATE_ERROR;
 							break;
 						}
+						zdone = (result == Z_STREAM_END);
 						consumed = png_private->z_buf_pos - png_private->zlib_state.avail_in;
-						produced = png_private->zlib_state.next_out-pos;
 						memmove(png_private->z_buf, png_private->zlib_state.next_in, ZBUF_SIZE-consumed);
 
 						png_private->z_buf_pos -= consumed;
@@ -1419,22 +2223,49 @@ png_saver_statemachine(struct png_info *info) {
 						png_private->buf_length = pos - png_private->buffer;
 					}
 
-					if (png_private->filter_state == FILTER_SA_STATE_FINISHED) {
-						/* we are done so please finish the stream with an IEND */
-						pos = png_private->buffer + png_private->buf_length;
-						pos = png_saver_start_block(pos, BLOCK_TYPE_IEND, png_private, 0);
-						pos = png_saver_end_block(pos, png_private);
-						png_private->buf_length = pos - png_private->buffer;
-
-						png_private->saver_state = SAVER_STATE_FINISHED;
+					if (!zdone)
+						break;
+					if (png_private->animate) {
+						/* over to the caller for the next frame or the end */
+						info->filestate |= PNG_FILE_FRAME;
+						png_private->saver_state = SAVER_STATE_FRAME_DONE;
+						leave = 1;
 						break;
 					}
+					/* we are done so please finish the stream with an IEND */
+					png_private->saver_state = SAVER_STATE_SEND_IEND;
+					break;
 
 				} else {
 					leave = 1;
 				}
 				break;
+			case SAVER_STATE_FRAME_DONE :
+				leave = 1;
+				break;
+			case SAVER_STATE_SEND_IEND :
+				if (BUFFER_SIZE - png_private->buf_length < 12) {
+					leave = 1;
+					break;
+				}
+				pos = png_private->buffer + png_private->buf_length;
+				pos = png_saver_start_block(pos, BLOCK_TYPE_IEND, png_private, 0);
+				pos = png_saver_end_block(pos, png_private);
+				png_private->buf_length = pos - png_private->buffer;
+				png_private->saver_state = SAVER_STATE_FINISHED;
+				break;
 			case SAVER_STATE_FINISHED :
+				if (png_private->animate) {
+					/* the acTL goes back in once the rest is out */
+					if (png_private->buf_length) {
+						leave = 1;
+						break;
+					}
+					if (png_saver_patch_actl(info) < 0) {
+						png_private->saver_state = SAVER_STATE_ERROR;
+						break;
+					}
+				}
 				deflateEnd(&png_private->zlib_state);
 
 				info->filestate &= ~PNG_FILE_SAVING;
@@ -1455,10 +2286,37 @@ png_saver_statemachine(struct png_info *info) {
 }
 
 		
+png_file_status
+png_next_frame(struct png_info *info) {
+	if (!info || !info->png_private)
+		return PNG_FILE_ERROR;
+	if (!(info->filestate & PNG_FILE_FRAME))
+		return info->filestate;
+
+	/* the fcTL that ended the last frame may be followed by the whole next one */
+	info->filestate &= ~PNG_FILE_FRAME;
+	return png_loader_statemachine(info);
+}
+
+
 png_file_status
 png_load_a_piece(struct png_info *info) {
+	return png_load_for(info, 0);
+}
+
+
+/*
+ * Load like png_load_a_piece() but give up the CPU once `budget'
+ * nanoseconds have passed, 0 for no limit; the state machine takes up
+ * where it left off on the next call. Checked between reads, so a slice
+ * can overrun by what one buffer full inflates to.
+ */
+png_file_status
+png_load_for(struct png_info *info, uint64_t budget) {
 	struct png_private *png_private;
+	struct timespec ts;
 	int32_t bytes_read;
+	uint64_t started, deadline;
 
 	if (!info)
 		return PNG_FILE_ERROR | PNG_FILE_OUT_OF_MEM;
@@ -1468,10 +2326,32 @@ png_load_a_piece(struct png_info *info) {
 	/* shortcut */
 	png_private = info->png_private;
 
+	deadline = 0;
+	if (budget) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		deadline = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec + budget;
+	}
+
 	do {
+		/* a frame is waiting for png_next_frame() */
+		if (info->filestate & PNG_FILE_FRAME)
+			break;
+
+		/* the rest of a skipped chunk isn't read at all, if it can be helped */
+		if ((png_private->block_state == BLOCK_LD_STATE_SKIP) &&
+		    (png_private->buf_length == 0) && png_private->cur_block_left &&
+		    (lseek(png_private->fhandle, png_private->cur_block_left, SEEK_CUR) != -1)) {
+			info->stats.bytes_skipped += png_private->cur_block_left;
+			png_private->cur_block_left = 0;
+		}
+
 		/* read the buffer full */
+		started = png_clock();
 		bytes_read = read(png_private->fhandle,
 				png_private->buffer+png_private->buf_length, BUFFER_SIZE-png_private->buf_length-1);
+		info->stats.read_ns += png_clock() - started;
+		if (bytes_read > 0)
+			info->stats.bytes_read += bytes_read;
 		if (bytes_read < 0) {
 			if (errno != EAGAIN) {
 				/* serious error -> cleaning up */
@@ -1484,14 +2364,87 @@ png_load_a_piece(struct png_info *info) {
 			 * when it needs more information
 			 */
 		}
-		png_private->buf_length += bytes_read;
+		if (bytes_read > 0)
+			png_private->buf_length += bytes_read;
 		png_loader_statemachine(info);
+		if (info->filestate & PNG_FILE_FRAME)
+			break;
+		if ((bytes_read == 0) && (info->filestate & PNG_FILE_LOADING)) {
+			/* end of file before IEND; truncated or no png */
+			info->filestate = PNG_FILE_ERROR | PNG_FILE_OUT_OF_SPECS;
+		}
+		if (deadline && (bytes_read > 0) && (info->filestate & PNG_FILE_LOADING)) {
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			if ((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec >= deadline)
+				break;
+		}
 	} while (bytes_read>0);
 
 	return info->filestate;
 }
 
 
+/*
+ * The next APNG frame to save, from the same blob: before
+ * png_start_saving() for the first one, which has to cover the image,
+ * and for the others once saving stopped with PNG_FILE_FRAME.
+ */
+png_file_status
+png_save_frame(struct png_info *info, const struct png_frame *frame) {
+	struct png_private *png_private;
+	const struct png_rect *r;
+
+	if (!info || !info->png_private)
+		return PNG_FILE_ERROR;
+	png_private = info->png_private;
+	if (!png_private->animate)
+		return PNG_FILE_ERROR;
+
+	/* frames start on a byte in the blob */
+	r = &frame->rect;
+	if (!r->width || !r->height ||
+	    (r->x > info->width) || (r->width > info->width - r->x) ||
+	    (r->y > info->height) || (r->height > info->height - r->y) ||
+	    ((r->x * info->bpp * info->samples_per_pixel) & 7) ||
+	    (frame->dispose_op > PNG_DISPOSE_PREVIOUS) ||
+	    (frame->blend_op > PNG_BLEND_OVER))
+		return PNG_FILE_ERROR | PNG_FILE_OUT_OF_SPECS;
+
+	if (!(info->filestate & PNG_FILE_SAVING)) {
+		if (r->x || r->y || (r->width != info->width) || (r->height != info->height))
+			return PNG_FILE_ERROR | PNG_FILE_OUT_OF_SPECS;
+		info->frame = *frame;
+		return info->filestate;
+	}
+	if (png_private->saver_state != SAVER_STATE_FRAME_DONE)
+		return PNG_FILE_ERROR;
+
+	if (deflateReset(&png_private->zlib_state) != Z_OK) {
+		info->filestate |= PNG_FILE_ZLIB_ERR;
+		png_private->saver_state = SAVER_STATE_ERROR;
+		return png_saver_statemachine(info);
+	}
+	info->frame = *frame;
+	info->filestate &= ~PNG_FILE_FRAME;
+	png_private->saver_state = SAVER_STATE_SEND_FCTL;
+	return info->filestate;
+}
+
+
+/* no more APNG frames; saving goes on to write the end of the file */
+png_file_status
+png_save_end(struct png_info *info) {
+	if (!info || !info->png_private)
+		return PNG_FILE_ERROR;
+	if (info->png_private->saver_state != SAVER_STATE_FRAME_DONE)
+		return PNG_FILE_ERROR;
+
+	info->filestate &= ~PNG_FILE_FRAME;
+	info->png_private->saver_state = SAVER_STATE_SEND_IEND;
+	return info->filestate;
+}
+
+
 png_file_status
 png_save_a_piece(struct png_info *info) {
 	struct png_private *png_private;
@@ -1524,7 +2477,7 @@ png_save_a_piece(struct png_info *info) {
 			 */
 		}
 		if (bytes_written > 0) {
-			memcpy(png_private->buffer, png_private->buffer+bytes_written, BUFFER_SIZE-bytes_written);
+			memmove(png_private->buffer, png_private->buffer+bytes_written, png_private->buf_length-bytes_written);
 			png_private->buf_length -= bytes_written;
 		}
 	} while (bytes_written>0);
@@ -1533,6 +2486,53 @@ png_save_a_piece(struct png_info *info) {
 }
 
 
+/*
+ * Returns the bKGD colour as 0x00RRGGBB, gamma corrected like the image
+ * will be; only valid before conversion since the stored samples are in
+ * the file's own colour type and depth.
+ */
+int
+png_get_background_rgb32(struct png_info *info, uint32_t *rgb) {
+	uint32_t R, G, B, grey, maxval;
+	uint8_t gamma[256];
+
+	if (!info || !info->has_backgroundcolour)
+		return 0;
+	if (info->colourtype & PNG_COLOURT_EI)
+		return 0;
+
+	if (info->colourtype == PNG_COLOUR_INDEXED) {
+		R = (info->palette[info->background_index] >> 16) & 0xff;
+		G = (info->palette[info->background_index] >>  8) & 0xff;
+		B = (info->palette[info->background_index]      ) & 0xff;
+	} else if (info->colourtype & PNG_COLOURT_COLOUR) {
+		R = info->background_R;
+		G = info->background_G;
+		B = info->background_B;
+		if (info->bpp == 16) {
+			R >>= 8; G >>= 8; B >>= 8;
+		}
+		R &= 0xff; G &= 0xff; B &= 0xff;
+	} else {
+		/* grey scales with its own sample depth */
+		grey = info->background_grey;
+		if (info->bpp == 16) {
+			grey >>= 8;
+		} else if (info->bpp < 8) {
+			maxval = (1 << info->bpp) - 1;
+			grey = ((grey & maxval) * 255) / maxval;
+		}
+		R = G = B = grey & 0xff;
+	}
+
+	if (png_gamma_table8(info, gamma)) {
+		R = gamma[R]; G = gamma[G]; B = gamma[B];
+	}
+	*rgb = (R << 16) | (G << 8) | B;
+	return 1;
+}
+
+
 /*
  * Converter routines ... seperate one day ?
  * XXX THEY BOTH SUCK for 16 bit samples.... redo this please !!! XXX
@@ -1546,10 +2546,19 @@ png_convert_to_rgba32(struct png_info *info, int inverse_alpha) {
 	uint32_t *outpos, *outblob;
 	uint32_t rgb, val, bpp, num_subpixels, subpixel, subpixel_mask, colour;
 	uint32_t width, height, colourtype;
+	uint32_t gamma_rgb[3*256], palette[256], i;
+	const uint32_t *pal;
+	uint8_t gamma[256];
+	uint64_t started;
+	png_convert_func convert;
+	png_convert_lut_func convert_lut;
+	int corrected;
 
 	if (!info)
 		return PNG_FILE_ERROR | PNG_FILE_OUT_OF_MEM;
 
+	started = png_clock();
+
 	bpp = info->bpp;
 	num_subpixels = 8/bpp;
 	subpixel_mask = (1<<bpp)-1;
@@ -1562,7 +2571,8 @@ png_convert_to_rgba32(struct png_info *info, int inverse_alpha) {
 	if (colourtype == PNG_COLOUR_RGBA_EI)
 		return info->filestate;
 
-	outblob = malloc((width+1) * (height+1) * sizeof(uint32_t));
+	WSDV_CONVERT_START(info, 32);
+	outblob = png_alloc(info, (size_t) (width+1) * (height+1) * sizeof(uint32_t), 0);
 
 	if (!outblob) {
 		info->filestate = PNG_FILE_ERROR | PNG_FILE_OUT_OF_MEM;
@@ -1571,9 +2581,53 @@ png_convert_to_rgba32(struct png_info *info, int inverse_alpha) {
 
 	outpos = outblob;
 
+	/* gamma is corrected on the way through tables, the palette up front */
+	corrected = png_gamma_table8(info, gamma);
+	pal = info->palette;
+	if (corrected) {
+		for (i = 0; i < 256; i++) {
+			gamma_rgb[i]       = gamma[i] << 16;
+			gamma_rgb[256 + i] = gamma[i] << 8;
+			gamma_rgb[512 + i] = gamma[i];
+		}
+		for (i = 0; i < 256; i++) {
+			rgb = info->palette[i];
+			palette[i] = (rgb & 0xff000000) | gamma_rgb[(rgb >> 16) & 0xff] |
+			    gamma_rgb[256 + ((rgb >> 8) & 0xff)] | gamma_rgb[512 + (rgb & 0xff)];
+		}
+		pal = palette;
+	}
+
+	/* the common 8 bit truecolour images go through the selected kernels */
+	yp = 0;
+	convert = NULL;
+	convert_lut = NULL;
+	if ((bpp == 8) && !info->has_transparancy) {
+		if (colourtype == PNG_COLOUR_RGB) {
+			convert = png_kernels.rgb8;
+			convert_lut = png_kernels.rgb8_lut;
+		}
+		if (colourtype == PNG_COLOUR_RGBA) {
+			convert = png_kernels.rgba8;
+			convert_lut = png_kernels.rgba8_lut;
+		}
+	}
+	if (convert) {
+		for (; yp < height; yp++) {
+			pos = info->blob + (size_t) yp*info->strave;
+			if (corrected)
+				convert_lut(outpos, pos, width,
+				    inverse_alpha ? 0xff000000 : 0, gamma_rgb);
+			else
+				convert(outpos, pos, width,
+				    inverse_alpha ? 0xff000000 : 0);
+			outpos += width;
+		}
+	}
+
 	/* the checks for (bpp>8) are to acommodate 16 bit samples */
 	pos = info->blob;
-	for(yp=0; yp < height; yp++) {
+	for(; yp < height; yp++) {
 		for(xp=0; xp < width; xp++) {
 			switch (colourtype) {
 				case PNG_COLOUR_GREY_ONLY :
@@ -1589,6 +2643,7 @@ png_convert_to_rgba32(struct png_info *info, int inverse_alpha) {
 							if (inverse_alpha)
 								A = 255-A;
 	
+							colour = gamma[colour];
 							rgb = (A<<24) | (colour << 16 | colour << 8 | colour);
 							*outpos++ = rgb;
 	
@@ -1606,7 +2661,7 @@ png_convert_to_rgba32(struct png_info *info, int inverse_alpha) {
 						if (inverse_alpha)
 							A = 255-A;
 
-						val >>= 8; /* XXX */
+						val = gamma[val >> 8]; /* XXX */
 						rgb = (A<<24) | (val << 16 | val << 8 | val);
 						*outpos++ = rgb;
 					}
@@ -1622,6 +2677,7 @@ png_convert_to_rgba32(struct png_info *info, int inverse_alpha) {
 	
 							if (inverse_alpha)
 								A = 255-A;
+							colour = gamma[colour];
 							rgb = (A<<24) | (colour << 16 | colour << 8 | colour);
 							*outpos++ = rgb;
 	
@@ -1634,6 +2690,7 @@ png_convert_to_rgba32(struct png_info *info, int inverse_alpha) {
 					} else {
 						val = READ2_BE(pos); pos += 2; val >>= 8;  /* XXX */
 						A   = READ2_BE(pos); pos += 2; A   >>= 8;  /* XXX */
+						val = gamma[val];
 
 						if (inverse_alpha)
 							A = 255-A;
@@ -1679,7 +2736,7 @@ png_convert_to_rgba32(struct png_info *info, int inverse_alpha) {
 
 					if (inverse_alpha)
 						A = 255-A;
-					rgb = (A<<24) | (R << 16) | (G << 8) | B;
+					rgb = (A<<24) | (gamma[R] << 16) | (gamma[G] << 8) | gamma[B];
 					*outpos++ = rgb;
 					break;
 				case PNG_COLOUR_INDEXED   :
@@ -1687,7 +2744,7 @@ png_convert_to_rgba32(struct png_info *info, int inverse_alpha) {
 					for(subpixel=0; subpixel<num_subpixels; subpixel++) {
 						colour = (val >> (8-bpp)) & subpixel_mask;
 
-						rgb = info->palette[colour];
+						rgb = pal[colour];
 						A = (rgb >> 24) & 0xff;
 						if (inverse_alpha)
 							A = 0xff-A;
@@ -1703,13 +2760,16 @@ png_convert_to_rgba32(struct png_info *info, int inverse_alpha) {
 					xp -= 1;
 					break;
 				default :
-					fprintf(stderr, "PNG codec rgba32 convert : the colourtype field is invalid !\n");
-					exit(1);
+					/* not one the loader lets through */
+					png_release(info, outblob);
+					info->filestate |= PNG_FILE_ERROR | PNG_FILE_OUT_OF_SPECS;
+					WSDV_CONVERT_DONE(info, info->filestate);
+					return info->filestate;
 			}
 		}
 	}
 	if (info->blob != (uint8_t *) outblob) {
-		free(info->blob);
+		free_image(info, info->blob);
 		info->blob = (uint8_t *) outblob;
 		info->bpp = 32;
 		info->samples_per_pixel = 4;
@@ -1717,6 +2777,9 @@ png_convert_to_rgba32(struct png_info *info, int inverse_alpha) {
 		info->colourtype = PNG_COLOUR_RGBA_EI;	/* extension			*/
 	}
 
+	info->stats.convert_ns += png_clock() - started;
+	WSDV_CONVERT_DONE(info, info->filestate);
+
 	return info->filestate;
 }
 
@@ -1730,10 +2793,13 @@ png_convert_to_rgba64(struct png_info *info, uint16_t *r_trans, uint16_t *g_tran
 	uint32_t width, height, colourtype;
 	uint64_t *outpos, *outblob;
 	uint64_t rgb, A, R, G, B, colour;
+	uint64_t started;
 
 	if (!info)
 		return PNG_FILE_ERROR | PNG_FILE_OUT_OF_MEM;
 
+	started = png_clock();
+
 	bpp = info->bpp;
 	num_subpixels = 8/bpp;
 	subpixel_mask = (1<<bpp)-1;
@@ -1746,7 +2812,8 @@ png_convert_to_rgba64(struct png_info *info, uint16_t *r_trans, uint16_t *g_tran
 	if (colourtype == PNG_COLOUR_RGBA_EI)
 		return info->filestate;
 
-	outblob = malloc((width+1) * (height+1) * sizeof(u_int64_t));
+	WSDV_CONVERT_START(info, 64);
+	outblob = png_alloc(info, (size_t) (width+1) * (height+1) * sizeof(u_int64_t), 0);
 
 	if (!outblob) {
 		info->filestate = PNG_FILE_ERROR | PNG_FILE_OUT_OF_MEM;
@@ -1794,7 +2861,10 @@ png_convert_to_rgba64(struct png_info *info, uint16_t *r_trans, uint16_t *g_tran
 						if (inverse_alpha)
 							A = 0xffff-A;
 
-						rgb = (A << 48) | (colour << 32) | (colour << 16) | (colour);
+						R = png_trans16(r_trans, colour);
+						G = png_trans16(g_trans, colour);
+						B = png_trans16(b_trans, colour);
+						rgb = (A << 48) | (R << 32) | (G << 16) | (B);
 						*outpos++ = rgb;
 					}
 					break;
@@ -1833,7 +2903,10 @@ png_convert_to_rgba64(struct png_info *info, uint16_t *r_trans, uint16_t *g_tran
 						if (inverse_alpha)
 							A = 0xffff-A;
 
-						rgb = (A << 48) | (colour << 32) | (colour << 16) | (colour);
+						R = png_trans16(r_trans, colour);
+						G = png_trans16(g_trans, colour);
+						B = png_trans16(b_trans, colour);
+						rgb = (A << 48) | (R << 32) | (G << 16) | (B);
 						*outpos++ = rgb;
 					}
 					break;
@@ -1877,6 +2950,10 @@ png_convert_to_rgba64(struct png_info *info, uint16_t *r_trans, uint16_t *g_tran
 								A = 0;
 							}
 						}
+
+						R = png_trans16(r_trans, R);
+						G = png_trans16(g_trans, G);
+						B = png_trans16(b_trans, B);
 					}
 
 					if (inverse_alpha)
@@ -1910,13 +2987,16 @@ png_convert_to_rgba64(struct png_info *info, uint16_t *r_trans, uint16_t *g_tran
 					xp -= 1;
 					break;
 				default :
-					fprintf(stderr, "PNG codec rgba64 convert : the colourtype field is invalid !\n");
-					exit(1);
+					/* not one the loader lets through */
+					png_release(info, outblob);
+					info->filestate |= PNG_FILE_ERROR | PNG_FILE_OUT_OF_SPECS;
+					WSDV_CONVERT_DONE(info, info->filestate);
+					return info->filestate;
 			}
 		}
 	}
 	if (info->blob != (uint8_t *) outblob) {
-		free(info->blob);
+		free_image(info, info->blob);
 		info->blob = (uint8_t *) outblob;
 		info->bpp = 64;
 		info->samples_per_pixel = 4;
@@ -1924,7 +3004,157 @@ png_convert_to_rgba64(struct png_info *info, uint16_t *r_trans, uint16_t *g_tran
 		info->colourtype = PNG_COLOUR_RGBA_EI;	/* extension			*/
 	}
 
+	info->stats.convert_ns += png_clock() - started;
+	WSDV_CONVERT_DONE(info, info->filestate);
+
 	return info->filestate;
 }
 
 
+
+
+/*
+ * APNG canvas. It outlives the contexts that compose on it, a play of
+ * the animation each, so it is plain heap rather than theirs.
+ */
+png_file_status
+png_canvas_init(struct png_canvas *canvas, struct png_info *info) {
+	memset(canvas, 0, sizeof(*canvas));
+	if (!info)
+		return PNG_FILE_ERROR;
+
+	canvas->pixels = calloc((size_t) info->canvas_width * info->canvas_height, sizeof(uint32_t));
+	if (!canvas->pixels)
+		return PNG_FILE_ERROR | PNG_FILE_OUT_OF_MEM;
+	canvas->width  = info->canvas_width;
+	canvas->height = info->canvas_height;
+	return info->filestate;
+}
+
+
+/* transparent black, as every play starts */
+void
+png_canvas_clear(struct png_canvas *canvas) {
+	memset(canvas->pixels, 0, (size_t) canvas->width * canvas->height * sizeof(uint32_t));
+	canvas->has_last = 0;
+}
+
+
+void
+png_canvas_free(struct png_canvas *canvas) {
+	free(canvas->pixels);
+	free(canvas->saved);
+	memset(canvas, 0, sizeof(*canvas));
+}
+
+
+static void
+png_rect_union(struct png_rect *a, const struct png_rect *b) {
+	uint32_t right, bottom;
+
+	right  = a->x + a->width;
+	bottom = a->y + a->height;
+	if (b->x + b->width > right)
+		right = b->x + b->width;
+	if (b->y + b->height > bottom)
+		bottom = b->y + b->height;
+	if (b->x < a->x)
+		a->x = b->x;
+	if (b->y < a->y)
+		a->y = b->y;
+	a->width  = right - a->x;
+	a->height = bottom - a->y;
+}
+
+
+/* src over dst, neither of them premultiplied */
+static inline uint32_t
+png_blend_over(uint32_t src, uint32_t dst) {
+	uint32_t sa, da, u, v, al, c, out, shift;
+
+	sa = src >> 24;
+	if (sa == 255)
+		return src;
+	if (sa == 0)
+		return dst;
+	da = dst >> 24;
+	if (da == 0)
+		return src;
+
+	u  = sa * 255;
+	v  = (255 - sa) * da;
+	al = u + v;
+	out = ((al + 127) / 255) << 24;
+	for (shift = 0; shift < 24; shift += 8) {
+		c = (((src >> shift) & 0xff) * u + ((dst >> shift) & 0xff) * v + al/2) / al;
+		out |= c << shift;
+	}
+	return out;
+}
+
+
+/*
+ * Dispose of the frame before and blend the one in the blob onto the
+ * canvas, converting it to rgba32 first.
+ */
+png_file_status
+png_compose_frame(struct png_info *info, struct png_canvas *canvas, struct png_rect *changed) {
+	const struct png_rect *rect, *last;
+	uint32_t *src, *dst, *saved;
+	uint32_t x, y;
+	png_file_status status;
+
+	status = png_convert_to_rgba32(info, 0);
+	if (status & PNG_FILE_ERROR)
+		return status;
+	rect = &info->frame.rect;
+	if ((info->bpp != 32) || (rect->width != info->width) || (rect->height != info->height) ||
+	    (rect->x + rect->width > canvas->width) || (rect->y + rect->height > canvas->height))
+		return PNG_FILE_ERROR | PNG_FILE_OUT_OF_SPECS;
+
+	/* what the last frame leaves behind */
+	*changed = *rect;
+	if (canvas->has_last && (canvas->last.dispose_op != PNG_DISPOSE_NONE)) {
+		last = &canvas->last.rect;
+		saved = canvas->saved;
+		for (y = 0; y < last->height; y++) {
+			dst = canvas->pixels + (size_t) (last->y + y) * canvas->width + last->x;
+			if (canvas->last.dispose_op == PNG_DISPOSE_BACKGROUND) {
+				memset(dst, 0, last->width * sizeof(uint32_t));
+			} else {
+				memcpy(dst, saved, last->width * sizeof(uint32_t));
+				saved += last->width;
+			}
+		}
+		png_rect_union(changed, last);
+	}
+
+	/* and what this one covers, if it is to be put back */
+	if (info->frame.dispose_op == PNG_DISPOSE_PREVIOUS) {
+		if (!canvas->saved)
+			canvas->saved = malloc((size_t) canvas->width * canvas->height * sizeof(uint32_t));
+		if (!canvas->saved)
+			return PNG_FILE_ERROR | PNG_FILE_OUT_OF_MEM;
+		saved = canvas->saved;
+		for (y = 0; y < rect->height; y++) {
+			memcpy(saved, canvas->pixels + (size_t) (rect->y + y) * canvas->width + rect->x,
+			    rect->width * sizeof(uint32_t));
+			saved += rect->width;
+		}
+	}
+
+	for (y = 0; y < rect->height; y++) {
+		src = (uint32_t *) (info->blob + (size_t) y * info->strave);
+		dst = canvas->pixels + (size_t) (rect->y + y) * canvas->width + rect->x;
+		if (info->frame.blend_op == PNG_BLEND_SOURCE) {
+			memcpy(dst, src, rect->width * sizeof(uint32_t));
+			continue;
+		}
+		for (x = 0; x < rect->width; x++)
+			dst[x] = png_blend_over(src[x], dst[x]);
+	}
+
+	canvas->last = info->frame;
+	canvas->has_last = 1;
+	return info->filestate;
+}
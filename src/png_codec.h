@@ -53,6 +53,23 @@
 #define PNG_COLOUR_RGBA		(PNG_COLOURT_COLOUR | PNG_COLOURT_ALPHA)
 #define PNG_COLOUR_RGBA_EI	(PNG_COLOUR_RGBA | PNG_COLOURT_EI)
 
+/* instruction sets for the decoder's inner loops */
+#define PNG_KERNELS_AUTO	-1
+#define PNG_KERNELS_SCALAR	 0
+#define PNG_KERNELS_SSE2	 1
+#define PNG_KERNELS_SSSE3	 2	/* with PCLMUL for the CRC if present */
+#define PNG_KERNELS_AVX2	 3
+#define PNG_KERNELS_NEON	 4
+#define PNG_KERNELS_COUNT	 5
+
+/* scanline filters used when saving */
+#define PNG_SAVE_FILTER_NONE	 0
+#define PNG_SAVE_FILTER_SUB	 1
+#define PNG_SAVE_FILTER_UP	 2
+#define PNG_SAVE_FILTER_AVERAGE	 3
+#define PNG_SAVE_FILTER_PAETH	 4
+#define PNG_SAVE_FILTER_ADAPTIVE 5		/* best per line, the default */
+
 
 typedef int png_file_status;
 #define PNG_FILE_CLEAR		((png_file_status) (0x0000))
@@ -71,11 +88,68 @@ typedef int png_file_status;
 #define PNG_FILE_DISPOSED	((png_file_status) (0x1000))
 #define PNG_FILE_WOULD_DESTROY	((png_file_status) (0x2000))
 #define PNG_FILE_BAD_FILEHANDLE ((png_file_status) (0x4000))
+#define PNG_FILE_FRAME		((png_file_status) (0x8000))	/* see png_next_frame() */
+
+
+/* APNG frame control, what fcTL says */
+#define PNG_DISPOSE_NONE	0
+#define PNG_DISPOSE_BACKGROUND	1	/* cleared to transparent black */
+#define PNG_DISPOSE_PREVIOUS	2	/* put back as it was */
+
+#define PNG_BLEND_SOURCE	0
+#define PNG_BLEND_OVER		1
+
+struct png_rect {
+	uint32_t	 x, y;
+	uint32_t	 width, height;
+};
+
+struct png_frame {
+	struct png_rect	 rect;			/* on the canvas */
+	uint16_t	 delay_num, delay_den;	/* seconds, den 0 is 100 */
+	uint8_t		 dispose_op;
+	uint8_t		 blend_op;
+	uint32_t	 index;			/* from 0 */
+};
 
 
 struct png_private;
 
 
+/*
+ * Time spent in each loader stage, in nanoseconds of the monotonic clock,
+ * accumulated over the life of a png_info. Build with PNG_NO_STATS to
+ * leave the clock alone. The mem_ fields count the heap bytes the context
+ * holds, zlib's included.
+ */
+struct png_stats {
+	uint64_t	 read_ns;
+	uint64_t	 crc_ns;
+	uint64_t	 inflate_ns;
+	uint64_t	 defilter_ns;
+	uint64_t	 convert_ns;
+
+	uint64_t	 bytes_read;
+	uint64_t	 bytes_skipped;		/* seeked over, not read */
+	uint64_t	 bytes_inflated;
+
+	uint64_t	 mem_current;
+	uint64_t	 mem_peak;
+};
+
+
+/*
+ * Heap bytes held by all contexts together. With a limit set, allocations
+ * that would go over it fail and the operation ends in PNG_FILE_OUT_OF_MEM;
+ * 0 is no limit.
+ */
+struct png_memory {
+	uint64_t	 current;
+	uint64_t	 peak;
+	uint64_t	 limit;
+};
+
+
 /*
  * Contains all information about a png file being loaded/saved
  */
@@ -107,32 +181,149 @@ struct png_info {
 	uint32_t	 background_G;
 	uint32_t	 background_B;
 
+	/* gAMA times 100000; sRGB overrides it */
+	uint8_t		 has_gamma;
+	uint32_t	 gamma;
+	uint8_t		 has_srgb;
+	uint8_t		 srgb_intent;
+	uint32_t	 display_gamma;		/* png_set_display_gamma() */
+
+	/*
+	 * APNG, decoded a frame at a time with png_set_animate(); width and
+	 * height are then those of the frame in the blob.
+	 */
+	uint8_t		 is_animated;
+	uint32_t	 num_frames;
+	uint32_t	 num_plays;		/* 0 is for ever */
+	uint32_t	 canvas_width, canvas_height;
+	struct png_frame frame;
+
 	uint32_t	 palette[256];
 	png_file_status	 filestate;
 
+	struct png_stats stats;
+
 	struct png_private *png_private;
 };
 
 
+/*
+ * What the start of a file tells about the image, from png_probe(): IHDR,
+ * and the chunks in front of the image data as far as they fit in the
+ * one read. `complete' is set when that reached the image data.
+ */
+#define PNG_PROBE_SIZE		4096
+
+struct png_header {
+	uint32_t	 width, height;
+	uint8_t		 bpp;			/* bits per sample, as IHDR */
+	uint8_t		 sample_depth;
+	uint8_t		 colourtype;
+	uint8_t		 interlace;
+
+	uint16_t	 palette_size;		/* PLTE entries */
+	uint8_t		 has_transparancy;
+	uint8_t		 has_backgroundcolour;
+	uint8_t		 has_gamma;
+	uint8_t		 has_srgb;
+	uint32_t	 gamma;
+	uint32_t	 num_frames;		/* acTL, 0 if there is none */
+	uint8_t		 complete;
+};
+
+
+/*
+ * What an animation is composed on, 0xAARRGGBB like png_convert_to_rgba32()
+ * gives. A frame is blended onto it, and disposed of when the next one
+ * comes; `changed' gets the part of the canvas that differs.
+ */
+struct png_canvas {
+	uint32_t	*pixels;
+	uint32_t	 width, height;
+	uint32_t	*saved;			/* under a frame to put back */
+	struct png_frame last;			/* to dispose of */
+	uint8_t		 has_last;
+};
+
+
 /* implemented functions; all args are preserved */
 extern void png_init(void);
 
+/* png_init() picks PNG_KERNELS_AUTO */
+extern int png_kernels_init(int level);
+extern int png_kernels_available(int level);
+extern int png_kernels_get(void);
+extern const char *png_kernels_name(int level);
+
+extern void png_get_memory(struct png_memory *memory);
+extern void png_set_memory_limit(uint64_t limit);
+
+/*
+ * Exponent of the display a context converts for, times 100000 like gAMA;
+ * 0 leaves the samples as they are. Contexts start out with
+ * PNG_GAMMA_DISPLAY; set it before converting.
+ */
+#define PNG_GAMMA_DISPLAY	220000
+#define PNG_GAMMA_SRGB		45455	/* the gAMA sRGB images would have */
+
+/* check the CRC of ancillary chunks the loader skips, off by default */
+extern void png_set_check_skipped(int check);
+
 
 extern struct png_info *png_create_png_context(void);
+extern void png_set_display_gamma(struct png_info *info, uint32_t gamma);
 extern png_file_status png_populate_and_allocate_empty_image(struct png_info *info, int colourtype, int bpp, int width, int height);
 extern png_file_status png_populate_with_image(struct png_info *info, int colourtype, void *blob, int bpp, int width, int height);
 
 
+/* one pread() at offset 0, the file position is left alone */
+extern png_file_status png_probe(int fhandle, struct png_header *header);
+
 extern png_file_status png_start_loading(struct png_info *info, int fhandle);
 extern png_file_status png_load_a_piece(struct png_info *info);
+extern png_file_status png_load_for(struct png_info *info, uint64_t budget);
+
+/*
+ * With animation on, loading stops with PNG_FILE_FRAME set when a frame
+ * is complete in the blob; png_next_frame() goes on to the next one. The
+ * last frame ends in PNG_FILE_FINISHED like a still image does.
+ */
+extern png_file_status png_set_animate(struct png_info *info, int animate);
+extern png_file_status png_next_frame(struct png_info *info);
+
+extern png_file_status png_canvas_init(struct png_canvas *canvas, struct png_info *info);
+extern void png_canvas_clear(struct png_canvas *canvas);
+extern void png_canvas_free(struct png_canvas *canvas);
+extern png_file_status png_compose_frame(struct png_info *info, struct png_canvas *canvas, struct png_rect *changed);
 
+extern png_file_status png_set_save_filter(struct png_info *info, int filter);
 extern png_file_status png_start_saving(struct png_info *info, int fhandle);
 extern png_file_status png_save_a_piece(struct png_info *info);
 
+/*
+ * With animation on, saving writes a frame at a time from the blob and
+ * stops with PNG_FILE_FRAME set after each; png_save_frame() gives the
+ * next one and png_save_end() ends the file. The frame count goes into
+ * acTL last, so the file has to be seekable.
+ */
+extern png_file_status png_save_frame(struct png_info *info, const struct png_frame *frame);
+extern png_file_status png_save_end(struct png_info *info);
+
 
 extern png_file_status png_dispose_png(struct png_info *info);
 
-/* converters */
+/* ancillary information */
+extern int png_get_background_rgb32(struct png_info *info, uint32_t *rgb);
+
+/* 8 bit samples to gamma corrected ones; 0 if the tables are identities */
+extern int png_gamma_table8(struct png_info *info, uint8_t *table);
+extern int png_gamma_table16(struct png_info *info, uint16_t *table);
+
+/*
+ * Converters; samples with a gamma to correct are mapped on the way. The
+ * 64 bit one takes the tables, 8 bit samples in, and interpolates in them
+ * for 16 bit samples.
+ */
 extern png_file_status png_convert_to_rgba32(struct png_info *info, int inverse_alpha);
 extern png_file_status png_convert_to_rgba64(struct png_info *info, uint16_t *r_trans, uint16_t *g_trans, uint16_t *b_trans, int inverse_alpha);
 
@@ -0,0 +1,794 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_KERNELS
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#include <immintrin.h>
+#endif
+#if (defined(__aarch64__) || defined(__ARM_NEON)) && defined(__GNUC__)
+#define HAVE_NEON_KERNELS
+#include <arm_neon.h>
+#endif
+
+#include "png_codec.h"
+#include "png_kernels.h"
+#include "cpu.h"
+
+static int png_kernels_level = PNG_KERNELS_SCALAR;
+
+static const struct {
+	const char	*name;
+	unsigned int	 needs;		/* to be available at all */
+	unsigned int	 may_use;	/* what its kernels may use */
+} levels[PNG_KERNELS_COUNT] = {
+	[PNG_KERNELS_SCALAR]	= { "scalar", 0, 0 },
+	[PNG_KERNELS_SSE2]	= { "sse2", CPU_SSE2, CPU_SSE2 },
+	[PNG_KERNELS_SSSE3]	= { "ssse3", CPU_SSSE3,
+	    CPU_SSE2 | CPU_SSSE3 | CPU_SSE41 | CPU_PCLMUL },
+	[PNG_KERNELS_AVX2]	= { "avx2", CPU_AVX2,
+	    CPU_SSE2 | CPU_SSSE3 | CPU_SSE41 | CPU_PCLMUL | CPU_AVX | CPU_AVX2 },
+	[PNG_KERNELS_NEON]	= { "neon", CPU_NEON, CPU_NEON | CPU_ARM_CRC32 },
+};
+
+
+/*
+ * Scalar versions, the reference for everything else
+ */
+static void
+unfilter_sub(uint8_t *row, const uint8_t *prior, size_t len, int bpp) {
+	size_t i;
+
+	for (i = bpp; i < len; i++)
+		row[i] += row[i - bpp];
+}
+
+
+static void
+unfilter_up(uint8_t *row, const uint8_t *prior, size_t len, int bpp) {
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		row[i] += prior[i];
+}
+
+
+static void
+unfilter_avg(uint8_t *row, const uint8_t *prior, size_t len, int bpp) {
+	size_t i;
+
+	for (i = 0; (i < (size_t) bpp) && (i < len); i++)
+		row[i] += prior[i] >> 1;
+	for (; i < len; i++)
+		row[i] += (row[i - bpp] + prior[i]) >> 1;
+}
+
+
+static inline uint8_t
+paeth(uint8_t a, uint8_t b, uint8_t c) {
+	int pa, pb, pc;
+
+	pa = abs(b - c);
+	pb = abs(a - c);
+	pc = abs(a + b - 2 * c);
+	if ((pa <= pb) && (pa <= pc))
+		return a;
+	if (pb <= pc)
+		return b;
+	return c;
+}
+
+
+static void
+unfilter_paeth(uint8_t *row, const uint8_t *prior, size_t len, int bpp) {
+	size_t i;
+
+	/* without a left neighbour the predictor is the byte above */
+	for (i = 0; (i < (size_t) bpp) && (i < len); i++)
+		row[i] += prior[i];
+	for (; i < len; i++)
+		row[i] += paeth(row[i - bpp], prior[i], prior[i - bpp]);
+}
+
+
+/*
+ * zlib's CRC is polynomial compatible and its tables are constant, so
+ * this needs no set up and is safe from any thread.
+ */
+static uint32_t
+crc_scalar(uint32_t crc, const uint8_t *buf, size_t len) {
+	while (len > 0) {
+		uInt n = (len > 0x40000000) ? 0x40000000 : (uInt) len;
+
+		crc = ~crc32(~crc, buf, n);
+		buf += n;
+		len -= n;
+	}
+	return crc;
+}
+
+
+static void
+convert_rgb8(uint32_t *dst, const uint8_t *src, uint32_t n, uint32_t axor) {
+	uint32_t x;
+
+	for (x = 0; x < n; x++, src += 3)
+		dst[x] = (0xff000000 ^ axor) | (src[0] << 16) | (src[1] << 8) |
+		    src[2];
+}
+
+
+static void
+convert_rgba8(uint32_t *dst, const uint8_t *src, uint32_t n, uint32_t axor) {
+	uint32_t x;
+
+	for (x = 0; x < n; x++, src += 4)
+		dst[x] = (((uint32_t) src[3] << 24) ^ axor) | (src[0] << 16) |
+		    (src[1] << 8) | src[2];
+}
+
+
+static void
+convert_rgb8_lut(uint32_t *dst, const uint8_t *src, uint32_t n, uint32_t axor,
+    const uint32_t *lut) {
+	uint32_t x;
+
+	for (x = 0; x < n; x++, src += 3)
+		dst[x] = (0xff000000 ^ axor) | lut[src[0]] |
+		    lut[256 + src[1]] | lut[512 + src[2]];
+}
+
+
+static void
+convert_rgba8_lut(uint32_t *dst, const uint8_t *src, uint32_t n,
+    uint32_t axor, const uint32_t *lut) {
+	uint32_t x;
+
+	for (x = 0; x < n; x++, src += 4)
+		dst[x] = (((uint32_t) src[3] << 24) ^ axor) | lut[src[0]] |
+		    lut[256 + src[1]] | lut[512 + src[2]];
+}
+
+
+/* usable before png_init(), which only ever swaps in faster entries */
+struct png_kernels png_kernels = {
+	.unfilter = { NULL, unfilter_sub, unfilter_up, unfilter_avg,
+	    unfilter_paeth },
+	.crc = crc_scalar,
+	.rgb8 = convert_rgb8,
+	.rgba8 = convert_rgba8,
+	.rgb8_lut = convert_rgb8_lut,
+	.rgba8_lut = convert_rgba8_lut,
+};
+
+
+#ifdef HAVE_X86_KERNELS
+/*
+ * Sub, Average and Paeth depend on the pixel to the left so they go one
+ * pixel of up to 8 bytes at a time; it still beats going byte by byte.
+ * The libpng SSE2 filters do the same.
+ */
+#define X86_INLINE(isa)	static inline __attribute__((always_inline, target(isa)))
+#define X86_FUNC(isa)	static __attribute__((target(isa)))
+
+X86_INLINE("sse2") __m128i
+load_px(const uint8_t *p, int bpp) {
+	uint64_t v = 0;
+
+	memcpy(&v, p, bpp);
+	return _mm_loadl_epi64((const __m128i *) &v);
+}
+
+
+X86_INLINE("sse2") void
+store_px(uint8_t *p, __m128i x, int bpp) {
+	uint64_t v;
+
+	_mm_storel_epi64((__m128i *) &v, x);
+	memcpy(p, &v, bpp);
+}
+
+
+X86_INLINE("sse2") void
+sub_px(uint8_t *row, size_t len, int bpp) {
+	__m128i a;
+	size_t i;
+
+	a = _mm_setzero_si128();
+	for (i = 0; i < len; i += bpp) {
+		a = _mm_add_epi8(load_px(row + i, bpp), a);
+		store_px(row + i, a, bpp);
+	}
+}
+
+
+X86_INLINE("sse2") void
+avg_px(uint8_t *row, const uint8_t *prior, size_t len, int bpp) {
+	__m128i a, b, avg, one;
+	size_t i;
+
+	a = _mm_setzero_si128();
+	one = _mm_set1_epi8(1);
+	for (i = 0; i < len; i += bpp) {
+		b = load_px(prior + i, bpp);
+		/* pavgb rounds up where PNG truncates */
+		avg = _mm_avg_epu8(a, b);
+		avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), one));
+		a = _mm_add_epi8(load_px(row + i, bpp), avg);
+		store_px(row + i, a, bpp);
+	}
+}
+
+
+X86_INLINE("sse2") __m128i
+abs_epi16_sse2(__m128i x) {
+	__m128i neg;
+
+	neg = _mm_cmplt_epi16(x, _mm_setzero_si128());
+	return _mm_sub_epi16(_mm_xor_si128(x, neg), neg);
+}
+
+
+X86_INLINE("sse2") __m128i
+select_si128(__m128i mask, __m128i t, __m128i f) {
+	return _mm_or_si128(_mm_and_si128(mask, t), _mm_andnot_si128(mask, f));
+}
+
+
+/* the predictor in 16 bit lanes, a b c as in the specs */
+X86_INLINE("sse2") void
+paeth_px(uint8_t *row, const uint8_t *prior, size_t len, int bpp) {
+	__m128i a, b, c, pa, pb, pc, least, zero;
+	size_t i;
+
+	zero = _mm_setzero_si128();
+	a = c = zero;
+	for (i = 0; i < len; i += bpp) {
+		b = _mm_unpacklo_epi8(load_px(prior + i, bpp), zero);
+		pa = _mm_sub_epi16(b, c);
+		pb = _mm_sub_epi16(a, c);
+		pc = abs_epi16_sse2(_mm_add_epi16(pa, pb));
+		pa = abs_epi16_sse2(pa);
+		pb = abs_epi16_sse2(pb);
+		least = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+		a = select_si128(_mm_cmpeq_epi16(least, pa), a,
+		    select_si128(_mm_cmpeq_epi16(least, pb), b, c));
+		/* the high bytes of the lanes stay zero */
+		a = _mm_add_epi8(_mm_unpacklo_epi8(load_px(row + i, bpp), zero), a);
+		store_px(row + i, _mm_packus_epi16(a, a), bpp);
+		c = b;
+	}
+}
+
+
+/* specialised for the pixel sizes found in 8 and 16 bit images */
+#define UNFILTER_BY_BPP(call)						\
+	switch (bpp) {							\
+	case 3: call(3); return;					\
+	case 4: call(4); return;					\
+	case 6: call(6); return;					\
+	case 8: call(8); return;					\
+	}
+
+X86_FUNC("sse2") void
+unfilter_sub_sse2(uint8_t *row, const uint8_t *prior, size_t len, int bpp) {
+#define SUB(n)	sub_px(row, len, n)
+	UNFILTER_BY_BPP(SUB)
+#undef SUB
+	unfilter_sub(row, prior, len, bpp);
+}
+
+
+X86_FUNC("sse2") void
+unfilter_avg_sse2(uint8_t *row, const uint8_t *prior, size_t len, int bpp) {
+#define AVG(n)	avg_px(row, prior, len, n)
+	UNFILTER_BY_BPP(AVG)
+#undef AVG
+	unfilter_avg(row, prior, len, bpp);
+}
+
+
+X86_FUNC("sse2") void
+unfilter_paeth_sse2(uint8_t *row, const uint8_t *prior, size_t len, int bpp) {
+#define PAETH(n) paeth_px(row, prior, len, n)
+	UNFILTER_BY_BPP(PAETH)
+#undef PAETH
+	unfilter_paeth(row, prior, len, bpp);
+}
+
+
+X86_FUNC("sse2") void
+unfilter_up_sse2(uint8_t *row, const uint8_t *prior, size_t len, int bpp) {
+	__m128i r, p;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		r = _mm_loadu_si128((const __m128i *) (row + i));
+		p = _mm_loadu_si128((const __m128i *) (prior + i));
+		_mm_storeu_si128((__m128i *) (row + i), _mm_add_epi8(r, p));
+	}
+	unfilter_up(row + i, prior + i, len - i, bpp);
+}
+
+
+X86_FUNC("avx2") void
+unfilter_up_avx2(uint8_t *row, const uint8_t *prior, size_t len, int bpp) {
+	__m256i r, p;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		r = _mm256_loadu_si256((const __m256i *) (row + i));
+		p = _mm256_loadu_si256((const __m256i *) (prior + i));
+		_mm256_storeu_si256((__m256i *) (row + i), _mm256_add_epi8(r, p));
+	}
+	_mm256_zeroupper();
+	unfilter_up(row + i, prior + i, len - i, bpp);
+}
+
+
+/*
+ * CRC by folding 64 bytes at a time with carry-less multiplies, after
+ * Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ"
+ * with the bit reflected constants for the PNG/zlib polynomial.
+ */
+X86_FUNC("sse4.1,pclmul") uint32_t
+crc_pclmul(uint32_t crc, const uint8_t *buf, size_t len) {
+	static const uint64_t k1k2[2] __attribute__((aligned(16))) =
+	    { 0x0154442bd4ULL, 0x01c6e41596ULL };
+	static const uint64_t k3k4[2] __attribute__((aligned(16))) =
+	    { 0x01751997d0ULL, 0x00ccaa009eULL };
+	static const uint64_t k5k0[2] __attribute__((aligned(16))) =
+	    { 0x0163cd6124ULL, 0x0000000000ULL };
+	static const uint64_t poly[2] __attribute__((aligned(16))) =
+	    { 0x01db710641ULL, 0x01f7011641ULL };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+	size_t tail;
+
+	if (len < 64)
+		return crc_scalar(crc, buf, len);
+	tail = len & 15;
+	len -= tail;
+
+	x1 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) crc));
+	x0 = _mm_load_si128((const __m128i *) k1k2);
+	buf += 64;
+	len -= 64;
+
+	/* four independent folds */
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		y5 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+		buf += 64;
+		len -= 64;
+	}
+
+	/* fold the four into one */
+	x0 = _mm_load_si128((const __m128i *) k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *) buf);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		buf += 16;
+		len -= 16;
+	}
+
+	/* 128 to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_loadl_epi64((const __m128i *) k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_load_si128((const __m128i *) poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	crc = (uint32_t) _mm_extract_epi32(x1, 1);
+
+	return crc_scalar(crc, buf, tail);
+}
+
+
+X86_FUNC("sse2") void
+convert_rgba8_sse2(uint32_t *dst, const uint8_t *src, uint32_t n,
+    uint32_t axor) {
+	__m128i p, ag, rb, ax;
+	uint32_t x;
+
+	/* R and B trade places, as in the XBGR blitter */
+	ag = _mm_set1_epi32(0xff00ff00);
+	rb = _mm_set1_epi32(0x000000ff);
+	ax = _mm_set1_epi32(axor);
+	for (x = 0; x + 4 <= n; x += 4) {
+		p = _mm_loadu_si128((const __m128i *) (src + 4 * x));
+		p = _mm_or_si128(_mm_and_si128(p, ag),
+		    _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 16), rb),
+		    _mm_slli_epi32(_mm_and_si128(p, rb), 16)));
+		_mm_storeu_si128((__m128i *) (dst + x), _mm_xor_si128(p, ax));
+	}
+	convert_rgba8(dst + x, src + 4 * x, n - x, axor);
+}
+
+
+X86_FUNC("ssse3") void
+convert_rgb8_ssse3(uint32_t *dst, const uint8_t *src, uint32_t n,
+    uint32_t axor) {
+	__m128i p, shuf, alpha;
+	uint32_t x;
+
+	shuf = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1,
+	    11, 10, 9, -1);
+	alpha = _mm_set1_epi32(0xff000000 ^ axor);
+	/* 16 byte loads for 12 bytes of pixels; stop before the row ends */
+	for (x = 0; x + 6 <= n; x += 4) {
+		p = _mm_loadu_si128((const __m128i *) (src + 3 * x));
+		p = _mm_or_si128(_mm_shuffle_epi8(p, shuf), alpha);
+		_mm_storeu_si128((__m128i *) (dst + x), p);
+	}
+	convert_rgb8(dst + x, src + 3 * x, n - x, axor);
+}
+
+
+X86_FUNC("ssse3") void
+convert_rgba8_ssse3(uint32_t *dst, const uint8_t *src, uint32_t n,
+    uint32_t axor) {
+	__m128i p, shuf, ax;
+	uint32_t x;
+
+	shuf = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11,
+	    14, 13, 12, 15);
+	ax = _mm_set1_epi32(axor);
+	for (x = 0; x + 4 <= n; x += 4) {
+		p = _mm_loadu_si128((const __m128i *) (src + 4 * x));
+		p = _mm_xor_si128(_mm_shuffle_epi8(p, shuf), ax);
+		_mm_storeu_si128((__m128i *) (dst + x), p);
+	}
+	convert_rgba8(dst + x, src + 4 * x, n - x, axor);
+}
+
+
+X86_FUNC("avx2") void
+convert_rgb8_avx2(uint32_t *dst, const uint8_t *src, uint32_t n,
+    uint32_t axor) {
+	__m256i p, shuf, alpha;
+	uint32_t x;
+
+	/* each lane gets 4 pixels from its own 16 byte load */
+	shuf = _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1,
+	    11, 10, 9, -1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1,
+	    11, 10, 9, -1);
+	alpha = _mm256_set1_epi32(0xff000000 ^ axor);
+	for (x = 0; x + 10 <= n; x += 8) {
+		p = _mm256_inserti128_si256(_mm256_castsi128_si256(
+		    _mm_loadu_si128((const __m128i *) (src + 3 * x))),
+		    _mm_loadu_si128((const __m128i *) (src + 3 * x + 12)), 1);
+		p = _mm256_or_si256(_mm256_shuffle_epi8(p, shuf), alpha);
+		_mm256_storeu_si256((__m256i *) (dst + x), p);
+	}
+	_mm256_zeroupper();
+	convert_rgb8_ssse3(dst + x, src + 3 * x, n - x, axor);
+}
+
+
+X86_FUNC("avx2") void
+convert_rgba8_avx2(uint32_t *dst, const uint8_t *src, uint32_t n,
+    uint32_t axor) {
+	__m256i p, shuf, ax;
+	uint32_t x;
+
+	shuf = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11,
+	    14, 13, 12, 15, 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11,
+	    14, 13, 12, 15);
+	ax = _mm256_set1_epi32(axor);
+	for (x = 0; x + 8 <= n; x += 8) {
+		p = _mm256_loadu_si256((const __m256i *) (src + 4 * x));
+		p = _mm256_xor_si256(_mm256_shuffle_epi8(p, shuf), ax);
+		_mm256_storeu_si256((__m256i *) (dst + x), p);
+	}
+	_mm256_zeroupper();
+	convert_rgba8(dst + x, src + 4 * x, n - x, axor);
+}
+
+
+/*
+ * Table lookups are gathers, one per channel for 8 pixels.  There are no
+ * gathers before AVX2, so SSE2, SSSE3 and NEON keep the scalar lookup.
+ */
+X86_FUNC("avx2") void
+convert_rgb8_lut_avx2(uint32_t *dst, const uint8_t *src, uint32_t n,
+    uint32_t axor, const uint32_t *lut) {
+	__m256i p, r, g, b, shuf_r, shuf_g, shuf_b, alpha;
+	uint32_t x;
+
+	shuf_r = _mm256_setr_epi8(0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1,
+	    9, -1, -1, -1, 0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1,
+	    9, -1, -1, -1);
+	shuf_g = _mm256_add_epi8(shuf_r, _mm256_set1_epi32(1));
+	shuf_b = _mm256_add_epi8(shuf_r, _mm256_set1_epi32(2));
+	alpha = _mm256_set1_epi32(0xff000000 ^ axor);
+	for (x = 0; x + 10 <= n; x += 8) {
+		p = _mm256_inserti128_si256(_mm256_castsi128_si256(
+		    _mm_loadu_si128((const __m128i *) (src + 3 * x))),
+		    _mm_loadu_si128((const __m128i *) (src + 3 * x + 12)), 1);
+		r = _mm256_i32gather_epi32((const int *) lut,
+		    _mm256_shuffle_epi8(p, shuf_r), 4);
+		g = _mm256_i32gather_epi32((const int *) lut + 256,
+		    _mm256_shuffle_epi8(p, shuf_g), 4);
+		b = _mm256_i32gather_epi32((const int *) lut + 512,
+		    _mm256_shuffle_epi8(p, shuf_b), 4);
+		p = _mm256_or_si256(_mm256_or_si256(r, g),
+		    _mm256_or_si256(b, alpha));
+		_mm256_storeu_si256((__m256i *) (dst + x), p);
+	}
+	_mm256_zeroupper();
+	convert_rgb8_lut(dst + x, src + 3 * x, n - x, axor, lut);
+}
+
+
+X86_FUNC("avx2") void
+convert_rgba8_lut_avx2(uint32_t *dst, const uint8_t *src, uint32_t n,
+    uint32_t axor, const uint32_t *lut) {
+	__m256i p, r, g, b, a, mask, ax;
+	uint32_t x;
+
+	mask = _mm256_set1_epi32(0xff);
+	ax = _mm256_set1_epi32(axor);
+	for (x = 0; x + 8 <= n; x += 8) {
+		p = _mm256_loadu_si256((const __m256i *) (src + 4 * x));
+		r = _mm256_i32gather_epi32((const int *) lut,
+		    _mm256_and_si256(p, mask), 4);
+		g = _mm256_i32gather_epi32((const int *) lut + 256,
+		    _mm256_and_si256(_mm256_srli_epi32(p, 8), mask), 4);
+		b = _mm256_i32gather_epi32((const int *) lut + 512,
+		    _mm256_and_si256(_mm256_srli_epi32(p, 16), mask), 4);
+		a = _mm256_xor_si256(_mm256_andnot_si256(
+		    _mm256_set1_epi32(0x00ffffff), p), ax);
+		p = _mm256_or_si256(_mm256_or_si256(r, g), _mm256_or_si256(b, a));
+		_mm256_storeu_si256((__m256i *) (dst + x), p);
+	}
+	_mm256_zeroupper();
+	convert_rgba8_lut(dst + x, src + 4 * x, n - x, axor, lut);
+}
+#endif	/* HAVE_X86_KERNELS */
+
+
+#ifdef HAVE_NEON_KERNELS
+static void
+unfilter_up_neon(uint8_t *row, const uint8_t *prior, size_t len, int bpp) {
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16)
+		vst1q_u8(row + i, vaddq_u8(vld1q_u8(row + i),
+		    vld1q_u8(prior + i)));
+	unfilter_up(row + i, prior + i, len - i, bpp);
+}
+
+
+/* structured loads split the channels, the store interleaves them again */
+static void
+convert_rgb8_neon(uint32_t *dst, const uint8_t *src, uint32_t n,
+    uint32_t axor) {
+	uint8x16x3_t in;
+	uint8x16x4_t out;
+	uint32_t x;
+
+	out.val[3] = vdupq_n_u8(0xff ^ (axor >> 24));
+	for (x = 0; x + 16 <= n; x += 16) {
+		in = vld3q_u8(src + 3 * x);
+		out.val[0] = in.val[2];
+		out.val[1] = in.val[1];
+		out.val[2] = in.val[0];
+		vst4q_u8((uint8_t *) (dst + x), out);
+	}
+	convert_rgb8(dst + x, src + 3 * x, n - x, axor);
+}
+
+
+static void
+convert_rgba8_neon(uint32_t *dst, const uint8_t *src, uint32_t n,
+    uint32_t axor) {
+	uint8x16x4_t in, out;
+	uint8x16_t ax;
+	uint32_t x;
+
+	ax = vdupq_n_u8(axor >> 24);
+	for (x = 0; x + 16 <= n; x += 16) {
+		in = vld4q_u8(src + 4 * x);
+		out.val[0] = in.val[2];
+		out.val[1] = in.val[1];
+		out.val[2] = in.val[0];
+		out.val[3] = veorq_u8(in.val[3], ax);
+		vst4q_u8((uint8_t *) (dst + x), out);
+	}
+	convert_rgba8(dst + x, src + 4 * x, n - x, axor);
+}
+#endif	/* HAVE_NEON_KERNELS */
+
+
+#if defined(__aarch64__) && defined(__GNUC__)
+/* the ARMv8 CRC32 instructions use the PNG/zlib polynomial */
+__attribute__((target("+crc"))) static uint32_t
+crc_armv8(uint32_t crc, const uint8_t *buf, size_t len) {
+	uint64_t v;
+
+	for (; len && ((uintptr_t) buf & 7); len--, buf++)
+		__asm__("crc32b %w0, %w0, %w1" : "+r" (crc) : "r" (*buf));
+	for (; len >= 8; len -= 8, buf += 8) {
+		memcpy(&v, buf, 8);
+		__asm__("crc32x %w0, %w0, %x1" : "+r" (crc) : "r" (v));
+	}
+	for (; len; len--, buf++)
+		__asm__("crc32b %w0, %w0, %w1" : "+r" (crc) : "r" (*buf));
+	return crc;
+}
+#endif
+
+
+int
+png_kernels_available(int level) {
+	if ((level < 0) || (level >= PNG_KERNELS_COUNT))
+		return 0;
+	return cpu_has(levels[level].needs);
+}
+
+
+const char *
+png_kernels_name(int level) {
+	if ((level < 0) || (level >= PNG_KERNELS_COUNT))
+		return "unknown";
+	return levels[level].name;
+}
+
+
+int
+png_kernels_get(void) {
+	return png_kernels_level;
+}
+
+
+/*
+ * Fill the kernel table. PNG_KERNELS_AUTO takes the widest instruction set
+ * the CPU has; an unavailable level falls back to scalar. Returns the level
+ * actually used. Contexts read the table unlocked, so changing it while
+ * other threads decode is not allowed.
+ */
+int
+png_kernels_init(int level) {
+	static const int preferred[] = {
+		PNG_KERNELS_AVX2, PNG_KERNELS_SSSE3, PNG_KERNELS_SSE2,
+		PNG_KERNELS_NEON
+	};
+	unsigned int use;
+	size_t i;
+
+	if (level == PNG_KERNELS_AUTO) {
+		level = PNG_KERNELS_SCALAR;
+		for (i = 0; i < sizeof(preferred) / sizeof(preferred[0]); i++) {
+			if (png_kernels_available(preferred[i])) {
+				level = preferred[i];
+				break;
+			}
+		}
+	}
+	if (!png_kernels_available(level))
+		level = PNG_KERNELS_SCALAR;
+	use = cpu_features() & levels[level].may_use;
+
+	png_kernels.unfilter[0] = NULL;
+	png_kernels.unfilter[1] = unfilter_sub;
+	png_kernels.unfilter[2] = unfilter_up;
+	png_kernels.unfilter[3] = unfilter_avg;
+	png_kernels.unfilter[4] = unfilter_paeth;
+	png_kernels.crc   = crc_scalar;
+	png_kernels.rgb8  = convert_rgb8;
+	png_kernels.rgba8 = convert_rgba8;
+	png_kernels.rgb8_lut  = convert_rgb8_lut;
+	png_kernels.rgba8_lut = convert_rgba8_lut;
+
+#ifdef HAVE_X86_KERNELS
+	if (use & CPU_SSE2) {
+		png_kernels.unfilter[1] = unfilter_sub_sse2;
+		png_kernels.unfilter[2] = unfilter_up_sse2;
+		png_kernels.unfilter[3] = unfilter_avg_sse2;
+		png_kernels.unfilter[4] = unfilter_paeth_sse2;
+		png_kernels.rgba8 = convert_rgba8_sse2;
+	}
+	if (use & CPU_SSSE3) {
+		png_kernels.rgb8  = convert_rgb8_ssse3;
+		png_kernels.rgba8 = convert_rgba8_ssse3;
+	}
+	if ((use & (CPU_SSE41 | CPU_PCLMUL)) == (CPU_SSE41 | CPU_PCLMUL))
+		png_kernels.crc = crc_pclmul;
+	if (use & CPU_AVX2) {
+		png_kernels.unfilter[2] = unfilter_up_avx2;
+		png_kernels.rgb8  = convert_rgb8_avx2;
+		png_kernels.rgba8 = convert_rgba8_avx2;
+		png_kernels.rgb8_lut  = convert_rgb8_lut_avx2;
+		png_kernels.rgba8_lut = convert_rgba8_lut_avx2;
+	}
+#endif
+#ifdef HAVE_NEON_KERNELS
+	if (use & CPU_NEON) {
+		png_kernels.unfilter[2] = unfilter_up_neon;
+		png_kernels.rgb8  = convert_rgb8_neon;
+		png_kernels.rgba8 = convert_rgba8_neon;
+	}
+#endif
+#if defined(__aarch64__) && defined(__GNUC__)
+	if (use & CPU_ARM_CRC32)
+		png_kernels.crc = crc_armv8;
+#endif
+#if !defined(HAVE_X86_KERNELS) && !defined(HAVE_NEON_KERNELS)
+	(void) use;
+#endif
+
+	png_kernels_level = level;
+	return level;
+}
@@ -0,0 +1,66 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PNG_KERNELS_H
+#define _PNG_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The codec's inner loops, private to it. png_kernels_init() fills the
+ * table with the best variant of each for the chosen instruction set.
+ */
+
+/* row, prior row, bytes in the row, bytes per pixel rounded up */
+typedef void (*png_unfilter_func)(uint8_t *, const uint8_t *, size_t, int);
+
+/* 0xAARRGGBB out, raw samples in, pixels, XOR mask applied to alpha */
+typedef void (*png_convert_func)(uint32_t *, const uint8_t *, uint32_t,
+    uint32_t);
+
+/*
+ * The same with the colour samples looked up in a table: 256 entries for
+ * red, green and blue each, already shifted into place.
+ */
+typedef void (*png_convert_lut_func)(uint32_t *, const uint8_t *, uint32_t,
+    uint32_t, const uint32_t *);
+
+struct png_kernels {
+	png_unfilter_func unfilter[5];		/* by filter type, 0 unused */
+
+	/* running ISO 3309 CRC, not inverted */
+	uint32_t	(*crc)(uint32_t, const uint8_t *, size_t);
+
+	png_convert_func rgb8;
+	png_convert_func rgba8;
+	png_convert_lut_func rgb8_lut;
+	png_convert_lut_func rgba8_lut;
+};
+
+extern struct png_kernels png_kernels;
+
+#endif	/* _PNG_KERNELS_H */
@@ -0,0 +1,297 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "png_codec.h"
+#include "png_batch.h"
+#include "prefetch.h"
+
+/* runs on a worker thread */
+static void
+prefetch_hook(struct png_batch_result *result, void *arg)
+{
+	struct prefetch *pf = arg;
+
+	result->data = pf->prepare(result->info, &result->data_size);
+	if (result->data != NULL)
+		result->info = NULL;
+}
+
+static void
+prefetch_hook_release(void *image, void *arg)
+{
+	struct prefetch *pf = arg;
+
+	pf->release(image);
+}
+
+static struct prefetch_entry *
+prefetch_lookup(struct prefetch *pf, const char *path)
+{
+	struct prefetch_entry *e;
+
+	TAILQ_FOREACH(e, &pf->entries, lru)
+		if (strcmp(e->path, path) == 0)
+			return e;
+	return NULL;
+}
+
+static void
+prefetch_remove(struct prefetch *pf, struct prefetch_entry *e)
+{
+	TAILQ_REMOVE(&pf->entries, e, lru);
+	if (e->image != NULL) {
+		pf->used -= e->bytes;
+		pf->release(e->image);
+	}
+	free(e);
+}
+
+/* drop the least recently used ready images until `need' more bytes fit */
+static void
+prefetch_evict(struct prefetch *pf, size_t need, struct prefetch_entry *keep)
+{
+	struct prefetch_entry *e, *prev;
+
+	for (e = TAILQ_LAST(&pf->entries, prefetch_entry_head);
+	    (e != NULL) && (pf->used + need > pf->budget); e = prev) {
+		prev = TAILQ_PREV(e, prefetch_entry_head, lru);
+		if ((e != keep) && (e->image != NULL))
+			prefetch_remove(pf, e);
+	}
+}
+
+/*
+ * Move finished decodes into the cache. With a job given, block until
+ * that one is in.
+ */
+static void
+prefetch_collect(struct prefetch *pf, int job)
+{
+	struct png_batch_result result;
+	struct prefetch_entry *e;
+
+	for (;;) {
+		if (!png_batch_next(pf->batch, &result, job >= 0))
+			break;
+		if (result.id == job)
+			job = -1;
+
+		TAILQ_FOREACH(e, &pf->entries, lru)
+			if (e->job == result.id)
+				break;
+		if ((e == NULL) || (result.data == NULL)) {
+			/* cancelled, or it failed and will be retried in full */
+			if (result.data != NULL)
+				pf->release(result.data);
+			png_dispose_png(result.info);
+			if (e != NULL)
+				prefetch_remove(pf, e);
+			continue;
+		}
+
+		e->job = -1;
+		e->image = result.data;
+		e->bytes = result.data_size;
+		prefetch_evict(pf, e->bytes, e);
+		pf->used += e->bytes;
+		if (pf->used > pf->budget)
+			prefetch_remove(pf, e);
+	}
+}
+
+bool
+prefetch_init(struct prefetch *pf, uint64_t budget, int workers,
+    prefetch_prepare_func prepare, prefetch_release_func release)
+{
+	memset(pf, 0, sizeof(*pf));
+	TAILQ_INIT(&pf->entries);
+	pf->prepare = prepare;
+	pf->release = release;
+	pf->budget = budget;
+	if (budget == 0)
+		return true;
+
+	pf->batch = png_batch_create(workers, 0);
+	if (pf->batch == NULL)
+		return false;
+	png_batch_set_hook(pf->batch, prefetch_hook, prefetch_hook_release, pf);
+	pf->enabled = true;
+	return true;
+}
+
+/* images bigger than this fail from their header, without decoding */
+void
+prefetch_set_limit(struct prefetch *pf, uint32_t width, uint32_t height)
+{
+	if (pf->batch != NULL)
+		png_batch_set_limit(pf->batch, width, height);
+}
+
+/* the display gamma the workers convert for */
+void
+prefetch_set_display_gamma(struct prefetch *pf, uint32_t gamma)
+{
+	if (pf->batch != NULL)
+		png_batch_set_display_gamma(pf->batch, gamma);
+}
+
+void
+prefetch_free(struct prefetch *pf)
+{
+	struct prefetch_entry *e;
+
+	/* stops the workers and throws away what they still had */
+	png_batch_destroy(pf->batch);
+	pf->batch = NULL;
+	while ((e = TAILQ_FIRST(&pf->entries)) != NULL)
+		prefetch_remove(pf, e);
+	pf->enabled = false;
+}
+
+/*
+ * The ready image for path, waiting for it if it is still being decoded;
+ * NULL if it has to be loaded the slow way. It stays the cache's.
+ */
+void *
+prefetch_get(struct prefetch *pf, const char *path)
+{
+	struct prefetch_entry *e;
+
+	if (!pf->enabled)
+		return NULL;
+
+	prefetch_collect(pf, -1);
+	e = prefetch_lookup(pf, path);
+	if ((e != NULL) && (e->image == NULL)) {
+		prefetch_collect(pf, e->job);
+		e = prefetch_lookup(pf, path);
+	}
+	if ((e == NULL) || (e->image == NULL)) {
+		pf->misses++;
+		return NULL;
+	}
+
+	pf->hits++;
+	TAILQ_REMOVE(&pf->entries, e, lru);
+	TAILQ_INSERT_HEAD(&pf->entries, e, lru);
+	return e->image;
+}
+
+/* hand over an image loaded the slow way, it is released if it won't fit */
+void
+prefetch_insert(struct prefetch *pf, const char *path, void *image,
+    size_t bytes)
+{
+	struct prefetch_entry *e;
+
+	if (!pf->enabled || (bytes > pf->budget) ||
+	    (prefetch_lookup(pf, path) != NULL) ||
+	    ((e = calloc(1, sizeof(*e))) == NULL)) {
+		pf->release(image);
+		return;
+	}
+
+	prefetch_evict(pf, bytes, NULL);
+	e->path = path;
+	e->image = image;
+	e->bytes = bytes;
+	e->job = -1;
+	pf->used += bytes;
+	TAILQ_INSERT_HEAD(&pf->entries, e, lru);
+}
+
+/*
+ * The images to have ready next, most wanted first. Decodes in flight for
+ * anything else are stale and get cancelled.
+ */
+void
+prefetch_want(struct prefetch *pf, const char **paths, int count)
+{
+	struct prefetch_entry *e, *next;
+	int i, job;
+
+	if (!pf->enabled)
+		return;
+
+	prefetch_collect(pf, -1);
+	for (e = TAILQ_FIRST(&pf->entries); e != NULL; e = next) {
+		next = TAILQ_NEXT(e, lru);
+		if (e->image != NULL)
+			continue;
+		for (i = 0; i < count; i++)
+			if (strcmp(e->path, paths[i]) == 0)
+				break;
+		if (i == count) {
+			png_batch_cancel(pf->batch, e->job);
+			prefetch_remove(pf, e);
+			pf->cancelled++;
+		}
+	}
+
+	/* backwards so the most wanted ends up most recently used */
+	for (i = count - 1; i >= 0; i--) {
+		e = prefetch_lookup(pf, paths[i]);
+		if (e != NULL) {
+			TAILQ_REMOVE(&pf->entries, e, lru);
+			TAILQ_INSERT_HEAD(&pf->entries, e, lru);
+			continue;
+		}
+		e = calloc(1, sizeof(*e));
+		if (e == NULL)
+			break;
+		job = png_batch_submit(pf->batch, paths[i], NULL);
+		if (job < 0) {
+			free(e);
+			break;
+		}
+		e->path = paths[i];
+		e->job = job;
+		TAILQ_INSERT_HEAD(&pf->entries, e, lru);
+	}
+}
+
+/* give all the memory back, e.g. when the codec ran out */
+void
+prefetch_flush(struct prefetch *pf)
+{
+	struct prefetch_entry *e;
+
+	if (!pf->enabled)
+		return;
+
+	while ((e = TAILQ_FIRST(&pf->entries)) != NULL) {
+		if (e->image == NULL) {
+			png_batch_cancel(pf->batch, e->job);
+			pf->cancelled++;
+		}
+		prefetch_remove(pf, e);
+	}
+}
@@ -0,0 +1,82 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PREFETCH_H
+#define _PREFETCH_H
+
+#include <sys/queue.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "png_codec.h"
+#include "png_batch.h"
+
+/*
+ * Images next to the one on screen are decoded and made ready for it on
+ * worker threads, then kept in an LRU cache bounded by a memory budget so
+ * that stepping to them only has to present them. A budget of 0 turns
+ * the whole thing off.
+ *
+ * The prepare function runs on a worker. It takes over the png_info when
+ * it returns an image, and sets the bytes that image holds.
+ */
+typedef void	*(*prefetch_prepare_func)(struct png_info *, size_t *);
+typedef void	 (*prefetch_release_func)(void *);
+
+struct prefetch_entry {
+	const char	*path;
+	void		*image;		/* NULL while being decoded */
+	size_t		 bytes;
+	int		 job;		/* png_batch id while being decoded */
+	TAILQ_ENTRY(prefetch_entry) lru;
+};
+
+struct prefetch {
+	bool		 enabled;
+	struct png_batch *batch;
+	prefetch_prepare_func prepare;
+	prefetch_release_func release;
+
+	uint64_t	 budget;
+	uint64_t	 used;		/* by ready images */
+	TAILQ_HEAD(prefetch_entry_head, prefetch_entry) entries; /* recent first */
+
+	uint64_t	 hits, misses, cancelled;
+};
+
+bool	prefetch_init(struct prefetch *, uint64_t, int, prefetch_prepare_func,
+	    prefetch_release_func);
+void	prefetch_set_limit(struct prefetch *, uint32_t, uint32_t);
+void	prefetch_set_display_gamma(struct prefetch *, uint32_t);
+void	prefetch_free(struct prefetch *);
+void	*prefetch_get(struct prefetch *, const char *);
+void	prefetch_insert(struct prefetch *, const char *, void *, size_t);
+void	prefetch_want(struct prefetch *, const char **, int);
+void	prefetch_flush(struct prefetch *);
+
+#endif	/* _PREFETCH_H */
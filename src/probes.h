@@ -0,0 +1,101 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PROBES_H
+#define _PROBES_H
+
+/*
+ * Static tracepoints, see probes.d for what they carry. The Makefile
+ * compiles them in wherever <sys/sdt.h> is found, where they cost a nop
+ * each until a tracer attaches; without USDT support they are nothing.
+ *
+ * WSDV_USDT_SDT uses <sys/sdt.h> as found with systemtap, perf and
+ * bpftrace on Linux; WSDV_USDT_DTRACE the header `dtrace -h' generates
+ * from probes.d.
+ */
+
+#if defined(WSDV_USDT_DTRACE)
+
+#include "probes_dtrace.h"
+
+#elif defined(WSDV_USDT_SDT)
+
+#include <sys/sdt.h>
+
+#define WSDV_LOAD_START(info, fd)				\
+	DTRACE_PROBE2(wsdv, load__start, info, fd)
+#define WSDV_LOAD_DONE(info, status)				\
+	DTRACE_PROBE2(wsdv, load__done, info, status)
+#define WSDV_CHUNK_START(info, type, length)			\
+	DTRACE_PROBE3(wsdv, chunk__start, info, type, length)
+#define WSDV_CHUNK_END(info, type, length, crc_ok)		\
+	DTRACE_PROBE4(wsdv, chunk__end, info, type, length, crc_ok)
+#define WSDV_INFLATE_START(info, in)				\
+	DTRACE_PROBE2(wsdv, inflate__start, info, in)
+#define WSDV_INFLATE_DONE(info, left, produced, result)	\
+	DTRACE_PROBE4(wsdv, inflate__done, info, left, produced, result)
+#define WSDV_PASS_START(info, pass)				\
+	DTRACE_PROBE2(wsdv, pass__start, info, pass)
+#define WSDV_ROW_DONE(info, pass, row)				\
+	DTRACE_PROBE3(wsdv, row__done, info, pass, row)
+#define WSDV_CONVERT_START(info, bits)				\
+	DTRACE_PROBE2(wsdv, convert__start, info, bits)
+#define WSDV_CONVERT_DONE(info, status)				\
+	DTRACE_PROBE2(wsdv, convert__done, info, status)
+
+#define WSDV_KEY(code, action)					\
+	DTRACE_PROBE2(wsdv, key, code, action)
+#define WSDV_DISPLAY_BEGIN(path)				\
+	DTRACE_PROBE1(wsdv, display__begin, path)
+#define WSDV_DISPLAY_END(path, ok, written)			\
+	DTRACE_PROBE3(wsdv, display__end, path, ok, written)
+#define WSDV_DISPLAY_CANCEL(path)				\
+	DTRACE_PROBE1(wsdv, display__cancel, path)
+#define WSDV_CMAP_SET(count)					\
+	DTRACE_PROBE1(wsdv, cmap__set, count)
+
+#else
+
+#define WSDV_LOAD_START(info, fd)			do { } while (0)
+#define WSDV_LOAD_DONE(info, status)			do { } while (0)
+#define WSDV_CHUNK_START(info, type, length)		do { } while (0)
+#define WSDV_CHUNK_END(info, type, length, crc_ok)	do { } while (0)
+#define WSDV_INFLATE_START(info, in)			do { } while (0)
+#define WSDV_INFLATE_DONE(info, left, produced, result)	do { } while (0)
+#define WSDV_PASS_START(info, pass)			do { } while (0)
+#define WSDV_ROW_DONE(info, pass, row)			do { } while (0)
+#define WSDV_CONVERT_START(info, bits)			do { } while (0)
+#define WSDV_CONVERT_DONE(info, status)			do { } while (0)
+
+#define WSDV_KEY(code, action)				do { } while (0)
+#define WSDV_DISPLAY_BEGIN(path)			do { } while (0)
+#define WSDV_DISPLAY_END(path, ok, written)		do { } while (0)
+#define WSDV_DISPLAY_CANCEL(path)			do { } while (0)
+#define WSDV_CMAP_SET(count)				do { } while (0)
+
+#endif
+
+#endif	/* _PROBES_H */
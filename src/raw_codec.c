@@ -0,0 +1,368 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "png_codec.h"
+#include "raw_codec.h"
+
+#define READ4_BE(pos) (((uint32_t) (pos)[0] << 24) | ((pos)[1] << 16) | ((pos)[2] << 8) | (pos)[3])
+
+/* QOI chunks, see the specification at qoiformat.org */
+#define QOI_OP_INDEX	0x00
+#define QOI_OP_DIFF	0x40
+#define QOI_OP_LUMA	0x80
+#define QOI_OP_RUN	0xc0
+#define QOI_OP_RGB	0xfe
+#define QOI_OP_RGBA	0xff
+#define QOI_MASK	0xc0
+#define QOI_HASH(p)	(((p)[0] * 3 + (p)[1] * 5 + (p)[2] * 7 + (p)[3] * 11) & 63)
+
+#define PNM_MAXVAL	65535
+
+
+int
+raw_sniff(const uint8_t *buf, size_t len) {
+	if (len < 8)
+		return RAW_FORMAT_NONE;
+	if (memcmp(buf, "qoif", 4) == 0)
+		return RAW_FORMAT_QOI;
+	if (memcmp(buf, "farbfeld", 8) == 0)
+		return RAW_FORMAT_FARBFELD;
+	if ((buf[0] == 'P') && (buf[1] >= '4') && (buf[1] <= '7') &&
+	    ((buf[2] == ' ') || (buf[2] == '\t') || (buf[2] == '\n') || (buf[2] == '\r')))
+		return RAW_FORMAT_PNM;
+	return RAW_FORMAT_NONE;
+}
+
+
+static int
+pnm_space(uint8_t c) {
+	return (c == ' ') || (c == '\t') || (c == '\n') || (c == '\r') || (c == '\v') || (c == '\f');
+}
+
+
+/*
+ * Next number of a P4-P6 header, past white space and comments; 1 with
+ * *at after it, 0 if the buffer ends first, -1 if it isn't one.
+ */
+static int
+pnm_number(const uint8_t *buf, size_t len, size_t *at, uint32_t *value) {
+	size_t pos;
+	uint64_t v;
+
+	pos = *at;
+	for (;;) {
+		if (pos >= len)
+			return 0;
+		if (buf[pos] == '#') {
+			while ((pos < len) && (buf[pos] != '\n'))
+				pos++;
+		} else if (pnm_space(buf[pos])) {
+			pos++;
+		} else {
+			break;
+		}
+	}
+	if ((buf[pos] < '0') || (buf[pos] > '9'))
+		return -1;
+	for (v = 0; (pos < len) && (buf[pos] >= '0') && (buf[pos] <= '9'); pos++) {
+		v = v * 10 + (buf[pos] - '0');
+		if (v > 0x7fffffff)
+			return -1;
+	}
+	/* a number has to be followed by something, the samples by one white space */
+	if (pos >= len)
+		return 0;
+	*at = pos;
+	*value = v;
+	return 1;
+}
+
+
+/* the header lines of a PAM up to ENDHDR */
+static int
+pam_read_header(const uint8_t *buf, size_t len, struct raw_header *header) {
+	const uint8_t *line, *end;
+	size_t pos, at;
+	uint32_t depth, *field;
+	int got;
+
+	depth = 0;
+	pos = 3;
+	for (;;) {
+		end = memchr(buf + pos, '\n', len - pos);
+		if (end == NULL)
+			return 0;
+		line = buf + pos;
+		pos = end - buf + 1;
+		while ((line < end) && pnm_space(*line))
+			line++;
+		if ((line == end) || (*line == '#'))
+			continue;
+		if ((end - line >= 6) && (memcmp(line, "ENDHDR", 6) == 0))
+			break;
+
+		field = NULL;
+		if ((end - line > 6) && (memcmp(line, "WIDTH", 5) == 0))
+			field = &header->width;
+		else if ((end - line > 7) && (memcmp(line, "HEIGHT", 6) == 0))
+			field = &header->height;
+		else if ((end - line > 6) && (memcmp(line, "DEPTH", 5) == 0))
+			field = &depth;
+		else if ((end - line > 7) && (memcmp(line, "MAXVAL", 6) == 0))
+			field = &header->maxval;
+		else if ((end - line > 8) && (memcmp(line, "TUPLTYPE", 8) == 0))
+			continue;		/* DEPTH tells all that matters */
+		else
+			return -1;
+
+		/* the value, the newline stops it */
+		at = 0;
+		while ((line + at < end) && (line[at] != ' ') && (line[at] != '\t'))
+			at++;
+		got = pnm_number(line, end - line + 1, &at, field);
+		if (got <= 0)
+			return -1;
+	}
+
+	switch (depth) {
+		case 1 : header->colourtype = PNG_COLOUR_GREY_ONLY;  break;
+		case 2 : header->colourtype = PNG_COLOUR_GREY_ALPHA; break;
+		case 3 : header->colourtype = PNG_COLOUR_RGB;	     break;
+		case 4 : header->colourtype = PNG_COLOUR_RGBA;	     break;
+		default :
+			return -1;
+	}
+	header->size = pos;
+	return 1;
+}
+
+
+int
+raw_read_header(int format, const uint8_t *buf, size_t len, struct raw_header *header) {
+	size_t at;
+	int got;
+
+	memset(header, 0, sizeof(*header));
+	switch (format) {
+		case RAW_FORMAT_QOI :
+			if (len < 14)
+				return 0;
+			header->width  = READ4_BE(buf + 4);
+			header->height = READ4_BE(buf + 8);
+			header->colourtype = (buf[12] == 4) ? PNG_COLOUR_RGBA : PNG_COLOUR_RGB;
+			header->bpp = 8;
+			header->linear = (buf[13] == 1);
+			header->maxval = 255;
+			header->size = 14;
+			if (((buf[12] != 3) && (buf[12] != 4)) || (buf[13] > 1))
+				return -1;
+			break;
+		case RAW_FORMAT_FARBFELD :
+			if (len < 16)
+				return 0;
+			header->width  = READ4_BE(buf + 8);
+			header->height = READ4_BE(buf + 12);
+			header->colourtype = PNG_COLOUR_RGBA;
+			header->bpp = 16;
+			header->maxval = PNM_MAXVAL;
+			header->size = 16;
+			break;
+		case RAW_FORMAT_PNM :
+			if (buf[1] == '7') {
+				got = pam_read_header(buf, len, header);
+				if (got <= 0)
+					return got;
+			} else {
+				at = 2;
+				got = pnm_number(buf, len, &at, &header->width);
+				if (got > 0)
+					got = pnm_number(buf, len, &at, &header->height);
+				header->maxval = 1;
+				if ((got > 0) && (buf[1] != '4'))
+					got = pnm_number(buf, len, &at, &header->maxval);
+				if (got <= 0)
+					return got;
+				if (!pnm_space(buf[at]))
+					return -1;
+				header->size = at + 1;
+				header->colourtype = (buf[1] == '6') ? PNG_COLOUR_RGB : PNG_COLOUR_GREY_ONLY;
+			}
+			if (!header->maxval || (header->maxval > PNM_MAXVAL))
+				return -1;
+			/* PBM is PNG's 1 bit grey, but for which way round */
+			header->bpp = (header->maxval > 255) ? 16 : 8;
+			if (buf[1] == '4')
+				header->bpp = 1;
+			break;
+		default :
+			return -1;
+	}
+
+	if (!header->width || !header->height ||
+	    (header->width > 0x7fffffff) || (header->height > 0x7fffffff))
+		return -1;
+	return 1;
+}
+
+
+void
+raw_start(struct raw_state *rs, uint8_t *out, size_t out_size) {
+	rs->out = out;
+	rs->out_pos = 0;
+	rs->out_size = out_size;
+	rs->px[0] = rs->px[1] = rs->px[2] = 0;
+	rs->px[3] = 255;
+	memset(rs->index, 0, sizeof(rs->index));
+	rs->run = 0;
+}
+
+
+static ptrdiff_t
+qoi_decode(struct raw_state *rs, const uint8_t *buf, size_t len) {
+	uint8_t *out, *px, b;
+	size_t pos, end;
+	int channels, dg;
+
+	channels = (rs->header.colourtype == PNG_COLOUR_RGBA) ? 4 : 3;
+	out = rs->out + rs->out_pos;
+	end = rs->out_size;
+	px = rs->px;
+	pos = 0;
+	while (rs->out_pos < end) {
+		if (rs->run) {
+			rs->run--;
+		} else {
+			if (pos >= len)
+				break;
+			b = buf[pos];
+			if (b == QOI_OP_RGB) {
+				if (len - pos < 4)
+					break;
+				px[0] = buf[pos+1];
+				px[1] = buf[pos+2];
+				px[2] = buf[pos+3];
+				pos += 4;
+			} else if (b == QOI_OP_RGBA) {
+				if (len - pos < 5)
+					break;
+				memcpy(px, buf + pos + 1, 4);
+				pos += 5;
+			} else if ((b & QOI_MASK) == QOI_OP_INDEX) {
+				memcpy(px, rs->index[b], 4);
+				pos++;
+			} else if ((b & QOI_MASK) == QOI_OP_DIFF) {
+				px[0] += ((b >> 4) & 3) - 2;
+				px[1] += ((b >> 2) & 3) - 2;
+				px[2] += ( b       & 3) - 2;
+				pos++;
+			} else if ((b & QOI_MASK) == QOI_OP_LUMA) {
+				if (len - pos < 2)
+					break;
+				dg = (b & 0x3f) - 32;
+				px[0] += dg - 8 + (buf[pos+1] >> 4);
+				px[1] += dg;
+				px[2] += dg - 8 + (buf[pos+1] & 15);
+				pos += 2;
+			} else {
+				rs->run = b & 0x3f;
+				pos++;
+			}
+			memcpy(rs->index[QOI_HASH(px)], px, 4);
+		}
+		memcpy(out, px, channels);
+		out += channels;
+		rs->out_pos += channels;
+	}
+	return pos;
+}
+
+
+/* samples scaled from maxval up to 255 or 65535 */
+static ptrdiff_t
+pnm_scale(struct raw_state *rs, const uint8_t *buf, size_t len) {
+	uint32_t maxval, v;
+	uint8_t *out;
+	size_t pos;
+
+	maxval = rs->header.maxval;
+	out = rs->out + rs->out_pos;
+	pos = 0;
+	if (rs->header.bpp == 8) {
+		len = (len < rs->out_size - rs->out_pos) ? len : rs->out_size - rs->out_pos;
+		for (; pos < len; pos++) {
+			v = buf[pos];
+			if (v > maxval)
+				return -1;
+			*out++ = (v * 255 + maxval / 2) / maxval;
+		}
+	} else {
+		for (; (pos + 2 <= len) && (rs->out_pos + pos < rs->out_size); pos += 2) {
+			v = (buf[pos] << 8) | buf[pos+1];
+			if (v > maxval)
+				return -1;
+			v = (v * 65535 + maxval / 2) / maxval;
+			*out++ = v >> 8;
+			*out++ = v;
+		}
+	}
+	rs->out_pos += pos;
+	return pos;
+}
+
+
+ptrdiff_t
+raw_decode(struct raw_state *rs, const uint8_t *buf, size_t len) {
+	size_t n, i;
+
+	if ((rs->format != RAW_FORMAT_QOI) &&
+	    (rs->header.maxval != 255) && (rs->header.maxval != PNM_MAXVAL) &&
+	    (rs->header.bpp != 1))
+		return pnm_scale(rs, buf, len);
+
+	switch (rs->format) {
+		case RAW_FORMAT_QOI :
+			return qoi_decode(rs, buf, len);
+		case RAW_FORMAT_FARBFELD :
+		case RAW_FORMAT_PNM :
+			/* PNG's layout already, bar PBM's black being 1 */
+			n = rs->out_size - rs->out_pos;
+			if (n > len)
+				n = len;
+			if (rs->header.bpp == 1) {
+				for (i = 0; i < n; i++)
+					rs->out[rs->out_pos + i] = ~buf[i];
+			} else {
+				memcpy(rs->out + rs->out_pos, buf, n);
+			}
+			rs->out_pos += n;
+			return n;
+	}
+	return -1;
+}
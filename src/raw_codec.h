@@ -0,0 +1,84 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _RAW_CODEC_H
+#define _RAW_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Decoders for the uncompressed and nearly uncompressed formats, private
+ * to the codec: the loader tells them by their signature and they fill
+ * in the same png_info a PNG would, samples laid out as PNG rows, so
+ * conversion and blitting can't tell the difference.
+ */
+
+#define RAW_FORMAT_NONE		0
+#define RAW_FORMAT_QOI		1	/* the Quite OK Image format */
+#define RAW_FORMAT_FARBFELD	2
+#define RAW_FORMAT_PNM		3	/* PAM, PPM, PGM and raw PBM */
+
+/* what the header says, in png_info terms */
+struct raw_header {
+	uint32_t	 width, height;
+	uint8_t		 colourtype;		/* PNG_COLOUR_* */
+	uint8_t		 bpp;			/* bits per sample */
+	uint8_t		 linear;		/* samples are not gamma encoded */
+	uint32_t	 maxval;		/* PNM: samples are scaled from it */
+	uint32_t	 size;			/* bytes before the samples */
+};
+
+struct raw_state {
+	int		 format;
+	struct raw_header header;
+
+	/* the image, PNG row layout */
+	uint8_t		*out;
+	size_t		 out_pos, out_size;
+
+	/* QOI */
+	uint8_t		 px[4];
+	uint8_t		 index[64][4];
+	uint32_t	 run;
+};
+
+/* RAW_FORMAT_* from the start of a file, at least 8 bytes of it */
+int	raw_sniff(const uint8_t *, size_t);
+
+/* 1 with the header read, 0 if it needs more bytes, -1 if it isn't sound */
+int	raw_read_header(int, const uint8_t *, size_t, struct raw_header *);
+
+/*
+ * Decode the samples following the header into out; returns the bytes
+ * of the buffer used, -1 on a broken stream. The image is complete when
+ * out_pos reaches out_size.
+ */
+void	raw_start(struct raw_state *, uint8_t *, size_t);
+ptrdiff_t raw_decode(struct raw_state *, const uint8_t *, size_t);
+
+#endif	/* _RAW_CODEC_H */
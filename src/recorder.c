@@ -0,0 +1,259 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "recorder.h"
+#include "display.h"
+
+
+/* record a screen of width x height pixels in pixfmt into path */
+bool
+recorder_open(struct recorder *rec, const char *path, uint32_t width,
+    uint32_t height, int pixfmt)
+{
+	uint8_t *blob;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->fd = -1;
+	rec->path = path;
+	rec->width = width;
+	rec->height = height;
+	rec->pixel_bytes = blit_pixfmt_bytes(pixfmt);
+	rec->unpack = blit_select_unpack(pixfmt);
+	if ((rec->unpack == NULL) || (rec->pixel_bytes == 0)) {
+		fprintf(stderr, "Can't record a %s screen\n",
+		    blit_pixfmt_name(pixfmt));
+		return false;
+	}
+
+	rec->last = malloc((size_t) width * height * rec->pixel_bytes);
+	blob = malloc((size_t) width * height * sizeof(uint32_t));
+	rec->png = png_create_png_context();
+	if ((rec->last == NULL) || (blob == NULL) || (rec->png == NULL)) {
+		fprintf(stderr, "Out of memory for recording\n");
+		free(blob);
+		recorder_close(rec, 0);
+		return false;
+	}
+	/* the blob now belongs to the context */
+	png_populate_with_image(rec->png, PNG_COLOUR_RGBA_EI, blob, 8,
+	    width, height);
+	png_set_animate(rec->png, 1);
+
+	rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (rec->fd < 0) {
+		perror(path);
+		recorder_close(rec, 0);
+		return false;
+	}
+	return true;
+}
+
+
+/* the pending frame, shown for `shown' ns */
+static bool
+recorder_write(struct recorder *rec, uint64_t shown)
+{
+	struct png_frame *frame;
+	png_file_status status;
+	uint64_t ms;
+
+	frame = &rec->pending;
+	ms = (shown + 500000) / 1000000;
+	if (ms <= 0xffff) {
+		frame->delay_num = ms;
+		frame->delay_den = 1000;
+	} else {
+		frame->delay_num = (ms / 10 > 0xffff) ? 0xffff : ms / 10;
+		frame->delay_den = 100;
+	}
+	frame->index = rec->frames;
+
+	status = png_save_frame(rec->png, frame);
+	if (!(status & PNG_FILE_ERROR) && !rec->saving) {
+		status = png_start_saving(rec->png, rec->fd);
+		rec->saving = true;
+	}
+	while ((status & PNG_FILE_SAVING) && !(status & PNG_FILE_FRAME) &&
+	    !(status & PNG_FILE_ERROR))
+		status = png_save_a_piece(rec->png);
+	if (status & PNG_FILE_ERROR) {
+		fprintf(stderr, "Error writing recording %s, status %x\n",
+		    rec->path, status);
+		return false;
+	}
+	rec->has_pending = false;
+	rec->frames++;
+	rec->pixels += (uint64_t) frame->rect.width * frame->rect.height;
+	return true;
+}
+
+
+/* columns [*left, *right) where two rows of n bytes differ, false if none */
+static bool
+recorder_row_diff(const uint8_t *a, const uint8_t *b, uint32_t n,
+    uint32_t *left, uint32_t *right)
+{
+	uint32_t l, r;
+
+	if (memcmp(a, b, n) == 0)
+		return false;
+	for (l = 0; a[l] == b[l]; l++)
+		;
+	for (r = n; a[r - 1] == b[r - 1]; r--)
+		;
+	*left = l;
+	*right = r;
+	return true;
+}
+
+
+/*
+ * Take a sample of the screen, `stride' bytes a row, at `now'. Anything
+ * that changed since the last one makes a new frame of the box around
+ * it, and writes out the frame before. False once recording failed.
+ */
+bool
+recorder_sample(struct recorder *rec, const uint8_t *pixels, uint32_t stride,
+    const struct display_cmap *cmap, uint64_t now)
+{
+	struct png_rect box;
+	const uint8_t *src;
+	uint8_t *last;
+	uint32_t *dst, rgb, y, left, right, row_bytes, pb;
+	uint32_t x0, x1, y0, y1, i;
+	bool all;
+
+	if (rec->png == NULL)
+		return false;
+	rec->samples++;
+	pb = rec->pixel_bytes;
+	row_bytes = rec->width * pb;
+
+	/* before the first frame and after a colour map change all of it is new */
+	all = (rec->frames == 0) && !rec->has_pending;
+	if (cmap != NULL) {
+		for (i = 0; i < cmap->count; i++) {
+			rgb = (cmap->red[i] << 16) | (cmap->green[i] << 8) |
+			    cmap->blue[i];
+			if (rgb != rec->cmap[i]) {
+				rec->cmap[i] = rgb;
+				all = true;
+			}
+		}
+	}
+
+	x0 = y0 = UINT32_MAX;
+	x1 = y1 = 0;
+	if (all) {
+		x0 = y0 = 0;
+		x1 = row_bytes;
+		y1 = rec->height;
+	} else {
+		for (y = 0; y < rec->height; y++) {
+			if (!recorder_row_diff(pixels + (size_t) y * stride,
+			    rec->last + (size_t) y * row_bytes, row_bytes,
+			    &left, &right))
+				continue;
+			if (y0 == UINT32_MAX)
+				y0 = y;
+			y1 = y + 1;
+			if (left < x0)
+				x0 = left;
+			if (right > x1)
+				x1 = right;
+		}
+		if (y0 == UINT32_MAX)
+			return true;
+	}
+
+	/* the frame before is over now */
+	if (rec->has_pending && !recorder_write(rec, now - rec->pending_ns)) {
+		rec->has_pending = rec->saving = false;
+		recorder_close(rec, now);
+		return false;
+	}
+
+	box.x = x0 / pb;
+	box.y = y0;
+	box.width = (x1 + pb - 1) / pb - box.x;
+	box.height = y1 - y0;
+	for (y = box.y; y < y1; y++) {
+		src = pixels + (size_t) y * stride + box.x * pb;
+		last = rec->last + (size_t) y * row_bytes + box.x * pb;
+		dst = (uint32_t *) rec->png->blob + (size_t) y * rec->width +
+		    box.x;
+		memcpy(last, src, box.width * pb);
+		rec->unpack(dst, src, rec->cmap, box.width);
+	}
+
+	memset(&rec->pending, 0, sizeof(rec->pending));
+	rec->pending.rect = box;
+	rec->pending.dispose_op = PNG_DISPOSE_NONE;
+	rec->pending.blend_op = PNG_BLEND_SOURCE;
+	rec->pending_ns = now;
+	rec->has_pending = true;
+	return true;
+}
+
+
+/* write the last frame, shown until `now', and finish the file */
+bool
+recorder_close(struct recorder *rec, uint64_t now)
+{
+	png_file_status status;
+	bool ok;
+
+	ok = (rec->png != NULL);
+	if (ok && rec->has_pending)
+		ok = recorder_write(rec, now - rec->pending_ns);
+	if (ok && rec->saving) {
+		status = png_save_end(rec->png);
+		while ((status & PNG_FILE_SAVING) && !(status & PNG_FILE_ERROR))
+			status = png_save_a_piece(rec->png);
+		if (status & PNG_FILE_ERROR) {
+			fprintf(stderr, "Error finishing recording %s, "
+			    "status %x\n", rec->path, status);
+			ok = false;
+		}
+	}
+
+	if (rec->fd >= 0)
+		close(rec->fd);
+	rec->fd = -1;
+	png_dispose_png(rec->png);
+	rec->png = NULL;
+	free(rec->last);
+	rec->last = NULL;
+	return ok;
+}
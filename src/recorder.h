@@ -0,0 +1,78 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _RECORDER_H
+#define _RECORDER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "png_codec.h"
+#include "blit.h"
+
+/*
+ * What the screen shows, recorded into an APNG. The screen is sampled
+ * every interval and compared with the sample before; only the box
+ * around what changed is converted and compressed, as a frame that
+ * stays up until the next change. A frame is written once the next
+ * change, or the end, tells how long it was shown.
+ */
+#define RECORDER_INTERVAL	(100 * 1000000)	/* ns between samples */
+
+struct recorder {
+	struct png_info	*png;		/* the screen as rgba32 in its blob */
+	int		 fd;
+	const char	*path;
+	blit_unpack_func unpack;
+	uint8_t		*last;		/* last sample, framebuffer layout */
+	uint32_t	 width, height;
+	uint32_t	 pixel_bytes;
+	uint32_t	 cmap[256];	/* 0x00RRGGBB, for CI8 */
+	bool		 saving;
+
+	/* sampled, not written yet */
+	bool		 has_pending;
+	struct png_frame pending;
+	uint64_t	 pending_ns;
+
+	uint64_t	 due;		/* of the next sample */
+
+	/* what it cost */
+	uint64_t	 samples;
+	uint64_t	 frames;
+	uint64_t	 pixels;	/* converted and compressed */
+};
+
+struct display_cmap;
+
+bool	recorder_open(struct recorder *, const char *, uint32_t, uint32_t,
+	    int);
+bool	recorder_sample(struct recorder *, const uint8_t *, uint32_t,
+	    const struct display_cmap *, uint64_t);
+bool	recorder_close(struct recorder *, uint64_t);
+
+#endif	/* _RECORDER_H */
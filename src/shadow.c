@@ -0,0 +1,223 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "blit.h"
+#include "shadow.h"
+
+
+bool
+shadow_init(struct shadow *sh, uint32_t width, uint32_t height,
+    uint32_t pixel_bytes)
+{
+	memset(sh, 0, sizeof(*sh));
+	sh->width = width;
+	sh->height = height;
+	sh->pixel_bytes = pixel_bytes;
+	sh->stride = width * pixel_bytes;
+
+	sh->pixels = malloc((size_t) sh->stride * height);
+	sh->scratch = malloc(sh->stride + 8);
+	if (!sh->pixels || !sh->scratch) {
+		shadow_free(sh);
+		return false;
+	}
+	return true;
+}
+
+
+void
+shadow_free(struct shadow *sh)
+{
+	free(sh->pixels);
+	free(sh->scratch);
+	sh->pixels = sh->scratch = NULL;
+	sh->valid = false;
+}
+
+
+/* screen got changed behind our back, next presentation redraws it all */
+void
+shadow_invalidate(struct shadow *sh)
+{
+	sh->valid = false;
+}
+
+
+/* clear [x, x + w) of screen row y */
+static void
+clear_span(struct shadow *sh, uint32_t y, uint32_t x, uint32_t w)
+{
+	uint32_t off, len;
+
+	if (w == 0)
+		return;
+	off = x * sh->pixel_bytes;
+	len = w * sh->pixel_bytes;
+	blit_fill(sh->fb + (size_t) y * sh->fb_stride + off, 0, len);
+	memset(sh->pixels + (size_t) y * sh->stride + off, 0, len);
+	sh->bytes_written += len;
+}
+
+
+/*
+ * Start presenting an image at (x, y) sized w x h. Only the parts of the
+ * previous image that the new one doesn't cover are cleared.
+ */
+void
+shadow_begin(struct shadow *sh, uint8_t *fb, uint32_t fb_stride,
+    uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+	uint32_t row, left, right, oright, nright;
+
+	sh->fb = fb;
+	sh->fb_stride = fb_stride;
+	sh->nx = x; sh->ny = y; sh->nw = w; sh->nh = h;
+	sh->bytes_written = 0;
+	sh->rows_skipped = 0;
+	sh->partial = false;
+
+	if (!sh->valid) {
+		/* unknown contents; start from a black screen */
+		for (row = 0; row < sh->height; row++)
+			clear_span(sh, row, 0, sh->width);
+		sh->x = sh->y = sh->w = sh->h = 0;
+		sh->valid = true;
+	}
+
+	oright = sh->x + sh->w;
+	nright = x + w;
+	for (row = sh->y; row < sh->y + sh->h; row++) {
+		if ((row < y) || (row >= y + h)) {
+			clear_span(sh, row, sh->x, sh->w);
+			continue;
+		}
+		/* parts left and right of the new image */
+		if (sh->x < x) {
+			right = (oright < x) ? oright : x;
+			clear_span(sh, row, sh->x, right - sh->x);
+		}
+		if (oright > nright) {
+			left = (sh->x > nright) ? sh->x : nright;
+			clear_span(sh, row, left, oright - left);
+		}
+	}
+}
+
+
+/*
+ * Redraw the part (x, y) sized w x h of the image being shown, rows
+ * relative to it; nothing around it is cleared. Animation frames are put
+ * on the screen this way.
+ */
+void
+shadow_begin_update(struct shadow *sh, uint8_t *fb, uint32_t fb_stride,
+    uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+	sh->fb = fb;
+	sh->fb_stride = fb_stride;
+	sh->nx = x; sh->ny = y; sh->nw = w; sh->nh = h;
+	sh->bytes_written = 0;
+	sh->rows_skipped = 0;
+	sh->partial = true;
+}
+
+
+/*
+ * Present image row `row' from the scratch buffer; compared with what is
+ * shown, rows that are the same are skipped and others only get the
+ * differing span written.
+ */
+void
+shadow_put_row(struct shadow *sh, uint32_t row)
+{
+	shadow_put_row_from(sh, row, sh->scratch);
+}
+
+
+/* the same for a row that is already in the framebuffer's format */
+void
+shadow_put_row_from(struct shadow *sh, uint32_t row, const uint8_t *a)
+{
+	const uint8_t *b;
+	uint64_t wa, wb;
+	uint32_t len, first, last, pb, sy;
+	uint8_t *shadow_row;
+
+	sy = sh->ny + row;
+	pb = sh->pixel_bytes;
+	len = sh->nw * pb;
+	shadow_row = sh->pixels + (size_t) sy * sh->stride + sh->nx * pb;
+	b = shadow_row;
+
+	/* narrow down to the span that differs */
+	for (first = 0; first + 8 <= len; first += 8) {
+		memcpy(&wa, a + first, 8);
+		memcpy(&wb, b + first, 8);
+		if (wa != wb)
+			break;
+	}
+	while ((first < len) && (a[first] == b[first]))
+		first++;
+	if (first == len) {
+		sh->rows_skipped++;
+		return;
+	}
+	for (last = len; last >= first + 8; last -= 8) {
+		memcpy(&wa, a + last - 8, 8);
+		memcpy(&wb, b + last - 8, 8);
+		if (wa != wb)
+			break;
+	}
+	while (a[last - 1] == b[last - 1])
+		last--;
+
+	/* whole pixels only */
+	first -= first % pb;
+	last += (pb - last % pb) % pb;
+
+	blit_copy(sh->fb + (size_t) sy * sh->fb_stride + sh->nx * pb + first,
+	    a + first, last - first);
+	memcpy(shadow_row + first, a + first, last - first);
+	sh->bytes_written += last - first;
+}
+
+
+void
+shadow_end(struct shadow *sh)
+{
+	blit_fence();
+	if (sh->partial) {
+		sh->partial = false;
+		return;
+	}
+	sh->x = sh->nx; sh->y = sh->ny;
+	sh->w = sh->nw; sh->h = sh->nh;
+}
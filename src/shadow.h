@@ -0,0 +1,78 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SHADOW_H
+#define _SHADOW_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * RAM copy of what is on the framebuffer. Images are presented through it
+ * so only the letterbox parts that change get cleared and only the parts
+ * of rows that differ from what is already shown get written.
+ */
+struct shadow {
+	uint8_t		*pixels;	/* packed rows, framebuffer layout */
+	uint8_t		*scratch;	/* row being presented */
+	uint32_t	 width, height;
+	uint32_t	 pixel_bytes;
+	uint32_t	 stride;
+	bool		 valid;		/* screen matches the shadow */
+
+	/* image currently shown */
+	uint32_t	 x, y, w, h;
+
+	/* presentation in progress */
+	uint8_t		*fb;
+	uint32_t	 fb_stride;
+	uint32_t	 nx, ny, nw, nh;
+	bool		 partial;	/* a part of the image shown */
+
+	/* statistics for the last presentation */
+	uint64_t	 bytes_written;
+	uint32_t	 rows_skipped;
+};
+
+bool	shadow_init(struct shadow *, uint32_t, uint32_t, uint32_t);
+void	shadow_free(struct shadow *);
+void	shadow_invalidate(struct shadow *);
+void	shadow_begin(struct shadow *, uint8_t *, uint32_t,
+	    uint32_t, uint32_t, uint32_t, uint32_t);
+void	shadow_begin_update(struct shadow *, uint8_t *, uint32_t,
+	    uint32_t, uint32_t, uint32_t, uint32_t);
+void	shadow_put_row(struct shadow *, uint32_t);
+void	shadow_put_row_from(struct shadow *, uint32_t, const uint8_t *);
+void	shadow_end(struct shadow *);
+
+/* presentation target for row y of the image, filled by a row blitter */
+static inline uint8_t *
+shadow_row_buffer(struct shadow *sh)
+{
+	return sh->scratch;
+}
+
+#endif	/* _SHADOW_H */
@@ -0,0 +1,321 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "stats.h"
+#include "latency.h"
+
+static const char *stage_names[STATS_STAGES] = {
+	"open", "read", "crc", "inflate", "defilter", "decode", "convert",
+	"clear", "blit", "total"
+};
+
+static const char *from_names[STATS_FROMS] = {
+	"decoder", "prefetch", "packed", "disk"
+};
+
+void
+stats_init(struct stats *st, bool print, FILE *json)
+{
+	memset(st, 0, sizeof(*st));
+	st->print = print;
+	st->json = json;
+	st->enabled = print || (json != NULL);
+}
+
+void
+stats_begin(struct stats *st, const char *path)
+{
+	if (!st->enabled)
+		return;
+
+	memset(&st->cur, 0, sizeof(st->cur));
+	st->path = path;
+	st->width = st->height = 0;
+	st->ok = false;
+	st->from = STATS_FROM_DECODER;
+	st->start = st->mark = latency_clock();
+}
+
+/* the stage that started at the previous mark has finished */
+void
+stats_mark(struct stats *st, int stage)
+{
+	uint64_t now;
+
+	if (!st->enabled)
+		return;
+
+	now = latency_clock();
+	st->cur.ns[stage] += now - st->mark;
+	st->mark = now;
+}
+
+/* take over what the codec counted while loading */
+void
+stats_codec(struct stats *st, const struct png_info *info)
+{
+	if (!st->enabled)
+		return;
+
+	st->cur.ns[STATS_READ]     = info->stats.read_ns;
+	st->cur.ns[STATS_CRC]      = info->stats.crc_ns;
+	st->cur.ns[STATS_INFLATE]  = info->stats.inflate_ns;
+	st->cur.ns[STATS_DEFILTER] = info->stats.defilter_ns;
+	st->cur.bytes_read = info->stats.bytes_read;
+	st->width = info->width;
+	st->height = info->height;
+}
+
+/* time it took to get the file open */
+void
+stats_open(struct stats *st, uint64_t ns)
+{
+	if (!st->enabled)
+		return;
+
+	st->cur.ns[STATS_OPEN] = ns;
+}
+
+/* came out of one of the caches, the codec's stages were off the clock */
+void
+stats_from(struct stats *st, int from, uint32_t width, uint32_t height)
+{
+	if (!st->enabled)
+		return;
+
+	st->from = from;
+	st->width = width;
+	st->height = height;
+}
+
+/* heap the context needed, conversion included */
+void
+stats_memory(struct stats *st, const struct png_info *info)
+{
+	if (!st->enabled)
+		return;
+
+	st->cur.mem_peak = info->stats.mem_peak;
+}
+
+/* the image made it to the screen */
+void
+stats_screen(struct stats *st, uint64_t bytes_written)
+{
+	if (!st->enabled)
+		return;
+
+	st->cur.bytes_written = bytes_written;
+	st->cur.pixels = (uint64_t) st->width * st->height;
+	st->ok = true;
+}
+
+static void
+json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if ((*s == '"') || (*s == '\\'))
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static void
+json_counters(FILE *f, const struct stats_counters *c)
+{
+	int i;
+
+	for (i = 0; i < STATS_STAGES; i++)
+		fprintf(f, ",\"%s_us\":%.1f", stage_names[i], c->ns[i] / 1e3);
+	fprintf(f, ",\"bytes_read\":%llu,\"bytes_written\":%llu,\"pixels\":%llu"
+	    ",\"mem_peak\":%llu", (unsigned long long) c->bytes_read,
+	    (unsigned long long) c->bytes_written,
+	    (unsigned long long) c->pixels,
+	    (unsigned long long) c->mem_peak);
+}
+
+static void
+print_counters(const char *what, const struct stats_counters *c)
+{
+	int i;
+
+	printf("%s:", what);
+	for (i = 0; i < STATS_STAGES; i++)
+		printf(" %s %.2f", stage_names[i], c->ns[i] / 1e6);
+	printf(" ms, memory %llu KiB\n",
+	    (unsigned long long) (c->mem_peak + 1023) / 1024);
+}
+
+void
+stats_end(struct stats *st)
+{
+	int i;
+
+	if (!st->enabled)
+		return;
+
+	st->cur.ns[STATS_TOTAL] = latency_clock() - st->start;
+
+	st->images++;
+	if (!st->ok)
+		st->failed++;
+	st->served[st->from]++;
+	for (i = 0; i < STATS_STAGES; i++)
+		st->total.ns[i] += st->cur.ns[i];
+	st->total.bytes_read += st->cur.bytes_read;
+	st->total.bytes_written += st->cur.bytes_written;
+	st->total.pixels += st->cur.pixels;
+	if (st->cur.mem_peak > st->total.mem_peak)
+		st->total.mem_peak = st->cur.mem_peak;
+
+	if (st->print) {
+		printf("%s %ux%u", st->path, st->width, st->height);
+		if (st->from != STATS_FROM_DECODER)
+			printf(" from %s", from_names[st->from]);
+		printf("%s\n", st->ok ? "" : " failed");
+		print_counters("  stages", &st->cur);
+	}
+	if (st->json) {
+		fprintf(st->json, "{\"type\":\"image\",\"path\":");
+		json_string(st->json, st->path);
+		fprintf(st->json, ",\"width\":%u,\"height\":%u,\"ok\":%s"
+		    ",\"from\":\"%s\"", st->width, st->height,
+		    st->ok ? "true" : "false", from_names[st->from]);
+		json_counters(st->json, &st->cur);
+		fprintf(st->json, "}\n");
+		fflush(st->json);
+	}
+}
+
+/* the image was given up for another one before it got to the screen */
+void
+stats_cancel(struct stats *st)
+{
+	uint64_t ns;
+
+	if (!st->enabled)
+		return;
+
+	ns = latency_clock() - st->start;
+	st->cancelled++;
+	if (st->print)
+		printf("%s cancelled after %.2f ms\n", st->path, ns / 1e6);
+	if (st->json) {
+		fprintf(st->json, "{\"type\":\"cancel\",\"path\":");
+		json_string(st->json, st->path);
+		fprintf(st->json, ",\"after_us\":%.1f}\n", ns / 1e3);
+		fflush(st->json);
+	}
+}
+
+/*
+ * An animation stopped after `frames' frames in `ns', `dropped' of them
+ * composed but never shown because their time had passed.
+ */
+void
+stats_animation(struct stats *st, const char *path, uint64_t frames,
+    uint64_t dropped, uint64_t ns)
+{
+	if (!st->enabled)
+		return;
+
+	st->frames += frames;
+	st->dropped += dropped;
+	if (st->print)
+		printf("%s played %llu frames, %llu dropped, %.1f frames/s\n",
+		    path, (unsigned long long) frames,
+		    (unsigned long long) dropped,
+		    ns ? (frames - dropped) * 1e9 / ns : 0.0);
+	if (st->json) {
+		fprintf(st->json, "{\"type\":\"animation\",\"path\":");
+		json_string(st->json, path);
+		fprintf(st->json, ",\"frames\":%llu,\"dropped\":%llu"
+		    ",\"played_us\":%.1f}\n", (unsigned long long) frames,
+		    (unsigned long long) dropped, ns / 1e3);
+		fflush(st->json);
+	}
+}
+
+void
+stats_summary(struct stats *st)
+{
+	struct png_memory memory;
+	double secs;
+	int i;
+
+	if (!st->enabled)
+		return;
+
+	png_get_memory(&memory);
+	secs = st->total.ns[STATS_TOTAL] / 1e9;
+	if (st->print) {
+		printf("%llu images, %llu failed, %llu cancelled, "
+		    "%.1f Mpixel/s, codec memory peak %llu KiB\n",
+		    (unsigned long long) st->images,
+		    (unsigned long long) st->failed,
+		    (unsigned long long) st->cancelled,
+		    secs > 0 ? st->total.pixels / secs / 1e6 : 0.0,
+		    (unsigned long long) (memory.peak + 1023) / 1024);
+		printf("  from:");
+		for (i = 0; i < STATS_FROMS; i++)
+			printf(" %s %llu", from_names[i],
+			    (unsigned long long) st->served[i]);
+		printf("\n");
+		if (st->frames)
+			printf("  animation frames %llu, dropped %llu\n",
+			    (unsigned long long) st->frames,
+			    (unsigned long long) st->dropped);
+		print_counters("  total", &st->total);
+	}
+	if (st->json) {
+		fprintf(st->json, "{\"type\":\"summary\",\"images\":%llu,"
+		    "\"failed\":%llu,\"cancelled\":%llu,"
+		    "\"frames\":%llu,\"dropped\":%llu,"
+		    "\"codec_mem_peak\":%llu",
+		    (unsigned long long) st->images,
+		    (unsigned long long) st->failed,
+		    (unsigned long long) st->cancelled,
+		    (unsigned long long) st->frames,
+		    (unsigned long long) st->dropped,
+		    (unsigned long long) memory.peak);
+		for (i = 0; i < STATS_FROMS; i++)
+			fprintf(st->json, ",\"from_%s\":%llu", from_names[i],
+			    (unsigned long long) st->served[i]);
+		json_counters(st->json, &st->total);
+		fprintf(st->json, "}\n");
+		fflush(st->json);
+	}
+}
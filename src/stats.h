@@ -0,0 +1,104 @@
+/*-
+ * Copyright (c) 2012 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "png_codec.h"
+
+/*
+ * Where the time goes while an image is put on the screen. Opening the
+ * file and the four stages after it come from fileio and the codec's
+ * png_stats and are part of decode; the rest are timed by wsdv itself.
+ */
+
+#define STATS_OPEN	0	/* open() and readahead hints */
+#define STATS_READ	1
+#define STATS_CRC	2
+#define STATS_INFLATE	3
+#define STATS_DEFILTER	4
+#define STATS_DECODE	5	/* all of png_load() */
+#define STATS_CONVERT	6
+#define STATS_CLEAR	7	/* letterbox around the image */
+#define STATS_BLIT	8
+#define STATS_TOTAL	9
+#define STATS_STAGES	10
+
+/* where an image came from, all but the decoder skip its stages */
+#define STATS_FROM_DECODER	0
+#define STATS_FROM_PREFETCH	1	/* ready from the prefetcher */
+#define STATS_FROM_PACKED	2	/* the compressed in-RAM tier */
+#define STATS_FROM_DISK		3	/* the disk cache */
+#define STATS_FROMS		4
+
+struct stats_counters {
+	uint64_t	 ns[STATS_STAGES];
+	uint64_t	 bytes_read;
+	uint64_t	 bytes_written;	/* to the framebuffer */
+	uint64_t	 pixels;
+	uint64_t	 mem_peak;	/* codec heap, the largest for totals */
+};
+
+struct stats {
+	bool		 enabled;
+	bool		 print;		/* human readable, to stdout */
+	FILE		*json;		/* JSON lines, NULL for none */
+
+	/* image in progress */
+	const char	*path;
+	uint32_t	 width, height;
+	bool		 ok;
+	int		 from;		/* STATS_FROM_* */
+	uint64_t	 start, mark;
+	struct stats_counters cur;
+
+	/* session */
+	uint64_t	 images, failed;
+	uint64_t	 cancelled;	/* skipped before they were shown */
+	uint64_t	 served[STATS_FROMS];	/* images by where they came from */
+	uint64_t	 frames, dropped;	/* of animations */
+	struct stats_counters total;
+};
+
+void	stats_init(struct stats *, bool, FILE *);
+void	stats_begin(struct stats *, const char *);
+void	stats_mark(struct stats *, int);
+void	stats_codec(struct stats *, const struct png_info *);
+void	stats_open(struct stats *, uint64_t);
+void	stats_from(struct stats *, int, uint32_t, uint32_t);
+void	stats_screen(struct stats *, uint64_t);
+void	stats_memory(struct stats *, const struct png_info *);
+void	stats_end(struct stats *);
+void	stats_cancel(struct stats *);
+void	stats_animation(struct stats *, const char *, uint64_t, uint64_t,
+	    uint64_t);
+void	stats_summary(struct stats *);
+
+#endif	/* _STATS_H */
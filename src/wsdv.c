@@ -30,146 +30,202 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <string.h>
-#include <err.h>
-
-#include <sys/syslimits.h>
-#include <sys/ioctl.h>
-#include <sys/mman.h>
-#include <sys/queue.h>
-#include <sys/sysctl.h>
-
-#include <dev/wscons/wsconsio.h>
-#include <dev/wscons/wsdisplay_usl_io.h>
+#include <poll.h>
+#include <unistd.h>
 
 #include "png_codec.h"
 #include "keymap.h"
+#include "blit.h"
+#include "shadow.h"
+#include "display.h"
+#include "latency.h"
+#include "stats.h"
+#include "prefetch.h"
+#include "diskcache.h"
+#include "packcache.h"
+#include "fileio.h"
+#include "playlist.h"
+#include "recorder.h"
+#include "probes.h"
 
 /* Debugging */
 //#define WSDV_DEBUG
 
-static const char* def_wsdisp = "/dev/ttyE0";
-static const char* def_wsdispcfg = "/dev/ttyEcfg";
-//static const char* def_wsdispstat = "/dev/ttyEstat";
-static const char* def_wskbd = "/dev/wskbd0";
-
-int wsdisp_fd;
-int wsdispcfg_fd;
-int wskbd_fd;
-
-u_int fbinfo_strave;
-struct wsdisplay_fbinfo fbinfo;
-struct wsdisplay_cmap ocmap;
-void *fb = NULL;
+struct display disp;
+struct shadow shadow;
+struct latency latency;
+struct stats stats;
+struct prefetch prefetch;
+struct diskcache diskcache;
+struct packcache packcache;
+struct fileio fileio;
+struct keymap keymap;
+
+/* images decoded ahead in the direction of travel */
+#define PREFETCH_AHEAD	2
+#define PREFETCH_BUDGET	(64 * 1024 * 1024)
+/* images shown, compressed */
+#define PACKED_BUDGET	(32 * 1024 * 1024)
+#define DISKCACHE_LIMIT	(512ULL * 1024 * 1024)
+/* and files past the prefetched ones that the kernel reads ahead */
+#define READAHEAD	4
+
+/* slideshow interval unless one is given, in milliseconds */
+#define SLIDESHOW_INTERVAL	5000
+
+/* decoding between looks at the keyboard, in nanoseconds */
+#define DECODE_SLICE	(10 * 1000000)
+
+/* digits typed so far, and the slideshow: 0 when it is off */
+#define KEY_COUNT_MAX	100000
+int key_count;
+uint64_t slideshow_interval, slideshow_due;
+
+/* key presses are written here as a headless backend script */
+FILE *record_file = NULL;
+uint64_t record_last;
+
+/* and what the screen shows as an APNG */
+struct recorder recorder;
 
 /* indicates if we want to use a translation file */
 bool flag_use_keymap_file = false;
 bool flag_specify_wsdisplay_device = false;
 
-struct wskbd_map_data wskbd_map;
-
-struct file_entry {
-	char *path;	
-	TAILQ_ENTRY(file_entry) entries;
-};
-
-TAILQ_HEAD(file_tailhead, file_entry) files_head;
-
-void *
-ws_mmap(int fd, size_t len)
-{
-	void *addr;
-	void *mapped;
-
-	addr = 0;	/* XXX: driver-dependent? */
-	
-	/* XXX: page size? */	
-	mapped = mmap(addr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);	
-	
-	return mapped;
-}
-
-
-void
-ws_cmap_get(int fd, struct wsdisplay_cmap *cmap, u_int size) 
-{
-	cmap->index = 0;
-	cmap->count = size;
-	cmap->red   = calloc(size, sizeof(u_int));
-	cmap->green = calloc(size, sizeof(u_int));
-	cmap->blue  = calloc(size, sizeof(u_int));
+/* what transparent images are put on */
+struct blit_backdrop backdrop;
 
-	if (ioctl(fd, WSDISPLAYIO_GETCMAP, cmap) == -1) 
-		perror("WSDISPLAYIO_GETCMAP ioctl failed");
+/* and the display's exponent every context converts for */
+uint32_t display_gamma = PNG_GAMMA_DISPLAY;
 
-}
+/* the images to show, from the command line and playlist files */
+struct playlist playlist;
 
+/* an image converted and placed for the screen, only the blit is left */
+struct ws_image {
+	struct png_info		*info;
+	struct blit_composite	 composite;
+	blit_row_func		 blit_row;
+	uint32_t		 bg;
+	u_int			 skip_lines, skip_pixels;
+};
 
-void
-ws_cmap_set(int fd, struct wsdisplay_cmap *cmap)
-{
-	if (ioctl(fd, WSDISPLAYIO_PUTCMAP, cmap) == -1) 
-		perror("WSDISPLAYIO_PUTCMAP ioctl failed");
-}
+/* the image being decoded for the screen, a slice at a time */
+struct wsdv_decode {
+	bool			 active;
+	char			*path;
+	struct png_info		*png;
+	struct fileio_file	 file;
+} decode;
 
+/*
+ * An APNG played with -A, a frame at a time from its file. Frames are
+ * composed on a canvas that stays and only what changed is blitted, on
+ * the clock of the first frame. A frame whose time has passed by when it
+ * is composed is dropped, the next one shown takes its changes along.
+ */
+bool flag_animate = false;
+
+struct wsdv_anim {
+	bool			 active;
+	char			*path;
+	struct png_info		*png;
+	struct fileio_file	 file;
+	struct png_canvas	 canvas;
+	struct blit_composite	 composite;
+	blit_row_func		 blit_row;
+	uint32_t		 x, y;		/* of the canvas on the screen */
+	struct png_rect		 dirty;		/* composed, not shown yet */
+	bool			 pending;	/* a frame decoded, not composed */
+	bool			 ready;		/* composed, waiting to be due */
+	bool			 done;		/* the last frame is composed */
+	bool			 shown;		/* the first frame made it */
+	uint64_t		 start, due, delay;
+	uint32_t		 plays;
+	uint64_t		 frames, dropped;
+} anim;
+
+void	wsdv_decode_done(int);
+bool	wsdv_anim_begin(char *);
 
 void
-png_cmap_to_ws_cmap(struct png_info *info, struct wsdisplay_cmap *cmap, int size)
+png_cmap_to_display_cmap(struct png_info *info, struct display_cmap *cmap,
+    int size, uint32_t bg)
 {
+	uint32_t rgb;
 	int i;
 
-	cmap->index = 0;
-	cmap->count = size;
-	cmap->red   = calloc(size, sizeof(u_int));
-	cmap->green = calloc(size, sizeof(u_int));
-	cmap->blue  = calloc(size, sizeof(u_int));
-
 	if (size > 256) {
 		fprintf(stderr, "Indexed palette is %d entries, can't handle correctly\n", size);
 		size = 256;
 	}
+	cmap->count = size;
+	/* tRNS alpha is folded into the palette against the backdrop */
 	for (i = 0; i < size; i++) {
-		cmap->red[i]   = (u_int) ((info->palette[i] >> 16) & 0xff);
-		cmap->green[i] = (u_int) ((info->palette[i] >>  8) & 0xff);
-		cmap->blue[i]  = (u_int) ((info->palette[i]      ) & 0xff);
+		rgb = blit_blend_pixel(info->palette[i], bg);
+		cmap->red[i]   = (rgb >> 16) & 0xff;
+		cmap->green[i] = (rgb >>  8) & 0xff;
+		cmap->blue[i]  = (rgb      ) & 0xff;
 	}
 }
 
 
-void
-ws_get_display_geom(char *wsdisp)
+/*
+ * Open the file and start a context loading it; false if it won't open
+ * or its header says it won't fit the screen.
+ */
+bool
+png_load_begin(const char *filename, struct png_info **info,
+    struct fileio_file *file, bool quiet)
 {
-	if (ioctl(wsdisp_fd, WSDISPLAYIO_GINFO, &fbinfo)) {
-		perror("WSDISPLAYIO_GINFO ioctl failed during getting wsdisplay info");
-		close(wsdisp_fd);
-		exit(EXIT_FAILURE);
+	struct png_header header;
+
+	if (fileio_open(&fileio, filename, file) < 0) {
+		if (!quiet)
+			fprintf(stderr, "Can't open input image %s\n", filename);
+		return false;
+	}
+
+	/* no point decoding what the header says won't fit */
+	if (!(png_probe(file->fd, &header) & PNG_FILE_ERROR) &&
+	    ((header.width > disp.width) || (header.height > disp.height))) {
+		if (!quiet)
+			fprintf(stderr, "PNG size (%d, %d) will not fit screen (%d, %d)\n",
+				header.width, header.height, disp.width, disp.height);
+		fileio_close(&fileio, file);
+		return false;
 	}
-	ioctl(wsdisp_fd, WSDISPLAYIO_LINEBYTES, &fbinfo_strave);
+
+	*info = png_create_png_context();
+	if (*info == NULL) {
+		fileio_close(&fileio, file);
+		return false;
+	}
+	png_set_display_gamma(*info, display_gamma);
+	png_start_loading(*info, file->fd);
+	return true;
 }
 
 
+/* close the file once loading stopped, 1 if it gave an image */
 int
-png_load(char *filename, struct png_info **info)
+png_load_end(const char *filename, int status, struct fileio_file *file,
+    bool quiet)
 {
-	int status;
-	int fh;
+	fileio_close(&fileio, file);
 
-	fh = open(filename, O_NONBLOCK | O_RDONLY);
-	if (fh < 0) {
-		fprintf(stderr, "Can't open input image %s\n", filename);
+	if (status & PNG_FILE_OUT_OF_MEM) {
+		if (!quiet)
+			fprintf(stderr, "Out of memory loading %s\n", filename);
 		return 0;
 	}
-
-	*info = png_create_png_context();
-	status = png_start_loading(*info, fh);
-	while (status & PNG_FILE_LOADING) {
-		status = png_load_a_piece(*info);
-	}
-	close(fh);
-
 	if (status & PNG_FILE_ERROR) {
-		fprintf(stderr, "Error loading png file\n");
+		if (!quiet)
+			fprintf(stderr, "Error loading png file\n");
 		return 0;
 	}
 
@@ -177,396 +233,1344 @@ png_load(char *filename, struct png_info **info)
 }
 
 
+/* open_ns, if given, gets the time it took to open the file */
 int
-png_convert2bpp(struct png_info *info, int bpp)
+png_load(const char *filename, struct png_info **info, uint64_t *open_ns,
+    bool quiet)
 {
+	struct fileio_file file;
 	int status;
+	bool opened;
+
+	opened = png_load_begin(filename, info, &file, quiet);
+	if (open_ns != NULL)
+		*open_ns = file.open_ns;
+	if (!opened)
+		return 0;
 
-	switch (bpp) {
-	case 8: 
+	do {
+		status = png_load_a_piece(*info);
+	} while (status & PNG_FILE_LOADING);
+
+	return png_load_end(filename, status, &file, quiet);
+}
+
+
+/*
+ * Convert the image into the layout the framebuffer's row blitters read;
+ * returns the BLIT_SRC_* kind or -1. Runs on the prefetch workers too,
+ * which keep quiet about failures that will be reported on display.
+ */
+int
+png_convert2fmt(struct png_info *info, int fmt, bool quiet)
+{
+	uint16_t trans[256];
+	int status;
+
+	if (fmt < 0) {
+		if (!quiet)
+			fprintf(stderr, "Unsupported framebuffer pixel format\n");
+		return -1;
+	}
+
+	switch (blit_pixfmt_source(fmt)) {
+	case BLIT_SRC_INDEXED8:
 		/* only accept 8 bit images */
 		if ((info->colourtype == PNG_COLOUR_INDEXED) && (info->sample_depth == 8))
-			return 1;
+			return BLIT_SRC_INDEXED8;
 		/* png_convert_to_8bit_indexed() */
-		fprintf(stderr, "Can't convert to 8 bit indexed image yet\n");
-		break;
-	case 16:
-		fprintf(stderr, "No support for 16 bit displays yet\n");
+		if (!quiet)
+			fprintf(stderr, "Can't convert to 8 bit indexed image yet\n");
 		break;
-	case 32:
+	case BLIT_SRC_RGBA32:
 		status = png_convert_to_rgba32(info, 0);
 		if (status & PNG_FILE_ERROR) {
-			fprintf(stderr, "Error converting file to rgba32\n");
-			return 0;
+			if (!quiet)
+				fprintf(stderr, "Error converting file to rgba32\n");
+			return -1;
+		}
+		return BLIT_SRC_RGBA32;
+	case BLIT_SRC_RGBA64:
+		/* keep 16 bit samples for 10 bit per channel displays */
+		png_gamma_table16(info, trans);
+		status = png_convert_to_rgba64(info, trans, trans, trans, 0);
+		if (status & PNG_FILE_ERROR) {
+			if (!quiet)
+				fprintf(stderr, "Error converting file to rgba64\n");
+			return -1;
 		}
-		return 1;
-	default:
-		fprintf(stderr, "Can't convert from %d to %d bits yet\n",
-			info->sample_depth * info->samples_per_pixel, bpp);
+		return BLIT_SRC_RGBA64;
 	}
-	return 0;
+	return -1;
 }
 
-
+/* Map the framebuffer and set up the shadow copy of it. */
 bool
-ws_prepare_keyboard(void)
+ws_prepare_screen(void)
 {
-	if (!wskbd_map.map) {
-		wskbd_map.map = calloc(sizeof(struct wscons_keymap), WSKBDIO_MAXMAPLEN);
-		if (wskbd_map.map == NULL) {
-			wskbd_map.maplen = 0;
-			perror("Can't allocate keyboard mapping");
-			return false;
-		}
+	if (disp.pixfmt < 0) {
+		fprintf(stderr, "Unsupported display depth %d\n", disp.depth);
+		return false;
 	}
-	wskbd_map.maplen = WSKBDIO_MAXMAPLEN;
-	if (ioctl(wskbd_fd, WSKBDIO_GETMAP, &wskbd_map)) {
-		perror("WSKBDIO_GETMAP failed");
+
+	if (!disp.be->map(&disp))
+		return false;
+
+	if (!shadow_init(&shadow, disp.width, disp.height,
+	    blit_pixfmt_bytes(disp.pixfmt))) {
+		fprintf(stderr, "Can't allocate screen shadow\n");
 		return false;
 	}
+	shadow_invalidate(&shadow);
 
-#ifdef WSDV_DEBUG
-	/* print keymapping for debug purposes */
-	printf("keymap len = %d, mapping :", wskbd_map.maplen);
-	struct wscons_keymap *km = wskbd_map.map;
-	int i;
-	for (i = 0; i < wskbd_map.maplen; i++) {
-		printf("%d => %d, ", i, KS_VALUE(km[i].group1[0]));
+	return true;
+}
+
+/*
+ * Everything short of touching the screen: conversion, placement and the
+ * backdrop. Takes over the png_info if it succeeds.
+ */
+bool
+ws_prepare_png(struct png_info *info, struct ws_image *img, bool quiet)
+{
+	int src;
+
+	memset(img, 0, sizeof(*img));
+
+	/* check if it will fit the display */
+	if ((info->width > disp.width) || (info->height > disp.height)) {
+		if (!quiet)
+			fprintf(stderr, "PNG size (%d, %d) will not fit screen (%d, %d)\n",
+				info->width, info->height, disp.width, disp.height);
+		return false;
 	}
-	printf("\n");
-#endif
 
-#if 0
-	/* this fails... but why? */
-	int ver = WSKBDIO_EVENT_VERSION;
-	if (ioctl(wskbd_fd, WSKBDIO_SETVERSION, &ver) == -1) {
-		perror("WSKBDIO_SETVERSION ioctl failed");
+	/* center image on screen */
+	img->skip_lines = (disp.height - info->height) / 2;
+	img->skip_pixels = (disp.width  - info->width) / 2;
+
+	/* backdrop needs the unconverted bKGD and alpha information */
+	img->bg = blit_backdrop_colour(&backdrop, info);
+	if ((disp.pixfmt != BLIT_FMT_CI8) &&
+	    !blit_composite_setup(&img->composite, &backdrop, info,
+	    img->skip_pixels, img->skip_lines) && !quiet) {
+		fprintf(stderr, "Can't allocate backdrop, ignoring alpha\n");
+	}
+
+	/* one specialised row blitter for the whole image */
+	src = png_convert2fmt(info, disp.pixfmt, quiet);
+	img->blit_row = blit_select_row(disp.pixfmt, src,
+	    img->composite.enabled);
+	if (img->blit_row == NULL) {
+		blit_composite_free(&img->composite);
 		return false;
 	}
+	img->info = info;
+	return true;
+}
+
+void
+ws_image_free(struct ws_image *img)
+{
+	blit_composite_free(&img->composite);
+	png_dispose_png(img->info);
+	img->info = NULL;
+}
+
+/* what a prepared image holds on to, for the prefetch budget */
+size_t
+ws_image_size(struct ws_image *img)
+{
+	size_t bytes;
+
+	bytes = sizeof(*img) + img->info->stats.mem_current;
+	if (img->composite.enabled)
+		bytes += 2 * img->info->width * sizeof(uint32_t);
+	return bytes;
+}
+
+void
+ws_present_png(struct ws_image *img, void *fb)
+{
+	struct png_info *info = img->info;
+	struct display_cmap cmap;
+	u_int png_strave;
+	int y;
+	uint8_t *ipos;
+
+	png_strave   = info->strave;
+
+#ifdef WSDV_DEBUG
+	printf("disp.width     = %d\n", disp.width);
+	printf("disp.height    = %d\n", disp.height);
+	printf("png_bpp        = %d\n", info->bpp);
+	printf("png_sample_depth = %d\n", info->sample_depth);
+	printf("png_samples_per_pixel = %d\n", info->samples_per_pixel);
+	printf("disp.stride    = %d\n", (int) disp.stride);
+	printf("png_strave     = %d\n", (int) png_strave);
+	printf("display_size   = %d\n", (int) disp.fb_size);
+	printf("pixel_bytes = %d\n", blit_pixfmt_bytes(disp.pixfmt));
 #endif
 
-	return true;
-}	
+	if (disp.pixfmt == BLIT_FMT_CI8) {
+		png_cmap_to_display_cmap(info, &cmap, disp.cmsize, img->bg);
+		WSDV_CMAP_SET(cmap.count);
+		disp.be->put_cmap(&disp, &cmap);
+	}
 
+	/* only changed borders and rows reach the framebuffer */
+	shadow_begin(&shadow, fb, disp.stride, img->skip_pixels,
+	    img->skip_lines, info->width, info->height);
+	stats_mark(&stats, STATS_CLEAR);
+	ipos = info->blob;
+	for (y = 0; y < info->height; y++) {
+		img->blit_row(shadow_row_buffer(&shadow), ipos,
+		    blit_composite_bg_row(&img->composite, y), info->width);
+		shadow_put_row(&shadow, y);
+		ipos += png_strave;
+	}
+	shadow_end(&shadow);
+	latency_mark(&latency, LATENCY_BLIT);
+	stats_mark(&stats, STATS_BLIT);
+	stats_screen(&stats, shadow.bytes_written);
+}
 
-int
-ws_kbd_translate(int kc)
+/* prefetch worker side of ws_prepare_png() */
+void *
+wsdv_prefetch_prepare(struct png_info *info, size_t *bytes)
+{
+	struct ws_image *img;
+
+	img = malloc(sizeof(*img));
+	if (img == NULL)
+		return NULL;
+	if (!ws_prepare_png(info, img, true)) {
+		free(img);
+		return NULL;
+	}
+	*bytes = ws_image_size(img);
+	return img;
+}
+
+void
+wsdv_prefetch_release(void *image)
+{
+	ws_image_free(image);
+	free(image);
+}
+
+/* blit an image kept in the disk cache, it is in the screen's format */
+void
+ws_present_cached(struct diskcache_image *dimg, void *fb)
+{
+	uint32_t y;
+
+	if ((disp.pixfmt == BLIT_FMT_CI8) && (dimg->cmap.count > 0)) {
+		WSDV_CMAP_SET(dimg->cmap.count);
+		disp.be->put_cmap(&disp, &dimg->cmap);
+	}
+
+	shadow_begin(&shadow, fb, disp.stride, dimg->x, dimg->y,
+	    dimg->width, dimg->height);
+	stats_mark(&stats, STATS_CLEAR);
+	for (y = 0; y < dimg->height; y++)
+		shadow_put_row_from(&shadow, y,
+		    dimg->pixels + (size_t) y * dimg->stride);
+	shadow_end(&shadow);
+	latency_mark(&latency, LATENCY_BLIT);
+	stats_mark(&stats, STATS_BLIT);
+	stats_screen(&stats, shadow.bytes_written);
+}
+
+/* the palette a CI8 screen gets for the image */
+struct display_cmap *
+ws_image_cmap(struct ws_image *img, struct display_cmap *cmap)
 {
-	struct wscons_keymap *km;
+	if (disp.pixfmt != BLIT_FMT_CI8)
+		return NULL;
+	png_cmap_to_display_cmap(img->info, cmap, disp.cmsize, img->bg);
+	return cmap;
+}
 
-	if (flag_use_keymap_file) 
-		return wsdv_keycode_translate(KS_VALUE(kc) & 0xff);
-	
-	if (wskbd_map.maplen == 0)
-		return WSDV_EXIT;
+/* blit an image from the compressed tier, unpacking it row by row */
+void
+ws_present_packed(struct packed_image *pk, void *fb)
+{
+	uint32_t y;
 
-	km = wskbd_map.map;
-	return KS_VALUE(km[kc].group1[0]);
+	if ((disp.pixfmt == BLIT_FMT_CI8) && (pk->cmap.count > 0)) {
+		WSDV_CMAP_SET(pk->cmap.count);
+		disp.be->put_cmap(&disp, &pk->cmap);
+	}
+
+	shadow_begin(&shadow, fb, disp.stride, pk->x, pk->y, pk->width,
+	    pk->height);
+	stats_mark(&stats, STATS_CLEAR);
+	for (y = 0; y < pk->height; y++)
+		shadow_put_row_from(&shadow, y,
+		    packcache_row(pk, y, shadow_row_buffer(&shadow)));
+	shadow_end(&shadow);
+	latency_mark(&latency, LATENCY_BLIT);
+	stats_mark(&stats, STATS_BLIT);
+	stats_screen(&stats, shadow.bytes_written);
 }
 
+/* the image just presented, the shadow has it in the screen's format */
+const uint8_t *
+ws_shown_pixels(void)
+{
+	return shadow.pixels + (size_t) shadow.y * shadow.stride +
+	    shadow.x * shadow.pixel_bytes;
+}
 
+/* keep what was just presented compressed, for coming back to it */
 void
-ws_restore_screen(void) 
+wsdv_pack_shown(const char *path, struct ws_image *img)
 {
-	int wsmode;
+	struct display_cmap cmap;
 
-	if (fbinfo.depth == 8)
-		ws_cmap_set(wsdisp_fd, &ocmap);
+	if (!packcache.enabled)
+		return;
+	packcache_put(&packcache, path, shadow.x, shadow.y, shadow.w,
+	    shadow.h, ws_shown_pixels(), shadow.stride,
+	    ws_image_cmap(img, &cmap));
+}
 
-	/* TODO: munmap */
+/* and on disk for the next run, written out on the cache's own thread */
+void
+wsdv_diskcache_store(const char *path, struct ws_image *img)
+{
+	struct diskcache_image dimg;
+	struct display_cmap cmap;
+	const uint8_t *row;
+	uint32_t y, len;
+
+	if (!diskcache_create(&diskcache, path, shadow.x, shadow.y, shadow.w,
+	    shadow.h, ws_image_cmap(img, &cmap), &dimg))
+		return;
+	row = ws_shown_pixels();
+	len = shadow.w * shadow.pixel_bytes;
+	for (y = 0; y < dimg.height; y++, row += shadow.stride)
+		memcpy(dimg.pixels + (size_t) y * dimg.stride, row, len);
+	diskcache_queue(&diskcache, &dimg);
+}
 
-	wsmode = WSDISPLAYIO_MODE_EMUL;
-	if (ioctl(wsdisp_fd, WSDISPLAYIO_SMODE, &wsmode) == -1) {
-		perror("WSDISPLAYIO_SMODE ioctl failed during restore");
+/* pre-warm thread: decode, prepare and blit an image into its entry */
+bool
+wsdv_diskcache_fill(struct diskcache *dc, const char *path)
+{
+	struct png_info *png;
+	struct ws_image img;
+	struct diskcache_image dimg;
+	struct display_cmap cmap;
+	uint8_t *ipos;
+	uint32_t y;
+	bool ok;
+
+	png = NULL;
+	if (!png_load(path, &png, NULL, true) ||
+	    !ws_prepare_png(png, &img, true)) {
+		png_dispose_png(png);
+		return false;
+	}
+
+	ok = diskcache_create(dc, path, img.skip_pixels, img.skip_lines,
+	    img.info->width, img.info->height, ws_image_cmap(&img, &cmap),
+	    &dimg);
+	if (ok) {
+		ipos = img.info->blob;
+		for (y = 0; y < dimg.height; y++) {
+			img.blit_row(dimg.pixels + (size_t) y * dimg.stride,
+			    ipos, blit_composite_bg_row(&img.composite, y),
+			    dimg.width);
+			ipos += img.info->strave;
+		}
+		ok = diskcache_commit(dc, &dimg);
 	}
+	ws_image_free(&img);
+	return ok;
 }
 
+void
+wsdv_usage(char *progname)
+{
+	fprintf(stderr, "usage: %s [-ALSVw] [-j stats] [-M limit] [-C budget] "
+	    "[-Z budget] [-G gamma] [-c cachedir] [-D limit] [-B backend] [-m display] [-k input] [-g geometry] [-R script] "
+	    "[-a recording] "
+	    "[-t keymap] [-b backdrop] [-l playlist] [file.png | dir ...]\n",
+	    progname);
+	fprintf(stderr, "backends: ");
+	display_backend_list(stderr);
+}
 
+/* a byte count with an optional k, m or g suffix */
 bool
-ws_prepare_screen(void)
+wsdv_parse_size(const char *arg, uint64_t *size)
 {
-	size_t display_size;
-	int wsmode;
+	unsigned long long val;
+	char *end;
 
-	/* imho this cannot work, descriptors will be closed at this moment */
-	/*atexit(ws_restore_screen);*/
+	val = strtoull(arg, &end, 10);
+	if (end == arg)
+		return false;
+	switch (*end) {
+	case 'g': case 'G':
+		val *= 1024;
+		/* FALLTHROUGH */
+	case 'm': case 'M':
+		val *= 1024;
+		/* FALLTHROUGH */
+	case 'k': case 'K':
+		val *= 1024;
+		end++;
+		break;
+	}
+	if (*end != '\0')
+		return false;
+
+	*size = val;
+	return true;
+}
 
-	wsmode = WSDISPLAYIO_MODE_MAPPED;
-	if (ioctl(wsdisp_fd, WSDISPLAYIO_SMODE, &wsmode) == -1) {
-		perror("WSDISPLAYIO_SMODE ioctl failed");
+/* a display exponent such as 2.2, kept times 100000 as PNG does */
+bool
+wsdv_parse_gamma(const char *arg, uint32_t *gamma)
+{
+	double val;
+	char *end;
+
+	val = strtod(arg, &end);
+	if ((end == arg) || (*end != '\0') || !(val >= 0) || (val > 10))
 		return false;
+	*gamma = val * 100000 + 0.5;
+	return true;
+}
+
+/*
+ * Put an image on the screen straight from one of the caches, or start
+ * decoding it; true if it is done with, false if decoding is under way.
+ */
+bool
+wsdv_display_file(char *path) 
+{
+	struct ws_image *img;
+	struct packed_image *pk;
+	struct diskcache_image dimg;
+
+	WSDV_DISPLAY_BEGIN(path);
+	stats_begin(&stats, path);
+
+	/* played frame by frame, never cached */
+	if (wsdv_anim_begin(path))
+		return false;
+
+	/* decoded and converted ahead of time, at most waiting for it */
+	img = prefetch_get(&prefetch, path);
+	if (img != NULL) {
+		latency_mark(&latency, LATENCY_DECODE);
+		stats_mark(&stats, STATS_DECODE);
+		stats_from(&stats, STATS_FROM_PREFETCH, img->info->width,
+		    img->info->height);
+		latency_mark(&latency, LATENCY_CONVERT);
+		stats_mark(&stats, STATS_CONVERT);
+		ws_present_png(img, disp.fb);
+		stats_end(&stats);
+		WSDV_DISPLAY_END(path, 1, shadow.bytes_written);
+		wsdv_pack_shown(path, img);
+		wsdv_diskcache_store(path, img);
+		return true;
 	}
 
-	if (fbinfo.depth == 8) 
-		ws_cmap_get(wsdisp_fd, &ocmap, fbinfo.cmsize);
+	/* shown before and kept compressed */
+	pk = packcache_get(&packcache, path);
+	if (pk != NULL) {
+		latency_mark(&latency, LATENCY_DECODE);
+		stats_mark(&stats, STATS_DECODE);
+		stats_from(&stats, STATS_FROM_PACKED, pk->width, pk->height);
+		latency_mark(&latency, LATENCY_CONVERT);
+		stats_mark(&stats, STATS_CONVERT);
+		ws_present_packed(pk, disp.fb);
+		stats_end(&stats);
+		WSDV_DISPLAY_END(path, 1, shadow.bytes_written);
+		return true;
+	}
 
-	display_size = fbinfo_strave * fbinfo.height;
-	if (fb == NULL)
-		fb = ws_mmap(wsdisp_fd, display_size);
+	/* ready for the screen from an earlier run, no decoding */
+	if (diskcache_open(&diskcache, path, &dimg)) {
+		latency_mark(&latency, LATENCY_DECODE);
+		stats_mark(&stats, STATS_DECODE);
+		stats_from(&stats, STATS_FROM_DISK, dimg.width, dimg.height);
+		latency_mark(&latency, LATENCY_CONVERT);
+		stats_mark(&stats, STATS_CONVERT);
+		ws_present_cached(&dimg, disp.fb);
+		diskcache_close(&dimg);
+		stats_end(&stats);
+		WSDV_DISPLAY_END(path, 1, shadow.bytes_written);
+		return true;
+	}
 
+	/* left to wsdv_decode_slice() from here on */
+	decode.path = path;
+	decode.active = png_load_begin(path, &decode.png, &decode.file, false);
+	stats_open(&stats, decode.file.open_ns);
+	if (decode.active)
+		return false;
+	wsdv_decode_done(0);
 	return true;
-}	
+}
 
+/*
+ * Put the image being decoded on the screen, or give up on it if it
+ * failed to load.
+ */
 void
-ws_display_png(struct png_info *info, void *fb)
+wsdv_decode_done(int ok)
 {
-	struct wsdisplay_cmap cmap;
-	u_int png_strave, skip_lines, skip_pixels;
-	int pixel_bytes, y;
-	char *opos, *ipos;
+	struct png_info *png;
+	struct ws_image *img;
+	char *path;
+
+	path = decode.path;
+	png = decode.png;
+	img = NULL;
+	decode.active = false;
+	decode.png = NULL;
+
+	if (ok) {
+		latency_mark(&latency, LATENCY_DECODE);
+		stats_mark(&stats, STATS_DECODE);
+		stats_codec(&stats, png);
+		img = malloc(sizeof(*img));
+		if ((img != NULL) && ws_prepare_png(png, img, false)) {
+			png = NULL;
+			latency_mark(&latency, LATENCY_CONVERT);
+			stats_mark(&stats, STATS_CONVERT);
+			ws_present_png(img, disp.fb);
+		} else {
+			free(img);
+			img = NULL;
+		}
+	}
 
-	/* check if it will fit the display */
-	if ((info->width > fbinfo.width) || (info->height > fbinfo.height)) {
-		fprintf(stderr, "PNG size (%d, %d) will not fit screen (%d, %d)\n",
-			info->width, info->height, fbinfo.width, fbinfo.height);
-		return;
+	if (png != NULL)
+		stats_memory(&stats, png);
+	png_dispose_png(png);
+	if (img != NULL)
+		stats_memory(&stats, img->info);
+	stats_end(&stats);
+	WSDV_DISPLAY_END(path, ok, ok ? shadow.bytes_written : 0);
+
+	if (img != NULL) {
+		wsdv_pack_shown(path, img);
+		wsdv_diskcache_store(path, img);
+		/* kept for stepping back to it */
+		prefetch_insert(&prefetch, path, img, ws_image_size(img));
 	}
+}
 
-	if (!png_convert2bpp(info, fbinfo.depth))
-		return;
+/* decode for at most one slice, true once the image is done with */
+bool
+wsdv_decode_slice(void)
+{
+	int status;
 
-	pixel_bytes = fbinfo.depth / 8;
+	if (!decode.active)
+		return false;
 
-	png_strave   = info->strave;
+	status = png_load_for(decode.png, DECODE_SLICE);
+	if (status & PNG_FILE_LOADING)
+		return false;
+	wsdv_decode_done(png_load_end(decode.path, status, &decode.file,
+	    false));
+	return true;
+}
 
-#ifdef WSDV_DEBUG
-	printf("fbinfo.width   = %d\n", fbinfo.width);
-	printf("fbinfo.height  = %d\n", fbinfo.height);
-	printf("png_bpp        = %d\n", info->bpp);
-	printf("png_sample_depth = %d\n", info->sample_depth);
-	printf("png_samples_per_pixel = %d\n", info->samples_per_pixel);
-	printf("fbinfo_strave  = %d\n", (int) fbinfo_strave);
-	printf("png_strave     = %d\n", (int) png_strave);
-	printf("display_size   = %d\n", (int) display_size);
-	printf("pixel_bytes = %d\n", pixel_bytes);
-#endif
+/* drop the image being decoded, another key press overtook it */
+void
+wsdv_decode_cancel(void)
+{
+	if (!decode.active)
+		return;
 
-	if (fbinfo.depth == 8) {
-		png_cmap_to_ws_cmap(info, &cmap, fbinfo.cmsize);
-		ws_cmap_set(wsdisp_fd, &cmap);
+	fileio_close(&fileio, &decode.file);
+	png_dispose_png(decode.png);
+	decode.png = NULL;
+	decode.active = false;
+	stats_cancel(&stats);
+	WSDV_DISPLAY_CANCEL(decode.path);
+}
+
+/* (re)start a play of the animation from the top of its file */
+bool
+wsdv_anim_open(void)
+{
+	if (anim.png != NULL) {
+		fileio_close(&fileio, &anim.file);
+		png_dispose_png(anim.png);
+		anim.png = NULL;
+		if (fileio_open(&fileio, anim.path, &anim.file) < 0)
+			return false;
 	}
 
-	/* clear screen */
-	opos = fb;
-	for (y = 0; y < fbinfo.height; y++) {
-		memset(opos, 0, fbinfo.width * pixel_bytes);
-		opos += fbinfo_strave;
+	anim.png = png_create_png_context();
+	if (anim.png == NULL) {
+		fileio_close(&fileio, &anim.file);
+		return false;
 	}
+	png_set_animate(anim.png, 1);
+	png_set_display_gamma(anim.png, display_gamma);
+	png_start_loading(anim.png, anim.file.fd);
+	return true;
+}
 
-	/* center image on screen */
-	skip_lines = (fbinfo.height - info->height) / 2;
-	skip_pixels = (fbinfo.width  - info->width) / 2;
-	opos = (char *) fb + skip_lines*fbinfo_strave + skip_pixels * pixel_bytes;
-	ipos = (char *) info->blob;
-	for (y = 0; y < info->height; y++) {
-		memcpy(opos, ipos, png_strave);
-		ipos += png_strave;
-		opos += fbinfo_strave;
+void
+wsdv_anim_free(void)
+{
+	if (anim.png != NULL) {
+		fileio_close(&fileio, &anim.file);
+		png_dispose_png(anim.png);
+		anim.png = NULL;
 	}
+	png_canvas_free(&anim.canvas);
+	blit_composite_free(&anim.composite);
+	anim.active = false;
+}
+
+/*
+ * Play path if it is an animation that fits the screen and the screen
+ * takes rgba32; false leaves it to the still image paths.
+ */
+bool
+wsdv_anim_begin(char *path)
+{
+	struct png_header header;
+	png_file_status status;
+
+	if (!flag_animate ||
+	    (blit_select_row(disp.pixfmt, BLIT_SRC_RGBA32, true) == NULL))
+		return false;
+
+	memset(&anim, 0, sizeof(anim));
+	anim.path = path;
+	if (fileio_open(&fileio, path, &anim.file) < 0)
+		return false;
+
+	/* an acTL further in than the probe reads gets the benefit of the doubt */
+	status = png_probe(anim.file.fd, &header);
+	if ((status & PNG_FILE_ERROR) ||
+	    (header.complete && (header.num_frames < 2)) ||
+	    (header.width > disp.width) || (header.height > disp.height) ||
+	    !wsdv_anim_open()) {
+		fileio_close(&fileio, &anim.file);
+		return false;
+	}
+
+	stats_open(&stats, anim.file.open_ns);
+	anim.active = true;
+	return true;
 }
 
+/* the animation is over or overtaken by a key press */
 void
-wsdv_usage(char *progname)
+wsdv_anim_stop(void)
 {
-	fprintf(stderr, "usage: %s [-m wsdisplay] [-k wskbd] [-t keymap] file.png\n", 
-	    progname);
+	if (!anim.active)
+		return;
+
+	if (anim.shown) {
+		stats_animation(&stats, anim.path, anim.frames, anim.dropped,
+		    latency_clock() - anim.start);
+	} else {
+		stats_cancel(&stats);
+		WSDV_DISPLAY_CANCEL(anim.path);
+	}
+	wsdv_anim_free();
+}
+
+/* stop on an error; true if no frame made it to the screen */
+bool
+wsdv_anim_fail(png_file_status status)
+{
+	bool first;
+
+	first = !anim.shown;
+	png_load_end(anim.path, status, &anim.file, false);
+	png_dispose_png(anim.png);
+	anim.png = NULL;
+	if (first) {
+		stats_end(&stats);
+		WSDV_DISPLAY_END(anim.path, 0, 0);
+	} else {
+		stats_animation(&stats, anim.path, anim.frames, anim.dropped,
+		    latency_clock() - anim.start);
+	}
+	wsdv_anim_free();
+	return first;
 }
 
 void
-wsdv_display_file(char *path) 
+wsdv_rect_union(struct png_rect *r, const struct png_rect *a)
+{
+	uint32_t right, bottom;
+
+	if (a->width == 0 || a->height == 0)
+		return;
+	if (r->width == 0 || r->height == 0) {
+		*r = *a;
+		return;
+	}
+	right = r->x + r->width;
+	if (a->x + a->width > right)
+		right = a->x + a->width;
+	bottom = r->y + r->height;
+	if (a->y + a->height > bottom)
+		bottom = a->y + a->height;
+	if (a->x < r->x)
+		r->x = a->x;
+	if (a->y < r->y)
+		r->y = a->y;
+	r->width = right - r->x;
+	r->height = bottom - r->y;
+}
+
+/* the frame decoded last onto the canvas, and when it is due */
+bool
+wsdv_anim_compose(void)
 {
 	struct png_info *png;
+	struct png_rect changed;
+	png_file_status status;
+	uint64_t now;
+
+	png = anim.png;
+	status = png->filestate;
+	if (anim.canvas.pixels == NULL) {
+		/* the backdrop needs the bKGD before conversion */
+		anim.x = (disp.width - png->canvas_width) / 2;
+		anim.y = (disp.height - png->canvas_height) / 2;
+		anim.blit_row = blit_select_row(disp.pixfmt, BLIT_SRC_RGBA32,
+		    true);
+		if (!blit_composite_setup_canvas(&anim.composite, &backdrop,
+		    png, anim.x, anim.y) ||
+		    (png_canvas_init(&anim.canvas, png) & PNG_FILE_ERROR)) {
+			fprintf(stderr, "Out of memory loading %s\n", anim.path);
+			return false;
+		}
+	} else if (png->frame.index == 0) {
+		/* every play starts from a clear canvas */
+		png_canvas_clear(&anim.canvas);
+	}
+	if (png_compose_frame(png, &anim.canvas, &changed) & PNG_FILE_ERROR) {
+		fprintf(stderr, "Error converting file to rgba32\n");
+		return false;
+	}
+	wsdv_rect_union(&anim.dirty, &changed);
+
+	now = latency_clock();
+	if (anim.frames == 0)
+		anim.start = anim.due = now;
+	else
+		anim.due += anim.delay;
+	anim.delay = (uint64_t) png->frame.delay_num * 1000000000ULL /
+	    (png->frame.delay_den ? png->frame.delay_den : 100);
+	anim.frames++;
+	if (!anim.shown) {
+		latency_mark(&latency, LATENCY_CONVERT);
+		stats_mark(&stats, STATS_CONVERT);
+	}
 
-#ifdef WSDV_DEBUG
-	printf("loading file %s\n", path);
-#endif
+	/* on to the next frame, the next play or the end */
+	anim.pending = false;
+	if (status & PNG_FILE_FINISHED) {
+		anim.plays++;
+		if (!png->is_animated ||
+		    (png->num_plays && (anim.plays >= png->num_plays)) ||
+		    !wsdv_anim_open())
+			anim.done = true;
+	} else {
+		png_next_frame(png);
+	}
 
-	if (png_load(path, &png))
-		ws_display_png(png, fb);
+	/* too late to be seen, the next frame shows what it changed */
+	if (anim.shown && !anim.done && (anim.delay != 0) &&
+	    (now >= anim.due + anim.delay)) {
+		anim.dropped++;
+		return true;
+	}
+	anim.ready = true;
+	return true;
+}
 
-	png_dispose_png(png);
+/* put what changed since the last frame shown on the screen */
+bool
+wsdv_anim_present(void)
+{
+	const struct png_rect *r;
+	const uint32_t *row;
+	uint32_t y;
+	bool first;
+
+	r = &anim.dirty;
+	first = !anim.shown;
+	if (first) {
+		shadow_begin(&shadow, disp.fb, disp.stride, anim.x, anim.y,
+		    anim.canvas.width, anim.canvas.height);
+		stats_mark(&stats, STATS_CLEAR);
+	} else {
+		shadow_begin_update(&shadow, disp.fb, disp.stride,
+		    anim.x + r->x, anim.y + r->y, r->width, r->height);
+	}
+	for (y = 0; y < r->height; y++) {
+		row = anim.canvas.pixels +
+		    (size_t) (r->y + y) * anim.canvas.width + r->x;
+		anim.blit_row(shadow_row_buffer(&shadow), (const uint8_t *) row,
+		    blit_composite_bg_row(&anim.composite, r->y + y) + r->x,
+		    r->width);
+		shadow_put_row(&shadow, y);
+	}
+	shadow_end(&shadow);
+	anim.ready = false;
+	anim.dirty.width = anim.dirty.height = 0;
+
+	if (first) {
+		anim.shown = true;
+		latency_mark(&latency, LATENCY_BLIT);
+		stats_mark(&stats, STATS_BLIT);
+		stats_screen(&stats, shadow.bytes_written);
+		if (anim.png != NULL)
+			stats_memory(&stats, anim.png);
+		stats_end(&stats);
+		WSDV_DISPLAY_END(anim.path, 1, shadow.bytes_written);
+	}
+	if (anim.done)
+		wsdv_anim_stop();
+	return first;
 }
 
-#if 0
-/* Return number of currently active wsdispaly screen. */
-int
-wsdv_screen_get_active()
+/* decoding or composing is to be done, no waiting for the clock */
+bool
+wsdv_anim_busy(void)
 {
-	int screen;
+	if (!anim.active)
+		return false;
+	return (!anim.pending && !anim.done) || (anim.pending && !anim.ready);
+}
 
-	if (ioctl(wsdispcfg_fd, VT_GETACTIVE, &screen) == -1) {
-		perror("Can't get active screen! Forgot WSDISPLAY_COMPAT_USL?\n");
-		return -1;
+/*
+ * Play on for a slice: show the composed frame once it is due, decode
+ * the next one meanwhile and compose it when the screen has the one
+ * before. True when the first frame made it to the screen or the
+ * animation failed before it did.
+ */
+bool
+wsdv_anim_step(void)
+{
+	png_file_status status;
+	bool first;
+
+	first = false;
+	if (anim.ready && (latency_clock() >= anim.due))
+		first = wsdv_anim_present();
+	if (!anim.active)
+		return first;
+
+	if (!anim.pending && !anim.done) {
+		status = png_load_for(anim.png, DECODE_SLICE);
+		if (status & PNG_FILE_ERROR)
+			return wsdv_anim_fail(status) || first;
+		if (!(status & (PNG_FILE_FRAME | PNG_FILE_FINISHED)))
+			return first;
+		if (anim.frames == 0) {
+			latency_mark(&latency, LATENCY_DECODE);
+			stats_mark(&stats, STATS_DECODE);
+			stats_codec(&stats, anim.png);
+		}
+		anim.pending = true;
 	}
+	if (anim.pending && !anim.ready && !wsdv_anim_compose())
+		return wsdv_anim_fail(PNG_FILE_CLEAR) || first;
 
-	printf("active screen is %d\n", screen);
-	
-	return screen;
+	if (anim.ready && (latency_clock() >= anim.due))
+		first = wsdv_anim_present() || first;
+	return first;
 }
 
+/* can be shown without decoding it */
 bool
-wsdv_screen_switch(int screen)
+wsdv_ready(const char *path)
 {
+	return packcache_has(&packcache, path) ||
+	    diskcache_has(&diskcache, path);
+}
 
-	printf("going to switch to screen %d\n", screen);
+/*
+ * Queue up the images the next key presses are most likely to want, and
+ * get the storage going on the files after them.
+ */
+void
+wsdv_prefetch_around(size_t file, int dir)
+{
+	const char *paths[PREFETCH_AHEAD + 1];
+	const char *ahead[PREFETCH_AHEAD + READAHEAD];
+	const char *f;
+	size_t i;
+	int n, m;
+
+	/* images in the caches further down don't need decoding */
+	n = m = 0;
+	for (i = 1; i <= PREFETCH_AHEAD + READAHEAD; i++) {
+		if ((dir < 0) && (i > file))
+			break;
+		f = playlist_path(&playlist, (dir > 0) ? file + i : file - i);
+		if (f == NULL)
+			break;
+		/* the next entries on disk are read in, the others looked up */
+		if ((i <= DISKCACHE_AHEAD) && !packcache_has(&packcache, f) &&
+		    diskcache_readahead(&diskcache, f))
+			continue;
+		if (wsdv_ready(f))
+			continue;
+		if (prefetch.enabled && (i <= PREFETCH_AHEAD))
+			paths[n++] = f;
+		else
+			ahead[m++] = f;
+	}
+	/* and the one we came from, it is most likely in the cache already */
+	f = NULL;
+	if (dir < 0)
+		f = playlist_path(&playlist, file + 1);
+	else if (file > 0)
+		f = playlist_path(&playlist, file - 1);
+	if ((f != NULL) && !wsdv_ready(f))
+		paths[n++] = f;
+	prefetch_want(&prefetch, paths, n);
+	fileio_readahead(&fileio, ahead, m);
+}
 
-	if (ioctl(wsdispcfg_fd, VT_ACTIVATE, screen) == -1) {
-		perror("Can't switch screen");
+/* what a raw keycode does, sym gets its key symbol or -1 if unknown */
+const struct keymap_action *
+wsdv_kbd_action(int kc, int *sym)
+{
+	if (keymap.loaded) {
+		*sym = -1;
+		return keymap_code(&keymap, kc);
 	}
-	
-	return true;
+
+	*sym = disp.be->translate(&disp, kc);
+	return keymap_symbol(&keymap, *sym);
 }
-#endif 
 
+/* append a key press to the recorded script */
 void
-wsdv_process_file_list() 
+wsdv_record_key(struct display_event *event, int sym,
+    const struct keymap_action *act)
 {
-	struct file_entry *file, *nfile;
-	struct wscons_event event;
+	if (record_file == NULL)
+		return;
 
-	file = TAILQ_FIRST(&files_head);
+	if (record_last != 0)
+		fprintf(record_file, "sleep %llu\n", (unsigned long long)
+		    ((event->time - record_last) / 1000000));
+	record_last = event->time;
+	if (sym < 0)
+		sym = keymap_action_symbol(act);
+	if (sym < 0)
+		fprintf(record_file, "# keycode %d has no key symbol\n",
+		    event->value);
+	else
+		fprintf(record_file, "key %d\n", sym);
+}
 
-	if (file == NULL)
-		fprintf(stderr, "file list empty, shouldn't happen\n");	
+/*
+ * Sample the screen for the recording once it is due, or for the last
+ * time. The shadow is read where it matches the screen, framebuffers
+ * can be slow to read from.
+ */
+void
+wsdv_record_screen(bool last)
+{
+	struct display_cmap cmap, *cm;
+	const uint8_t *pixels;
+	uint32_t stride;
+	uint64_t now;
 
-	wsdv_display_file(file->path);
+	if (recorder.png == NULL)
+		return;
+	now = latency_clock();
+	if (!last && (now < recorder.due))
+		return;
 
-	for (;;) {
-		read(wskbd_fd, &event, sizeof(event));
-		// printf("event type %x value %x\n", event.type, event.value);
-		if (event.type == WSCONS_EVENT_KEY_DOWN)
-			switch (ws_kbd_translate(event.value)) {
-			case WSDV_EXIT:
-				return;
-				break;
-			case WSDV_NEXTIMG:
-				nfile = TAILQ_NEXT(file, entries);
-				if (!nfile)
-					break;
-				file = nfile;
-				wsdv_display_file(file->path);
-				break;
-			case WSDV_PREVIMG:
-				nfile = TAILQ_PREV(file, file_tailhead, entries);
-				if (!nfile)
-					break;
-				file = nfile;
-				wsdv_display_file(file->path);
-				break;
-#if 0
-			case WSDV_SWITCH_SCREEN_2:
-				ws_restore_screen();
-				close(wskbd_fd);
-				close(wsdisp_fd);
-				wsdv_screen_get_active();
-				wsdv_screen_switch(2);
-				close(wsdispcfg_fd);
-				break;
-#endif
-			default:
-				printf("unhandled key value %x\n", 
-				    event.value);
-			}
+	if (shadow.valid) {
+		pixels = shadow.pixels;
+		stride = shadow.stride;
+	} else {
+		pixels = disp.fb;
+		stride = disp.stride;
 	}
-
+	cm = NULL;
+	if ((disp.pixfmt == BLIT_FMT_CI8) && disp.be->get_cmap(&disp, &cmap))
+		cm = &cmap;
+	recorder_sample(&recorder, pixels, stride, cm, now);
+
+	recorder.due += RECORDER_INTERVAL;
+	if (recorder.due <= now)
+		recorder.due = now + RECORDER_INTERVAL;
 }
 
 /*
- * Try to determine default wsdisplay device, not hardcode it... 
- * This needs some cleanup and much more error checking. 
+ * Wait up to timeout milliseconds, -1 for as long as it takes, for the
+ * next input event; 1 for an event, 0 if there is none, -1 on error.
  */
-char *
-wsdv_display_get_default() 
+int
+wsdv_next_event(struct display_event *event, int timeout)
 {
-	int i;
-	char *ttypath, *ttydevname;
-	struct stat s;
-	dev_t ttydev;
-	devmajor_t wsdisp_major;
-	size_t miblen;
-	struct kinfo_drivers *kern_drivers;
-	static int mib[2] = {CTL_KERN, KERN_DRIVERS};
-
-	wsdisp_major = 0;
-	ttypath = (char*) malloc(sizeof(char)*PATH_MAX);
-	memset(ttypath, 0, PATH_MAX);
-	ttydev = 0;
-
-	sysctl(mib, 2, NULL, &miblen, NULL, 0);
-	kern_drivers = malloc(miblen);
-	sysctl(mib, 2, kern_drivers, &miblen, NULL, 0);
-
-	/* obtain device major number for wsdisplay driver */
-	for (i = 0; i < miblen / sizeof(*kern_drivers); kern_drivers++, i++) {
-		if (strcmp("wsdisplay", kern_drivers->d_name))
-			continue;
-		wsdisp_major = kern_drivers->d_cmajor;
-		break;
+	struct pollfd pfd;
+	int due, nfds, r;
+
+	nfds = 1;
+	due = (disp.be->pending != NULL) ? disp.be->pending(&disp) : -1;
+	if (due >= 0) {
+		if (due == 0)
+			return disp.be->read_event(&disp, event);
+		/* nothing to poll, just the time to let pass */
+		nfds = 0;
+		if ((timeout < 0) || (due < timeout))
+			timeout = due;
 	}
 
-	if (wsdisp_major == 0)
-		err(EXIT_FAILURE, 
-		    "could not deterine wsdisplay device major number\n");
-			
-	if (isatty(0)) {
-		ttypath = ttyname(0);
-	
-		if (stat(ttypath, &s) == -1)
-			perror("error stating stdin");
+	pfd.fd = disp.input_fd;
+	pfd.events = POLLIN;
+	r = poll(&pfd, nfds, timeout);
+	if (r < 0)
+		return (errno == EINTR) ? 0 : -1;
+	if ((r == 0) || (nfds == 0))
+		return 0;
+	return disp.be->read_event(&disp, event);
+}
+
+/*
+ * The file n images on from file, as far as the list goes. Only as much
+ * of the playlist is read as it takes to get there.
+ */
+size_t
+wsdv_step(size_t file, int64_t n)
+{
+	if (n < 0)
+		return ((uint64_t) -n > file) ? 0 : file + n;
+	if (playlist_path(&playlist, file + n) != NULL)
+		return file + n;
+	return playlist_count(&playlist) - 1;
+}
 
-		ttydev = s.st_dev; 
-	}
+/* the n-th file counting from 1, negative from the end */
+size_t
+wsdv_nth(int64_t n)
+{
+	if (n > 0)
+		return wsdv_step(0, n - 1);
+	return wsdv_step(playlist_count(&playlist) - 1, n + 1);
+}
 
-	/* if stdin is not a tty or is a tty that is not a wsdisplay */
-	if (ttydev == 0 || (major(ttydev) != wsdisp_major)) {
-		ttypath = strcpy(ttypath, "/dev/");
-		ttydevname = devname(makedev(wsdisp_major, 0), S_IFCHR);
-		strncat(ttypath, ttydevname, strlen(ttydevname));
-	}
+/* the image of a move in direction dir made it to the screen, or failed */
+void
+wsdv_shown(size_t file, int dir)
+{
+	latency_end(&latency);
+	wsdv_prefetch_around(file, dir);
+	if (slideshow_interval)
+		slideshow_due = latency_clock() + slideshow_interval;
+}
+
+/* move on to file, dropping whatever was on its way to the screen */
+void
+wsdv_show(size_t file, int dir)
+{
+	wsdv_decode_cancel();
+	wsdv_anim_stop();
+	if (wsdv_display_file(playlist_path(&playlist, file)))
+		wsdv_shown(file, dir);
+}
+
+/*
+ * How long poll() may wait: not at all while decoding, until the next
+ * frame or slideshow image is due, -1 for ever.
+ */
+int
+wsdv_timeout(void)
+{
+	uint64_t now, due;
+
+	if (decode.active || wsdv_anim_busy())
+		return 0;
+	due = UINT64_MAX;
+	if (anim.active && anim.ready)
+		due = anim.due;
+	if (slideshow_interval && (slideshow_due < due))
+		due = slideshow_due;
+	if ((recorder.png != NULL) && (recorder.due < due))
+		due = recorder.due;
+	if (due == UINT64_MAX)
+		return -1;
+	now = latency_clock();
+	if (due <= now)
+		return 0;
+	return (due - now + 999999) / 1000000;
+}
 
-	if (stat(ttypath, &s) == -1) {
-		perror("error stating wsdisplay device file");
-		/* fall back to hard coded default */
-		strncpy(ttypath, def_wsdisp, strlen(def_wsdisp));
+void
+wsdv_slideshow_toggle(const struct keymap_action *act)
+{
+	if (slideshow_interval) {
+		slideshow_interval = 0;
+		return;
 	}
+	if (act->arg > 0)
+		slideshow_interval = act->arg;
+	else if (key_count > 0)
+		slideshow_interval = (uint64_t) key_count * 1000;
+	else
+		slideshow_interval = SLIDESHOW_INTERVAL;
+	slideshow_interval *= 1000000;
+	slideshow_due = latency_clock() + slideshow_interval;
+}
+
+/*
+ * Keys are read between decoding slices: moving on from an image still
+ * being decoded drops it at once rather than waiting for an image that
+ * is no longer wanted.
+ */
+void
+wsdv_process_file_list() 
+{
+	struct display_event event;
+	const struct keymap_action *act;
+	size_t file, nfile;
+	int64_t n;
+	int r, sym, dir, ndir;
+
+	file = 0;
+	dir = 1;
+	wsdv_show(file, dir);
+
+	for (;;) {
+		r = wsdv_next_event(&event, wsdv_timeout());
+		if (r < 0) {
+			perror("Reading input events");
+			break;
+		}
+		wsdv_record_screen(false);
+		if (r == 0) {
+			if (decode.active) {
+				if (wsdv_decode_slice())
+					wsdv_shown(file, dir);
+				continue;
+			}
+			if (anim.active && wsdv_anim_step())
+				wsdv_shown(file, dir);
+			if (slideshow_interval &&
+			    (latency_clock() >= slideshow_due)) {
+				/* round and round */
+				if (playlist_path(&playlist, ++file) == NULL)
+					file = 0;
+				dir = 1;
+				wsdv_show(file, dir);
+			}
+			continue;
+		}
+		if (event.type != DISPLAY_EVENT_KEY_DOWN)
+			continue;
+
+		act = wsdv_kbd_action(event.value, &sym);
+		WSDV_KEY(event.value, act->action);
+		wsdv_record_key(&event, sym, act);
+		nfile = file;
+		ndir = dir;
+		switch (act->action) {
+		case KEYMAP_EXIT:
+			wsdv_decode_cancel();
+			wsdv_anim_stop();
+			return;
+			break;
+		case KEYMAP_DIGIT:
+			if (key_count < KEY_COUNT_MAX)
+				key_count = key_count * 10 + act->arg;
+			continue;
+		case KEYMAP_MOVE:
+			n = (int64_t) act->arg * (key_count ? key_count : 1);
+			nfile = wsdv_step(file, n);
+			ndir = (n > 0) ? 1 : -1;
+			break;
+		case KEYMAP_GOTO:
+			n = act->arg ? act->arg : (key_count ? key_count : 1);
+			nfile = wsdv_nth(n);
+			ndir = (n > 0) ? 1 : -1;
+			break;
+		case KEYMAP_SLIDESHOW:
+			wsdv_slideshow_toggle(act);
+			break;
+#if 0
+		case WSDV_SWITCH_SCREEN_2:
+			display_close(&disp);
+			wsdv_screen_get_active();
+			wsdv_screen_switch(2);
+			break;
+#endif
+		case KEYMAP_NONE:
+			/* unbound, as if it hadn't been pressed */
+			continue;
+		default:
+#ifdef WSDV_DEBUG
+			printf("unhandled key value %x\n", event.value);
+#endif
+			break;
+		}
+		key_count = 0;
 
-	return ttypath;
+		if (nfile == file)
+			continue;
+		latency_begin(&latency, event.time);
+		file = nfile;
+		dir = ndir;
+		wsdv_show(file, dir);
+	}
+	wsdv_decode_cancel();
+	wsdv_anim_stop();
 }
 
 int
 main(int argc, char *argv[]) 
 {
 	int ch;
-	char wsdisp[PATH_MAX];
-	char wsdispcfg[PATH_MAX];
-	char wskbd[PATH_MAX];
-	char keymap[PATH_MAX];
-	char progname[PATH_MAX];
-	struct file_entry *file;
-
-	fb = NULL;
+	char *wsdisp, *wskbd;
+	FILE *stats_json;
+	bool flag_stats, flag_warm, flag_check;
+	char *cache_dir, *recording;
+	uint64_t memory_limit, cache_budget, packed_budget, cache_limit;
+	char keymap_file[PATH_MAX];
+	char *progname;
+	const struct display_backend *be;
 
-	TAILQ_INIT(&files_head); 
+	playlist_init(&playlist);
 
-	strncpy(progname, argv[0], sizeof(progname));
-	strncpy(wsdispcfg, def_wsdispcfg, sizeof(wsdispcfg));
-	strncpy(wskbd, def_wskbd, sizeof(wskbd));
+	progname = argv[0];
+	wsdisp = wskbd = NULL;
+	be = display_backend_default();
 
 	flag_use_keymap_file = false;
-	while ((ch = getopt(argc, argv, "m:k:t:")) != -1) {
+	blit_backdrop_init(&backdrop);
+	latency_init(&latency, false);
+	stats_json = NULL;
+	flag_stats = false;
+	memory_limit = 0;
+	cache_budget = PREFETCH_BUDGET;
+	packed_budget = PACKED_BUDGET;
+	cache_limit = DISKCACHE_LIMIT;
+	cache_dir = recording = NULL;
+	flag_warm = false;
+	flag_check = false;
+	while ((ch = getopt(argc, argv, "ALSVwa:j:M:C:Z:G:c:D:B:m:k:g:R:t:b:l:")) != -1) {
 
 		switch (ch) {
+		case 'A':
+			flag_animate = true;
+			break;
+		case 'L':
+			latency_init(&latency, true);
+			break;
+		case 'S':
+			flag_stats = true;
+			break;
+		case 'V':
+			flag_check = true;
+			break;
+		case 'w':
+			flag_warm = true;
+			break;
+		case 'a':
+			recording = optarg;
+			break;
+		case 'j':
+			if (strcmp(optarg, "-") == 0)
+				stats_json = stdout;
+			else
+				stats_json = fopen(optarg, "a");
+			if (stats_json == NULL) {
+				perror("Can't open stats file");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'M':
+			if (!wsdv_parse_size(optarg, &memory_limit)) {
+				fprintf(stderr, "Invalid memory limit %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'C':
+			if (!wsdv_parse_size(optarg, &cache_budget)) {
+				fprintf(stderr, "Invalid cache budget %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'Z':
+			if (!wsdv_parse_size(optarg, &packed_budget)) {
+				fprintf(stderr, "Invalid cache budget %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'G':
+			if (!wsdv_parse_gamma(optarg, &display_gamma)) {
+				fprintf(stderr, "Invalid gamma %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'c':
+			cache_dir = optarg;
+			break;
+		case 'D':
+			if (!wsdv_parse_size(optarg, &cache_limit)) {
+				fprintf(stderr, "Invalid cache limit %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'B':
+			be = display_backend_find(optarg);
+			if (be == NULL) {
+				fprintf(stderr, "Unknown backend %s\n", optarg);
+				wsdv_usage(progname);
+				return EXIT_FAILURE;
+			}
+			break;
 		case 'm':
 			flag_specify_wsdisplay_device = true;
-			strncpy(wsdisp, optarg, sizeof(wsdisp));	
+			wsdisp = optarg;
 			break;
 		case 'k':
-			strncpy(wskbd, optarg, sizeof(wskbd));	
+			wskbd = optarg;
+			break;
+		case 'g':
+			disp.geometry = optarg;
+			break;
+		case 'R':
+			record_file = fopen(optarg, "w");
+			if (record_file == NULL) {
+				perror("Can't create script");
+				return EXIT_FAILURE;
+			}
 			break;
 		case 't':
-			strncpy(keymap, optarg, sizeof(keymap));	
+			snprintf(keymap_file, sizeof(keymap_file), "%s", optarg);
 			flag_use_keymap_file = true;
 			break;
+		case 'b':
+			if (!blit_backdrop_parse(&backdrop, optarg)) {
+				fprintf(stderr, "Invalid backdrop %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'l':
+			if (!playlist_add_file(&playlist, optarg))
+				return EXIT_FAILURE;
+			break;
 		default:
 			wsdv_usage(progname);
 			return EXIT_FAILURE;
@@ -575,60 +1579,92 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (*argv == NULL) {
+	if ((*argv == NULL) && (playlist.queued == 0)) {
 		wsdv_usage(progname);
 		return EXIT_FAILURE;
 	}
-
-	if (flag_use_keymap_file)
-		wsdv_keymap_load(keymap);
-
-	while (*argv != NULL) {
-		printf("got filename arg %s\n", *argv);
-		file = (struct file_entry*) malloc(sizeof(struct file_entry));
-		file->path = *argv;
-		TAILQ_INSERT_TAIL(&files_head, file, entries);
-		argv++;
-	}
-	
-	if (!flag_specify_wsdisplay_device) {
-		strncpy(wsdisp, wsdv_display_get_default(), sizeof(wsdisp));	
+	if (!playlist_add_paths(&playlist, argv, argc) ||
+	    (playlist_path(&playlist, 0) == NULL)) {
+		fprintf(stderr, "No images to show\n");
+		return EXIT_FAILURE;
 	}
 
-	printf("using wsdisplay dev %s, wskdb dev %s\n", 
-	    wsdisp, wskbd);
-
-	wskbd_fd = open(wskbd, O_RDWR);
-	wsdisp_fd = open(wsdisp, O_RDWR);
-	wsdispcfg_fd = open(wsdisp, O_RDWR);
+	keymap_init(&keymap);
+	if (flag_use_keymap_file)
+		keymap_load(&keymap, keymap_file);
+	stats_init(&stats, flag_stats, stats_json);
 
-	if (wsdisp_fd < 0) {
-		perror("Can't open wsdisplay dev");
-		return EXIT_FAILURE;
-	}
-	if (wskbd_fd < 0) {
-		perror("Can't open wskbd dev");
+	if (!display_open(&disp, be, wsdisp, wskbd)) {
+		display_close(&disp);
 		return EXIT_FAILURE;
 	}
 
 	png_init();
-	ws_get_display_geom(wsdisp);
-
-	if (!ws_prepare_keyboard())
+	png_set_memory_limit(memory_limit);
+	png_set_check_skipped(flag_check);
+	fileio_init(&fileio, FILEIO_BIG);
+	blit_store_init(BLIT_STORE_AUTO);
+	if (!disp.be->query(&disp)) {
+		display_close(&disp);
 		return EXIT_FAILURE;
+	}
 
 	if (!ws_prepare_screen()) {
-		ws_restore_screen();
+		display_close(&disp);
 		return EXIT_FAILURE;
 	}
 
-	wsdv_process_file_list();
-
-	ws_restore_screen();
+	/* workers need the screen's geometry and format */
+	if (!prefetch_init(&prefetch, cache_budget, PREFETCH_AHEAD,
+	    wsdv_prefetch_prepare, wsdv_prefetch_release))
+		fprintf(stderr, "Can't start prefetching, going without\n");
+	prefetch_set_limit(&prefetch, disp.width, disp.height);
+	prefetch_set_display_gamma(&prefetch, display_gamma);
+	if ((recording != NULL) && !recorder_open(&recorder, recording,
+	    disp.width, disp.height, disp.pixfmt))
+		fprintf(stderr, "Can't record to %s, going without\n", recording);
+	if (!packcache_init(&packcache, packed_budget,
+	    blit_pixfmt_bytes(disp.pixfmt)))
+		fprintf(stderr, "Can't keep packed images, going without\n");
+
+	/* entries are for this screen, backdrop and gamma only */
+	if ((cache_dir != NULL) && !diskcache_init(&diskcache, cache_dir,
+	    disp.width, disp.height, disp.pixfmt, &backdrop, display_gamma,
+	    cache_limit))
+		fprintf(stderr, "Can't use cache %s, going without\n", cache_dir);
+	/* the whole playlist, the array stays put once it is complete */
+	if (flag_warm && diskcache.enabled &&
+	    ((playlist_count(&playlist) > INT_MAX) ||
+	    !diskcache_warm(&diskcache, (const char **) playlist.paths,
+	    playlist_count(&playlist), wsdv_diskcache_fill)))
+		fprintf(stderr, "Can't pre-warm the cache\n");
 
-	close(wsdisp_fd);
-	close(wskbd_fd);
+	wsdv_process_file_list();
+	if (recorder.png != NULL) {
+		wsdv_record_screen(true);
+		if (recorder_close(&recorder, latency_clock()) && flag_stats)
+			printf("recorded %s: %llu frames from %llu samples, "
+			    "%llu pixels\n", recording,
+			    (unsigned long long) recorder.frames,
+			    (unsigned long long) recorder.samples,
+			    (unsigned long long) recorder.pixels);
+	}
+	diskcache_free(&diskcache);
+	prefetch_free(&prefetch);
+	packcache_free(&packcache);
+
+	disp.be->unmap(&disp);
+	shadow_free(&shadow);
+	display_close(&disp);
+	playlist_free(&playlist);
+
+	if (record_file != NULL)
+		fclose(record_file);
+	latency_report(&latency, stderr);
+	latency_free(&latency);
+	stats_summary(&stats);
+	if ((stats_json != NULL) && (stats_json != stdout))
+		fclose(stats_json);
 
 	return EXIT_SUCCESS;
 }
-